@@ -0,0 +1,951 @@
+#include "header.h"
+
+// COPY between storage servers as one archive stream. The source connects to
+// the peer's client port, sends "ARCHIVE" and, once the peer answers
+// "ARCHIVE READY", writes
+//   u32 ARCHIVE_MAGIC, then per entry
+//   u32 type | u32 permissions | u32 dir_len | u32 name_len | u64 size |
+//   dir | name | size bytes of file data
+// ending with an ARCHIVE_END entry. The peer extracts entries as they arrive
+// and answers once at the end with "ARCHIVE DONE <entries> <failed>". Every
+// entry carries its length, so one that cannot be created is skipped without
+// losing the stream, and a tree of small files costs no round trip per file.
+// An ARCHIVE_DELETE entry removes dir/name on the peer; backups use it to
+// replace what changed since the last one, see backup_to_peer.
+// A directory COPY runs several such archives side by side, see
+// copy_files_to_peer. A COPY whose peer is this server is not sent anywhere;
+// copyLocally recreates it with the data copied inside the kernel.
+
+int copy_streams = COPY_STREAMS;
+
+// One entry of a COPY. The entries are listed from the tree up front, under
+// namespace_lock, and sent afterwards without it, so CREATE and DELETE on this
+// server are not held up for the length of the transfer.
+typedef struct CopyEntry
+{
+    char *source;   // Path of the entry, for findNode; NULL to only delete it on the peer
+    char *dest_dir; // Directory on the peer it is created in
+    char *name;
+    NodeType type;
+    Permissions permissions;
+    off_t size; // For progress reports, the stream carries the size at send time
+    int replace; // Delete what the peer has at dest_dir/name before creating it
+} CopyEntry;
+
+typedef struct CopyPlan
+{
+    CopyEntry *entries;
+    size_t count;
+    size_t capacity;
+} CopyPlan;
+
+// One connection of a COPY and the entries it carries
+typedef struct ArchiveStream
+{
+    int index; // Into the per-stream progress
+    const char *peer_ip;
+    int peer_port;
+    Node *root;
+    CopyEntry **entries;
+    size_t count;
+    CopyProgress *progress;
+    int ok;
+    unsigned long acked;  // Entries the peer extracted
+    unsigned long failed; // Entries it could not create
+    size_t skipped;       // Files gone before they were sent
+} ArchiveStream;
+
+// Buffered reads of an archive on the receiving side
+typedef struct ArchiveReader
+{
+    int sock;
+    char *buffer;
+    size_t start;
+    size_t end;
+} ArchiveReader;
+
+// Append an entry creating node as dest_dir/name, or only deleting
+// dest_dir/name if node is NULL
+static CopyEntry *addCopyEntry(CopyPlan *plan, Node *node, const char *source, const char *dest_dir, const char *name)
+{
+    if (plan->count == plan->capacity)
+    {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 64;
+        plan->entries = (CopyEntry *)realloc(plan->entries, plan->capacity * sizeof(CopyEntry));
+    }
+    CopyEntry *entry = &plan->entries[plan->count++];
+    entry->source = node ? strdup(source) : NULL;
+    entry->dest_dir = strdup(dest_dir);
+    entry->name = strdup(name);
+    entry->type = node ? node->type : FILE_NODE;
+    entry->permissions = node ? node->permissions : 0;
+    struct stat st;
+    entry->size = node && node->type == FILE_NODE && getFileMetadata(node, &st) == 0 ? st.st_size : 0;
+    entry->replace = 0;
+    return entry;
+}
+
+// Entries that carry file data; the rest only change the peer's namespace
+static int carriesData(const CopyEntry *entry)
+{
+    return entry->source && entry->type == FILE_NODE;
+}
+
+// Add node and, for a directory, everything below it in pre-order
+static void planCopy(CopyPlan *plan, Node *node, const char *source, const char *dest_dir)
+{
+    addCopyEntry(plan, node, source, dest_dir, node->name);
+
+    if (node->type != DIRECTORY_NODE || !node->children)
+        return;
+    char child_source[MAX_PATH_LENGTH];
+    char child_dest[MAX_PATH_LENGTH];
+    snprintf(child_dest, sizeof(child_dest), "%s/%s", dest_dir, node->name);
+    uint32_t cursor = 0;
+    Node *child;
+    while ((child = nextChild(node->children, &cursor)) != NULL)
+    {
+        snprintf(child_source, sizeof(child_source), "%s/%s", source, child->name);
+        planCopy(plan, child, child_source, child_dest);
+    }
+}
+
+static void freeCopyPlan(CopyPlan *plan)
+{
+    for (size_t i = 0; i < plan->count; i++)
+    {
+        free(plan->entries[i].source);
+        free(plan->entries[i].dest_dir);
+        free(plan->entries[i].name);
+    }
+    free(plan->entries);
+}
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Send a PROGRESS frame ahead of the COPY reply, at most every
+// COPY_PROGRESS_INTERVAL_MS unless force is set. With several streams the
+// bytes done/total of each follow the totals. Caller holds progress->lock
+// once the streams are running.
+static void reportCopyProgress(CopyProgress *progress, int force)
+{
+    if (!progress->request)
+        return;
+    long long now = monotonicMs();
+    if (!force && now - progress->last_report_ms < COPY_PROGRESS_INTERVAL_MS)
+        return;
+    progress->last_report_ms = now;
+    char line[128 + COPY_STREAMS_MAX * 48];
+    int used = snprintf(line, sizeof(line), "PROGRESS %zu %zu %llu %llu", progress->entries_done, progress->entries_total,
+                        (unsigned long long)progress->bytes_done, (unsigned long long)progress->bytes_total);
+    for (int k = 0; progress->streams > 1 && k < progress->streams; k++)
+        used += snprintf(line + used, sizeof(line) - used, " %llu/%llu", (unsigned long long)progress->stream_bytes_done[k],
+                         (unsigned long long)progress->stream_bytes_total[k]);
+    replyToNamingServer(progress->request, line, strlen(line), 1);
+}
+
+// Count bytes and entries sent by one stream
+static void addCopyProgress(CopyProgress *progress, int stream, uint64_t bytes, size_t entries)
+{
+    pthread_mutex_lock(&progress->lock);
+    progress->bytes_done += bytes;
+    progress->stream_bytes_done[stream] += bytes;
+    progress->entries_done += entries;
+    reportCopyProgress(progress, 0);
+    pthread_mutex_unlock(&progress->lock);
+}
+
+static void putU32(char *buffer, size_t *used, uint32_t value)
+{
+    uint32_t net = htonl(value);
+    memcpy(buffer + *used, &net, sizeof(net));
+    *used += sizeof(net);
+}
+
+static void putU64(char *buffer, size_t *used, uint64_t value)
+{
+    putU32(buffer, used, (uint32_t)(value >> 32));
+    putU32(buffer, used, (uint32_t)value);
+}
+
+static uint32_t getU32(const char *buffer)
+{
+    uint32_t net;
+    memcpy(&net, buffer, sizeof(net));
+    return ntohl(net);
+}
+
+// Like sendAll, but tells the kernel more is coming so an entry header and a
+// small file go out in the same segment
+static int sendAllMore(int sock, const char *buffer, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(sock, buffer + sent, len - sent, MSG_NOSIGNAL | MSG_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+static int sendArchiveHeader(int sock, uint32_t type, const CopyEntry *entry, uint64_t size)
+{
+    char header[ARCHIVE_HEADER_SIZE + 2 * MAX_PATH_LENGTH];
+    const char *dir = entry ? entry->dest_dir : "";
+    const char *name = entry ? entry->name : "";
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    if (dir_len >= MAX_PATH_LENGTH || name_len >= MAX_PATH_LENGTH)
+        return -1;
+    size_t used = 0;
+    putU32(header, &used, type);
+    putU32(header, &used, entry ? (uint32_t)entry->permissions : 0);
+    putU32(header, &used, (uint32_t)dir_len);
+    putU32(header, &used, (uint32_t)name_len);
+    putU64(header, &used, size);
+    memcpy(header + used, dir, dir_len);
+    used += dir_len;
+    memcpy(header + used, name, name_len);
+    used += name_len;
+    // The end of the archive is pushed out at once, the peer answers it
+    return type == ARCHIVE_END ? sendAll(sock, header, used) : sendAllMore(sock, header, used);
+}
+
+// Send one file entry with its data. The size in the header is taken under
+// the file's read lock, so no WRITE can change it in between; should the file
+// still come up short, the rest is padded to keep the stream in step.
+// Returns 1 if sent, 0 if the file was gone or busy and skipped, -1 if the
+// connection failed.
+static int sendArchiveFile(int sock, Node *root, const CopyEntry *entry, CopyProgress *progress, int stream)
+{
+    // The node is pinned before namespace_lock is let go, so a DELETE of the
+    // file waits for the transfer instead of freeing the node
+    pthread_rwlock_rdlock(&namespace_lock);
+    Node *node = findNode(root, entry->source);
+    nodePin(node);
+    pthread_rwlock_unlock(&namespace_lock);
+    int locked = nodeLockPinned(node, 0, NODE_LOCK_TIMEOUT_MS) == 0;
+    if (!locked)
+    {
+        printf("Skipping %s in archive: gone or busy\n", entry->source);
+        return 0;
+    }
+    int fd = fdCacheAcquire(node);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            fdCacheRelease(node, fd);
+        nodeUnlockRead(node);
+        printf("Skipping %s in archive: cannot open it\n", entry->source);
+        return 0;
+    }
+
+    int result = 1;
+    uint64_t left = (uint64_t)st.st_size;
+    off_t offset = 0;
+    if (sendArchiveHeader(sock, ARCHIVE_FILE, entry, left) < 0)
+        result = -1;
+    while (result > 0 && left > 0)
+    {
+        // Chunks go from the page cache straight to the peer with sendfile
+        size_t want = left < ARCHIVE_BUFFER ? (size_t)left : ARCHIVE_BUFFER;
+        ssize_t sent = sendFileRange(sock, fd, &offset, want);
+        if (sent == 0)
+        {
+            static const char zeros[4096];
+            sent = want < sizeof(zeros) ? want : sizeof(zeros);
+            if (sendAll(sock, zeros, sent) < 0)
+                sent = -1;
+        }
+        if (sent < 0)
+        {
+            result = -1;
+            break;
+        }
+        left -= sent;
+        addCopyProgress(progress, stream, sent, 0);
+    }
+    fdCacheRelease(node, fd);
+    nodeUnlockRead(node);
+    return result;
+}
+
+// Send the entries of one stream over its own connection to the peer
+static void *sendArchiveStream(void *arg)
+{
+    ArchiveStream *stream = (ArchiveStream *)arg;
+    stream->ok = 0;
+    stream->acked = 0;
+    stream->failed = 0;
+    stream->skipped = 0;
+    int peer_socket = connectToServer(stream->peer_ip, stream->peer_port);
+    char reply[128];
+    memset(reply, 0, sizeof(reply));
+    int ok = peer_socket >= 0 && sendAll(peer_socket, "ARCHIVE", strlen("ARCHIVE")) == 0 &&
+             recv(peer_socket, reply, sizeof(reply) - 1, 0) > 0 && strncmp(reply, "ARCHIVE READY", 13) == 0;
+    if (ok)
+    {
+        char magic[4];
+        size_t used = 0;
+        putU32(magic, &used, ARCHIVE_MAGIC);
+        ok = sendAllMore(peer_socket, magic, used) == 0;
+    }
+
+    size_t sent_entries = 0;
+    for (; ok && sent_entries < stream->count; sent_entries++)
+    {
+        CopyEntry *entry = stream->entries[sent_entries];
+        if (entry->replace || !entry->source)
+            ok = sendArchiveHeader(peer_socket, ARCHIVE_DELETE, entry, 0) == 0;
+        if (ok && entry->source && entry->type == DIRECTORY_NODE)
+            ok = sendArchiveHeader(peer_socket, ARCHIVE_DIRECTORY, entry, 0) == 0;
+        else if (ok && carriesData(entry))
+        {
+            int sent = sendArchiveFile(peer_socket, stream->root, entry, stream->progress, stream->index);
+            ok = sent >= 0;
+            stream->skipped += sent == 0;
+        }
+        addCopyProgress(stream->progress, stream->index, 0, 1);
+    }
+
+    if (ok)
+    {
+        ok = sendArchiveHeader(peer_socket, ARCHIVE_END, NULL, 0) == 0;
+        memset(reply, 0, sizeof(reply));
+        ok = ok && recv(peer_socket, reply, sizeof(reply) - 1, 0) > 0 &&
+             sscanf(reply, "ARCHIVE DONE %lu %lu", &stream->acked, &stream->failed) == 2;
+    }
+    if (peer_socket >= 0)
+        close(peer_socket);
+    if (!ok)
+        printf("Archive stream %d to %s:%d broken off after %zu of %zu entries\n", stream->index, stream->peer_ip,
+               stream->peer_port, sent_entries, stream->count);
+    stream->ok = ok;
+    return NULL;
+}
+
+// Write all of len bytes at offset
+static int pwriteAll(int fd, const char *buffer, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, buffer, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buffer += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Copy size bytes from fd_in to the empty fd_out without passing them through
+// user space: a reflink where the file system can share the blocks, else
+// copy_file_range, else pread/pwrite. Returns 1 if reflinked, 0 if copied,
+// -1 on error.
+static int copyFileData(int fd_in, int fd_out, uint64_t size, CopyProgress *progress)
+{
+    if (size > 0 && ioctl(fd_out, FICLONE, fd_in) == 0)
+    {
+        addCopyProgress(progress, 0, size, 0);
+        return 1;
+    }
+    loff_t in_offset = 0;
+    loff_t out_offset = 0;
+    int use_range = 1;
+    while ((uint64_t)in_offset < size)
+    {
+        size_t want = size - in_offset < LOCAL_COPY_CHUNK ? (size_t)(size - in_offset) : LOCAL_COPY_CHUNK;
+        ssize_t n;
+        if (use_range)
+        {
+            n = copy_file_range(fd_in, &in_offset, fd_out, &out_offset, want, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                use_range = 0;
+                continue;
+            }
+        }
+        else
+        {
+            char buffer[SENDFILE_FALLBACK_BUFFER];
+            n = pread(fd_in, buffer, want < sizeof(buffer) ? want : sizeof(buffer), in_offset);
+            if (n > 0)
+            {
+                if (pwriteAll(fd_out, buffer, n, out_offset) < 0)
+                    return -1;
+                in_offset += n;
+                out_offset += n;
+            }
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break; // Shorter than it was, the copy is too
+        addCopyProgress(progress, 0, n, 0);
+    }
+    return 0;
+}
+
+// Delete dir/name below root if it is there. Caller holds namespace_lock for
+// writing. Returns -1 only if it is there and could not be deleted.
+static int removeEntry(Node *root, const char *dir, const char *name)
+{
+    Node *parentDir = findNode(root, dir);
+    if (!parentDir || parentDir->type != DIRECTORY_NODE || !parentDir->children)
+        return 0;
+    Node *node = searchNode(parentDir->children, name);
+    return node ? deleteNode(node) : 0;
+}
+
+// Create name in parentDir for an archive entry. A directory that is already
+// there is used as it is, so a backup can fill in one it made before.
+static Node *createEntry(Node *parentDir, const char *name, NodeType type)
+{
+    if (type == DIRECTORY_NODE && parentDir && parentDir->type == DIRECTORY_NODE && parentDir->children)
+    {
+        Node *existing = searchNode(parentDir->children, name);
+        if (existing && existing->type == DIRECTORY_NODE)
+            return existing;
+    }
+    return createEmptyNode(parentDir, name, type);
+}
+
+// COPY within this server. Entries are created through createEmptyNode, as
+// an archive from a peer would be, so the tree and the journal stay right;
+// file data goes straight from file to file. Destination files are opened
+// relative to a descriptor of their directory, which pre-order keeps valid
+// for a whole run of siblings. Returns 1 on success.
+static int copyLocally(CopyPlan *plan, Node *root, CopyProgress *progress)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int dir_fd = -1;
+    const char *dir_path = NULL; // dest_dir dir_fd was opened for
+    unsigned long failed = 0, reflinked = 0;
+    for (size_t i = 0; i < plan->count; i++)
+    {
+        CopyEntry *entry = &plan->entries[i];
+        pthread_rwlock_wrlock(&namespace_lock);
+        if (entry->replace || !entry->source)
+        {
+            // The directory dir_fd is open on may be the one going away
+            if (dir_fd >= 0)
+                close(dir_fd);
+            dir_fd = -1;
+            dir_path = NULL;
+            if (removeEntry(root, entry->dest_dir, entry->name) < 0)
+                failed++;
+        }
+        if (!entry->source)
+        {
+            pthread_rwlock_unlock(&namespace_lock);
+            addCopyProgress(progress, 0, 0, 1);
+            continue;
+        }
+        Node *parentDir = findNode(root, entry->dest_dir);
+        Node *target = createEntry(parentDir, entry->name, entry->type);
+        if (target && entry->type == FILE_NODE)
+        {
+            nodeLockWrite(target, NODE_LOCK_TIMEOUT_MS); // Freshly created, nobody else holds it
+            if (!dir_path || strcmp(dir_path, entry->dest_dir) != 0)
+            {
+                char location[PATH_MAX];
+                if (dir_fd >= 0)
+                    close(dir_fd);
+                dir_fd = getDataLocation(parentDir, location, sizeof(location)) < 0 ? -1 : open(location, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                dir_path = entry->dest_dir;
+            }
+        }
+        pthread_rwlock_unlock(&namespace_lock);
+        if (!target)
+        {
+            failed++;
+            addCopyProgress(progress, 0, 0, 1);
+            continue;
+        }
+        if (entry->type != FILE_NODE)
+        {
+            addCopyProgress(progress, 0, 0, 1);
+            continue;
+        }
+
+        int copied = -1;
+        int fd_out = dir_fd >= 0 ? openat(dir_fd, entry->name, O_WRONLY | O_CLOEXEC) : -1;
+        pthread_rwlock_rdlock(&namespace_lock);
+        Node *source = findNode(root, entry->source);
+        nodePin(source);
+        pthread_rwlock_unlock(&namespace_lock);
+        int locked = nodeLockPinned(source, 0, NODE_LOCK_TIMEOUT_MS) == 0;
+        if (locked)
+        {
+            int fd_in = fdCacheAcquire(source);
+            struct stat st;
+            if (fd_in >= 0 && fd_out >= 0 && fstat(fd_in, &st) == 0)
+                copied = copyFileData(fd_in, fd_out, st.st_size, progress);
+            if (fd_in >= 0)
+                fdCacheRelease(source, fd_in);
+            nodeUnlockRead(source);
+        }
+        if (fd_out >= 0)
+            close(fd_out);
+        if (copied >= 0)
+            replicateContent(target);
+        journalRecordResize(target);
+        nodeUnlockWrite(target);
+        if (copied < 0)
+            failed++;
+        reflinked += copied > 0;
+        addCopyProgress(progress, 0, 0, 1);
+    }
+    if (dir_fd >= 0)
+        close(dir_fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Copied locally: %zu entries (%lu failed, %lu reflinked), %llu bytes in %.2f ms, %.0f files/s\n",
+           plan->count, failed, reflinked, (unsigned long long)progress->bytes_done, elapsed_ms,
+           elapsed_ms > 0 ? plan->count * 1000.0 / elapsed_ms : 0.0);
+    return failed == 0;
+}
+
+static int compareEntrySize(const void *a, const void *b)
+{
+    off_t left = (*(CopyEntry *const *)a)->size;
+    off_t right = (*(CopyEntry *const *)b)->size;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+// Carry out plan on the peer. It goes over up to copy_streams connections:
+// first one archive with every entry that only changes the namespace, so each
+// file finds its parent whichever stream carries it, then the files, dealt
+// largest first to the stream with the fewest bytes so far and sent in
+// parallel. A peer that is this server gets a local copy instead. If
+// progress_request is set, progress is reported on its reply as the copy
+// goes. Returns 1 on success.
+static int sendCopyPlan(CopyPlan *plan, const char *peer_ip, int peer_port, Node *root, NamingRequest *progress_request)
+{
+    if (peer_port == local_client_port && strcmp(peer_ip, local_ip) == 0)
+    {
+        CopyProgress progress;
+        memset(&progress, 0, sizeof(progress));
+        pthread_mutex_init(&progress.lock, NULL);
+        progress.request = progress_request;
+        progress.streams = 1;
+        progress.entries_total = plan->count;
+        for (size_t i = 0; i < plan->count; i++)
+            progress.bytes_total += plan->entries[i].size;
+        reportCopyProgress(&progress, 1);
+        int ok = copyLocally(plan, root, &progress);
+        pthread_mutex_destroy(&progress.lock);
+        return ok;
+    }
+
+    size_t files = 0;
+    for (size_t i = 0; i < plan->count; i++)
+        files += carriesData(&plan->entries[i]);
+    int streams = copy_streams < 1 ? 1 : copy_streams > COPY_STREAMS_MAX ? COPY_STREAMS_MAX : copy_streams;
+    if ((size_t)streams > files)
+        streams = files > 1 ? (int)files : 1;
+
+    CopyProgress progress;
+    memset(&progress, 0, sizeof(progress));
+    pthread_mutex_init(&progress.lock, NULL);
+    progress.request = progress_request;
+    progress.streams = streams;
+    progress.entries_total = plan->count;
+
+    // Lay the entries out stream after stream, directories in front
+    CopyEntry **order = (CopyEntry **)malloc((plan->count + 1) * sizeof(CopyEntry *));
+    ArchiveStream stream[COPY_STREAMS_MAX];
+    ArchiveStream directories;
+    memset(stream, 0, sizeof(stream));
+    memset(&directories, 0, sizeof(directories));
+    size_t placed = 0;
+    if (streams == 1)
+    {
+        for (size_t i = 0; i < plan->count; i++)
+        {
+            order[placed++] = &plan->entries[i];
+            progress.stream_bytes_total[0] += plan->entries[i].size;
+        }
+        stream[0].entries = order;
+        stream[0].count = placed;
+    }
+    else
+    {
+        for (size_t i = 0; i < plan->count; i++)
+        {
+            if (!carriesData(&plan->entries[i]))
+                order[placed++] = &plan->entries[i];
+        }
+        directories.entries = order;
+        directories.count = placed;
+        CopyEntry **by_size = order + placed;
+        for (size_t i = 0; i < plan->count; i++)
+        {
+            if (carriesData(&plan->entries[i]))
+                by_size[placed++ - directories.count] = &plan->entries[i];
+        }
+        qsort(by_size, files, sizeof(CopyEntry *), compareEntrySize);
+        int *owner = (int *)malloc(files * sizeof(int));
+        for (size_t i = 0; i < files; i++)
+        {
+            int least = 0;
+            for (int k = 1; k < streams; k++)
+            {
+                if (progress.stream_bytes_total[k] < progress.stream_bytes_total[least])
+                    least = k;
+            }
+            owner[i] = least;
+            progress.stream_bytes_total[least] += by_size[i]->size;
+            stream[least].count++;
+        }
+        // Regroup by stream behind a second array, then copy back in place
+        CopyEntry **grouped = (CopyEntry **)malloc((files + 1) * sizeof(CopyEntry *));
+        size_t start = 0;
+        for (int k = 0; k < streams; k++)
+        {
+            stream[k].entries = by_size + start;
+            size_t filled = 0;
+            for (size_t i = 0; i < files; i++)
+            {
+                if (owner[i] == k)
+                    grouped[start + filled++] = by_size[i];
+            }
+            start += filled;
+        }
+        memcpy(by_size, grouped, files * sizeof(CopyEntry *));
+        free(grouped);
+        free(owner);
+    }
+    for (int k = 0; k < streams; k++)
+    {
+        stream[k].index = k;
+        stream[k].peer_ip = peer_ip;
+        stream[k].peer_port = peer_port;
+        stream[k].root = root;
+        stream[k].progress = &progress;
+        progress.bytes_total += progress.stream_bytes_total[k];
+    }
+    directories.peer_ip = peer_ip;
+    directories.peer_port = peer_port;
+    directories.root = root;
+    directories.progress = &progress;
+    reportCopyProgress(&progress, 1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ok = 1;
+    if (streams > 1)
+    {
+        sendArchiveStream(&directories);
+        ok = directories.ok;
+    }
+    pthread_t threads[COPY_STREAMS_MAX];
+    int started[COPY_STREAMS_MAX];
+    for (int k = 0; ok && k < streams; k++)
+    {
+        started[k] = streams > 1 && pthread_create(&threads[k], NULL, sendArchiveStream, &stream[k]) == 0;
+        if (!started[k])
+            sendArchiveStream(&stream[k]);
+    }
+    unsigned long entries = directories.acked, failed = directories.failed;
+    size_t skipped = 0;
+    for (int k = 0; ok && k < streams; k++)
+    {
+        if (started[k])
+            pthread_join(threads[k], NULL);
+    }
+    for (int k = 0; ok && k < streams; k++)
+    {
+        ok = stream[k].ok;
+        entries += stream[k].acked;
+        failed += stream[k].failed;
+        skipped += stream[k].skipped;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (ok)
+        printf("Sent archive over %d streams: %lu entries (%lu failed, %zu skipped), %llu bytes in %.2f ms, %.0f files/s\n",
+               streams, entries, failed, skipped, (unsigned long long)progress.bytes_done, elapsed_ms,
+               elapsed_ms > 0 ? entries * 1000.0 / elapsed_ms : 0.0);
+    pthread_mutex_destroy(&progress.lock);
+    free(order);
+    return ok && failed == 0 && skipped == 0;
+}
+
+// Copy source_path, a file or a directory with everything in it, into
+// dest_path on the peer. Returns 1 on success.
+int copy_files_to_peer(const char *source_path, const char *dest_path, const char *peer_ip, int peer_port, Node *root, NamingRequest *progress_request)
+{
+    CopyPlan plan = {NULL, 0, 0};
+    pthread_rwlock_rdlock(&namespace_lock);
+    Node *source_node = findNode(root, source_path);
+    if (source_node)
+        planCopy(&plan, source_node, source_path, dest_path);
+    pthread_rwlock_unlock(&namespace_lock);
+    if (!source_node)
+        return 0;
+    int ok = sendCopyPlan(&plan, peer_ip, peer_port, root, progress_request);
+    freeCopyPlan(&plan);
+    return ok;
+}
+
+// Backups of other servers kept here, backup_<id> at the top, are not backed
+// up again, nor replicated
+int isBackupPath(const char *path)
+{
+    while (*path == '/')
+        path++;
+    if (strncmp(path, "backup_", 7) != 0 || !isdigit((unsigned char)path[7]))
+        return 0;
+    path += 7;
+    while (isdigit((unsigned char)*path))
+        path++;
+    return *path == '\0' || *path == '/';
+}
+
+// Everything on this server, in place of whatever dest_dir held on the peer
+static void planFullBackup(CopyPlan *plan, Node *root, const char *dest_dir)
+{
+    char parent[MAX_PATH_LENGTH];
+    char name[MAX_PATH_LENGTH];
+    snprintf(parent, sizeof(parent), "%s", dest_dir);
+    char *slash = strrchr(parent, '/');
+    if (!slash || slash[1] == '\0')
+        return;
+    snprintf(name, sizeof(name), "%s", slash + 1);
+    slash[slash == parent ? 1 : 0] = '\0';
+    addCopyEntry(plan, NULL, NULL, parent, name);
+    addCopyEntry(plan, root, "/", parent, name);
+
+    uint32_t cursor = 0;
+    Node *child;
+    char child_source[MAX_PATH_LENGTH];
+    while (root->children && (child = nextChild(root->children, &cursor)) != NULL)
+    {
+        snprintf(child_source, sizeof(child_source), "/%s", child->name);
+        if (!isBackupPath(child_source))
+            planCopy(plan, child, child_source, dest_dir);
+    }
+}
+
+// The paths touched since the last backup, in path order so a directory
+// comes before what is in it. What is gone is only deleted on the peer; files,
+// and directories that were deleted on the way, replace what the peer has.
+static void planIncrementalBackup(CopyPlan *plan, Node *root, const char *dest_dir, JournalChange *changes, int count)
+{
+    char entry_dir[MAX_PATH_LENGTH];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            const char *path = changes[i].path;
+            const char *slash = strrchr(path, '/');
+            if (!slash || slash[1] == '\0' || isBackupPath(path))
+                continue;
+            Node *node = findNode(root, path);
+            if ((pass == 0) != (node == NULL))
+                continue;
+            snprintf(entry_dir, sizeof(entry_dir), "%s%.*s", dest_dir, (int)(slash - path), path);
+            CopyEntry *entry = addCopyEntry(plan, node, path, entry_dir, slash + 1);
+            entry->replace = node && (node->type == FILE_NODE || changes[i].deleted);
+        }
+    }
+}
+
+// Bring dest_dir on the peer up to date with this server for the naming
+// server's replicas. If epoch is this run's and the journal still has every
+// event after after_seq, the last backup's checkpoint, only the paths those
+// events touched are sent; otherwise dest_dir is replaced by a full copy.
+// *backup_seq is the checkpoint of this backup and *full tells which it was.
+// Returns 1 on success.
+int backup_to_peer(const char *dest_dir, const char *peer_ip, int peer_port, Node *root, uint32_t epoch, uint64_t after_seq, uint64_t *backup_seq, int *full)
+{
+    // A replica the chain streams to has everything once it caught up
+    if (epoch != 0 && epoch == journalEpoch() && replicationCovers(dest_dir, peer_ip, peer_port, backup_seq))
+    {
+        *full = 0;
+        printf("Backup to %s:%d %s: kept up by replication (seq %llu)\n", peer_ip, peer_port, dest_dir,
+               (unsigned long long)*backup_seq);
+        return 1;
+    }
+    CopyPlan plan = {NULL, 0, 0};
+    JournalChange *changes = NULL;
+    int count = -1;
+    // No event can slip in between the checkpoint and the plan: creates and
+    // deletes need namespace_lock, and a write journaled after the checkpoint
+    // is simply sent again next time
+    pthread_rwlock_rdlock(&namespace_lock);
+    if (epoch != 0 && epoch == journalEpoch())
+        count = journalChangesSince(after_seq, &changes, backup_seq);
+    *full = count < 0;
+    if (*full)
+    {
+        *backup_seq = journalLastSeq();
+        planFullBackup(&plan, root, dest_dir);
+    }
+    else
+        planIncrementalBackup(&plan, root, dest_dir, changes, count);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    printf("Backup to %s:%d %s: %s, %zu entries (seq %llu)\n", peer_ip, peer_port, dest_dir,
+           *full ? "full" : "incremental", plan.count, (unsigned long long)*backup_seq);
+    int ok = plan.count == 0 || sendCopyPlan(&plan, peer_ip, peer_port, root, NULL);
+    if (changes)
+        freeJournalChanges(changes, count);
+    freeCopyPlan(&plan);
+    return ok;
+}
+
+// Read exactly len bytes, through the reader's buffer
+static int readArchive(ArchiveReader *reader, char *out, size_t len)
+{
+    while (len > 0)
+    {
+        if (reader->start == reader->end)
+        {
+            ssize_t n = recv(reader->sock, reader->buffer, ARCHIVE_BUFFER, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            reader->start = 0;
+            reader->end = n;
+        }
+        size_t take = reader->end - reader->start < len ? reader->end - reader->start : len;
+        memcpy(out, reader->buffer + reader->start, take);
+        reader->start += take;
+        out += take;
+        len -= take;
+    }
+    return 0;
+}
+
+// Pass size bytes of file data to target, or drop them if target is NULL.
+// Data is written straight out of the receive buffer.
+static int extractFileData(ArchiveReader *reader, Node *target, uint64_t size)
+{
+    int failed = 0;
+    while (size > 0)
+    {
+        if (reader->start == reader->end)
+        {
+            ssize_t n = recv(reader->sock, reader->buffer, ARCHIVE_BUFFER, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            reader->start = 0;
+            reader->end = n;
+        }
+        size_t take = reader->end - reader->start;
+        if (take > size)
+            take = (size_t)size;
+        if (target && !failed && writeFileChunk(target, reader->buffer + reader->start, take) != (ssize_t)take)
+            failed = 1;
+        reader->start += take;
+        size -= take;
+    }
+    return failed ? 1 : 0;
+}
+
+// Receive an archive on sock, after "ARCHIVE READY" went out, creating its
+// entries below root. Answers "ARCHIVE DONE <entries> <failed>" at the end.
+// Returns -1 if the stream broke off.
+int extractArchive(int sock, Node *root)
+{
+    ArchiveReader reader = {sock, (char *)malloc(ARCHIVE_BUFFER), 0, 0};
+    if (!reader.buffer)
+        return -1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char header[ARCHIVE_HEADER_SIZE];
+    char dir[MAX_PATH_LENGTH];
+    char name[MAX_PATH_LENGTH];
+    unsigned long entries = 0, failed = 0;
+    unsigned long long bytes = 0;
+    int broken = readArchive(&reader, header, 4) < 0 || getU32(header) != ARCHIVE_MAGIC;
+    while (!broken)
+    {
+        if (readArchive(&reader, header, ARCHIVE_HEADER_SIZE) < 0)
+        {
+            broken = 1;
+            break;
+        }
+        uint32_t type = getU32(header);
+        uint32_t dir_len = getU32(header + 8);
+        uint32_t name_len = getU32(header + 12);
+        uint64_t size = ((uint64_t)getU32(header + 16) << 32) | getU32(header + 20);
+        if (type == ARCHIVE_END)
+            break;
+        if (dir_len >= MAX_PATH_LENGTH || name_len >= MAX_PATH_LENGTH || readArchive(&reader, dir, dir_len) < 0 ||
+            readArchive(&reader, name, name_len) < 0)
+        {
+            broken = 1;
+            break;
+        }
+        dir[dir_len] = '\0';
+        name[name_len] = '\0';
+        entries++;
+
+        pthread_rwlock_wrlock(&namespace_lock);
+        if (type == ARCHIVE_DELETE)
+        {
+            failed += removeEntry(root, dir, name) < 0;
+            pthread_rwlock_unlock(&namespace_lock);
+            continue;
+        }
+        Node *parentDir = findNode(root, dir);
+        Node *target = createEntry(parentDir, name, type == ARCHIVE_DIRECTORY ? DIRECTORY_NODE : FILE_NODE);
+        if (target && type == ARCHIVE_FILE)
+            nodeLockWrite(target, NODE_LOCK_TIMEOUT_MS); // Freshly created, nobody else holds it
+        pthread_rwlock_unlock(&namespace_lock);
+        if (!target)
+            failed++;
+        if (type != ARCHIVE_FILE)
+            continue;
+
+        int result = extractFileData(&reader, target, size);
+        if (target)
+        {
+            journalRecordResize(target);
+            nodeUnlockWrite(target);
+        }
+        if (result < 0)
+            broken = 1;
+        else if (result > 0 && target)
+            failed++;
+        bytes += size;
+    }
+    free(reader.buffer);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (broken)
+    {
+        printf("Archive broken off after %lu entries\n", entries);
+        return -1;
+    }
+
+    char reply[64];
+    snprintf(reply, sizeof(reply), "ARCHIVE DONE %lu %lu", entries, failed);
+    sendAll(sock, reply, strlen(reply));
+    printf("Extracted archive: %lu entries (%lu failed), %llu bytes in %.2f ms, %.0f files/s\n",
+           entries, failed, bytes, elapsed_ms, elapsed_ms > 0 ? entries * 1000.0 / elapsed_ms : 0.0);
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include "header.h"
+
+// Open descriptors for recently used files, keyed by their Node. Transfers
+// acquire a descriptor, use pread/sendfile/write on it and release it, so a
+// file is opened once instead of once per chunk. Descriptors are opened
+// O_RDWR | O_APPEND because every write on this server appends; reads and
+// sendfile take explicit offsets and never touch the shared file position.
+// At most FD_CACHE_CAPACITY idle descriptors stay open; the least recently
+// used idle one is closed first. Entries still in use are never closed, they
+// are only marked stale and closed by the last release.
+typedef struct FdCacheEntry
+{
+    Node *node;
+    int fd;
+    int refs;
+    struct FdCacheEntry *prev; // LRU list, most recent first
+    struct FdCacheEntry *next;
+    struct FdCacheEntry *hash_next;
+} FdCacheEntry;
+
+static FdCacheEntry *fd_buckets[FD_CACHE_BUCKETS];
+static FdCacheEntry *fd_head = NULL;
+static FdCacheEntry *fd_tail = NULL;
+static FdCacheEntry *stale_entries = NULL; // Invalidated while in use, closed by the last release
+static int fd_cached = 0;
+static unsigned long fd_hits = 0;
+static unsigned long fd_misses = 0;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int nodeBucket(Node *node)
+{
+    uintptr_t key = (uintptr_t)node;
+    key ^= key >> 17;
+    key *= 0x9E3779B1u;
+    return (unsigned int)(key >> 7) % FD_CACHE_BUCKETS;
+}
+
+static void unlinkEntry(FdCacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        fd_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        fd_tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void pushFront(FdCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = fd_head;
+    if (fd_head)
+        fd_head->prev = entry;
+    fd_head = entry;
+    if (!fd_tail)
+        fd_tail = entry;
+}
+
+// Take an entry out of the table and the LRU list; the caller closes it
+static void dropEntry(FdCacheEntry *entry)
+{
+    FdCacheEntry **link = &fd_buckets[nodeBucket(entry->node)];
+    while (*link && *link != entry)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = entry->hash_next;
+    unlinkEntry(entry);
+    fd_cached--;
+}
+
+// Close idle descriptors from the cold end until the cache is within budget
+static void evictIdle()
+{
+    FdCacheEntry *entry = fd_tail;
+    while (entry && fd_cached > FD_CACHE_CAPACITY)
+    {
+        FdCacheEntry *prev = entry->prev;
+        if (entry->refs == 0)
+        {
+            dropEntry(entry);
+            close(entry->fd);
+            free(entry);
+        }
+        entry = prev;
+    }
+}
+
+// Returns an open descriptor for a file node, or -1. Every successful call
+// must be paired with fdCacheRelease.
+int fdCacheAcquire(Node *node)
+{
+    if (!node || node->type != FILE_NODE)
+        return -1;
+
+    pthread_mutex_lock(&fd_lock);
+    FdCacheEntry *entry = fd_buckets[nodeBucket(node)];
+    while (entry && entry->node != node)
+        entry = entry->hash_next;
+    if (entry)
+    {
+        entry->refs++;
+        unlinkEntry(entry);
+        pushFront(entry);
+        fd_hits++;
+        int fd = entry->fd;
+        pthread_mutex_unlock(&fd_lock);
+        return fd;
+    }
+    fd_misses++;
+    pthread_mutex_unlock(&fd_lock);
+
+    // Open outside the lock; a file without write access on disk can still
+    // be served for reads
+    char location[PATH_MAX];
+    if (getDataLocation(node, location, sizeof(location)) < 0)
+        return -1;
+    int fd = open(location, O_RDWR | O_APPEND);
+    if (fd < 0 && (errno == EACCES || errno == EROFS))
+        fd = open(location, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&fd_lock);
+    entry = fd_buckets[nodeBucket(node)];
+    while (entry && entry->node != node)
+        entry = entry->hash_next;
+    if (entry)
+    {
+        // Another thread opened it meanwhile, share theirs
+        entry->refs++;
+        int cached = entry->fd;
+        pthread_mutex_unlock(&fd_lock);
+        close(fd);
+        return cached;
+    }
+    entry = malloc(sizeof(FdCacheEntry));
+    if (!entry)
+    {
+        pthread_mutex_unlock(&fd_lock);
+        close(fd);
+        return -1;
+    }
+    entry->node = node;
+    entry->fd = fd;
+    entry->refs = 1;
+    unsigned int index = nodeBucket(node);
+    entry->hash_next = fd_buckets[index];
+    fd_buckets[index] = entry;
+    pushFront(entry);
+    fd_cached++;
+    evictIdle();
+    pthread_mutex_unlock(&fd_lock);
+    return fd;
+}
+
+void fdCacheRelease(Node *node, int fd)
+{
+    pthread_mutex_lock(&fd_lock);
+    FdCacheEntry *entry = fd_buckets[nodeBucket(node)];
+    while (entry && !(entry->node == node && entry->fd == fd))
+        entry = entry->hash_next;
+    if (entry)
+    {
+        entry->refs--;
+        if (fd_cached > FD_CACHE_CAPACITY)
+            evictIdle();
+        pthread_mutex_unlock(&fd_lock);
+        return;
+    }
+
+    // The node was invalidated while this descriptor was in use
+    FdCacheEntry **link = &stale_entries;
+    while (*link && !((*link)->node == node && (*link)->fd == fd))
+        link = &(*link)->hash_next;
+    entry = *link;
+    if (entry && --entry->refs == 0)
+    {
+        *link = entry->hash_next;
+        close(entry->fd);
+        free(entry);
+    }
+    pthread_mutex_unlock(&fd_lock);
+}
+
+// Forget a node's descriptor, e.g. before the file is deleted. If a
+// transfer still holds it, it stays open until that transfer releases it.
+void fdCacheInvalidate(Node *node)
+{
+    pthread_mutex_lock(&fd_lock);
+    FdCacheEntry *entry = fd_buckets[nodeBucket(node)];
+    while (entry && entry->node != node)
+        entry = entry->hash_next;
+    if (entry)
+    {
+        dropEntry(entry);
+        if (entry->refs == 0)
+        {
+            close(entry->fd);
+            free(entry);
+        }
+        else
+        {
+            entry->hash_next = stale_entries;
+            stale_entries = entry;
+        }
+    }
+    pthread_mutex_unlock(&fd_lock);
+}
+
+void formatFdCacheStats(char *buffer, size_t size)
+{
+    pthread_mutex_lock(&fd_lock);
+    snprintf(buffer, size, "File descriptor cache: %d/%d open, %lu hits, %lu misses\n", fd_cached, FD_CACHE_CAPACITY, fd_hits, fd_misses);
+    pthread_mutex_unlock(&fd_lock);
+}
@@ -1,64 +1,45 @@
 #include"header.h"
 
-// Hash function for strings
-unsigned int hash(const char *str)
+// Helper to create a new node (file or directory) with metadata. Its
+// location on disk follows from its parents, see getDataLocation.
+Node *createNode(const char *name, NodeType type, Permissions perms)
 {
-    unsigned int hash = 0;
-    while (*str)
-    {
-        hash = (hash * 31) + *str;
-        str++;
-    }
-    return hash % TABLE_SIZE;
-}
-
-// Initialize a new hash table for storing children
-NodeTable *createNodeTable()
-{
-    NodeTable *nodeTable = (NodeTable *)malloc(sizeof(NodeTable));
-    for (int i = 0; i < TABLE_SIZE; i++)
-        nodeTable->table[i] = NULL;
-    return nodeTable;
-}
-
-// Helper to create a new node (file or directory) with metadata
-Node *createNode(const char *name, NodeType type, Permissions perms, const char *dataLocation)
-{
-    Node *node = (Node *)malloc(sizeof(Node));
-    node->name = strdup(name);
+    Node *node = allocNode();
+    node->name = internName(name);
     node->type = type;
     node->permissions = perms;
-    node->dataLocation = dataLocation ? strdup(dataLocation) : NULL;
     node->parent = NULL;
-    node->next = NULL;
-    node->lock_type=0;
     node->children = (type == DIRECTORY_NODE) ? createNodeTable() : NULL;
-    node->lock_type = 0; // No lock by default
+    nodeLockInit(&node->lock); // Unlocked by default
     return node;
 }
 
-// Insert a node into a directory's hash table
-void insertNode(NodeTable *table, Node *node)
+// Build the on-disk location of a node from its parents: the root is named
+// after its location and every other node adds "/<name>". Returns the
+// length, or -1 if it does not fit in size bytes.
+int getDataLocation(const Node *node, char *buffer, size_t size)
 {
-    unsigned int index = hash(node->name);
-    node->next = table->table[index];
-    table->table[index] = node;
-}
-
-// Search for a file or directory in a hash table by name
-Node *searchNode(NodeTable *table, const char *name)
-{
-    unsigned int index = hash(name);
-    Node *current = table->table[index];
-    while (current && strcmp(current->name, name) != 0)
-    {
-        current = current->next;
-    }
-    return current;
+    size_t len = strlen(node->name);
+    for (const Node *up = node->parent; up; up = up->parent)
+        len += 1 + strlen(up->name);
+    if (len + 1 > size)
+        return -1;
+
+    buffer[len] = '\0';
+    size_t end = len;
+    for (const Node *up = node; up; up = up->parent)
+    {
+        size_t name_len = strlen(up->name);
+        end -= name_len;
+        memcpy(buffer + end, up->name, name_len);
+        if (up->parent)
+            buffer[--end] = '/';
+    }
+    return (int)len;
 }
 
 // Add a file under a directory with metadata
-void addFile(Node *parentDir, const char *fileName, Permissions perms, const char *dataLocation)
+void addFile(Node *parentDir, const char *fileName, Permissions perms)
 {
     if (parentDir->type != DIRECTORY_NODE)
     {
@@ -66,7 +47,7 @@ void addFile(Node *parentDir, const char *fileName, Permissions perms, const cha
         return;
     }
 
-    Node *newFile = createNode(fileName, FILE_NODE, perms, dataLocation);
+    Node *newFile = createNode(fileName, FILE_NODE, perms);
     newFile->parent = parentDir;
     insertNode(parentDir->children, newFile);
 }
@@ -80,7 +61,7 @@ void addDirectory(Node *parentDir, const char *dirName, Permissions perms)
         return;
     }
 
-    Node *newDir = createNode(dirName, DIRECTORY_NODE, perms, NULL);
+    Node *newDir = createNode(dirName, DIRECTORY_NODE, perms);
     newDir->parent = parentDir;
     insertNode(parentDir->children, newDir);
 }
@@ -104,117 +85,60 @@ void printFileSystemTree(Node *node, int depth)
     // If it's a directory, print all its children
     if (node->type == DIRECTORY_NODE && node->children)
     {
-        for (int i = 0; i < TABLE_SIZE; i++)
+        uint32_t cursor = 0;
+        Node *current;
+        while ((current = nextChild(node->children, &cursor)) != NULL)
         {
-            Node *current = node->children->table[i];
-            while (current)
-            {
-                printFileSystemTree(current, depth + 1);
-                current = current->next;
-            }
+            printFileSystemTree(current, depth + 1);
         }
     }
 }
 
-// Helper function to split path into components
-char **splitPath(const char *path, int *count)
-{
-    char *pathCopy = strdup(path);
-    char *temp = pathCopy;
-    *count = 0;
-
-    // Count components
-    while (*temp)
-    {
-        if (*temp == '/')
-            (*count)++;
-        temp++;
-    }
-    (*count)++; // For the last component
-
-    // Allocate array for components
-    char **components = malloc(sizeof(char *) * (*count));
-    int idx = 0;
-
-    // Split path
-    char *token = strtok(pathCopy, "/");
-    while (token && idx < *count)
-    {
-        components[idx++] = strdup(token);
-        token = strtok(NULL, "/");
-    }
-    *count = idx; // Update actual count
-
-    free(pathCopy);
-    return components;
-}
-
-// Modified search path function
-Node *searchPath(Node *root, const char *path)
+// Resolve a path one component at a time, straight from the caller's
+// string: each component is hashed while its end is found and looked up by
+// pointer and length, so nothing is copied or allocated. Returns NULL if a
+// component is missing or something other than a directory is in the way.
+// With skip_root_name a leading component equal to the root's name is ignored.
+Node *walkPath(Node *root, const char *path, int skip_root_name)
 {
-    // printf("\nSearching for path: %s\n", path);
-
-    // Split path into components
-    int componentCount;
-    char **pathComponents = splitPath(path, &componentCount);
-
     Node *current = root;
-
-    // Skip the first component if it matches the root name
-    int startIdx = 0;
-    if (componentCount > 0 && strcmp(pathComponents[0], root->name) == 0)
+    const char *p = path;
+    int first = 1;
+    while (current)
     {
-        startIdx = 1;
-    }
-
-    // Traverse path components
-    for (int i = startIdx; i < componentCount && current != NULL; i++)
-    {
-        // printf("Looking for component: %s in directory: %s\n",
-        //        pathComponents[i], current->name);
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
 
-        if (current->type != DIRECTORY_NODE)
+        const char *component = p;
+        unsigned int h = NAME_HASH_SEED;
+        while (*p && *p != '/')
         {
-            printf("Error: %s is not a directory\n", current->name);
-            current = NULL;
-            break;
+            h = NAME_HASH_STEP(h, *p);
+            p++;
         }
+        size_t len = p - component;
 
-        // Search in current directory's hash table
-        Node *found = searchNode(current->children, pathComponents[i]);
-
-        if (!found)
+        if (first && skip_root_name && strncmp(component, root->name, len) == 0 && root->name[len] == '\0')
         {
-            // printf("Component not found: %s\n", pathComponents[i]);
-            // // Print contents of current directory for debugging
-            // printf("Contents of directory %s:\n", current->name);
-            // for (int j = 0; j < TABLE_SIZE; j++)
-            // {
-            //     Node *child = current->children->table[j];
-            //     while (child)
-            //     {
-            //         printf("  - %s\n", child->name);
-            //         child = child->next;
-            //     }
-            // }
-            current = NULL;
-            break;
+            first = 0;
+            continue;
         }
-
-        current = found;
-        // printf("Found component: %s\n", current->name);
-    }
-
-    // Free path components
-    for (int i = 0; i < componentCount; i++)
-    {
-        free(pathComponents[i]);
+        first = 0;
+        if (current->type != DIRECTORY_NODE || !current->children)
+            return NULL;
+        current = searchNodeHashed(current->children, component, len, h);
     }
-    free(pathComponents);
-
     return current;
 }
 
+// Modified search path function
+Node *searchPath(Node *root, const char *path)
+{
+    return walkPath(root, path, 1);
+}
+
 // Check if a node has specific permissions
 int hasPermission(Node *node, Permissions perm)
 {
@@ -231,18 +155,16 @@ void listDirectory(Node *dir)
     }
 
     printf("Contents of directory %s:\n", dir->name);
-    for (int i = 0; i < TABLE_SIZE; i++)
+    char location[PATH_MAX];
+    uint32_t cursor = 0;
+    Node *child;
+    while ((child = nextChild(dir->children, &cursor)) != NULL)
     {
-        Node *child = dir->children->table[i];
-        while (child)
-        {
-            printf("- %s (%s), Location: %s, Permissions: %d\n",
-                   child->name,
-                   child->type == FILE_NODE ? "File" : "Directory",
-                   child->dataLocation ? child->dataLocation : "N/A",
-                   child->permissions);
-            child = child->next;
-        }
+        printf("- %s (%s), Location: %s, Permissions: %d\n",
+               child->name,
+               child->type == FILE_NODE ? "File" : "Directory",
+               getDataLocation(child, location, sizeof(location)) >= 0 ? location : "N/A",
+               child->permissions);
     }
 }
 
@@ -251,22 +173,17 @@ void freeNode(Node *node)
 {
     if (node->children)
     {
-        for (int i = 0; i < TABLE_SIZE; i++)
+        uint32_t cursor = 0;
+        Node *child;
+        while ((child = nextChild(node->children, &cursor)) != NULL)
         {
-            Node *child = node->children->table[i];
-            while (child)
-            {
-                Node *next = child->next;
-                freeNode(child);
-                child = next;
-            }
+            freeNode(child);
         }
-        free(node->children);
+        freeNodeTable(node->children);
     }
-    free(node->name);
-    if (node->dataLocation)
-        free(node->dataLocation);
-    free(node);
+    releaseName(node->name);
+    nodeLockDestroy(&node->lock);
+    freeNodeMemory(node);
 }
 
 // Traverse the file system starting from `path` and add all files/directories to `parentDir`
@@ -309,7 +226,7 @@ void traverseAndAdd(Node *parentDir, const char *path)
         if (st.st_mode & S_IXUSR)
             perms |= EXECUTE;
 
-        Node *newNode = createNode(entry->d_name, type, perms, fullPath);
+        Node *newNode = createNode(entry->d_name, type, perms);
         newNode->parent = parentDir;
 
         // printf("Inserting: %s (type: %s)\n", entry->d_name, (type == DIRECTORY_NODE) ? "Directory" : "File");
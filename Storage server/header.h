@@ -1,8 +1,10 @@
 #ifndef HEADER_H
 #define HEADER_H
+#define _GNU_SOURCE // copy_file_range
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <pthread.h>
@@ -16,7 +18,20 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <asm-generic/socket.h>
-#define TABLE_SIZE 10
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#define NODE_TABLE_GROUP 8         // Control bytes probed together in a directory table
+#define NODE_TABLE_MIN_CAPACITY 8  // Slots allocated on a directory's first child
+#define NODE_TABLE_MIGRATE_STEP 32 // Old slots moved per insert during a rehash
+#define NODE_SLAB_CHUNK (1 << 20)  // Block size nodes and directory tables are carved from
+#define NAME_HASH_SEED 2166136261u // FNV-1a over child names, see hash()
+#define NAME_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * 16777619u)
 #define MAX_COMMAND_LENGTH 10
 #define MAX_PATH_LENGTH 1024
 #define MAX_CONTENT_LENGTH 100001
@@ -24,6 +39,38 @@
 #define BUFFER_SIZE 100001
 #define MAX_BUFFER_SIZE 100001
 #define ACK_PORT 8090
+#define TREE_STREAM_MAGIC 0x4E545231 // "NTR1", starts a serialized node tree
+#define TREE_STREAM_BUFFER 65536
+#define EVENT_STREAM_MAGIC 0x4E455631 // "NEV1", starts a batch of namespace events
+#define JOURNAL_CAPACITY 65536        // Namespace events kept for naming server resyncs
+#define SENDFILE_FALLBACK_BUFFER 65536 // Buffer for file transfers when sendfile is unavailable
+#define FD_CACHE_CAPACITY 128         // Idle file descriptors kept open for reuse
+#define FD_CACHE_BUCKETS 256
+#define NODE_LOCK_TIMEOUT_MS 5000     // How long READ/WRITE wait for a busy file before ERROR 52
+#define COPY_PROGRESS_INTERVAL_MS 250 // Least time between PROGRESS reports of a COPY
+#define COPY_STREAMS 4                // Parallel connections of a directory COPY, SS_COPY_STREAMS overrides
+#define COPY_STREAMS_MAX 16
+#define LOCAL_COPY_CHUNK (8 << 20)    // Bytes per copy_file_range call of a local COPY, between progress reports
+#define ARCHIVE_MAGIC 0x53534131      // "SSA1", starts a COPY archive stream, see archive.c
+#define ARCHIVE_HEADER_SIZE 24        // Fixed part of an archive entry header
+#define ARCHIVE_BUFFER 262144         // Receive buffer and largest sendfile call of an archive
+#define ARCHIVE_END 0
+#define ARCHIVE_DIRECTORY 1
+#define ARCHIVE_FILE 2
+#define ARCHIVE_DELETE 3              // Remove dir/name on the peer if it is there, see backup_to_peer
+#define REPLICA_HEADER_SIZE 32        // Fixed part of a replication record, see replication.c
+#define REPLICA_ACK_SIZE 20           // Cumulative ack going back up a chain
+#define REPLICA_CREATE_DIRECTORY 1
+#define REPLICA_CREATE_FILE 2
+#define REPLICA_DELETE 3
+#define REPLICA_WRITE 4               // size bytes at offset
+#define REPLICA_CONTENT 5             // The whole file, size bytes
+#define REPLICA_REDO 1                // Record flag: queued during the catch-up, may already be applied
+#define REPLICA_QUEUE_MAX_BYTES (64 << 20) // Write data waiting for the chain before it is broken off
+#define REPLICA_ACK_TIMEOUT_MS 5000   // How long a reply waits for replica acks before the chain is broken off
+#define FRAME_MORE 0x80000000u        // Length bit: more frames of this reply follow, see frame.c
+#define FRAME_CHUNK_SIZE 65536        // Longer payloads are split over several frames
+#define FRAME_MAX_PAYLOAD (16 << 20)  // Larger frames mean the stream is out of step
 
 typedef enum
 {
@@ -34,8 +81,14 @@ typedef enum
     CMD_CREATE,
     CMD_DELETE,
     CMD_COPY,
+    CMD_BACKUP,
+    CMD_REPLICAS,
+    CMD_REPLICATE,
     CMD_FILECOPY,
     CMD_DIRCOPY,
+    CMD_ARCHIVE,
+    CMD_SYNC,
+    CMD_STATS,
     CMD_UNKNOWN
 } CommandType;
 
@@ -53,16 +106,26 @@ typedef enum
     DIRECTORY_NODE
 } NodeType;
 
+typedef struct NodeLock
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t readers_cond;
+    pthread_cond_t writers_cond;
+    int readers;         // Readers holding the lock
+    int writer;          // 1 while a writer holds it
+    int waiting_writers; // Writers queued; new readers wait behind them
+    int pins;            // Lookups about to lock it, see nodePin
+    int retired;         // Taken out of the tree; the last pin frees it
+} NodeLock;
+
 typedef struct Node
 {
-    char *name;      
+    const char *name; // Interned, see node_alloc.c
     NodeType type;
     Permissions permissions;
-    char *dataLocation;
     struct Node *parent;
-    struct Node *next;
     struct NodeTable *children; 
-    int lock_type; // 0= none, 1 = read, 2 = write
+    NodeLock lock; // Held for the whole READ, STREAM, WRITE or COPY of a file
 } Node;
 
 struct ClientData
@@ -71,9 +134,32 @@ struct ClientData
     int client_port;
     int port;
     char* ip;
+    const char *local_ip; // Address this server registers under
     Node *root;
 };
 
+// When a change is acknowledged, see replication.c; SS_DURABILITY overrides
+typedef enum
+{
+    DURABILITY_PRIMARY, // Once this server has it
+    DURABILITY_ONE,     // Once the first replica has it too
+    DURABILITY_ALL      // Once every replica has it
+} DurabilityMode;
+
+typedef enum
+{
+    JOURNAL_CREATE = 1,
+    JOURNAL_DELETE,
+    JOURNAL_RESIZE
+} JournalOp;
+
+// A path touched by journal events since a backup checkpoint
+typedef struct JournalChange
+{
+    char *path;  // Relative to the storage server root
+    int deleted; // One of its events was a delete
+} JournalChange;
+
 typedef struct
 {
     Node *root;
@@ -81,13 +167,52 @@ typedef struct
     int socket;
 } ThreadArgs;
 
+// One framed request from the naming server, served on its own thread
+typedef struct NamingRequest
+{
+    Node *root;
+    int socket;          // Naming server connection it came in on
+    uint32_t connection; // Registration that connection belongs to
+    uint32_t id;         // Echoed on every frame of the reply
+    char *command;
+} NamingRequest;
+
+// How far a COPY has got, reported to the naming server as
+// PROGRESS <entries done> <entries> <bytes done> <bytes> [<done>/<total> per stream]
+typedef struct CopyProgress
+{
+    NamingRequest *request; // NULL if the naming server did not ask
+    pthread_mutex_t lock;   // The streams of a COPY report from their own threads
+    size_t entries_done;
+    size_t entries_total;
+    uint64_t bytes_done;
+    uint64_t bytes_total;
+    int streams;
+    uint64_t stream_bytes_done[COPY_STREAMS_MAX];
+    uint64_t stream_bytes_total[COPY_STREAMS_MAX];
+    long long last_report_ms;
+} CopyProgress;
+
+typedef struct NodeTableSlots
+{
+    uint8_t *ctrl; // Per slot: empty, deleted, or a 7-bit tag of the name hash
+    Node **slots;
+    uint32_t capacity; // Power of two, a multiple of NODE_TABLE_GROUP
+} NodeTableSlots;
+
+// Children of a directory, see node_table.c
 typedef struct NodeTable
 {
-    Node *table[TABLE_SIZE];
+    NodeTableSlots current;
+    NodeTableSlots old;   // Slots still being drained by an incremental rehash
+    uint32_t migrate_pos; // Next old slot to move
+    uint32_t size;        // Children in both arrays
+    uint32_t used;        // Live and deleted slots in current
 } NodeTable;
 
 typedef struct AsyncWriteTask {
-    Node *targetNode;
+    Node *root;
+    char path[MAX_PATH_LENGTH]; // Looked up again when flushed
     char *data;
     size_t size;
     int clientId; // To identify the client socket
@@ -100,35 +225,98 @@ typedef struct AsyncWriteTask {
 extern AsyncWriteTask *asyncWriteQueue; // The head of the queue
 extern pthread_mutex_t queueMutex;      // Mutex for queue protection
 extern pthread_cond_t queueCondition;   // Condition variable for signaling
+extern pthread_rwlock_t namespace_lock; // Write: adding or removing nodes; read: walking the tree
+extern int copy_streams;                // Connections a directory COPY is spread over
+extern int durability_mode;             // DurabilityMode of changes replicated down the chain
+extern char local_ip[INET_ADDRSTRLEN];  // Address and client port we registered with,
+extern int local_client_port;           // a COPY to them stays on this server
 
 unsigned int hash(const char *str);
 NodeTable *createNodeTable();
-Node *createNode(const char *name, NodeType type, Permissions perms, const char *dataLocation);
+void freeNodeTable(NodeTable *table);
+int removeNode(NodeTable *table, Node *node);
+Node *nextChild(NodeTable *table, uint32_t *cursor);
+Node *createNode(const char *name, NodeType type, Permissions perms);
+int getDataLocation(const Node *node, char *buffer, size_t size);
+Node *allocNode();
+void freeNodeMemory(Node *node);
+NodeTable *allocNodeTable();
+void freeNodeTableMemory(NodeTable *table);
+const char *internName(const char *name);
+void releaseName(const char *name);
+void formatNodeAllocStats(char *buffer, size_t size);
+long residentMemoryKB();
 void insertNode(NodeTable *table, Node *node);
 Node *searchNode(NodeTable *table, const char *name);
-void addFile(Node *parentDir, const char *fileName, Permissions perms, const char *dataLocation);
+Node *searchNodeHashed(NodeTable *table, const char *name, size_t len, unsigned int h);
+Node *walkPath(Node *root, const char *path, int skip_root_name);
+void addFile(Node *parentDir, const char *fileName, Permissions perms);
 void addDirectory(Node *parentDir, const char *dirName, Permissions perms);
 Node *searchPath(Node *root, const char *path);
 void printFileSystemTree(Node *node, int depth);
-char **splitPath(const char *path, int *count);
 int hasPermission(Node *node, Permissions perm);
 void listDirectory(Node *dir);
 void freeNode(Node *node);
 void traverseAndAdd(Node *parentDir, const char *path);
 CommandType parseCommand(const char *cmd);
 void printUsage();
-void processCommand_namingServer(Node *root, char *input, int client_socket);
+void processCommand_namingServer(Node *root, char *input, NamingRequest *request);
 void processCommand_user(Node *root, char *input, int client_socket);
 Node *createEmptyNode(Node *parentDir, const char *name, NodeType type);
 int deleteNode(Node *node);
 int copyNode(Node *sourceNode, Node *destDir, const char *newName);
+int sendAll(int sock, const char *buffer, size_t len);
 int getFileMetadata(Node *fileNode, struct stat *metadata);
-ssize_t streamAudioFile(Node *fileNode, char *buffer, size_t size, off_t offset);
-int copy_directory_recursive(int peer_socket, Node *dir_node, const char *dest_path, int naming_socket);
-void copy_files_to_peer(const char *source_path, const char *dest_path, const char *peer_ip, int peer_port, Node *root, int naming_socket);
-int copy_single_file(int peer_socket, Node *source_node, const char *dest_path, int naming_socket);
+ssize_t sendFileRange(int sock, int fd, off_t *offset, size_t count);
+int copy_files_to_peer(const char *source_path, const char *dest_path, const char *peer_ip, int peer_port, Node *root, NamingRequest *progress_request);
+int backup_to_peer(const char *dest_dir, const char *peer_ip, int peer_port, Node *root, uint32_t epoch, uint64_t after_seq, uint64_t *backup_seq, int *full);
+int extractArchive(int sock, Node *root);
+int isBackupPath(const char *path);
+void initReplication(Node *root);
+int replicationActive();
+void replicateNamespace(JournalOp journal_op, const Node *node, const char *path);
+void replicateWrite(Node *node, const char *data, size_t size, off_t offset);
+void replicateContent(Node *node);
+uint64_t replicationTicket();
+void replicationWait(uint64_t ticket);
+int replicationCovers(const char *dest_dir, const char *peer_ip, int peer_port, uint64_t *seq);
+int configureReplication(const char *dest_dir, const char *spec);
+void formatReplicationStats(char *buffer, size_t size);
+void formatReplicationStatus(const char *dest_dir, char *buffer, size_t size);
+int applyReplicationStream(int sock, Node *root, const char *args);
+ssize_t writeFileChunk(Node *node, const char *buffer, size_t size);
+int connectToServer(const char *ip, int port);
 Node *findNode(Node *root, const char *path);
 void *flushAsyncWrites(char *ip);
+int fdCacheAcquire(Node *node);
+void fdCacheRelease(Node *node, int fd);
+void fdCacheInvalidate(Node *node);
+void formatFdCacheStats(char *buffer, size_t size);
+void nodeLockInit(NodeLock *lock);
+void nodeLockDestroy(NodeLock *lock);
+int nodeLockRead(Node *node, int timeout_ms);
+int nodeLockWrite(Node *node, int timeout_ms);
+void nodeUnlockRead(Node *node);
+void nodeUnlockWrite(Node *node);
+void formatNodeLockStats(char *buffer, size_t size);
+void nodePin(Node *node);
+int nodeLockPinned(Node *node, int write, int timeout_ms);
+void nodeRetire(Node *node, int write_locked);
+void initJournal(const char *root_location);
+uint32_t journalEpoch();
+uint64_t journalLastSeq();
+int journalPath(const Node *node, char *path, size_t size);
+void journalRecord(JournalOp op, Node *node, int64_t size);
+void journalRecordResize(Node *node);
+int journalChangesSince(uint64_t after_seq, JournalChange **changes, uint64_t *last_seq);
+void freeJournalChanges(JournalChange *changes, int count);
+int sendNamespaceSince(int sock, NamingRequest *request, Node *root, int have_base, uint64_t after_seq);
+int sendNodeTree(int sock, NamingRequest *request, Node *root);
+int sendFrame(int sock, uint32_t request_id, const char *payload, size_t len, int more);
+int recvFrame(int sock, uint32_t *request_id, char **payload, size_t *len, int *more);
+int replyToNamingServer(NamingRequest *request, const char *payload, size_t len, int more);
+int sendNamespaceBytes(int sock, NamingRequest *request, const char *data, size_t len);
+int sendServerInfo(int sock, const char *ip, int nm_port, int client_port, Node *root);
 void sendAckToNamingServer(const char *status, const char *message, int clientId, const char *fileName, const char *clientIP, int clientPort, char *ip);
 
 #endif
@@ -0,0 +1,219 @@
+#include "header.h"
+
+// In-memory journal of namespace changes on this storage server. Every
+// create, delete and size change gets the next sequence number; the naming
+// server remembers the last sequence it applied and asks for the events after
+// it instead of the whole tree. The last JOURNAL_CAPACITY events are kept;
+// anyone further behind gets the full tree again. The epoch is new for every
+// run of the server, so sequence numbers are only compared within one run.
+typedef struct JournalEvent
+{
+    uint64_t seq;
+    uint8_t op;
+    uint8_t type;
+    uint8_t permissions;
+    int64_t size;
+    char *path; // Relative to the storage server root
+} JournalEvent;
+
+static JournalEvent journal[JOURNAL_CAPACITY];
+static uint64_t journal_last_seq = 0; // Sequence of the newest event
+static uint32_t journal_epoch = 0;
+static char journal_root[MAX_PATH_LENGTH];
+static size_t journal_root_len = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void initJournal(const char *root_location)
+{
+    pthread_mutex_lock(&journal_lock);
+    journal_epoch = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    if (journal_epoch == 0)
+        journal_epoch = 1;
+    strncpy(journal_root, root_location, sizeof(journal_root) - 1);
+    journal_root_len = strlen(journal_root);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+uint32_t journalEpoch()
+{
+    return journal_epoch;
+}
+
+uint64_t journalLastSeq()
+{
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = journal_last_seq;
+    pthread_mutex_unlock(&journal_lock);
+    return seq;
+}
+
+// Path of node relative to the storage server root, "/" for the root
+int journalPath(const Node *node, char *path, size_t size)
+{
+    char location[PATH_MAX];
+    if (!node || getDataLocation(node, location, sizeof(location)) < 0)
+        return -1;
+    const char *relative = location;
+    if (strncmp(relative, journal_root, journal_root_len) == 0)
+        relative += journal_root_len;
+    snprintf(path, size, "%s", *relative ? relative : "/");
+    return 0;
+}
+
+// Append an event for a node; its path is derived from its location. Creates
+// and deletes go down the replication chain in the same order.
+void journalRecord(JournalOp op, Node *node, int64_t size)
+{
+    char path[PATH_MAX];
+    if (journalPath(node, path, sizeof(path)) < 0)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    JournalEvent *event = &journal[(journal_last_seq + 1) % JOURNAL_CAPACITY];
+    free(event->path);
+    event->seq = ++journal_last_seq;
+    event->op = (uint8_t)op;
+    event->type = (uint8_t)node->type;
+    event->permissions = (uint8_t)node->permissions;
+    event->size = size;
+    event->path = strdup(path);
+    replicateNamespace(op, node, path);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void journalRecordResize(Node *node)
+{
+    struct stat st;
+    char location[PATH_MAX];
+    if (node && getDataLocation(node, location, sizeof(location)) >= 0 && stat(location, &st) == 0)
+        journalRecord(JOURNAL_RESIZE, node, st.st_size);
+}
+
+static int compareChangePaths(const void *a, const void *b)
+{
+    return strcmp(((const JournalChange *)a)->path, ((const JournalChange *)b)->path);
+}
+
+// The paths touched by the events after after_seq, each listed once, for an
+// incremental backup. Returns how many there are, with the newest sequence in
+// *last_seq, or -1 if the journal no longer reaches back that far.
+int journalChangesSince(uint64_t after_seq, JournalChange **changes, uint64_t *last_seq)
+{
+    pthread_mutex_lock(&journal_lock);
+    uint64_t last = journal_last_seq;
+    if (after_seq > last || last - after_seq > JOURNAL_CAPACITY)
+    {
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+    int count = (int)(last - after_seq);
+    JournalChange *list = (JournalChange *)malloc((count + 1) * sizeof(JournalChange));
+    for (int i = 0; i < count; i++)
+    {
+        JournalEvent *event = &journal[(after_seq + 1 + i) % JOURNAL_CAPACITY];
+        list[i].path = strdup(event->path);
+        list[i].deleted = event->op == JOURNAL_DELETE;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    qsort(list, count, sizeof(JournalChange), compareChangePaths);
+    int unique = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (unique > 0 && strcmp(list[unique - 1].path, list[i].path) == 0)
+        {
+            list[unique - 1].deleted |= list[i].deleted;
+            free(list[i].path);
+            continue;
+        }
+        list[unique++] = list[i];
+    }
+    *changes = list;
+    *last_seq = last;
+    return unique;
+}
+
+void freeJournalChanges(JournalChange *changes, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(changes[i].path);
+    free(changes);
+}
+
+static void putU32(char *buffer, size_t *used, uint32_t value)
+{
+    uint32_t net = htonl(value);
+    memcpy(buffer + *used, &net, sizeof(net));
+    *used += sizeof(net);
+}
+
+static void putU64(char *buffer, size_t *used, uint64_t value)
+{
+    putU32(buffer, used, (uint32_t)(value >> 32));
+    putU32(buffer, used, (uint32_t)value);
+}
+
+// Stream the events after after_seq as one EVENT_STREAM_MAGIC message:
+//   magic | u32 count | u64 last_seq, then per event
+//   u32 record_len | u64 seq | u8 op | u8 type | u8 permissions | u64 size |
+//   u32 path_len | path
+// Returns 1 if the journal no longer reaches back that far, so the caller
+// has to send the full tree instead.
+static int sendJournalSince(int sock, NamingRequest *request, uint64_t after_seq)
+{
+    pthread_mutex_lock(&journal_lock);
+    uint64_t last = journal_last_seq;
+    if (after_seq > last || last - after_seq > JOURNAL_CAPACITY)
+    {
+        pthread_mutex_unlock(&journal_lock);
+        return 1;
+    }
+
+    size_t size = 4 * sizeof(uint32_t);
+    for (uint64_t seq = after_seq + 1; seq <= last; seq++)
+        size += 8 * sizeof(uint32_t) + 3 + strlen(journal[seq % JOURNAL_CAPACITY].path);
+    char *buffer = malloc(size);
+    size_t used = 0;
+    putU32(buffer, &used, EVENT_STREAM_MAGIC);
+    putU32(buffer, &used, (uint32_t)(last - after_seq));
+    putU64(buffer, &used, last);
+    for (uint64_t seq = after_seq + 1; seq <= last; seq++)
+    {
+        JournalEvent *event = &journal[seq % JOURNAL_CAPACITY];
+        uint32_t path_len = strlen(event->path);
+        putU32(buffer, &used, 8 + 3 + 8 + 4 + path_len);
+        putU64(buffer, &used, event->seq);
+        buffer[used++] = event->op;
+        buffer[used++] = event->type;
+        buffer[used++] = event->permissions;
+        putU64(buffer, &used, (uint64_t)event->size);
+        putU32(buffer, &used, path_len);
+        memcpy(buffer + used, event->path, path_len);
+        used += path_len;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    int result = sendNamespaceBytes(sock, request, buffer, used);
+    free(buffer);
+    if (result == 0)
+        printf("Sent %llu namespace events (%zu bytes)\n", (unsigned long long)(last - after_seq), used);
+    return result;
+}
+
+// Bring the naming server up to date: the events after after_seq when
+// it has a base to apply them to and the journal still has them, otherwise
+// the whole tree. With a request the data goes out as frames of its reply,
+// which the caller still has to end.
+int sendNamespaceSince(int sock, NamingRequest *request, Node *root, int have_base, uint64_t after_seq)
+{
+    if (have_base)
+    {
+        int result = sendJournalSince(sock, request, after_seq);
+        if (result <= 0)
+            return result;
+    }
+    pthread_rwlock_rdlock(&namespace_lock);
+    int result = sendNodeTree(sock, request, root);
+    pthread_rwlock_unlock(&namespace_lock);
+    return result;
+}
@@ -4,81 +4,126 @@
 AsyncWriteTask *asyncWriteQueue = NULL;                   // The head of the queue
 pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;   // Mutex for queue protection
 pthread_cond_t queueCondition = PTHREAD_COND_INITIALIZER; // Condition variable for signaling
-
-int sendNodeChain(int sock, Node *node)
+char local_ip[INET_ADDRSTRLEN] = "";
+int local_client_port = 0;
+
+// Requests from the naming server are served on threads of their own, so
+// replies from several of them share the connection: each goes out as whole
+// frames under naming_send_lock. naming_connection counts registrations;
+// a reply to a request from an earlier connection is dropped rather than sent
+// to the new one.
+static pthread_mutex_t naming_send_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t naming_connection = 0;
+
+// The node tree goes to the naming server as one length-prefixed binary
+// stream: a TREE_STREAM_MAGIC header and the journal sequence the tree is
+// current to (u64), followed by one record per node in pre-order. Each record is
+//   u32 record_len | u8 type | u8 permissions | u32 name_len | u32 loc_len |
+//   u32 child_count | name | location
+// in network byte order, followed by the records of its children. Only the
+// root carries a location; the others follow from their names. Records are
+// packed into a TREE_STREAM_BUFFER sized buffer and sent without per-field acks;
+// as the reply to a SYNC request each buffer goes out as one frame.
+typedef struct TreeWriter
+{
+    int sock;
+    NamingRequest *request; // NULL while registering, before framing starts
+    char buffer[TREE_STREAM_BUFFER];
+    size_t used;
+    size_t total_bytes;
+    int node_count;
+    int failed;
+} TreeWriter;
+
+static void flushTreeWriter(TreeWriter *writer)
 {
-    Node *current = node;
-    char ack[1024];
-    while (current != NULL)
+    if (!writer->failed && writer->used > 0 &&
+        sendNamespaceBytes(writer->sock, writer->request, writer->buffer, writer->used) < 0)
     {
-        // Send marker for valid node
-        int valid_marker = 1;
-        if (send(sock, &valid_marker, sizeof(int), 0) < 0)
-            return -1;
-        recv(sock,ack,sizeof(ack),0);
-
-        // Send node data
-        int name_len = strlen(current->name) + 1;
-        if (send(sock, &name_len, sizeof(int), 0) < 0)
-            return -1;
-        recv(sock, ack, sizeof(ack), 0);
-
-        if (send(sock, current->name, name_len, 0) < 0)
-            return -1;
-        recv(sock, ack, sizeof(ack), 0);
-
-        if (send(sock, &current->type, sizeof(NodeType), 0) < 0)
-            return -1;
-        recv(sock, ack, sizeof(ack), 0);
-
-        if (send(sock, &current->permissions, sizeof(Permissions), 0) < 0)
-            return -1;
-        recv(sock, ack, sizeof(ack), 0);
-
-        int loc_len = strlen(current->dataLocation) + 1;
-        if (send(sock, &loc_len, sizeof(int), 0) < 0)
-            return -1;
-        recv(sock, ack, sizeof(ack), 0);
-
-        if (send(sock, current->dataLocation, loc_len, 0) < 0)
-            return -1;
-        recv(sock, ack, sizeof(ack), 0);
-
-        // If this node has children (is a directory)
-        if (current->type == DIRECTORY_NODE && current->children != NULL)
-        {
-            // Send marker indicating has children
-            int has_children = 1;
-            if (send(sock, &has_children, sizeof(int), 0) < 0)
-                return -1;
-            recv(sock, ack, sizeof(ack), 0);
-
-            // Send the entire hash table of children
-            for (int i = 0; i < TABLE_SIZE; i++)
-            {
-                if (sendNodeChain(sock, current->children->table[i]) < 0)
-                    return -1;
-            }
-        }
-        else
-        {
-            // Send marker indicating no children
-            int has_children = 0;
-            if (send(sock, &has_children, sizeof(int), 0) < 0)
-                return -1;
-            recv(sock, ack, sizeof(ack), 0);
-        }
+        perror("Failed to send node tree");
+        writer->failed = 1;
+    }
+    writer->total_bytes += writer->used;
+    writer->used = 0;
+}
 
-        current = current->next;
+static void putTreeBytes(TreeWriter *writer, const void *data, size_t len)
+{
+    const char *bytes = (const char *)data;
+    while (len > 0 && !writer->failed)
+    {
+        size_t room = sizeof(writer->buffer) - writer->used;
+        size_t chunk = len < room ? len : room;
+        memcpy(writer->buffer + writer->used, bytes, chunk);
+        writer->used += chunk;
+        bytes += chunk;
+        len -= chunk;
+        if (writer->used == sizeof(writer->buffer))
+            flushTreeWriter(writer);
     }
-    // sleep(1);
-    // Send end of chain marker
-    int end_marker = -1;
-    if (send(sock, &end_marker, sizeof(int), 0) < 0)
-        return -1;
-    recv(sock, ack, sizeof(ack), 0);
+}
 
-    return 0;
+static void putTreeU32(TreeWriter *writer, uint32_t value)
+{
+    uint32_t net = htonl(value);
+    putTreeBytes(writer, &net, sizeof(net));
+}
+
+static uint32_t countChildren(Node *node)
+{
+    if (node->type != DIRECTORY_NODE || node->children == NULL)
+        return 0;
+    return node->children->size;
+}
+
+static void writeTreeNode(TreeWriter *writer, Node *node)
+{
+    uint32_t name_len = strlen(node->name);
+    const char *location = node->parent == NULL ? node->name : "";
+    uint32_t loc_len = strlen(location);
+    uint32_t child_count = countChildren(node);
+    uint8_t type = (uint8_t)node->type;
+    uint8_t permissions = (uint8_t)node->permissions;
+
+    putTreeU32(writer, 2 + 3 * sizeof(uint32_t) + name_len + loc_len);
+    putTreeBytes(writer, &type, 1);
+    putTreeBytes(writer, &permissions, 1);
+    putTreeU32(writer, name_len);
+    putTreeU32(writer, loc_len);
+    putTreeU32(writer, child_count);
+    putTreeBytes(writer, node->name, name_len);
+    putTreeBytes(writer, location, loc_len);
+    writer->node_count++;
+
+    if (child_count == 0)
+        return;
+    uint32_t cursor = 0;
+    Node *child;
+    while (!writer->failed && (child = nextChild(node->children, &cursor)) != NULL)
+        writeTreeNode(writer, child);
+}
+
+int sendNodeTree(int sock, NamingRequest *request, Node *root)
+{
+    TreeWriter *writer = (TreeWriter *)malloc(sizeof(TreeWriter));
+    writer->sock = sock;
+    writer->request = request;
+    writer->used = 0;
+    writer->total_bytes = 0;
+    writer->node_count = 0;
+    writer->failed = 0;
+
+    // Taken before the walk: events racing with it are replayed, not lost
+    uint64_t seq = journalLastSeq();
+    putTreeU32(writer, TREE_STREAM_MAGIC);
+    putTreeU32(writer, (uint32_t)(seq >> 32));
+    putTreeU32(writer, (uint32_t)seq);
+    writeTreeNode(writer, root);
+    flushTreeWriter(writer);
+
+    int failed = writer->failed;
+    free(writer);
+    return failed ? -1 : 0;
 }
 
 // Function to send server information including the hash table
@@ -99,6 +144,12 @@ int sendServerInfo(int sock, const char *ip, int nm_port, int client_port, Node
     memcpy(buffer + offset, &client_port, sizeof(int));
     offset += sizeof(int);
 
+    // Copy journal epoch, so the naming server can tell a reconnect of this
+    // run from a restart
+    uint32_t epoch = journalEpoch();
+    memcpy(buffer + offset, &epoch, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
     // Send the entire buffer
     if (send(sock, buffer, offset, 0) < 0)
     {
@@ -106,9 +157,18 @@ int sendServerInfo(int sock, const char *ip, int nm_port, int client_port, Node
         return -1;
     }
     memset(buffer, 0 , sizeof(buffer));
-    recv(sock, buffer, sizeof(buffer), 0);
-    // Send the root node and its entire structure
-    return sendNodeChain(sock, root);
+    // The naming server echoes the whole buffer back; consume all of it so
+    // none of it is mistaken for a later command
+    if (recv(sock, buffer, sizeof(buffer), MSG_WAITALL) != sizeof(buffer))
+        return -1;
+
+    // The echo says whether the naming server still holds our tree from
+    // before the disconnect, and up to which journal sequence
+    uint32_t resume;
+    uint64_t applied_seq;
+    memcpy(&resume, buffer + offset, sizeof(uint32_t));
+    memcpy(&applied_seq, buffer + offset + sizeof(uint32_t), sizeof(uint64_t));
+    return sendNamespaceSince(sock, NULL, root, resume == 1, applied_seq);
 }
 
 void *handleClient(void *arg)
@@ -146,18 +206,39 @@ void *handleClient(void *arg)
     pthread_exit(NULL);
 }
 
-// void *thread_process_command(void *arg)
-// {
-//     ThreadArgs *args = (ThreadArgs *)arg;
+// Send (part of) the reply to a naming server request; more says further
+// frames follow. Returns -1 if the connection it came in on is gone.
+int replyToNamingServer(NamingRequest *request, const char *payload, size_t len, int more)
+{
+    int result = -1;
+    pthread_mutex_lock(&naming_send_lock);
+    if (request->connection == naming_connection)
+        result = sendFrame(request->socket, request->id, payload, len, more);
+    pthread_mutex_unlock(&naming_send_lock);
+    return result;
+}
+
+// Namespace data goes out raw during registration and framed as a SYNC reply
+int sendNamespaceBytes(int sock, NamingRequest *request, const char *data, size_t len)
+{
+    if (request)
+        return replyToNamingServer(request, data, len, 1);
+    return sendAll(sock, data, len);
+}
 
-//     // Process the command
-//     processCommand_namingServer(args->root, args->command, args->socket);
+void *thread_process_command(void *arg)
+{
+    NamingRequest *request = (NamingRequest *)arg;
 
-//     // Free the thread arguments
-//     free(args);
+    // Process the command
+    processCommand_namingServer(request->root, request->command, request);
 
-//     return NULL;
-// }
+    // Free the request
+    free(request->command);
+    free(request);
+
+    return NULL;
+}
 
 void *namingServerHandler(void *arg)
 {
@@ -167,32 +248,38 @@ void *namingServerHandler(void *arg)
 
     while (1)
     {
-        // Receive command from naming server
-        char command[100001];
-        memset(command, 0 , sizeof(command));
-        ssize_t bytes_received = recv(naming_server_sock, command, sizeof(command), 0);
-
-        if (bytes_received <= 0)
+        // Receive the next framed command from naming server
+        uint32_t request_id;
+        char *command;
+        size_t command_len;
+        int more;
+        if (recvFrame(naming_server_sock, &request_id, &command, &command_len, &more) < 0)
         {
             // Connection lost, attempt to reconnect
             printf("Lost connection to naming server. Attempting to reconnect...\n");
+            pthread_mutex_lock(&naming_send_lock);
+            naming_connection++; // Replies still being worked on are for the old connection
             close(naming_server_sock);
+            pthread_mutex_unlock(&naming_send_lock);
 
             // Recreate socket and attempt reconnection
             struct sockaddr_in naming_serv_addr;
             naming_server_sock = socket(AF_INET, SOCK_STREAM, 0);
             naming_serv_addr.sin_family = AF_INET;
-            naming_serv_addr.sin_port = info->port;
+            naming_serv_addr.sin_port = htons(info->port);
             inet_pton(AF_INET, info->ip, &naming_serv_addr.sin_addr);
 
             while (connect(naming_server_sock, (struct sockaddr *)&naming_serv_addr,
                            sizeof(naming_serv_addr)) < 0)
             {
+                // A socket whose connect failed cannot be reused
+                close(naming_server_sock);
+                naming_server_sock = socket(AF_INET, SOCK_STREAM, 0);
                 sleep(5); // Wait before retry
             }
 
             // Reregister with naming server
-            if (sendServerInfo(naming_server_sock, info->ip, info->port, info->client_port, root) < 0)
+            if (sendServerInfo(naming_server_sock, info->local_ip, info->port, info->client_port, root) < 0)
             {
                 printf("Failed to re-register with naming server\n");
                 continue;
@@ -201,9 +288,26 @@ void *namingServerHandler(void *arg)
             info->socket = naming_server_sock;
             continue;
         }
-        command[bytes_received] = '\0';
         printf("naming aaya\n");
-        processCommand_namingServer(root, command, naming_server_sock);
+
+        // Each request gets its own thread, so a long COPY does not hold up
+        // a CREATE or SYNC sent after it
+        NamingRequest *request = (NamingRequest *)malloc(sizeof(NamingRequest));
+        request->root = root;
+        request->socket = naming_server_sock;
+        pthread_mutex_lock(&naming_send_lock);
+        request->connection = naming_connection;
+        pthread_mutex_unlock(&naming_send_lock);
+        request->id = request_id;
+        request->command = command;
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, thread_process_command, request) != 0)
+        {
+            perror("Failed to create naming server request thread");
+            thread_process_command(request);
+            continue;
+        }
+        pthread_detach(worker);
     }
     return NULL;
 }
@@ -300,6 +404,20 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Invalid port number. Please enter a value between 1 and 65535.\n");
         exit(EXIT_FAILURE);
     }
+    // A client hanging up mid-transfer must fail the send, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (getenv("SS_COPY_STREAMS"))
+        copy_streams = atoi(getenv("SS_COPY_STREAMS"));
+    if (getenv("SS_DURABILITY"))
+    {
+        const char *mode = getenv("SS_DURABILITY");
+        if (strcasecmp(mode, "primary") == 0)
+            durability_mode = DURABILITY_PRIMARY;
+        else if (strcasecmp(mode, "all") == 0)
+            durability_mode = DURABILITY_ALL;
+        else
+            durability_mode = DURABILITY_ONE;
+    }
     int storage_server_sock;
     struct sockaddr_in storage_serv_addr;
     storage_server_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -354,20 +472,25 @@ int main(int argc, char *argv[])
     pthread_detach(flushThread);
     char ip_buffer[INET_ADDRSTRLEN];
     get_local_ip(ip_buffer, sizeof(ip_buffer));
+    strcpy(local_ip, ip_buffer);
+    local_client_port = client_port;
     // int client_port = ntohs(storage_serv_addr.sin_port); // Store the port in global variable
 
     printf("Storage server is listening for client connections on port %d...\n", client_port);
 
-    Node *root = createNode("/home", DIRECTORY_NODE, READ | WRITE | EXECUTE, "/home");
+    Node *root = createNode("/home", DIRECTORY_NODE, READ | WRITE | EXECUTE);
     traverseAndAdd(root, "/home");
+    initJournal(root->name);
+    initReplication(root);
 
 
-    // Locate and set lock_type for /readtest.txt and /writetest.txt
+    // Pin /readtest.txt under a read lock and /writetest.txt under a write
+    // lock so the busy-file paths can be exercised
     Node *readTestNode = searchPath(root, "/readtest.txt");
     if (readTestNode)
     {
-        readTestNode->lock_type = 1;
-        printf("Set lock_type of /readtest.txt to 1\n");
+        nodeLockRead(readTestNode, 0);
+        printf("Holding a read lock on /readtest.txt\n");
     }
     else
     {
@@ -379,8 +502,8 @@ int main(int argc, char *argv[])
     Node *writeTestNode = searchPath(root, "/writetest.txt");
     if (writeTestNode)
     {
-        writeTestNode->lock_type = 2;
-        printf("Set lock_type of /writetest.txt to 2\n");
+        nodeLockWrite(writeTestNode, 0);
+        printf("Holding a write lock on /writetest.txt\n");
     }
     else
     {
@@ -433,6 +556,7 @@ int main(int argc, char *argv[])
     server_info->client_port = client_port;
     server_info->port = port;
     server_info->ip = ip_address;
+    server_info->local_ip = ip_buffer;
     if (pthread_create(&naming_server_thread, NULL, namingServerHandler, server_info) != 0)
     {
         perror("Failed to create naming server handler thread");
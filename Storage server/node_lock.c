@@ -0,0 +1,223 @@
+#include "header.h"
+
+// Reader/writer lock for each file node. Any number of readers may hold it
+// at once; a writer holds it alone. Once a writer is waiting, new readers
+// queue behind it so a steady stream of READs cannot starve a WRITE. Waiters
+// give up after timeout_ms, which the caller reports as ERROR 52.
+//
+// Nobody waits for a node while holding namespace_lock, or one busy file would
+// hold up every CREATE and DELETE. A lookup pins the node under
+// namespace_lock instead and locks it once that is let go:
+//   nodePin(node); unlock namespace_lock; nodeLockPinned(node, ...)
+// A DELETE in between still takes the node out of the tree, but nodeRetire
+// leaves freeing it to the last pin, and nodeLockPinned reports it gone.
+
+static atomic_ulong read_locks = 0;
+static atomic_ulong write_locks = 0;
+static atomic_ulong contended_locks = 0; // Acquisitions that had to wait
+static atomic_ulong lock_timeouts = 0;
+static atomic_ulong lock_wait_us = 0;   // Total time spent waiting
+
+void nodeLockInit(NodeLock *lock)
+{
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_cond_init(&lock->readers_cond, NULL);
+    pthread_cond_init(&lock->writers_cond, NULL);
+    lock->readers = 0;
+    lock->writer = 0;
+    lock->waiting_writers = 0;
+    lock->pins = 0;
+    lock->retired = 0;
+}
+
+void nodeLockDestroy(NodeLock *lock)
+{
+    pthread_cond_destroy(&lock->readers_cond);
+    pthread_cond_destroy(&lock->writers_cond);
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static void deadlineAfter(struct timespec *deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static long microsSince(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Returns 0 once the read lock is held, ETIMEDOUT if a writer kept it longer
+// than timeout_ms
+int nodeLockRead(Node *node, int timeout_ms)
+{
+    NodeLock *lock = &node->lock;
+    int result = 0;
+    pthread_mutex_lock(&lock->mutex);
+    if (lock->writer || lock->waiting_writers)
+    {
+        struct timespec deadline, start;
+        deadlineAfter(&deadline, timeout_ms);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        atomic_fetch_add(&contended_locks, 1);
+        while ((lock->writer || lock->waiting_writers) && result == 0)
+            result = pthread_cond_timedwait(&lock->readers_cond, &lock->mutex, &deadline);
+        if (result == ETIMEDOUT && !lock->writer && !lock->waiting_writers)
+            result = 0;
+        atomic_fetch_add(&lock_wait_us, microsSince(&start));
+    }
+    if (result == 0)
+    {
+        lock->readers++;
+        atomic_fetch_add(&read_locks, 1);
+    }
+    else
+        atomic_fetch_add(&lock_timeouts, 1);
+    pthread_mutex_unlock(&lock->mutex);
+    return result;
+}
+
+// Returns 0 once the node is held exclusively, ETIMEDOUT otherwise
+int nodeLockWrite(Node *node, int timeout_ms)
+{
+    NodeLock *lock = &node->lock;
+    int result = 0;
+    pthread_mutex_lock(&lock->mutex);
+    if (lock->writer || lock->readers)
+    {
+        struct timespec deadline, start;
+        deadlineAfter(&deadline, timeout_ms);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        atomic_fetch_add(&contended_locks, 1);
+        lock->waiting_writers++;
+        while ((lock->writer || lock->readers) && result == 0)
+            result = pthread_cond_timedwait(&lock->writers_cond, &lock->mutex, &deadline);
+        if (result == ETIMEDOUT && !lock->writer && !lock->readers)
+            result = 0;
+        lock->waiting_writers--;
+        atomic_fetch_add(&lock_wait_us, microsSince(&start));
+        // Readers held back for this writer may go again if it gave up
+        if (result != 0 && lock->waiting_writers == 0 && !lock->writer)
+            pthread_cond_broadcast(&lock->readers_cond);
+    }
+    if (result == 0)
+    {
+        lock->writer = 1;
+        atomic_fetch_add(&write_locks, 1);
+    }
+    else
+        atomic_fetch_add(&lock_timeouts, 1);
+    pthread_mutex_unlock(&lock->mutex);
+    return result;
+}
+
+void nodeUnlockRead(Node *node)
+{
+    NodeLock *lock = &node->lock;
+    pthread_mutex_lock(&lock->mutex);
+    if (lock->readers > 0 && --lock->readers == 0 && lock->waiting_writers)
+        pthread_cond_signal(&lock->writers_cond);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+// Caller holds lock->mutex
+static void releaseWriter(NodeLock *lock)
+{
+    lock->writer = 0;
+    if (lock->waiting_writers)
+        pthread_cond_signal(&lock->writers_cond);
+    else
+        pthread_cond_broadcast(&lock->readers_cond);
+}
+
+void nodeUnlockWrite(Node *node)
+{
+    NodeLock *lock = &node->lock;
+    pthread_mutex_lock(&lock->mutex);
+    releaseWriter(lock);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+// Keep node from being freed; caller holds namespace_lock. NULL is ignored.
+void nodePin(Node *node)
+{
+    if (!node)
+        return;
+    pthread_mutex_lock(&node->lock.mutex);
+    node->lock.pins++;
+    pthread_mutex_unlock(&node->lock.mutex);
+}
+
+static void nodeUnpin(Node *node)
+{
+    NodeLock *lock = &node->lock;
+    pthread_mutex_lock(&lock->mutex);
+    int last = --lock->pins == 0 && lock->retired;
+    pthread_mutex_unlock(&lock->mutex);
+    if (last)
+    {
+        nodeLockDestroy(lock);
+        freeNodeMemory(node);
+    }
+}
+
+// Lock a pinned node, for writing if write is set, and drop the pin. Returns
+// 0 with the node locked, ENOENT if node is NULL or was deleted meanwhile, or
+// ETIMEDOUT if it stayed busy.
+int nodeLockPinned(Node *node, int write, int timeout_ms)
+{
+    if (!node)
+        return ENOENT;
+    int result = write ? nodeLockWrite(node, timeout_ms) : nodeLockRead(node, timeout_ms);
+    if (result == 0)
+    {
+        pthread_mutex_lock(&node->lock.mutex);
+        int retired = node->lock.retired;
+        pthread_mutex_unlock(&node->lock.mutex);
+        if (retired)
+        {
+            if (write)
+                nodeUnlockWrite(node);
+            else
+                nodeUnlockRead(node);
+            result = ENOENT;
+        }
+    }
+    nodeUnpin(node);
+    return result;
+}
+
+// Free a node deleteNode took out of the tree, letting go of its write lock
+// if write_locked, unless a lookup still pins it. Marking it retired with the
+// lock let go keeps a waiter from taking the lock to a node about to go.
+void nodeRetire(Node *node, int write_locked)
+{
+    NodeLock *lock = &node->lock;
+    pthread_mutex_lock(&lock->mutex);
+    lock->retired = 1;
+    if (write_locked)
+        releaseWriter(lock);
+    int pinned = lock->pins > 0;
+    pthread_mutex_unlock(&lock->mutex);
+    if (!pinned)
+    {
+        nodeLockDestroy(lock);
+        freeNodeMemory(node);
+    }
+}
+
+void formatNodeLockStats(char *buffer, size_t size)
+{
+    snprintf(buffer, size, "Node locks: %lu read, %lu write, %lu contended, %lu timed out, %lu us waiting\n",
+             atomic_load(&read_locks), atomic_load(&write_locks), atomic_load(&contended_locks),
+             atomic_load(&lock_timeouts), atomic_load(&lock_wait_us));
+}
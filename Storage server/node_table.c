@@ -0,0 +1,270 @@
+#include "header.h"
+
+// Children of a directory live in an open-addressing table in the style of
+// a Swiss table. Every slot has a control byte: CTRL_EMPTY, CTRL_DELETED, or
+// the low 7 bits of the child's name hash. Lookups probe whole groups of
+// NODE_TABLE_GROUP control bytes at once and only compare names on slots
+// whose tag matches, so a lookup touches one or two cache lines no matter
+// how large the directory is.
+//
+// When the table passes 7/8 load it moves to a new slot array of twice the
+// size, or the same size if most of the load is deleted slots. The old array
+// is not rehashed in one go: each insert moves NODE_TABLE_MIGRATE_STEP old
+// slots across and lookups check both arrays until the old one is drained.
+// Removals only rewrite control bytes and never move children, so a directory
+// can be walked with nextChild while its children are being removed.
+
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+#define GROUP_LSBS 0x0101010101010101ULL
+#define GROUP_MSBS 0x8080808080808080ULL
+
+// FNV-1a; the high bits pick the group and the low 7 bits are the tag
+unsigned int hash(const char *str)
+{
+    unsigned int hash = NAME_HASH_SEED;
+    while (*str)
+        hash = NAME_HASH_STEP(hash, *str++);
+    return hash;
+}
+
+static uint64_t loadGroup(const uint8_t *ctrl)
+{
+    uint64_t group;
+    memcpy(&group, ctrl, sizeof(group));
+    return group;
+}
+
+// Bytes equal to tag. May also flag a byte just above a real match, which the
+// name comparison filters out; never flags an empty or deleted slot.
+static uint64_t matchTag(uint64_t group, uint8_t tag)
+{
+    uint64_t x = group ^ (GROUP_LSBS * tag);
+    return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static uint64_t matchEmpty(uint64_t group)
+{
+    return group & ~(group << 6) & GROUP_MSBS;
+}
+
+static uint64_t matchEmptyOrDeleted(uint64_t group)
+{
+    return group & GROUP_MSBS;
+}
+
+// Slot within the group for the lowest bit set in a match mask
+static uint32_t matchSlot(uint64_t mask)
+{
+    uint32_t byte = __builtin_ctzll(mask) >> 3;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    byte = NODE_TABLE_GROUP - 1 - byte;
+#endif
+    return byte;
+}
+
+// Slots and control bytes share one allocation, control bytes at the end
+static void allocSlots(NodeTableSlots *slots, uint32_t capacity)
+{
+    slots->slots = (Node **)malloc(capacity * (sizeof(Node *) + 1));
+    slots->ctrl = (uint8_t *)(slots->slots + capacity);
+    memset(slots->ctrl, CTRL_EMPTY, capacity);
+    slots->capacity = capacity;
+}
+
+static void freeSlots(NodeTableSlots *slots)
+{
+    free(slots->slots);
+    slots->ctrl = NULL;
+    slots->slots = NULL;
+    slots->capacity = 0;
+}
+
+// Returns the slot holding the len-byte name, or -1
+static long findSlot(const NodeTableSlots *slots, const char *name, size_t len, unsigned int h)
+{
+    if (slots->capacity == 0)
+        return -1;
+    uint32_t groups = slots->capacity / NODE_TABLE_GROUP;
+    uint32_t g = (h >> 7) & (groups - 1);
+    uint8_t tag = h & 0x7F;
+    // Triangular probing visits every group once when the count is a power of two
+    for (uint32_t probe = 1; probe <= groups; probe++)
+    {
+        const uint8_t *ctrl = slots->ctrl + g * NODE_TABLE_GROUP;
+        uint64_t group = loadGroup(ctrl);
+        for (uint64_t match = matchTag(group, tag); match; match &= match - 1)
+        {
+            uint32_t i = g * NODE_TABLE_GROUP + matchSlot(match & -match);
+            const char *candidate = slots->slots[i]->name;
+            if (ctrl[i - g * NODE_TABLE_GROUP] == tag && memcmp(candidate, name, len) == 0 && candidate[len] == '\0')
+                return i;
+        }
+        if (matchEmpty(group))
+            return -1;
+        g = (g + probe) & (groups - 1);
+    }
+    return -1;
+}
+
+// Put a node in the first free slot of its probe sequence. Returns 1 if that
+// slot was empty rather than deleted, i.e. the used count grows.
+static int placeSlot(NodeTableSlots *slots, Node *node, unsigned int h)
+{
+    uint32_t groups = slots->capacity / NODE_TABLE_GROUP;
+    uint32_t g = (h >> 7) & (groups - 1);
+    for (uint32_t probe = 1;; probe++)
+    {
+        uint64_t match = matchEmptyOrDeleted(loadGroup(slots->ctrl + g * NODE_TABLE_GROUP));
+        if (match)
+        {
+            uint32_t i = g * NODE_TABLE_GROUP + matchSlot(match & -match);
+            int was_empty = slots->ctrl[i] == CTRL_EMPTY;
+            slots->ctrl[i] = h & 0x7F;
+            slots->slots[i] = node;
+            return was_empty;
+        }
+        g = (g + probe) & (groups - 1);
+    }
+}
+
+// Mark a slot free. If its group still has an empty slot no probe ever went
+// past the group, so the slot can go back to empty instead of a tombstone.
+static int clearSlot(NodeTableSlots *slots, uint32_t i)
+{
+    uint32_t start = i & ~(uint32_t)(NODE_TABLE_GROUP - 1);
+    int to_empty = matchEmpty(loadGroup(slots->ctrl + start)) != 0;
+    slots->ctrl[i] = to_empty ? CTRL_EMPTY : CTRL_DELETED;
+    slots->slots[i] = NULL;
+    return to_empty;
+}
+
+// Move up to steps old slots into the current array
+static void migrateSlots(NodeTable *table, uint32_t steps)
+{
+    while (table->old.capacity && steps-- > 0)
+    {
+        uint32_t i = table->migrate_pos++;
+        if ((table->old.ctrl[i] & 0x80) == 0)
+        {
+            Node *node = table->old.slots[i];
+            table->old.ctrl[i] = CTRL_DELETED;
+            table->used += placeSlot(&table->current, node, hash(node->name));
+        }
+        if (table->migrate_pos == table->old.capacity)
+        {
+            freeSlots(&table->old);
+            table->migrate_pos = 0;
+        }
+    }
+}
+
+// Make room for one more child in the current array
+static void reserveSlot(NodeTable *table)
+{
+    if (table->current.capacity == 0)
+    {
+        allocSlots(&table->current, NODE_TABLE_MIN_CAPACITY);
+        return;
+    }
+    if ((uint64_t)(table->used + 1) * 8 <= (uint64_t)table->current.capacity * 7)
+        return;
+
+    // A rehash still in flight is finished before the next one starts
+    migrateSlots(table, table->old.capacity);
+    uint32_t capacity = table->current.capacity;
+    if ((uint64_t)table->size * 16 >= (uint64_t)capacity * 7)
+        capacity *= 2;
+    table->old = table->current;
+    table->migrate_pos = 0;
+    allocSlots(&table->current, capacity);
+    table->used = 0;
+}
+
+// Initialize a new table for storing children; slots are allocated on the
+// first insert so empty directories stay small
+NodeTable *createNodeTable()
+{
+    NodeTable *nodeTable = allocNodeTable();
+    memset(nodeTable, 0, sizeof(NodeTable));
+    return nodeTable;
+}
+
+void freeNodeTable(NodeTable *table)
+{
+    if (!table)
+        return;
+    freeSlots(&table->current);
+    freeSlots(&table->old);
+    freeNodeTableMemory(table);
+}
+
+// Insert a node into a directory's table; the name must not be present yet
+void insertNode(NodeTable *table, Node *node)
+{
+    reserveSlot(table);
+    table->used += placeSlot(&table->current, node, hash(node->name));
+    table->size++;
+    migrateSlots(table, NODE_TABLE_MIGRATE_STEP);
+}
+
+// Look up a name that is not NUL-terminated, e.g. a component in the middle
+// of a path, whose hash the caller already computed
+Node *searchNodeHashed(NodeTable *table, const char *name, size_t len, unsigned int h)
+{
+    long i = findSlot(&table->current, name, len, h);
+    if (i >= 0)
+        return table->current.slots[i];
+    i = findSlot(&table->old, name, len, h);
+    return i >= 0 ? table->old.slots[i] : NULL;
+}
+
+// Search for a file or directory in a table by name
+Node *searchNode(NodeTable *table, const char *name)
+{
+    return searchNodeHashed(table, name, strlen(name), hash(name));
+}
+
+// Take a node out of a directory's table without freeing it. Returns 0 if
+// it was there, -1 otherwise.
+int removeNode(NodeTable *table, Node *node)
+{
+    unsigned int h = hash(node->name);
+    size_t len = strlen(node->name);
+    long i = findSlot(&table->current, node->name, len, h);
+    if (i >= 0 && table->current.slots[i] == node)
+    {
+        table->used -= clearSlot(&table->current, i);
+        table->size--;
+        return 0;
+    }
+    i = findSlot(&table->old, node->name, len, h);
+    if (i >= 0 && table->old.slots[i] == node)
+    {
+        clearSlot(&table->old, i);
+        table->size--;
+        return 0;
+    }
+    return -1;
+}
+
+// Walk the children: start with *cursor = 0 and call until it returns NULL.
+// Children may be removed during the walk but not inserted.
+Node *nextChild(NodeTable *table, uint32_t *cursor)
+{
+    if (!table)
+        return NULL;
+    while (*cursor < table->current.capacity + table->old.capacity)
+    {
+        uint32_t i = (*cursor)++;
+        NodeTableSlots *slots = &table->current;
+        if (i >= slots->capacity)
+        {
+            i -= slots->capacity;
+            slots = &table->old;
+        }
+        if ((slots->ctrl[i] & 0x80) == 0)
+            return slots->slots[i];
+    }
+    return NULL;
+}
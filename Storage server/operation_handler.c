@@ -19,10 +19,22 @@ CommandType parseCommand(const char *cmd)
         // printf("heuiewjdn\n");
         return CMD_COPY;
     }
+    if (strcasecmp(cmd, "BACKUP") == 0)
+        return CMD_BACKUP;
+    if (strcasecmp(cmd, "REPLICAS") == 0)
+        return CMD_REPLICAS;
+    if (strcasecmp(cmd, "REPLICATE") == 0)
+        return CMD_REPLICATE;
     if (strcasecmp(cmd, "FILE_META") == 0)
         return CMD_FILECOPY;
     if (strcasecmp(cmd, "CREATE_DIR") == 0)
         return CMD_DIRCOPY;
+    if (strcasecmp(cmd, "ARCHIVE") == 0)
+        return CMD_ARCHIVE;
+    if (strcasecmp(cmd, "SYNC") == 0)
+        return CMD_SYNC;
+    if (strcasecmp(cmd, "STATS") == 0)
+        return CMD_STATS;
     return CMD_UNKNOWN;
 }
 
@@ -38,42 +50,38 @@ void printUsage()
     printf("CREATE DIR <path>              - Create an empty directory\n");
     printf("DELETE <path>                  - Delete a file or directory\n");
     printf("COPY <source> <destination>    - Copy file or directory\n");
+    printf("STATS                          - Show lock contention and descriptor cache counters\n");
     printf("EXIT                           - Exit the program\n");
 }
 
+// Chunk helpers; the caller holds the node's read or write lock
 ssize_t readFileChunk(Node *node, char *buffer, size_t size, off_t offset)
 {
-    printf("lock_type = %d\n", node->lock_type);
-    node->lock_type = 1; // Set read lock
-    printf("lock_type = %d\n", node->lock_type);
-    int fd = open(node->dataLocation, O_RDONLY);
+    int fd = fdCacheAcquire(node);
     if (fd < 0)
         return -1;
 
-    lseek(fd, offset, SEEK_SET);
-    ssize_t bytes = read(fd, buffer, size);
-    close(fd);
-    node->lock_type = 0; // Release lock
-    printf("lock_type = %d\n", node->lock_type);
+    ssize_t bytes = pread(fd, buffer, size, offset);
+    fdCacheRelease(node, fd);
 
     return bytes;
 }
 
-// Helper function to write file in chunks
-ssize_t writeFileChunk(Node *node, const char *buffer, size_t size, off_t offset)
+// Helper function to write file in chunks. Writes append: the cached
+// descriptor is opened O_APPEND
+ssize_t writeFileChunk(Node *node, const char *buffer, size_t size)
 {
-    printf("lock_type = %d\n", node->lock_type);
-    node->lock_type = 2; // Set write lock
-    printf("lock_type = %d\n", node->lock_type);
-    int fd = open(node->dataLocation, O_WRONLY | O_APPEND);
+    int fd = fdCacheAcquire(node);
     if (fd < 0)
         return -1;
 
-    lseek(fd, offset, SEEK_SET);
+    // The fd appends; where this chunk lands is what the replicas need
+    struct stat st;
+    off_t at = replicationActive() && fstat(fd, &st) == 0 ? st.st_size : -1;
     ssize_t bytes = write(fd, buffer, size);
-    close(fd);
-    node->lock_type = 0; // Release lock
-    printf("lock_type = %d\n", node->lock_type);
+    fdCacheRelease(node, fd);
+    if (bytes > 0 && at >= 0)
+        replicateWrite(node, buffer, bytes, at);
 
     return bytes;
 }
@@ -154,6 +162,21 @@ void sendAckToNamingServer(const char *status, const char *message, int clientId
     close(ack_socket);
 }
 
+// Look a client's path up and lock its node, for writing if write is set, so
+// a DELETE waits for the transfer instead of freeing the node under it. The
+// wait is pinned, not under namespace_lock, see node_lock.c. Returns NULL if
+// the path is missing, with *busy set if it stayed locked instead.
+static Node *lockClientNode(Node *root, const char *path, int write, int *busy)
+{
+    pthread_rwlock_rdlock(&namespace_lock);
+    Node *node = searchPath(root, path);
+    nodePin(node);
+    pthread_rwlock_unlock(&namespace_lock);
+    int result = nodeLockPinned(node, write, NODE_LOCK_TIMEOUT_MS);
+    *busy = result != 0 && result != ENOENT;
+    return result == 0 ? node : NULL;
+}
+
 void *flushAsyncWrites(char *ip)
 {
 
@@ -175,20 +198,52 @@ void *flushAsyncWrites(char *ip)
             asyncWriteQueue = asyncWriteQueue->next;
 
             pthread_mutex_unlock(&queueMutex);
-            sendAckToNamingServer("Start", "Write operation started for file", task->clientId, task->targetNode->name, task->clientIP, task->clientPort,ip);
-
-            // Simulate writing to persistent storage
-            FILE *file = fopen(task->targetNode->dataLocation, "a");
-            if (file)
+            const char *name = strrchr(task->path, '/') ? strrchr(task->path, '/') + 1 : task->path;
+            sendAckToNamingServer("Start", "Write operation started for file", task->clientId, name, task->clientIP, task->clientPort,ip);
+
+            // The path is looked up again: the file may have been deleted
+            // since the write was accepted. One held by readers past the lock
+            // timeout fails rather than holding up the writes queued behind it.
+            size_t written = 0;
+            int busy;
+            Node *target = lockClientNode(task->root, task->path, 1, &busy);
+            if (!target)
             {
-                fwrite(task->data, 1, task->size, file);
-                fclose(file);
-                printf("Async write completed for file: %s\n", task->targetNode->name);
-                sendAckToNamingServer("End", "Write operation completed successfully for file", task->clientId, task->targetNode->name, task->clientIP, task->clientPort,ip);
+                printf("Async write to %s failed: %s\n", task->path, busy ? "the file stayed locked" : "the file is gone");
+                sendAckToNamingServer("Failed", busy ? "Write operation failed, file busy" : "Write operation failed, file deleted",
+                                      task->clientId, name, task->clientIP, task->clientPort, ip);
+                free(task->data);
+                free(task);
+                pthread_mutex_lock(&queueMutex);
+                continue;
+            }
+            int fd = fdCacheAcquire(target);
+            struct stat st;
+            off_t at = fd >= 0 && replicationActive() && fstat(fd, &st) == 0 ? st.st_size : -1;
+            while (fd >= 0 && written < task->size)
+            {
+                ssize_t n = write(fd, task->data + written, task->size - written);
+                if (n <= 0)
+                    break;
+                written += n;
+            }
+            if (fd >= 0)
+                fdCacheRelease(target, fd);
+            if (written > 0 && at >= 0)
+                replicateWrite(target, task->data, written, at);
+            if (fd >= 0 && written == task->size)
+                journalRecordResize(target);
+            nodeUnlockWrite(target);
+            if (fd >= 0 && written == task->size)
+            {
+                replicationWait(replicationTicket());
+                printf("Async write completed for file: %s\n", name);
+                sendAckToNamingServer("End", "Write operation completed successfully for file", task->clientId, name, task->clientIP, task->clientPort,ip);
             }
             else
             {
                 perror("Error writing to file");
+                sendAckToNamingServer("Failed", "Write operation failed for file", task->clientId, name, task->clientIP, task->clientPort, ip);
             }
 
             // Free the task memory
@@ -203,15 +258,9 @@ void *flushAsyncWrites(char *ip)
     return NULL;
 }
 
-int queueAsyncWrite(Node *targetNode, const char *data, size_t size, int client_socket, const char *client_ip, int client_port)
+// The caller has checked path is a file; it is looked up again when flushed
+int queueAsyncWrite(Node *root, const char *path, const char *data, size_t size, int client_socket, const char *client_ip, int client_port)
 {
-    // Validate that the node is a file
-    if (targetNode->type != FILE_NODE)
-    {
-        fprintf(stderr, "Error: Target node is not a file.\n");
-        return -1;
-    }
-
     // Allocate memory for the task
     AsyncWriteTask *task = malloc(sizeof(AsyncWriteTask));
     if (!task)
@@ -221,7 +270,8 @@ int queueAsyncWrite(Node *targetNode, const char *data, size_t size, int client_
     }
 
     // Initialize the task
-    task->targetNode = targetNode;
+    task->root = root;
+    snprintf(task->path, sizeof(task->path), "%s", path);
     task->data = malloc(size);
     if (!task->data)
     {
@@ -310,98 +360,103 @@ void processCommand_user(Node *root, char *input, int client_socket)
             return;
         }
 
-        Node *targetNode = searchPath(root, path);
-        if (!targetNode)
+        // READ, META and STREAM hold the node's read lock from the lookup on.
+        // A WRITE only knows which lock it needs once the size is in; until
+        // then it goes by what the lookup saw, and looks the path up again.
+        int busy = 0;
+        int targetPermissions = 0;
+        NodeType targetType = FILE_NODE;
+        Node *targetNode = NULL;
+        if (cmd == CMD_WRITE)
+        {
+            pthread_rwlock_rdlock(&namespace_lock);
+            Node *found = searchPath(root, path);
+            if (found)
+            {
+                targetPermissions = found->permissions;
+                targetType = found->type;
+            }
+            pthread_rwlock_unlock(&namespace_lock);
+            if (!found)
+            {
+                const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0";
+                send(client_socket, error, strlen(error), 0);
+                return;
+            }
+        }
+        else if (!(targetNode = lockClientNode(root, path, 0, &busy)))
         {
             memset(response, 0, sizeof(response));
-            snprintf(response, sizeof(response), " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0");
+            if (busy)
+                snprintf(response, sizeof(response), " \033[1;31mERROR 52:\033[0m \033[38;5;214mFile is being written to\n\0\033[0m");
+            else
+                snprintf(response, sizeof(response), " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0");
             send(client_socket, response, strlen(response), 0);
             return;
         }
 
         if (cmd == CMD_READ)
         {
-            printf("read command. lock_type = %d\n", targetNode->lock_type);
-            // Check if the lock is open
-            if (targetNode->lock_type == 2)
-            {
-                snprintf(response, sizeof(response), " \033[1;31mERROR 52:\033[0m \033[38;5;214mFile is being written to\n\0\033[0m");                              
-                send(client_socket, response, strlen(response), 0);
-                return;
-            }
-            ssize_t bytes;
+            printf("read command\n");
             off_t offset = 0;
             struct stat st;
             if ((targetNode->permissions & READ) == 0)
             {
+                nodeUnlockRead(targetNode);
                 const char *error = " \033[1;31mERROR 50:\033[0m \033[38;5;214mPermission Denied!\033[0m\n\0";
                 send(client_socket, error, strlen(error), 0);
                 return;
             }
             if (targetNode->type != FILE_NODE)
             {
+                nodeUnlockRead(targetNode);
                 const char *error = " \033[1;31mERROR 51:\033[0m \033[38;5;214mNot a File!\033[0m\n\0";
                 send(client_socket, error, strlen(error), 0);
                 return;
             }
-            if (getFileMetadata(targetNode, &st) == 0)
+            // Streamed read: a "FILE_SIZE:<n>\n" header followed by exactly n
+            // bytes, with no per-chunk acks; TCP back-pressure paces the sender
+            // and the bytes go out with sendfile
+            int fd = fdCacheAcquire(targetNode);
+            if (fd < 0 || fstat(fd, &st) != 0)
             {
-                memset(response, 0, sizeof(response));
-                snprintf(response, sizeof(response), "FILE_SIZE:%ld\n", st.st_size);
-                send(client_socket, response, strlen(response), 0);
-                memset(buffer, 0, sizeof(buffer));
-                recv(client_socket, buffer, sizeof(buffer), 0);
+                if (fd >= 0)
+                    fdCacheRelease(targetNode, fd);
+                nodeUnlockRead(targetNode);
+                const char *error = " \033[1;31mERROR 30:\033[0m \033[38;5;214mUnable to open the file!\033[0m\n\0";
+                send(client_socket, error, strlen(error), 0);
+                return;
             }
-            memset(buffer, 0, sizeof(buffer));
-
-            while ((bytes = readFileChunk(targetNode, buffer, sizeof(buffer), offset)) > 0)
+            memset(response, 0, sizeof(response));
+            snprintf(response, sizeof(response), "FILE_SIZE:%ld\n", st.st_size);
+            int failed = sendAll(client_socket, response, strlen(response)) < 0;
+            if (!failed)
+                failed = sendFileRange(client_socket, fd, &offset, st.st_size) != st.st_size;
+            fdCacheRelease(targetNode, fd);
+            nodeUnlockRead(targetNode);
+            if (failed)
             {
-                // printf("%s\n", buffer);
-                send(client_socket, buffer, bytes, 0);
-                memset(buffer, 0, sizeof(buffer));
-                recv(client_socket, buffer, sizeof(buffer), 0);
-                offset += bytes;
-                memset(buffer, 0, sizeof(buffer));
+                // The file shrank or the client went away; the client can only
+                // tell a short transfer apart if the connection ends here
+                perror("Streamed read failed");
+                shutdown(client_socket, SHUT_RDWR);
             }
-
-            // Send end marker
-            send(client_socket, "END_OF_FILE\n", strlen("END_OF_FILE\n"), 0);
-            memset(buffer, 0, sizeof(buffer));
-            recv(client_socket, buffer, sizeof(buffer), 0);
         }
         else if (cmd == CMD_WRITE)
         {
-            printf("write command. lock_type = %d\n", targetNode->lock_type);
-            // Check if the lock is open
-            if (targetNode->lock_type == 2)
-            {
-                printf(" \033[1;31mERROR 52:\033[0m \033[38;5;214mFile is being written to\n\0\033[0m");
-                printf(" ");
-                snprintf(response, sizeof(response), " \033[1;31mERROR 52:\033[0m \033[38;5;214mFile is being written to\n\0\033[0m");
-                send(client_socket, response, strlen(response), 0);
-                return;
-            }
-            // Check if the lock is open
-            if (targetNode->lock_type == 1)
-            {
-                printf(" \033[1;31mERROR 52:\033[0m \033[38;5;214mFile is being read\n\0\033[0m");
-                printf(" ");
-                snprintf(response, sizeof(response), "\033[1;31mERROR: 52\033[0m \033[38;5;214mFile is being read\033[0m\n\0");
-                send(client_socket, response, strlen(response), 0);
-                return;
-            }
+            printf("write command\n");
             send(client_socket, "Error: Invalid file size format\n", strlen("Error: Invalid file size format\n"), 0);
 
             // First receive file size from client
             memset(buffer, 0, sizeof(buffer));
             recv(client_socket, buffer, sizeof(buffer), 0);
-            if ((targetNode->permissions & WRITE) == 0)
+            if ((targetPermissions & WRITE) == 0)
             {
                 const char *error = " \033[1;31mERROR 50:\033[0m \033[38;5;214mPermission Denied!\033[0m\n\0";
                 send(client_socket, error, strlen(error), 0);
                 return;
             }
-            if (targetNode->type != FILE_NODE)
+            if (targetType != FILE_NODE)
             {
                 const char *error = " \033[1;31mERROR 51:\033[0m \033[38;5;214mNot a File!\033[0m\n\0";
                 send(client_socket, error, strlen(error), 0);
@@ -424,6 +479,18 @@ void processCommand_user(Node *root, char *input, int client_socket)
                 is_sync = 1;
             }
 
+            // A synchronous write holds the file exclusively until the last
+            // chunk is on disk; asynchronous ones take the lock when flushed
+            if (is_sync == 1 && !(targetNode = lockClientNode(root, path, 1, &busy)))
+            {
+                if (busy)
+                    snprintf(response, sizeof(response), "\033[1;31mERROR: 52\033[0m \033[38;5;214mFile is being read\033[0m\n\0");
+                else
+                    snprintf(response, sizeof(response), " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0");
+                send(client_socket, response, strlen(response), 0);
+                return;
+            }
+
             // Send acknowledgment
             send(client_socket, "READY_TO_RECEIVE\n", strlen("READY_TO_RECEIVE\n"), 0);
             if (is_sync == 1)
@@ -440,13 +507,15 @@ void processCommand_user(Node *root, char *input, int client_socket)
 
                     if (bytesReceived <= 0)
                     {
+                        nodeUnlockWrite(targetNode);
                         send(client_socket, " \033[1;31mERROR 56:\033[0m \033[38;5;214mUnable to receive file data!\033[0m\n\0",
                              strlen(" \033[1;31mERROR 56:\033[0m \033[38;5;214mUnable to receive file data!\033[0m\n\0"), 0);
                         return;
                     }
 
-                    if (writeFileChunk(targetNode, buffer, bytesReceived, totalReceived) != bytesReceived)
+                    if (writeFileChunk(targetNode, buffer, bytesReceived) != bytesReceived)
                     {
+                        nodeUnlockWrite(targetNode);
                         send(client_socket, " \033[1;31mERROR 57:\033[0m \033[38;5;214mUnable to Write to the file!\033[0m\n\0",
                              strlen(" \033[1;31mERROR 57:\033[0m \033[38;5;214mUnable to Write to the file!\033[0m\n\0"), 0);
                         return;
@@ -454,6 +523,9 @@ void processCommand_user(Node *root, char *input, int client_socket)
                     send(client_socket, "ok\0", 3, 0);
                     totalReceived += bytesReceived;
                 }
+                journalRecordResize(targetNode);
+                nodeUnlockWrite(targetNode);
+                replicationWait(replicationTicket());
                 memset(buffer, 0, sizeof(buffer));
                 recv(client_socket, buffer, sizeof(buffer), 0);
                 memset(response, 0, sizeof(response));
@@ -508,7 +580,7 @@ void processCommand_user(Node *root, char *input, int client_socket)
                 send(client_socket, "ACK: WRITE REQUEST ACCEPTED\n", strlen("ACK: WRITE REQUEST ACCEPTED\n"), 0);
 
                 // Queue the data for asynchronous write
-                if (queueAsyncWrite(targetNode, asyncDataBuffer, fileSize, client_socket, client_ip, client_port) != 0)
+                if (queueAsyncWrite(root, path, asyncDataBuffer, fileSize, client_socket, client_ip, client_port) != 0)
                 {
                     free(asyncDataBuffer);
                     send(client_socket, " \033[1;31mERROR 90:\033[0m \033[38;5;214mFailed to queue asynchronous write!\033[0m\n\0", strlen(" \033[1;31mERROR 90:\033[0m \033[38;5;214mFailed to queue asynchronous write!\033[0m\n\0"), 0);
@@ -536,10 +608,12 @@ void processCommand_user(Node *root, char *input, int client_socket)
                          permissions,
                          ctime(&metadata.st_atime),
                          ctime(&metadata.st_mtime));
+                nodeUnlockRead(targetNode);
                 send(client_socket, response, strlen(response), 0);
             }
             else
             {
+                nodeUnlockRead(targetNode);
                 send(client_socket, " \033[1;31mERROR 30:\033[0m \033[38;5;214mUnable to get MetaData.\033[0m\n\0",
                      strlen(" \033[1;31mERROR 30:\033[0m \033[38;5;214mUnable to get MetaData.\033[0m\n\0"), 0);
             }
@@ -551,33 +625,43 @@ void processCommand_user(Node *root, char *input, int client_socket)
             ssize_t bytes;
             if ((targetNode->permissions & READ) == 0)
             {
+                nodeUnlockRead(targetNode);
                 const char *error = " \033[1;31mERROR 50:\033[0m \033[38;5;214mPermission Denied!\033[0m\n\0";
                 send(client_socket, error, strlen(error), 0);
                 return;
             }
             if (targetNode->type != FILE_NODE)
             {
+                nodeUnlockRead(targetNode);
                 const char *error = " \033[1;31mERROR 51:\033[0m \033[38;5;214mNot a File!\033[0m\n\0";
                 send(client_socket, error, strlen(error), 0);
                 return;
             }
+            int fd = fdCacheAcquire(targetNode);
+            if (fd == -1)
+            {
+                nodeUnlockRead(targetNode);
+                perror("Error opening audio file");
+                const char *error = " \033[1;31mERROR 31:\033[0m \033[38;5;214mUnable to Stream Data!\033[0m\n\0";
+                send(client_socket, error, strlen(error), 0);
+                return;
+            }
             send(client_socket, "START_STREAM\n", strlen("START_STREAM\n"), 0);
 
-            while ((bytes = streamAudioFile(targetNode, buffer, CHUNK_SIZE, offset)) > 0)
+            // Each chunk goes out with sendfile, then waits for the client's ack
+            while ((bytes = sendFileRange(client_socket, fd, &offset, CHUNK_SIZE)) > 0)
             {
-                if (send(client_socket, buffer, bytes, 0) != bytes)
-                {
-                    send(client_socket, " \033[1;31mERROR 31:\033[0m \033[38;5;214mUnable to Stream Data!\033[0m\n\0",
-                         strlen(" \033[1;31mERROR 31:\033[0m \033[38;5;214mUnable to Stream Data!\033[0m\n\0"), 0);
-                    break;
-                }
-                memset(buffer, 0, sizeof(buffer));
                 recv(client_socket, buffer, sizeof(buffer), 0);
-                memset(buffer, 0, sizeof(buffer));
-                offset += bytes;
                 chunks++;
                 usleep(100000);
             }
+            if (bytes < 0)
+            {
+                send(client_socket, " \033[1;31mERROR 31:\033[0m \033[38;5;214mUnable to Stream Data!\033[0m\n\0",
+                     strlen(" \033[1;31mERROR 31:\033[0m \033[38;5;214mUnable to Stream Data!\033[0m\n\0"), 0);
+            }
+            fdCacheRelease(targetNode, fd);
+            nodeUnlockRead(targetNode);
             send(client_socket, "END_STREAM\n", strlen("END_STREAM\n"), 0);
             memset(buffer, 0, sizeof(buffer));
             recv(client_socket, buffer, sizeof(buffer), 0);
@@ -591,9 +675,11 @@ void processCommand_user(Node *root, char *input, int client_socket)
             send(client_socket, " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath is needed!\033[0m\n\0", strlen(" \033[1;31mERROR 404:\033[0m \033[38;5;214mPath is needed!\033[0m\n\0"), 0);
             return;
         }
+        pthread_rwlock_wrlock(&namespace_lock);
         Node *parentDir = findNode(root, path);
         if (!parentDir)
         {
+            pthread_rwlock_unlock(&namespace_lock);
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0");
             send(client_socket, response, strlen(response), 0);
@@ -602,7 +688,11 @@ void processCommand_user(Node *root, char *input, int client_socket)
         }
 
         NodeType type = FILE_NODE;
-        if (createEmptyNode(parentDir, name, type))
+        Node *target = createEmptyNode(parentDir, name, type);
+        if (target)
+            nodeLockWrite(target, NODE_LOCK_TIMEOUT_MS); // Freshly created, nobody else holds it
+        pthread_rwlock_unlock(&namespace_lock);
+        if (target)
         {
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), "CREATE DONE");
@@ -610,11 +700,6 @@ void processCommand_user(Node *root, char *input, int client_socket)
             memset(response, 0, sizeof(response));
             memset(buffer, 0, sizeof(buffer));
             size_t bytes_received;
-            int totalReceived = 0;
-            char node_path[1024];
-            snprintf(node_path, sizeof(node_path), "%s/%s", path, name);
-            // printf("%s\n", node_path);
-            Node *target = findNode(root, node_path);
             memset(buffer, 0, sizeof(buffer));
             while ((bytes_received = recv(client_socket, buffer, sizeof(buffer), 0)) > 0)
             {
@@ -624,9 +709,11 @@ void processCommand_user(Node *root, char *input, int client_socket)
                 buffer[bytes_received] = '\0';
                 if (strncmp(buffer, "END_OF_FILE\n", 12) == 0)
                     break;
-                writeFileChunk(target, buffer, bytes_received, totalReceived);
+                writeFileChunk(target, buffer, bytes_received);
                 memset(buffer, 0, sizeof(buffer));
             }
+            journalRecordResize(target);
+            nodeUnlockWrite(target);
             // return;
         }
         else
@@ -646,9 +733,11 @@ void processCommand_user(Node *root, char *input, int client_socket)
             send(client_socket, " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath is needed!\033[0m\n\0", strlen(" \033[1;31mERROR 404:\033[0m \033[38;5;214mPath is needed!\033[0m\n\0"), 0);
             return;
         }
+        pthread_rwlock_wrlock(&namespace_lock);
         parentDir = findNode(root, path);
         if (!parentDir)
         {
+            pthread_rwlock_unlock(&namespace_lock);
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Disrectory Missing!\033[0m\n\0");
             send(client_socket, response, strlen(response), 0);
@@ -657,7 +746,9 @@ void processCommand_user(Node *root, char *input, int client_socket)
         }
 
         type = DIRECTORY_NODE;
-        if (createEmptyNode(parentDir, name2, type))
+        target = createEmptyNode(parentDir, name2, type);
+        pthread_rwlock_unlock(&namespace_lock);
+        if (target)
         {
             memset(response, 0, sizeof(response));
 
@@ -675,35 +766,50 @@ void processCommand_user(Node *root, char *input, int client_socket)
             return;
         }
         break;
+    case CMD_ARCHIVE:
+        // A peer storage server streams a COPY to us, see archive.c
+        send(client_socket, "ARCHIVE READY", strlen("ARCHIVE READY"), 0);
+        extractArchive(client_socket, root);
+        break;
+    case CMD_REPLICATE:
+        // The server we back up streams its changes, see replication.c
+        applyReplicationStream(client_socket, root, cmd_start);
+        break;
 
+    case CMD_STATS:
+    {
+        char stats[512];
+        formatNodeLockStats(stats, sizeof(stats));
+        formatFdCacheStats(stats + strlen(stats), sizeof(stats) - strlen(stats));
+        formatReplicationStats(stats + strlen(stats), sizeof(stats) - strlen(stats));
+        send(client_socket, stats, strlen(stats), 0);
+        break;
+    }
     case CMD_UNKNOWN:
         send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mUnknown command: %s\nUsage: READ|WRITE|META|STREAM <args>\n\033[0m\n\0", strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mUnknown command: %s\nUsage: READ|WRITE|META|STREAM <args>\n\033[0m\n\0"), 0);
         break;
     }
 }
 
-void processCommand_namingServer(Node *root, char *input, int client_socket)
+void processCommand_namingServer(Node *root, char *input, NamingRequest *request)
 {
     char path[MAX_PATH_LENGTH];
-    char buffer[MAX_CONTENT_LENGTH];
     char secondPath[MAX_PATH_LENGTH];
     char typeStr[5];
     struct stat metadata;
     char command[20];
     char response[100001];
-    printf("helllo\n");
     char *cmd_start = input;
     while (*cmd_start == ' ')
         cmd_start++;
     if (strlen(cmd_start) == 0)
     {
-        printf("hey\n");
-        send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: It is empty!\033[0m\n\0", strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: It is empty!\033[0m\n\0"), 0);
+        replyToNamingServer(request, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: It is empty!\033[0m\n\0", strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: It is empty!\033[0m\n\0"), 0);
         return;
     }
     if (sscanf(cmd_start, "%s", command) != 1)
     {
-        send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command Format!\033[0m\n\0", strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command Format!\033[0m\n\0"), 0);
+        replyToNamingServer(request, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command Format!\033[0m\n\0", strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command Format!\033[0m\n\0"), 0);
         return;
     }
     cmd_start += strlen(command);
@@ -712,7 +818,7 @@ void processCommand_namingServer(Node *root, char *input, int client_socket)
 
     if (strcmp(command, "EXIT") == 0)
     {
-        send(client_socket, "Exiting...\n", strlen("Exiting...\n"), 0);
+        replyToNamingServer(request, "Exiting...\n", strlen("Exiting...\n"), 0);
         return;
     }
     printf("%s\n", command);
@@ -729,7 +835,7 @@ void processCommand_namingServer(Node *root, char *input, int client_socket)
         {
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: Type and path are required!\033[0m\n\0");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
             return;
         }
@@ -738,37 +844,36 @@ void processCommand_namingServer(Node *root, char *input, int client_socket)
         {
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 404:\033[0m \033[38;5;214mInvalid Path Format!\033[0m\n\0");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
             return;
         }
         *lastSlash = '\0';
         char *name = lastSlash + 1;
+        pthread_rwlock_wrlock(&namespace_lock);
         Node *parentDir = searchPath(root, path);
         *lastSlash = '/';
 
         if (!parentDir)
         {
+            pthread_rwlock_unlock(&namespace_lock);
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
             return;
         }
 
         NodeType type = (strcasecmp(typeStr, "DIR") == 0) ? DIRECTORY_NODE : FILE_NODE;
-        if (createEmptyNode(parentDir, name, type))
+        Node *created = createEmptyNode(parentDir, name, type);
+        pthread_rwlock_unlock(&namespace_lock);
+        if (created)
         {
+            replicationWait(replicationTicket());
             memset(response, 0, sizeof(response));
-            printf("hillo\n");
-            fflush(stdout);
             snprintf(response, sizeof(response), "CREATE DONE");
-            if (send(client_socket, response, strlen(response), 0) < 0)
-            {
-                perror("hajnckm");
-            }
-            printf("sent\n");
-            fflush(stdout);
+            if (replyToNamingServer(request, response, strlen(response), 0) < 0)
+                perror("Failed to answer CREATE");
             memset(response, 0, sizeof(response));
             return;
         }
@@ -776,74 +881,133 @@ void processCommand_namingServer(Node *root, char *input, int client_socket)
         {
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 32:\033[0m \033[38;5;214mUnable to create node!\033[0m\n\0");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
         }
         break;
 
     case CMD_COPY:
-        sscanf(cmd_start, "%s %s", path, secondPath);
-        memset(buffer, 0, sizeof(buffer));
-        snprintf(buffer, sizeof(buffer), "ACknowledgement");
-        ssize_t bytes_sent = send(client_socket, buffer, strlen(buffer), 0);
-        printf("Bytes sent: %zd\n", bytes_sent);
-        fflush(stdout);
-
-        if (bytes_sent <= 0)
+    {
+        // COPY <source> <destination dir> <peer ip> <peer client port> [PROGRESS]
+        char peer_ip[16];
+        char flag[16] = "";
+        int peer_port;
+        if (sscanf(cmd_start, "%s %s %15s %d %15s", path, secondPath, peer_ip, &peer_port, flag) < 4)
         {
-            perror("Failed to send COPY command to source");
-            fflush(stdout);
+            memset(response, 0, sizeof(response));
+            snprintf(response, sizeof(response), " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: Source, destination and peer are required!\033[0m\n\0");
+            replyToNamingServer(request, response, strlen(response), 0);
             return;
         }
-        printf("sent %s\n", buffer);
-        fflush(stdout);
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0)
-            break;
-        buffer[bytes_received] = '\0';
+        if (copy_files_to_peer(path, secondPath, peer_ip, peer_port, root, strcmp(flag, "PROGRESS") == 0 ? request : NULL))
+            replyToNamingServer(request, "COPY DONE", strlen("COPY DONE"), 0);
+        else
+            replyToNamingServer(request, " \033[1;31mERROR 45:\033[0m \033[38;5;214mDirectory copy failed!\033[0m\n\0", strlen(" \033[1;31mERROR 45:\033[0m \033[38;5;214mDirectory copy failed!\033[0m\n\0"), 0);
+        break;
+    }
+
+    case CMD_BACKUP:
+    {
+        // BACKUP <destination dir> <peer ip> <peer client port> <epoch> <after seq>
         char peer_ip[16];
         int peer_port;
-        int flag = 0;
-        if (strncmp(buffer, "SOURCE SERVER_INFO", 18) == 0)
+        unsigned int epoch;
+        unsigned long long after_seq;
+        if (sscanf(cmd_start, "%s %15s %d %u %llu", secondPath, peer_ip, &peer_port, &epoch, &after_seq) != 5)
+        {
+            memset(response, 0, sizeof(response));
+            snprintf(response, sizeof(response), " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: Destination, peer and checkpoint are required!\033[0m\n\0");
+            replyToNamingServer(request, response, strlen(response), 0);
+            return;
+        }
+        uint64_t backup_seq = 0;
+        int full = 0;
+        memset(response, 0, sizeof(response));
+        if (backup_to_peer(secondPath, peer_ip, peer_port, root, epoch, after_seq, &backup_seq, &full))
+            snprintf(response, sizeof(response), "BACKUP DONE %s %u %llu", full ? "FULL" : "INCREMENTAL", journalEpoch(),
+                     (unsigned long long)backup_seq);
+        else
+            snprintf(response, sizeof(response), " \033[1;31mERROR 47:\033[0m \033[38;5;214mBackup failed!\033[0m\n\0");
+        replyToNamingServer(request, response, strlen(response), 0);
+        break;
+    }
+
+    case CMD_REPLICAS:
+    {
+        // REPLICAS <destination dir> <peer ip> <peer client port> <epoch> <seq> [second replica alike],
+        // or just the destination dir to ask how far the chain got
+        if (sscanf(cmd_start, "%s", secondPath) != 1)
+        {
+            memset(response, 0, sizeof(response));
+            snprintf(response, sizeof(response), " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command: Destination and replicas are required!\033[0m\n\0");
+            replyToNamingServer(request, response, strlen(response), 0);
+            return;
+        }
+        const char *spec = strstr(cmd_start, secondPath) + strlen(secondPath);
+        memset(response, 0, sizeof(response));
+        if (spec[strspn(spec, " \t\r\n")] == '\0')
         {
-            printf("source\n");
-            sscanf(buffer, "SOURCE SERVER_INFO %s %d", peer_ip, &peer_port);
-            copy_files_to_peer(path, secondPath, peer_ip, peer_port, root, client_socket);
-            flag = 1;
+            formatReplicationStatus(secondPath, response, sizeof(response));
+            replyToNamingServer(request, response, strlen(response), 0);
+            break;
         }
+        int started = configureReplication(secondPath, spec);
+        memset(response, 0, sizeof(response));
+        if (started < 0)
+            snprintf(response, sizeof(response), " \033[1;31mERROR 48:\033[0m \033[38;5;214mReplication could not be set up!\033[0m\n\0");
+        else
+            snprintf(response, sizeof(response), "REPLICAS %s", started ? "STARTED" : "KEPT");
+        replyToNamingServer(request, response, strlen(response), 0);
         break;
+    }
+
+    case CMD_SYNC:
+    {
+        // SYNC <last applied seq>: reply with the newer events, or the tree
+        unsigned long long applied_seq;
+        if (sscanf(cmd_start, "%llu", &applied_seq) != 1)
+            applied_seq = 0;
+        if (sendNamespaceSince(request->socket, request, root, 1, applied_seq) < 0)
+            perror("Failed to send namespace update");
+        replyToNamingServer(request, "", 0, 0); // Ends the reply
+        break;
+    }
 
     case CMD_DELETE:
         if (sscanf(cmd_start, "%s", path) != 1)
         {
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 404:\033[0m \033[38;5;214mMissing Path argument!\033[0m\n\0");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
             return;
         }
+        pthread_rwlock_wrlock(&namespace_lock);
         Node *nodeToDelete = searchPath(root, path);
         if (!nodeToDelete)
         {
+            pthread_rwlock_unlock(&namespace_lock);
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
             return;
         }
-        if (deleteNode(nodeToDelete) == 0)
+        int deleted = deleteNode(nodeToDelete) == 0;
+        pthread_rwlock_unlock(&namespace_lock);
+        if (deleted)
         {
+            replicationWait(replicationTicket());
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), "DELETE DONE");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
         }
         else
         {
             memset(response, 0, sizeof(response));
             snprintf(response, sizeof(response), " \033[1;31mERROR 33:\033[0m \033[38;5;214mUnable to delete node!\033[0m\n\0");
-            send(client_socket, response, strlen(response), 0);
+            replyToNamingServer(request, response, strlen(response), 0);
             memset(response, 0, sizeof(response));
         }
         break;
@@ -851,7 +1015,7 @@ void processCommand_namingServer(Node *root, char *input, int client_socket)
     case CMD_UNKNOWN:
         memset(response, 0, sizeof(response));
         snprintf(response, sizeof(response), " \033[1;31mERROR 101:\033[0m \033[38;5;214mUnknown command: %s\nUsage: READ|WRITE|META|STREAM <args>\n\033[0m\n\0", command);
-        send(client_socket, response, strlen(response), 0);
+        replyToNamingServer(request, response, strlen(response), 0);
         memset(response, 0, sizeof(response));
         break;
     }
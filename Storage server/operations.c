@@ -1,52 +1,80 @@
 #include "header.h"
 
-int getFileMetadata(Node *fileNode, struct stat *metadata)
+// Naming server requests run concurrently (see namingServerHandler), so
+// adding and removing nodes takes namespace_lock for writing and walking the
+// tree for reading. File contents are guarded by the per-node locks as before.
+pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Send the whole buffer, resuming after partial sends
+int sendAll(int sock, const char *buffer, size_t len)
 {
-    if (!fileNode || !fileNode->dataLocation)
+    size_t sent = 0;
+    while (sent < len)
     {
-        return -1;
+        ssize_t n = send(sock, buffer + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        sent += n;
     }
-
-    return stat(fileNode->dataLocation, metadata);
+    return 0;
 }
 
-ssize_t streamAudioFile(Node *fileNode, char *buffer, size_t size, off_t offset)
+int getFileMetadata(Node *fileNode, struct stat *metadata)
 {
-    if (fileNode->type != FILE_NODE)
-    {
-        printf("Error: Not a file\n");
-        return -1;
-    }
-
-    if (!hasPermission(fileNode, READ))
-    {
-        printf("Error: No read permission\n");
-        return -1;
-    }
-
-    int fd = open(fileNode->dataLocation, O_RDONLY);
-    if (fd == -1)
+    char location[PATH_MAX];
+    if (!fileNode || getDataLocation(fileNode, location, sizeof(location)) < 0)
     {
-        perror("Error opening audio file");
         return -1;
     }
 
-    // Seek to the specified offset
-    if (lseek(fd, offset, SEEK_SET) == -1)
-    {
-        perror("Error seeking in file");
-        close(fd);
-        return -1;
-    }
+    return stat(location, metadata);
+}
 
-    ssize_t bytesRead = read(fd, buffer, size);
-    if (bytesRead == -1)
+// Send count bytes of fd starting at *offset (advanced as data goes out).
+// The data moves file -> socket inside the kernel with sendfile; if the
+// kernel or file system refuses, it falls back to pread + send through a
+// small buffer. Returns the bytes sent, which is short only at end of file,
+// or -1 if nothing could be sent.
+ssize_t sendFileRange(int sock, int fd, off_t *offset, size_t count)
+{
+    size_t total = 0;
+    int use_sendfile = 1;
+    while (total < count)
     {
-        perror("Error reading audio file");
+        ssize_t n;
+        if (use_sendfile)
+        {
+            n = sendfile(sock, fd, offset, count - total);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                use_sendfile = 0;
+                continue;
+            }
+        }
+        else
+        {
+            char buffer[SENDFILE_FALLBACK_BUFFER];
+            size_t want = count - total < sizeof(buffer) ? count - total : sizeof(buffer);
+            n = pread(fd, buffer, want, *offset);
+            if (n > 0)
+            {
+                if (sendAll(sock, buffer, n) < 0)
+                    n = -1;
+                else
+                    *offset += n;
+            }
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n < 0 && total == 0)
+                return -1;
+            break;
+        }
+        total += n;
     }
-
-    close(fd);
-    return bytesRead;
+    return total;
 }
 
 Node *createEmptyNode(Node *parentDir, const char *name, NodeType type)
@@ -65,8 +93,15 @@ Node *createEmptyNode(Node *parentDir, const char *name, NodeType type)
     }
 
     // Create the physical file/directory
+    char location[PATH_MAX];
     char fullPath[PATH_MAX];
-    snprintf(fullPath, PATH_MAX, "%s/%s", parentDir->dataLocation, name);
+    if (getDataLocation(parentDir, location, sizeof(location)) < 0)
+        return NULL;
+    if (snprintf(fullPath, PATH_MAX, "%s/%s", location, name) >= PATH_MAX)
+    {
+        printf("Error: path of %s is too long\n", name);
+        return NULL;
+    }
 
     if (type == DIRECTORY_NODE)
     {
@@ -88,9 +123,10 @@ Node *createEmptyNode(Node *parentDir, const char *name, NodeType type)
     }
 
     // Create and insert the node
-    Node *newNode = createNode(name, type, READ | WRITE, fullPath);
+    Node *newNode = createNode(name, type, READ | WRITE);
     newNode->parent = parentDir;
     insertNode(parentDir->children, newNode);
+    journalRecord(JOURNAL_CREATE, newNode, 0);
     return newNode;
 }
 
@@ -105,22 +141,21 @@ int deleteNode(Node *node)
     // Recursively delete all children if the node is a directory
     if (node->type == DIRECTORY_NODE && node->children)
     {
-        for (int i = 0; i < TABLE_SIZE; i++)
+        uint32_t cursor = 0;
+        Node *child;
+        while ((child = nextChild(node->children, &cursor)) != NULL)
         {
-            Node *child = node->children->table[i];
-            while (child)
-            {
-                Node *next = child->next;
-                deleteNode(child);
-                child = next;
-            }
+            deleteNode(child);
         }
     }
 
     // Remove the physical file or directory
+    char location[PATH_MAX];
+    if (getDataLocation(node, location, sizeof(location)) < 0)
+        return -1;
     if (node->type == DIRECTORY_NODE)
     {
-        if (rmdir(node->dataLocation) != 0)
+        if (rmdir(location) != 0)
         {
             perror("Error deleting directory");
             return -1;
@@ -128,40 +163,33 @@ int deleteNode(Node *node)
     }
     else
     {
-        if (unlink(node->dataLocation) != 0)
+        // Let running transfers finish before the file goes away
+        if (nodeLockWrite(node, NODE_LOCK_TIMEOUT_MS) != 0)
+        {
+            printf("Error: %s is busy\n", location);
+            return -1;
+        }
+        fdCacheInvalidate(node);
+        if (unlink(location) != 0)
         {
             perror("Error deleting file");
+            nodeUnlockWrite(node);
             return -1;
         }
     }
 
-    // Remove node from parent's hash table
-    unsigned int index = hash(node->name);
-    Node *current = node->parent->children->table[index];
-    Node *prev = NULL;
-
-    while (current != NULL)
+    // Remove node from parent's table
+    if (removeNode(node->parent->children, node) != 0)
     {
-        if (current == node)
-        {
-            if (prev == NULL)
-            {
-                node->parent->children->table[index] = current->next;
-            }
-            else
-            {
-                prev->next = current->next;
-            }
-            free(node->name);
-            free(node->dataLocation);
-            free(node);
-            return 0;
-        }
-        prev = current;
-        current = current->next;
+        if (node->type == FILE_NODE)
+            nodeUnlockWrite(node);
+        return -1;
     }
-
-    return -1;
+    journalRecord(JOURNAL_DELETE, node, 0);
+    releaseName(node->name);
+    freeNodeTable(node->children);
+    nodeRetire(node, node->type == FILE_NODE);
+    return 0;
 }
 
 int copyNode(Node *sourceNode, Node *destDir, const char *newName)
@@ -173,9 +201,13 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
     }
 
     // Create destination path
+    char sourcePath[PATH_MAX];
     char destPath[PATH_MAX];
-    snprintf(destPath, PATH_MAX, "%s/%s",
-             destDir->dataLocation,
+    if (getDataLocation(sourceNode, sourcePath, sizeof(sourcePath)) < 0 ||
+        getDataLocation(destDir, destPath, sizeof(destPath)) < 0)
+        return -1;
+    size_t destLen = strlen(destPath);
+    snprintf(destPath + destLen, PATH_MAX - destLen, "/%s",
              newName ? newName : sourceNode->name);
 
     if (sourceNode->type == DIRECTORY_NODE)
@@ -189,12 +221,12 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
 
         // Create node in our file system
         Node *newDir = createNode(newName ? newName : sourceNode->name,
-                                  DIRECTORY_NODE, sourceNode->permissions, destPath);
+                                  DIRECTORY_NODE, sourceNode->permissions);
         newDir->parent = destDir;
         insertNode(destDir->children, newDir);
 
         // Copy contents recursively
-        DIR *dir = opendir(sourceNode->dataLocation);
+        DIR *dir = opendir(sourcePath);
         if (!dir)
         {
             perror("Error opening source directory");
@@ -219,15 +251,14 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
     else
     {
 
-        if (sourceNode->lock_type == 2) // Check if the file is being written to
+        if (nodeLockRead(sourceNode, NODE_LOCK_TIMEOUT_MS) != 0)
         {
             return 0; // File is being written to, cannot copy
         }
 
-        sourceNode->lock_type = 1; // read lock
         // Copy file contents
         char buffer[8192];
-        int sourceFd = open(sourceNode->dataLocation, O_RDONLY);
+        int sourceFd = open(sourcePath, O_RDONLY);
         int destFd = open(destPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
        
         if (sourceFd == -1 || destFd == -1)
@@ -237,7 +268,7 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
                 close(sourceFd);
             if (destFd != -1)
                 close(destFd);
-            sourceNode->lock_type = 0; // unlock
+            nodeUnlockRead(sourceNode);
             return -1;
         }
 
@@ -249,17 +280,18 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
                 perror("Error writing to destination file");
                 close(sourceFd);
                 close(destFd);
-                sourceNode->lock_type = 0; // unlock
+                nodeUnlockRead(sourceNode);
                 return -1;
             }
         }
 
         close(sourceFd);
         close(destFd);
+        nodeUnlockRead(sourceNode);
 
         // Create node in our file system
         Node *newFile = createNode(newName ? newName : sourceNode->name,
-                                   FILE_NODE, sourceNode->permissions, destPath);
+                                   FILE_NODE, sourceNode->permissions);
         newFile->parent = destDir;
         insertNode(destDir->children, newFile);
     }
@@ -299,198 +331,9 @@ int connectToServer(const char *ip, int port)
 }
 Node *findNode(Node *root, const char *path)
 {
-    if (!root || !path || strlen(path) == 0)
+    if (!root || !path || path[0] == '\0')
     {
-        printf("Error: Invalid root or path.\n");
         return NULL;
     }
-
-    // Handle root path case
-    if (strcmp(path, "/") == 0)
-    {
-        return root;
-    }
-
-    // Tokenize the path using the path separator
-    char *pathCopy = strdup(path); // Make a mutable copy of the path
-    char *token = strtok(pathCopy, "/");
-    Node *current = root;
-
-    while (token != NULL)
-    {
-        // Traverse the children of the current node
-        NodeTable *childrenTable = current->children;
-        if (!childrenTable)
-        {
-            printf("Error: Path component '%s' not found (no children).\n", token);
-            free(pathCopy);
-            return NULL;
-        }
-
-        Node *child = NULL;
-        for (int i = 0; i < TABLE_SIZE; i++)
-        {
-            child = childrenTable->table[i];
-            while (child != NULL)
-            {
-                if (strcmp(child->name, token) == 0)
-                {
-                    break;
-                }
-                child = child->next;
-            }
-            if (child)
-            {
-                break;
-            }
-        }
-
-        if (!child)
-        {
-            printf("Error: Path component '%s' not found.\n", token);
-            free(pathCopy);
-            return NULL;
-        }
-
-        // Move to the next level
-        current = child;
-        token = strtok(NULL, "/");
-    }
-
-    free(pathCopy);
-    return current;
-}
-
-void copy_files_to_peer(const char *source_path, const char *dest_path, const char *peer_ip, int peer_port, Node *root, int naming_socket)
-{
-    Node *source_node = findNode(root, source_path);
-    int peer_socket = connectToServer(peer_ip, peer_port);
-    if (peer_socket < 0)
-        return;
-
-    if (source_node->type == FILE_NODE)
-    {
-
-        if (copy_single_file(peer_socket, source_node, dest_path, naming_socket))
-        {
-            // printf("done\n");
-            send(naming_socket, "COPY DONE", strlen("COPY DONE"), 0);
-        }
-        else
-        {
-            // printf("fail\n");
-            send(naming_socket, " \033[1;31mERROR 45:\033[0m \033[38;5;214mDirectory copy failed!\033[0m\n\0", strlen(" \033[1;31mERROR 45:\033[0m \033[38;5;214mDirectory copy failed!\033[0m\n\0"), 0);
-        }
-    }
-    else if (source_node->type == DIRECTORY_NODE)
-    {
-        // printf("hii\n");
-        if(copy_directory_recursive(peer_socket, source_node, dest_path,naming_socket))
-        {
-            // printf("done\n");
-            send(naming_socket, "COPY DONE", strlen("COPY DONE"),0);
-        }
-        else
-        {
-            // printf("fail\n");
-            send(naming_socket, " \033[1;31mERROR 45:\033[0m \033[38;5;214mDirectory copy failed!\033[0m\n\0", strlen(" \033[1;31mERROR 45:\033[0m \033[38;5;214mDirectory copy failed!\033[0m\n\0"), 0);
-        }
-    }
-
-    close(peer_socket);
-}
-
-int copy_single_file(int peer_socket, Node *source_node, const char *dest_path, int naming_socket)
-{
-    // Send file metadata
-    char metadata[MAX_BUFFER_SIZE];
-    memset(metadata, 0 , sizeof(metadata));
-    snprintf(metadata, sizeof(metadata), "FILE_META %s %s %d", dest_path, source_node->name, source_node->permissions);
-    send(peer_socket, metadata, strlen(metadata), 0);
-    char respond[1024];
-    memset(respond, 0 , sizeof(respond));
-    recv(peer_socket, respond, sizeof(respond), 0);
-    // printf("%s\n", respond);
-    if (strncmp(respond, "CREATE DONE", 11) == 0)
-    {
-        FILE *fp = fopen(source_node->dataLocation, "rb");
-        if (!fp)
-            return 0;
-
-        char buffer[100001];
-        size_t bytes_read;
-        char com[20];
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0)
-        {
-            // printf("%s\n", buffer);
-            send(peer_socket, buffer, bytes_read, 0);
-            memset(com, 0 , sizeof(com));
-            recv(peer_socket, com, sizeof(com), 0);
-            memset(buffer, 0, sizeof(buffer));
-        }
-        fclose(fp);
-        send(peer_socket, "END_OF_FILE\n", strlen("END_OF_FILE\n"), 0);
-        memset(buffer, 0 , sizeof(buffer));
-        recv(peer_socket, buffer, sizeof(buffer), 0);
-        // send(naming_socket, "COPY DONE", strlen("COPY DONE"), 0);
-        return 1;
-    }
-    else
-    {
-        // send(naming_socket, respond, strlen(respond), 0);
-        return 0;
-    }
+    return walkPath(root, path, 0);
 }
-
-int copy_directory_recursive(int peer_socket, Node *dir_node, const char *dest_path,int naming_socket)
-{
-    // Create directory on peer
-    char dir_cmd[MAX_BUFFER_SIZE];
-    memset(dir_cmd, 0, sizeof(dir_cmd));
-    snprintf(dir_cmd, sizeof(dir_cmd), "CREATE_DIR %s %s %d",dest_path, dir_node->name, dir_node->permissions);
-    send(peer_socket, dir_cmd, strlen(dir_cmd), 0);
-    memset(dir_cmd, 0 , sizeof(dir_cmd));
-    recv(peer_socket,dir_cmd,sizeof(dir_cmd),0);
-    int flag=1;
-    if (strncmp(dir_cmd, "CREATE DONE",11)==0)
-    {
-        // Recursively copy all children
-        for (int i = 0; i < TABLE_SIZE; i++)
-        {
-            Node *child = dir_node->children->table[i];
-            while (child)
-            {
-                char new_dest_path[MAX_PATH_LENGTH];
-                snprintf(new_dest_path, sizeof(new_dest_path), "%s/%s", dest_path, dir_node->name);
-
-                if (child->type == FILE_NODE)
-                {
-                    if(!copy_single_file(peer_socket, child, new_dest_path, naming_socket))
-                    {
-                        flag=0;
-                        break;
-                    }
-                }
-                else
-                {
-                    if(!copy_directory_recursive(peer_socket, child, new_dest_path,naming_socket))
-                    {
-                        flag=0;
-                        break;
-                    }
-                }
-                child = child->next;
-            }
-        }
-        if(flag)
-        return 1;
-        else
-        {
-            return 0;
-        }
-    }
-    else
-    {
-        return 0;
-    }
-}
\ No newline at end of file
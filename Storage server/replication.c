@@ -0,0 +1,972 @@
+#include "header.h"
+
+// Chain replication of this server's changes to its replicas. The naming
+// server tells us our replicas once a backup to them is in place:
+//   REPLICAS <dest dir> <ip> <client port> <epoch> <seq> [<ip> <client port> <epoch> <seq>]
+// From then on every create, delete and write here is queued as an op. The
+// replicas are first brought up to date from their checkpoints with
+// backup_to_peer, then the queue streams to the first one, which applies each
+// op below dest dir and passes it on to the second. The chain connection
+// starts with "REPLICATE <dest dir> <next ip|-> <next port>", answered with
+// "REPLICATE READY", and carries records of
+//   u32 type | u32 permissions | u32 path_len | u32 flags | u64 offset | u64 size |
+//   path | size bytes of data
+// Going back come cumulative acks: u64 ops applied | u64 ops applied down the
+// whole chain | u32 rest of the chain is connected.
+//
+// Ops may reach a replica that already has them: whatever changed while it
+// was caught up is sent again. Every op can be applied twice: a create keeps
+// what is there, a delete of something gone is fine, and a write carries the
+// offset it went to, so bytes a file already has are skipped. Files only grow
+// between being created and deleted here (writes append), which makes that
+// check enough. A failing op that was queued during the catch-up is skipped
+// for that reason; any other failure means the replica is off and it hangs
+// up, as does the chain on a full queue or a replica that is too slow. The
+// naming server's next backup refresh finds the chain broken, catches the
+// replicas up again and sends REPLICAS to restart it. Asked with no replicas,
+//   REPLICAS <dest dir>
+// is answered with how far the chain got, see formatReplicationStatus.
+//
+// How long a reply waits is set by durability_mode: not at all, until the
+// first replica applied the change, or until all of them did. While the chain
+// is catching up or broken no reply waits.
+
+int durability_mode = DURABILITY_ONE;
+
+typedef struct ReplicaOp
+{
+    uint32_t type;
+    uint32_t permissions;
+    char *path;      // Relative to the storage server root
+    uint64_t offset; // Where the data of a REPLICA_WRITE goes
+    char *data;      // NULL for a REPLICA_CONTENT, read from the file when sent
+    uint64_t size;
+    struct ReplicaOp *next;
+} ReplicaOp;
+
+typedef struct ReplicaMember
+{
+    char ip[16];
+    int port;
+    uint32_t epoch; // Its backup checkpoint, for the catch-up, then the last
+    uint64_t seq;   // journal event it is known to have
+} ReplicaMember;
+
+typedef enum
+{
+    CHAIN_NONE,
+    CHAIN_CATCHING_UP,
+    CHAIN_STREAMING,
+    CHAIN_BROKEN
+} ChainState;
+
+// The chain of this server; tickets count the ops ever queued
+static struct
+{
+    uint32_t generation; // New configuration; the threads of an older one stop
+    ChainState state;
+    char dest_dir[MAX_PATH_LENGTH];
+    int members;
+    ReplicaMember member[2];
+    int sock; // To the first replica while streaming
+    ReplicaOp *head;
+    ReplicaOp *tail;
+    size_t queued;
+    size_t queued_bytes;
+    uint64_t enqueued;   // Ticket of the newest op
+    uint64_t base;       // Ticket before the first op of this configuration
+    uint64_t redo_until; // Ops up to here may already be in the catch-up copy
+    uint64_t acked_head; // Ticket applied by the first replica
+    uint64_t acked_all;  // Ticket applied by all of them
+    int tail_ok;         // The second replica is still connected
+} chain;
+
+static pthread_mutex_t replication_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replication_cond; // Acks came in or the state changed
+static atomic_int chain_active;         // CATCHING_UP or STREAMING, checked without the lock
+static Node *replication_root;
+
+// Receiving end of a chain connection
+typedef struct ReplicaStream
+{
+    int sock;             // From the server before us
+    int next_sock;        // To the next replica, -1 if there is none
+    int next_ok;          // Cleared when the next replica goes away
+    pthread_mutex_t lock; // Acks go back from the applying and the ack reading thread
+    uint64_t applied;
+    uint64_t acked;       // applied as of the last ack sent back
+    uint64_t next_applied;
+    char *buffer;
+    size_t start;
+    size_t end;
+} ReplicaStream;
+
+static void putU32(char *buffer, size_t *used, uint32_t value)
+{
+    uint32_t net = htonl(value);
+    memcpy(buffer + *used, &net, sizeof(net));
+    *used += sizeof(net);
+}
+
+static void putU64(char *buffer, size_t *used, uint64_t value)
+{
+    putU32(buffer, used, (uint32_t)(value >> 32));
+    putU32(buffer, used, (uint32_t)value);
+}
+
+static uint32_t getU32(const char *buffer)
+{
+    uint32_t net;
+    memcpy(&net, buffer, sizeof(net));
+    return ntohl(net);
+}
+
+static uint64_t getU64(const char *buffer)
+{
+    return ((uint64_t)getU32(buffer) << 32) | getU32(buffer + 4);
+}
+
+// Like sendAll, but with more of the record to come unless more is 0
+static int sendAllMore(int sock, const char *buffer, size_t len, int more)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(sock, buffer + sent, len - sent, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+static int recvAll(int sock, char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = recv(sock, buffer, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void initReplication(Node *root)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&replication_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    replication_root = root;
+    chain.sock = -1;
+}
+
+// Caller holds replication_lock
+static void setChainState(ChainState state)
+{
+    chain.state = state;
+    atomic_store(&chain_active, state == CHAIN_CATCHING_UP || state == CHAIN_STREAMING);
+    pthread_cond_broadcast(&replication_cond);
+}
+
+// Caller holds replication_lock
+static void dropQueue()
+{
+    while (chain.head)
+    {
+        ReplicaOp *op = chain.head;
+        chain.head = op->next;
+        free(op->path);
+        free(op->data);
+        free(op);
+    }
+    chain.tail = NULL;
+    chain.queued = 0;
+    chain.queued_bytes = 0;
+}
+
+// Give up on the chain until the naming server configures it again. Caller
+// holds replication_lock.
+static void breakChain(const char *why)
+{
+    if (chain.state != CHAIN_CATCHING_UP && chain.state != CHAIN_STREAMING)
+        return;
+    printf("Replication to %s:%d stopped: %s\n", chain.member[0].ip, chain.member[0].port, why);
+    setChainState(CHAIN_BROKEN);
+    dropQueue();
+    if (chain.sock >= 0)
+        shutdown(chain.sock, SHUT_RDWR); // Wakes the sender and the ack reader
+}
+
+int replicationActive()
+{
+    return atomic_load(&chain_active);
+}
+
+static void enqueueOp(ReplicaOp *op)
+{
+    pthread_mutex_lock(&replication_lock);
+    if (chain.state != CHAIN_CATCHING_UP && chain.state != CHAIN_STREAMING)
+    {
+        pthread_mutex_unlock(&replication_lock);
+        free(op->path);
+        free(op->data);
+        free(op);
+        return;
+    }
+    if (chain.queued_bytes + op->size > REPLICA_QUEUE_MAX_BYTES)
+    {
+        breakChain("queue full");
+        pthread_mutex_unlock(&replication_lock);
+        free(op->path);
+        free(op->data);
+        free(op);
+        return;
+    }
+    op->next = NULL;
+    if (chain.tail)
+        chain.tail->next = op;
+    else
+        chain.head = op;
+    chain.tail = op;
+    chain.queued++;
+    if (op->data)
+        chain.queued_bytes += op->size;
+    chain.enqueued++;
+    pthread_cond_broadcast(&replication_cond);
+    pthread_mutex_unlock(&replication_lock);
+}
+
+static ReplicaOp *newOp(uint32_t type, const char *path)
+{
+    ReplicaOp *op = (ReplicaOp *)calloc(1, sizeof(ReplicaOp));
+    if (!op)
+        return NULL;
+    op->type = type;
+    op->path = strdup(path);
+    return op;
+}
+
+// A create or delete, from journalRecord with the journal locked so ops are
+// queued in journal order
+void replicateNamespace(JournalOp journal_op, const Node *node, const char *path)
+{
+    if (!replicationActive() || (journal_op != JOURNAL_CREATE && journal_op != JOURNAL_DELETE) ||
+        strcmp(path, "/") == 0 || isBackupPath(path))
+        return;
+    uint32_t type = journal_op == JOURNAL_DELETE ? REPLICA_DELETE
+                    : node->type == DIRECTORY_NODE ? REPLICA_CREATE_DIRECTORY
+                                                   : REPLICA_CREATE_FILE;
+    ReplicaOp *op = newOp(type, path);
+    if (!op)
+        return;
+    op->permissions = node->permissions;
+    enqueueOp(op);
+}
+
+// size bytes written to node at offset. Caller holds the node's write lock,
+// so the writes of a file are queued in order.
+void replicateWrite(Node *node, const char *data, size_t size, off_t offset)
+{
+    char path[PATH_MAX];
+    if (!replicationActive() || size == 0 || journalPath(node, path, sizeof(path)) < 0 || isBackupPath(path))
+        return;
+    ReplicaOp *op = newOp(REPLICA_WRITE, path);
+    if (!op)
+        return;
+    op->offset = offset;
+    op->size = size;
+    op->data = (char *)malloc(size);
+    if (!op->data)
+    {
+        free(op->path);
+        free(op);
+        pthread_mutex_lock(&replication_lock);
+        breakChain("out of memory");
+        pthread_mutex_unlock(&replication_lock);
+        return;
+    }
+    memcpy(op->data, data, size);
+    enqueueOp(op);
+}
+
+// node was filled without going through a write, as a local COPY does; the
+// replicas get the whole file as it is when the op goes out
+void replicateContent(Node *node)
+{
+    char path[PATH_MAX];
+    if (!replicationActive() || journalPath(node, path, sizeof(path)) < 0 || isBackupPath(path))
+        return;
+    ReplicaOp *op = newOp(REPLICA_CONTENT, path);
+    if (op)
+        enqueueOp(op);
+}
+
+// Ticket of the newest op queued, for replicationWait
+uint64_t replicationTicket()
+{
+    pthread_mutex_lock(&replication_lock);
+    uint64_t ticket = chain.enqueued;
+    pthread_mutex_unlock(&replication_lock);
+    return ticket;
+}
+
+// Caller holds replication_lock
+static uint64_t ackedFor(int mode)
+{
+    return mode == DURABILITY_ALL && chain.members > 1 && chain.tail_ok ? chain.acked_all : chain.acked_head;
+}
+
+// Hold a reply until the ops up to ticket are as durable as durability_mode
+// asks. A chain that cannot keep up within REPLICA_ACK_TIMEOUT_MS is broken
+// off rather than stall writes.
+void replicationWait(uint64_t ticket)
+{
+    if (durability_mode == DURABILITY_PRIMARY || ticket == 0)
+        return;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += REPLICA_ACK_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (REPLICA_ACK_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&replication_lock);
+    uint32_t generation = chain.generation;
+    while (chain.state == CHAIN_STREAMING && chain.generation == generation && ticket > chain.base &&
+           ackedFor(durability_mode) < ticket)
+    {
+        if (pthread_cond_timedwait(&replication_cond, &replication_lock, &deadline) == ETIMEDOUT)
+        {
+            breakChain("acks timed out");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replication_lock);
+}
+
+// A backup to peer is already done if the chain streams to it: wait until it
+// has applied every op queued so far and report the journal position as of
+// then as its checkpoint. Returns 1 if so, 0 if the backup has to be sent.
+int replicationCovers(const char *dest_dir, const char *peer_ip, int peer_port, uint64_t *seq)
+{
+    uint64_t last_seq = journalLastSeq(); // Its events are queued by now, see journalRecord
+    int covered = 0;
+    pthread_mutex_lock(&replication_lock);
+    int index = -1;
+    for (int i = 0; i < chain.members; i++)
+    {
+        if (strcmp(chain.member[i].ip, peer_ip) == 0 && chain.member[i].port == peer_port)
+            index = i;
+    }
+    if (chain.state == CHAIN_STREAMING && index >= 0 && strcmp(chain.dest_dir, dest_dir) == 0)
+    {
+        uint64_t ticket = chain.enqueued;
+        uint32_t generation = chain.generation;
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += REPLICA_ACK_TIMEOUT_MS / 1000;
+        while (chain.state == CHAIN_STREAMING && chain.generation == generation && (index == 0 || chain.tail_ok) &&
+               (index == 0 ? chain.acked_head : chain.acked_all) < ticket)
+        {
+            if (pthread_cond_timedwait(&replication_cond, &replication_lock, &deadline) == ETIMEDOUT)
+            {
+                // The backup is sent instead, which must not race the chain
+                breakChain("replica fell behind");
+                break;
+            }
+        }
+        covered = chain.state == CHAIN_STREAMING && chain.generation == generation && (index == 0 || chain.tail_ok);
+    }
+    pthread_mutex_unlock(&replication_lock);
+    if (covered)
+        *seq = last_seq;
+    return covered;
+}
+
+static int sendRecordHeader(int sock, uint32_t type, uint32_t permissions, uint32_t flags, const char *path,
+                            uint64_t offset, uint64_t size)
+{
+    char header[REPLICA_HEADER_SIZE + MAX_PATH_LENGTH];
+    size_t used = 0;
+    uint32_t path_len = strlen(path);
+    if (path_len >= MAX_PATH_LENGTH)
+        return -1;
+    putU32(header, &used, type);
+    putU32(header, &used, permissions);
+    putU32(header, &used, path_len);
+    putU32(header, &used, flags);
+    putU64(header, &used, offset);
+    putU64(header, &used, size);
+    memcpy(header + used, path, path_len);
+    used += path_len;
+    return sendAllMore(sock, header, used, size > 0);
+}
+
+// The file of a REPLICA_CONTENT op as it is now. One that is gone goes out
+// empty; its delete follows.
+static int sendContent(int sock, const ReplicaOp *op, uint32_t flags)
+{
+    pthread_rwlock_rdlock(&namespace_lock);
+    Node *node = findNode(replication_root, op->path);
+    if (node && node->type != FILE_NODE)
+        node = NULL;
+    nodePin(node);
+    pthread_rwlock_unlock(&namespace_lock);
+    int locked = nodeLockPinned(node, 0, NODE_LOCK_TIMEOUT_MS) == 0;
+    int fd = locked ? fdCacheAcquire(node) : -1;
+    struct stat st;
+    uint64_t left = fd >= 0 && fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    int result = sendRecordHeader(sock, op->type, op->permissions, fd >= 0 ? flags : flags | REPLICA_REDO, op->path, 0, left);
+    off_t offset = 0;
+    while (result == 0 && left > 0)
+    {
+        size_t want = left < ARCHIVE_BUFFER ? (size_t)left : ARCHIVE_BUFFER;
+        ssize_t sent = sendFileRange(sock, fd, &offset, want);
+        if (sent == 0)
+        {
+            static const char zeros[4096];
+            sent = want < sizeof(zeros) ? want : sizeof(zeros);
+            if (sendAll(sock, zeros, sent) < 0)
+                sent = -1;
+        }
+        if (sent < 0)
+            result = -1;
+        else
+            left -= sent;
+    }
+    if (fd >= 0)
+        fdCacheRelease(node, fd);
+    if (locked)
+        nodeUnlockRead(node);
+    return result;
+}
+
+// Acks from the first replica, until its connection goes
+static void *chainAckReader(void *arg)
+{
+    uint32_t generation = (uint32_t)(uintptr_t)arg;
+    pthread_mutex_lock(&replication_lock);
+    int sock = chain.sock;
+    pthread_mutex_unlock(&replication_lock);
+    char ack[REPLICA_ACK_SIZE];
+    while (recvAll(sock, ack, sizeof(ack)) == 0)
+    {
+        pthread_mutex_lock(&replication_lock);
+        if (chain.generation != generation)
+        {
+            pthread_mutex_unlock(&replication_lock);
+            break;
+        }
+        chain.acked_head = chain.base + getU64(ack);
+        chain.acked_all = chain.base + getU64(ack + 8);
+        if (chain.tail_ok && !getU32(ack + 16))
+            printf("Replication to %s:%d: next replica lost, waiting on the first only\n", chain.member[0].ip, chain.member[0].port);
+        chain.tail_ok = getU32(ack + 16);
+        pthread_cond_broadcast(&replication_cond);
+        pthread_mutex_unlock(&replication_lock);
+    }
+    pthread_mutex_lock(&replication_lock);
+    if (chain.generation == generation)
+        breakChain("first replica hung up");
+    pthread_mutex_unlock(&replication_lock);
+    return NULL;
+}
+
+// Catch the replicas up, then stream the queue to the first one for as long
+// as this configuration lasts
+static void *chainSender(void *arg)
+{
+    uint32_t generation = (uint32_t)(uintptr_t)arg;
+    pthread_mutex_lock(&replication_lock);
+    char dest_dir[MAX_PATH_LENGTH];
+    ReplicaMember member[2];
+    int members = chain.members;
+    snprintf(dest_dir, sizeof(dest_dir), "%s", chain.dest_dir);
+    memcpy(member, chain.member, sizeof(member));
+    pthread_mutex_unlock(&replication_lock);
+
+    int ok = 1;
+    uint64_t caught_up[2] = {0, 0};
+    for (int i = 0; ok && i < members; i++)
+    {
+        int full = 0;
+        ok = backup_to_peer(dest_dir, member[i].ip, member[i].port, replication_root, member[i].epoch, member[i].seq,
+                            &caught_up[i], &full);
+    }
+
+    int sock = ok ? connectToServer(member[0].ip, member[0].port) : -1;
+    char handshake[MAX_PATH_LENGTH + 64];
+    if (members > 1)
+        snprintf(handshake, sizeof(handshake), "REPLICATE %s %s %d", dest_dir, member[1].ip, member[1].port);
+    else
+        snprintf(handshake, sizeof(handshake), "REPLICATE %s - 0", dest_dir);
+    char reply[64];
+    memset(reply, 0, sizeof(reply));
+    ok = sock >= 0 && sendAll(sock, handshake, strlen(handshake)) == 0 && recv(sock, reply, sizeof(reply) - 1, 0) > 0 &&
+         strncmp(reply, "REPLICATE READY", 15) == 0;
+
+    pthread_mutex_lock(&replication_lock);
+    if (chain.generation != generation || chain.state != CHAIN_CATCHING_UP)
+        ok = 0;
+    else if (!ok)
+        breakChain("catch-up failed");
+    else
+    {
+        chain.sock = sock;
+        chain.redo_until = chain.enqueued;
+        for (int i = 0; i < members; i++)
+        {
+            chain.member[i].epoch = journalEpoch();
+            chain.member[i].seq = caught_up[i];
+        }
+        chain.tail_ok = members > 1 && strstr(reply, "CHAINED") != NULL;
+        if (members > 1 && !chain.tail_ok)
+            printf("Replication to %s:%d: next replica unreachable\n", member[0].ip, member[0].port);
+        setChainState(CHAIN_STREAMING);
+        char next[48] = "";
+        if (members > 1)
+            snprintf(next, sizeof(next), " and %s:%d", member[1].ip, member[1].port);
+        printf("Replicating to %s:%d%s in %s, %zu ops queued while catching up\n", member[0].ip, member[0].port, next,
+               dest_dir, chain.queued);
+    }
+    pthread_mutex_unlock(&replication_lock);
+    if (!ok)
+    {
+        if (sock >= 0)
+            close(sock);
+        return NULL;
+    }
+
+    pthread_t ack_thread;
+    int ack_started = pthread_create(&ack_thread, NULL, chainAckReader, arg) == 0;
+    uint64_t ticket = 0;
+    pthread_mutex_lock(&replication_lock);
+    ticket = chain.base;
+    while (ack_started && chain.generation == generation && chain.state == CHAIN_STREAMING)
+    {
+        if (!chain.head)
+        {
+            pthread_cond_wait(&replication_cond, &replication_lock);
+            continue;
+        }
+        ReplicaOp *op = chain.head;
+        chain.head = op->next;
+        if (!chain.head)
+            chain.tail = NULL;
+        chain.queued--;
+        if (op->data)
+            chain.queued_bytes -= op->size;
+        uint32_t flags = ++ticket <= chain.redo_until ? REPLICA_REDO : 0;
+        pthread_mutex_unlock(&replication_lock);
+
+        int sent;
+        if (op->type == REPLICA_CONTENT)
+            sent = sendContent(sock, op, flags);
+        else
+            sent = sendRecordHeader(sock, op->type, op->permissions, flags, op->path, op->offset, op->size) == 0 &&
+                           (!op->data || sendAll(sock, op->data, op->size) == 0)
+                       ? 0
+                       : -1;
+        free(op->path);
+        free(op->data);
+        free(op);
+
+        pthread_mutex_lock(&replication_lock);
+        if (sent < 0 && chain.generation == generation)
+            breakChain("send failed");
+    }
+    if (chain.generation == generation)
+    {
+        breakChain("stopped");
+        chain.sock = -1;
+    }
+    pthread_mutex_unlock(&replication_lock);
+
+    shutdown(sock, SHUT_RDWR);
+    if (ack_started)
+        pthread_join(ack_thread, NULL);
+    close(sock);
+    return NULL;
+}
+
+// REPLICAS from the naming server. A chain already streaming to the same
+// replicas is left alone; anything else starts over with a catch-up. Returns
+// 1 if a new chain was started, 0 if the old one is kept, -1 on error.
+int configureReplication(const char *dest_dir, const char *spec)
+{
+    ReplicaMember member[2];
+    memset(member, 0, sizeof(member));
+    int members = 0;
+    int consumed = 0;
+    while (members < 2 && sscanf(spec, "%15s %d %u %llu%n", member[members].ip, &member[members].port,
+                                  &member[members].epoch, (unsigned long long *)&member[members].seq, &consumed) == 4)
+    {
+        spec += consumed;
+        members++;
+    }
+    if (members == 0)
+        return -1;
+
+    pthread_mutex_lock(&replication_lock);
+    int same = chain.state == CHAIN_STREAMING && chain.members == members && strcmp(chain.dest_dir, dest_dir) == 0 &&
+               (members == 1 || chain.tail_ok);
+    for (int i = 0; same && i < members; i++)
+        same = strcmp(chain.member[i].ip, member[i].ip) == 0 && chain.member[i].port == member[i].port;
+    if (same)
+    {
+        pthread_mutex_unlock(&replication_lock);
+        return 0;
+    }
+    breakChain("reconfigured");
+    chain.generation++;
+    chain.sock = -1;
+    snprintf(chain.dest_dir, sizeof(chain.dest_dir), "%s", dest_dir);
+    chain.members = members;
+    memcpy(chain.member, member, sizeof(member));
+    chain.base = chain.enqueued;
+    chain.redo_until = chain.enqueued;
+    chain.acked_head = chain.enqueued;
+    chain.acked_all = chain.enqueued;
+    chain.tail_ok = members > 1;
+    setChainState(CHAIN_CATCHING_UP); // Ops queue from here on, before the catch-up looks at anything
+    uintptr_t generation = chain.generation;
+    pthread_mutex_unlock(&replication_lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, chainSender, (void *)generation) != 0)
+    {
+        pthread_mutex_lock(&replication_lock);
+        breakChain("no sender thread");
+        pthread_mutex_unlock(&replication_lock);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+void formatReplicationStats(char *buffer, size_t size)
+{
+    static const char *states[] = {"off", "catching up", "streaming", "broken"};
+    static const char *modes[] = {"primary", "one", "all"};
+    char next[48] = "";
+    pthread_mutex_lock(&replication_lock);
+    if (chain.members > 1)
+        snprintf(next, sizeof(next), " -> %s:%d%s", chain.member[1].ip, chain.member[1].port, chain.tail_ok ? "" : " (lost)");
+    if (chain.members == 0)
+        snprintf(buffer, size, "Replication: off, durability %s\n", modes[durability_mode]);
+    else
+        snprintf(buffer, size, "Replication: %s to %s:%d%s, durability %s, %zu ops (%zu bytes) queued, acked %llu/%llu of %llu\n",
+                 states[chain.state], chain.member[0].ip, chain.member[0].port, next, modes[durability_mode], chain.queued, chain.queued_bytes,
+                 (unsigned long long)(chain.acked_head - chain.base), (unsigned long long)(chain.acked_all - chain.base),
+                 (unsigned long long)(chain.enqueued - chain.base));
+    pthread_mutex_unlock(&replication_lock);
+}
+
+// Where the chain to dest_dir stands, for the naming server to pick the
+// replicas that may serve reads:
+//   REPLICAS STATUS <epoch> [<ip> <client port> <seq>]...
+// lists the replicas the chain streams to, each with the last journal event
+// it has. One that applied every op queued so far has all of the journal as
+// read before looking, as in replicationCovers.
+void formatReplicationStatus(const char *dest_dir, char *buffer, size_t size)
+{
+    uint64_t last_seq = journalLastSeq();
+    pthread_mutex_lock(&replication_lock);
+    size_t used = snprintf(buffer, size, "REPLICAS STATUS %u", journalEpoch());
+    if (chain.state == CHAIN_STREAMING && strcmp(chain.dest_dir, dest_dir) == 0)
+    {
+        for (int i = 0; i < chain.members && (i == 0 || chain.tail_ok) && used < size; i++)
+        {
+            if ((i == 0 ? chain.acked_head : chain.acked_all) >= chain.enqueued && chain.member[i].seq < last_seq)
+                chain.member[i].seq = last_seq;
+            used += snprintf(buffer + used, size - used, " %s %d %llu", chain.member[i].ip, chain.member[i].port,
+                             (unsigned long long)chain.member[i].seq);
+        }
+    }
+    pthread_mutex_unlock(&replication_lock);
+}
+
+// Tell the server before us how far we and the rest of the chain got. Caller
+// holds stream->lock.
+static void sendReplicaAck(ReplicaStream *stream)
+{
+    uint64_t chain_applied = stream->applied;
+    if (stream->next_sock >= 0)
+        chain_applied = stream->next_applied < stream->applied ? stream->next_applied : stream->applied;
+    char ack[REPLICA_ACK_SIZE];
+    size_t used = 0;
+    putU64(ack, &used, stream->applied);
+    putU64(ack, &used, chain_applied);
+    putU32(ack, &used, stream->next_sock < 0 || stream->next_ok);
+    sendAll(stream->sock, ack, used);
+    stream->acked = stream->applied;
+}
+
+// Acks of the next replica, passed back up the chain
+static void *replicaAckReader(void *arg)
+{
+    ReplicaStream *stream = (ReplicaStream *)arg;
+    char ack[REPLICA_ACK_SIZE];
+    while (recvAll(stream->next_sock, ack, sizeof(ack)) == 0)
+    {
+        pthread_mutex_lock(&stream->lock);
+        stream->next_applied = getU64(ack + 8);
+        sendReplicaAck(stream);
+        pthread_mutex_unlock(&stream->lock);
+    }
+    pthread_mutex_lock(&stream->lock);
+    if (stream->next_ok)
+        printf("Next replica hung up, replicating without it\n");
+    stream->next_ok = 0;
+    sendReplicaAck(stream);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// Have something in the buffer, acking what was applied before blocking
+// for more
+static int fillReplica(ReplicaStream *stream)
+{
+    while (stream->start == stream->end)
+    {
+        pthread_mutex_lock(&stream->lock);
+        if (stream->acked != stream->applied)
+            sendReplicaAck(stream);
+        pthread_mutex_unlock(&stream->lock);
+        ssize_t n = recv(stream->sock, stream->buffer, ARCHIVE_BUFFER, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        stream->start = 0;
+        stream->end = n;
+    }
+    return 0;
+}
+
+static int readReplica(ReplicaStream *stream, char *out, size_t len)
+{
+    while (len > 0)
+    {
+        if (fillReplica(stream) < 0)
+            return -1;
+        size_t take = stream->end - stream->start;
+        if (take > len)
+            take = len;
+        memcpy(out, stream->buffer + stream->start, take);
+        out += take;
+        stream->start += take;
+        len -= take;
+    }
+    return 0;
+}
+
+// Pass bytes of the current record on to the next replica
+static void forwardReplica(ReplicaStream *stream, const char *data, size_t len, int more)
+{
+    if (stream->next_sock < 0 || !stream->next_ok)
+        return;
+    if (sendAllMore(stream->next_sock, data, len, more) == 0)
+        return;
+    pthread_mutex_lock(&stream->lock);
+    stream->next_ok = 0;
+    pthread_mutex_unlock(&stream->lock);
+    shutdown(stream->next_sock, SHUT_RDWR);
+}
+
+// Create path as type, keeping what is there already
+static int applyCreate(Node *root, const char *path, NodeType type)
+{
+    char parent[MAX_PATH_LENGTH];
+    if (snprintf(parent, sizeof(parent), "%s", path) >= (int)sizeof(parent))
+        return 0; // Cut short, it would name the wrong parent
+    char *slash = strrchr(parent, '/');
+    if (!slash || slash[1] == '\0')
+        return 0;
+    *slash = '\0';
+    const char *name = slash + 1;
+    pthread_rwlock_wrlock(&namespace_lock);
+    Node *parentDir = findNode(root, parent);
+    Node *existing = parentDir && parentDir->type == DIRECTORY_NODE && parentDir->children ? searchNode(parentDir->children, name) : NULL;
+    if (existing && existing->type != type && deleteNode(existing) == 0)
+        existing = NULL;
+    Node *created = existing ? existing : createEmptyNode(parentDir, name, type);
+    pthread_rwlock_unlock(&namespace_lock);
+    return created != NULL;
+}
+
+static int applyDelete(Node *root, const char *path)
+{
+    pthread_rwlock_wrlock(&namespace_lock);
+    Node *node = findNode(root, path);
+    int ok = !node || deleteNode(node) == 0;
+    pthread_rwlock_unlock(&namespace_lock);
+    return ok;
+}
+
+// The data of a REPLICA_WRITE or REPLICA_CONTENT into path, passing it on as
+// it comes. Returns 1 if applied, 0 if not, -1 if the stream broke.
+static int applyData(ReplicaStream *stream, Node *root, const char *path, uint32_t type, uint64_t offset, uint64_t size)
+{
+    pthread_rwlock_rdlock(&namespace_lock);
+    Node *node = findNode(root, path);
+    if (node && node->type != FILE_NODE)
+        node = NULL;
+    nodePin(node);
+    pthread_rwlock_unlock(&namespace_lock);
+    int locked = nodeLockPinned(node, 1, NODE_LOCK_TIMEOUT_MS) == 0;
+    int fd = locked ? fdCacheAcquire(node) : -1;
+    int ok = fd >= 0;
+    uint64_t have = 0; // Bytes the file has
+    struct stat st;
+    if (ok && type == REPLICA_CONTENT)
+        ok = ftruncate(fd, 0) == 0;
+    else if (ok)
+        ok = fstat(fd, &st) == 0 && (have = st.st_size) >= offset; // Anything before offset missing is a gap
+    uint64_t at = type == REPLICA_CONTENT ? 0 : offset;
+    int broken = 0;
+    while (size > 0)
+    {
+        if (fillReplica(stream) < 0)
+        {
+            broken = 1;
+            break;
+        }
+        size_t take = stream->end - stream->start;
+        if (take > size)
+            take = (size_t)size;
+        const char *chunk = stream->buffer + stream->start;
+        forwardReplica(stream, chunk, take, size > take);
+        if (ok && at + take > have)
+        {
+            size_t skip = have - at; // Already there from the catch-up
+            ssize_t n = write(fd, chunk + skip, take - skip);
+            ok = n == (ssize_t)(take - skip);
+            have = at + take;
+        }
+        at += take;
+        stream->start += take;
+        size -= take;
+    }
+    if (fd >= 0)
+        fdCacheRelease(node, fd);
+    if (locked)
+    {
+        journalRecordResize(node);
+        nodeUnlockWrite(node);
+    }
+    return broken ? -1 : ok;
+}
+
+// Serve a chain connection after "REPLICATE <dest dir> <next ip|-> <next port>",
+// applying its ops below dest_dir and passing them on to the next replica
+int applyReplicationStream(int sock, Node *root, const char *args)
+{
+    char dest_dir[MAX_PATH_LENGTH];
+    char next_ip[16];
+    int next_port = 0;
+    if (sscanf(args, "%1023s %15s %d", dest_dir, next_ip, &next_port) != 3 || !isBackupPath(dest_dir))
+    {
+        sendAll(sock, " \033[1;31mERROR 49:\033[0m \033[38;5;214mInvalid replication stream!\033[0m\n",
+                strlen(" \033[1;31mERROR 49:\033[0m \033[38;5;214mInvalid replication stream!\033[0m\n"));
+        return -1;
+    }
+
+    ReplicaStream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.sock = sock;
+    stream.next_sock = -1;
+    pthread_mutex_init(&stream.lock, NULL);
+    stream.buffer = (char *)malloc(ARCHIVE_BUFFER);
+    if (!stream.buffer)
+        return -1;
+
+    pthread_t ack_thread;
+    int ack_started = 0;
+    if (strcmp(next_ip, "-") != 0)
+    {
+        char handshake[MAX_PATH_LENGTH + 32];
+        char reply[64];
+        memset(reply, 0, sizeof(reply));
+        snprintf(handshake, sizeof(handshake), "REPLICATE %s - 0", dest_dir);
+        stream.next_sock = connectToServer(next_ip, next_port);
+        stream.next_ok = stream.next_sock >= 0 && sendAll(stream.next_sock, handshake, strlen(handshake)) == 0 &&
+                         recv(stream.next_sock, reply, sizeof(reply) - 1, 0) > 0 && strncmp(reply, "REPLICATE READY", 15) == 0;
+        ack_started = stream.next_ok && pthread_create(&ack_thread, NULL, replicaAckReader, &stream) == 0;
+        if (!ack_started)
+        {
+            printf("Next replica %s:%d unreachable, replicating without it\n", next_ip, next_port);
+            stream.next_ok = 0;
+        }
+    }
+    const char *ready = stream.next_ok ? "REPLICATE READY CHAINED" : "REPLICATE READY";
+    sendAll(sock, ready, strlen(ready));
+    printf("Replication stream into %s opened\n", dest_dir);
+
+    char header[REPLICA_HEADER_SIZE];
+    char relative[MAX_PATH_LENGTH];
+    char path[2 * MAX_PATH_LENGTH];
+    unsigned long failed = 0;
+    while (readReplica(&stream, header, REPLICA_HEADER_SIZE) == 0)
+    {
+        uint32_t type = getU32(header);
+        uint32_t path_len = getU32(header + 8);
+        uint32_t flags = getU32(header + 12);
+        uint64_t offset = getU64(header + 16);
+        uint64_t size = getU64(header + 24);
+        if (path_len >= MAX_PATH_LENGTH || readReplica(&stream, relative, path_len) < 0)
+            break;
+        relative[path_len] = '\0';
+        snprintf(path, sizeof(path), "%s%s", dest_dir, relative);
+        forwardReplica(&stream, header, sizeof(header), 1);
+        forwardReplica(&stream, relative, path_len, size > 0);
+
+        int result;
+        if (strlen(path) >= MAX_PATH_LENGTH)
+            result = 0; // No room below dest_dir on this server
+        else if (type == REPLICA_CREATE_DIRECTORY || type == REPLICA_CREATE_FILE)
+            result = applyCreate(root, path, type == REPLICA_CREATE_DIRECTORY ? DIRECTORY_NODE : FILE_NODE);
+        else if (type == REPLICA_DELETE)
+            result = applyDelete(root, path);
+        else if (type == REPLICA_WRITE || type == REPLICA_CONTENT)
+            result = applyData(&stream, root, path, type, offset, size);
+        else
+            result = -1;
+        if (result < 0)
+            break;
+        if (!result && !(flags & REPLICA_REDO))
+        {
+            printf("Replication op %u on %s failed, hanging up\n", type, path);
+            break;
+        }
+        failed += !result;
+        pthread_mutex_lock(&stream.lock);
+        stream.applied++;
+        pthread_mutex_unlock(&stream.lock);
+    }
+
+    pthread_mutex_lock(&stream.lock);
+    stream.next_ok = 0;
+    pthread_mutex_unlock(&stream.lock);
+    if (stream.next_sock >= 0)
+        shutdown(stream.next_sock, SHUT_RDWR);
+    if (ack_started)
+        pthread_join(ack_thread, NULL);
+    if (stream.next_sock >= 0)
+        close(stream.next_sock);
+    printf("Replication stream into %s closed after %llu ops (%lu skipped)\n", dest_dir,
+           (unsigned long long)stream.applied, failed);
+    free(stream.buffer);
+    pthread_mutex_destroy(&stream.lock);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // POLLRDHUP
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,8 +11,24 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <poll.h>
 
 #define MAX_BUFFER_SIZE 100001
+#define MAX_PATH_LENGTH 1024
+#define LOCATION_CACHE_BUCKETS 256
+#define LOCATION_CACHE_CAPACITY 1024 // Leased locations kept; more are not cached
+#define POOL_MAX_SERVERS 16           // Storage servers with idle connections kept
+#define POOL_IDLE_PER_SERVER 4
+#define POOL_IDLE_TIMEOUT_MS 30000 // Idle connections older than this are closed, not reused
+#define MAX_REPLICAS 3                // A storage server and its two backups
+#define HEDGE_PERCENTILE 95           // READ hedges once the first byte is later than this percentile
+#define HEDGE_SAMPLES 64              // Recent first byte latencies the percentile is taken over
+#define HEDGE_MIN_SAMPLES 8           // Below this HEDGE_INITIAL_DELAY_MS is used
+#define HEDGE_INITIAL_DELAY_MS 50
+#define HEDGE_MIN_DELAY_MS 5          // Never hedge sooner than this
+#define CLIENT_READ_TIMEOUT_MS 30000  // Longest wait for a storage server's reply to go on
 #define ACK_RECEIVE_PORT 9091 // Dedicated port for receiving ACKs
 int ack_socket;               // Declare globally to be accessed by both functions
 struct sockaddr_in ack_addr;
@@ -26,6 +43,9 @@ void displayHelp()
     printf("LIST <path> - List all files and folders in the specified directory\n");
     printf("META <path> - Get file metadata\n");
     printf("STREAM <path> - Stream file content\n");
+    printf("COPY <source> <destination> - Copy a file or folder in the background\n");
+    printf("COPYSTATUS [<job>] - Show progress of background copies\n");
+    printf("BACKUPSTATUS - Show where each storage server is backed up and how it went\n");
     printf("EXIT - Close connection and exit\n");
 
     printf("HELP - Display this help message\n\n");
@@ -40,6 +60,256 @@ struct ServerInfo
     int port;
 };
 
+// Where the path of a command can be served, in the order to try. For
+// READ/META/STREAM the naming server lists the server holding the path and
+// its replicas, least loaded first; a replica has the path under prefix.
+// Anything else only ever goes to the primary.
+typedef struct ReplicaSet
+{
+    int count;
+    int primary; // Index of the server holding the path itself, -1 once unreachable
+    struct ServerInfo server[MAX_REPLICAS];
+    char prefix[MAX_REPLICAS][32]; // "" for the primary
+} ReplicaSet;
+
+// Storage server locations the naming server leased to us, keyed by
+// canonical path. READ/WRITE/META/STREAM on a path with a live lease go
+// straight to the storage server. The naming server revokes leases through
+// the ACK socket when a location may go stale; otherwise they run out.
+typedef struct LocationEntry
+{
+    char path[MAX_PATH_LENGTH];
+    ReplicaSet replicas;
+    long long expires_ms; // CLOCK_MONOTONIC
+    struct LocationEntry *next;
+} LocationEntry;
+
+static LocationEntry *location_cache[LOCATION_CACHE_BUCKETS];
+static int location_count = 0;
+static unsigned long revocation_count = 0; // Bumped by every revocation
+static pthread_mutex_t location_lock = PTHREAD_MUTEX_INITIALIZER;
+static int leases_enabled = 0;
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Same form the naming server keys leases by: absolute, single slashes,
+// no trailing slash
+static void canonicalizePath(const char *path, char *out, size_t size)
+{
+    size_t len = 0;
+    out[len++] = '/';
+    for (const char *p = path; *p && len < size - 1; p++)
+    {
+        if (*p == '/' && out[len - 1] == '/')
+            continue;
+        out[len++] = *p;
+    }
+    if (len > 1 && out[len - 1] == '/')
+        len--;
+    out[len] = '\0';
+}
+
+static unsigned int locationBucket(const char *path)
+{
+    unsigned int hash = 2166136261u;
+    while (*path)
+        hash = (hash ^ (unsigned char)*path++) * 16777619u;
+    return hash % LOCATION_CACHE_BUCKETS;
+}
+
+// Path argument of a command, canonicalized; 0 if there is none
+static int commandPath(const char *command, char *path, size_t size)
+{
+    char raw[MAX_PATH_LENGTH];
+    if (sscanf(command, "%*s %1023s", raw) != 1)
+        return 0;
+    canonicalizePath(raw, path, size);
+    return 1;
+}
+
+static int lookupLocation(const char *path, ReplicaSet *replicas)
+{
+    long long now = monotonicMs();
+    int found = 0;
+    pthread_mutex_lock(&location_lock);
+    for (LocationEntry *entry = location_cache[locationBucket(path)]; entry; entry = entry->next)
+    {
+        if (strcmp(entry->path, path) == 0 && entry->expires_ms > now)
+        {
+            *replicas = entry->replicas;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&location_lock);
+    return found;
+}
+
+// Remove entries for which drop() holds, and expired ones
+static void dropLocations(int (*drop)(const LocationEntry *, const void *), const void *arg)
+{
+    long long now = monotonicMs();
+    for (int i = 0; i < LOCATION_CACHE_BUCKETS; i++)
+    {
+        LocationEntry **link = &location_cache[i];
+        while (*link)
+        {
+            LocationEntry *entry = *link;
+            if (entry->expires_ms > now && !drop(entry, arg))
+            {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry);
+            location_count--;
+        }
+    }
+}
+
+static int locationWithin(const LocationEntry *entry, const void *arg)
+{
+    const char *prefix = (const char *)arg;
+    size_t len = strlen(prefix);
+    if (len == 1)
+        return 1; // "/"
+    return strncmp(entry->path, prefix, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/');
+}
+
+static int noLocation(const LocationEntry *entry, const void *arg)
+{
+    return 0;
+}
+
+static int locationOnServer(const LocationEntry *entry, const void *arg)
+{
+    const struct ServerInfo *server = (const struct ServerInfo *)arg;
+    for (int i = 0; i < entry->replicas.count; i++)
+    {
+        if (entry->replicas.server[i].port == server->port && strcmp(entry->replicas.server[i].ip, server->ip) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Keep a leased location unless a revocation arrived since the request went
+// out (seen_revocations): it may have been meant for this very answer. An
+// answer naming only the primary, as for WRITE, keeps the replicas already
+// known for it.
+static void cacheLocation(const char *path, const ReplicaSet *replicas, long long expires_ms, unsigned long seen_revocations)
+{
+    pthread_mutex_lock(&location_lock);
+    if (revocation_count != seen_revocations)
+    {
+        pthread_mutex_unlock(&location_lock);
+        return;
+    }
+    LocationEntry **bucket = &location_cache[locationBucket(path)];
+    for (LocationEntry *entry = *bucket; entry; entry = entry->next)
+    {
+        if (strcmp(entry->path, path) == 0)
+        {
+            const struct ServerInfo *answered = &replicas->server[replicas->primary];
+            const struct ServerInfo *primary = entry->replicas.primary >= 0 ? &entry->replicas.server[entry->replicas.primary] : NULL;
+            if (replicas->count > 1 || !primary || primary->port != answered->port || strcmp(primary->ip, answered->ip) != 0)
+                entry->replicas = *replicas;
+            entry->expires_ms = expires_ms;
+            pthread_mutex_unlock(&location_lock);
+            return;
+        }
+    }
+    if (location_count >= LOCATION_CACHE_CAPACITY)
+    {
+        dropLocations(noLocation, NULL); // Clears out expired entries
+        if (location_count >= LOCATION_CACHE_CAPACITY)
+        {
+            pthread_mutex_unlock(&location_lock);
+            return;
+        }
+    }
+    LocationEntry *entry = (LocationEntry *)malloc(sizeof(LocationEntry));
+    if (entry)
+    {
+        strcpy(entry->path, path);
+        entry->replicas = *replicas;
+        entry->expires_ms = expires_ms;
+        entry->next = *bucket;
+        *bucket = entry;
+        location_count++;
+    }
+    pthread_mutex_unlock(&location_lock);
+}
+
+// Take server out of every replica set; sets left empty are dropped. A path
+// left without its primary is looked up again by the next command that
+// needs it, reads go on to the remaining replicas. Caller holds location_lock.
+static void dropReplica(const struct ServerInfo *server)
+{
+    for (int i = 0; i < LOCATION_CACHE_BUCKETS; i++)
+    {
+        for (LocationEntry *entry = location_cache[i]; entry; entry = entry->next)
+        {
+            ReplicaSet *replicas = &entry->replicas;
+            for (int j = 0; j < replicas->count; j++)
+            {
+                if (replicas->server[j].port != server->port || strcmp(replicas->server[j].ip, server->ip) != 0)
+                    continue;
+                memmove(&replicas->server[j], &replicas->server[j + 1], (replicas->count - j - 1) * sizeof(replicas->server[0]));
+                memmove(replicas->prefix[j], replicas->prefix[j + 1], (replicas->count - j - 1) * sizeof(replicas->prefix[0]));
+                replicas->count--;
+                if (replicas->primary == j)
+                    replicas->primary = -1;
+                else if (replicas->primary > j)
+                    replicas->primary--;
+                break;
+            }
+            if (replicas->count == 0)
+                entry->expires_ms = 0; // Dropped below
+        }
+    }
+    dropLocations(noLocation, NULL);
+}
+
+// Handle a revocation from the naming server; returns 0 if message is not one
+static int applyRevocation(const char *message)
+{
+    char path[MAX_PATH_LENGTH];
+    struct ServerInfo server;
+    pthread_mutex_lock(&location_lock);
+    int handled = 1;
+    if (sscanf(message, "REVOKE_SERVER %19s %d", server.ip, &server.port) == 2)
+        dropReplica(&server);
+    else if (sscanf(message, "REVOKE %1023s", path) == 1)
+        dropLocations(locationWithin, path);
+    else
+        handled = 0;
+    if (handled)
+        revocation_count++;
+    pthread_mutex_unlock(&location_lock);
+    return handled;
+}
+
+// A storage server we could not reach; ask the naming server again
+static void forgetServer(const struct ServerInfo *server)
+{
+    pthread_mutex_lock(&location_lock);
+    dropLocations(locationOnServer, server);
+    pthread_mutex_unlock(&location_lock);
+}
+
+// A replica we could not reach while reading; the rest of its sets still serve
+static void forgetReplica(const struct ServerInfo *server)
+{
+    pthread_mutex_lock(&location_lock);
+    dropReplica(server);
+    pthread_mutex_unlock(&location_lock);
+}
+
 int connectToServer(const char *ip, int port)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -71,6 +341,125 @@ int connectToServer(const char *ip, int port)
     return sock;
 }
 
+// Idle connections to storage servers, reused across commands: the storage
+// server serves commands on a connection until it closes. A connection goes
+// back to the pool only after an exchange that ended at a command boundary,
+// and is checked before reuse: any pending data or hang-up means it is out of
+// step or dead, and it is closed instead.
+typedef struct PooledConnection
+{
+    int sock;
+    long long idle_since_ms;
+} PooledConnection;
+
+typedef struct ServerPool
+{
+    struct ServerInfo server;
+    PooledConnection idle[POOL_IDLE_PER_SERVER]; // Most recently used last
+    int idle_count;
+} ServerPool;
+
+static ServerPool pools[POOL_MAX_SERVERS];
+static int pool_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ServerPool *findPool(const struct ServerInfo *server, int create)
+{
+    for (int i = 0; i < pool_count; i++)
+    {
+        if (pools[i].server.port == server->port && strcmp(pools[i].server.ip, server->ip) == 0)
+            return &pools[i];
+    }
+    if (!create || pool_count == POOL_MAX_SERVERS)
+        return NULL;
+    ServerPool *pool = &pools[pool_count++];
+    pool->server = *server;
+    pool->idle_count = 0;
+    return pool;
+}
+
+static int connectionHealthy(const PooledConnection *conn, long long now)
+{
+    if (now - conn->idle_since_ms > POOL_IDLE_TIMEOUT_MS)
+        return 0;
+    struct pollfd pfd;
+    pfd.fd = conn->sock;
+    pfd.events = POLLIN | POLLRDHUP;
+    pfd.revents = 0;
+    // Nothing is owed to an idle client: readable means EOF or stray bytes
+    return poll(&pfd, 1, 0) == 0;
+}
+
+// A connection to a storage server, from the pool if a healthy one is idle
+int acquireStorageConnection(const struct ServerInfo *server)
+{
+    long long now = monotonicMs();
+    pthread_mutex_lock(&pool_lock);
+    ServerPool *pool = findPool(server, 0);
+    while (pool && pool->idle_count > 0)
+    {
+        PooledConnection conn = pool->idle[--pool->idle_count];
+        if (connectionHealthy(&conn, now))
+        {
+            pthread_mutex_unlock(&pool_lock);
+            return conn.sock;
+        }
+        close(conn.sock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    int sock = connectToServer(server->ip, server->port);
+    if (sock >= 0)
+    {
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        struct timeval timeout = {CLIENT_READ_TIMEOUT_MS / 1000, (CLIENT_READ_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return sock;
+}
+
+// Hand a connection back after a command; it is kept only if reusable
+void releaseStorageConnection(const struct ServerInfo *server, int sock, int reusable)
+{
+    if (sock < 0)
+        return;
+    if (reusable)
+    {
+        pthread_mutex_lock(&pool_lock);
+        ServerPool *pool = findPool(server, 1);
+        if (pool && pool->idle_count == POOL_IDLE_PER_SERVER)
+        {
+            // Full: the oldest idle connection makes room
+            close(pool->idle[0].sock);
+            memmove(&pool->idle[0], &pool->idle[1], (POOL_IDLE_PER_SERVER - 1) * sizeof(PooledConnection));
+            pool->idle_count--;
+        }
+        if (pool)
+        {
+            pool->idle[pool->idle_count].sock = sock;
+            pool->idle[pool->idle_count].idle_since_ms = monotonicMs();
+            pool->idle_count++;
+            pthread_mutex_unlock(&pool_lock);
+            return;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    close(sock);
+}
+
+void closeStorageConnections()
+{
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < pool_count; i++)
+    {
+        while (pools[i].idle_count > 0)
+            close(pools[i].idle[--pools[i].idle_count].sock);
+    }
+    pool_count = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
 void initializeAckSocket()
 {
     // Create socket to receive acknowledgment messages
@@ -139,7 +528,8 @@ void *ackReceiver(void *arg)
         if (recv_size > 0)
         {
             buffer[recv_size] = '\0'; // Null-terminate the received message
-            printf("Received ACK: %s\n", buffer);
+            if (!applyRevocation(buffer))
+                printf("Received ACK: %s\n", buffer);
         }
         else
         {
@@ -152,48 +542,85 @@ void *ackReceiver(void *arg)
     return NULL;
 }
 
-void handleRead(int sock, const char *command)
+// The storage server answers READ with "FILE_SIZE:<n>\n" and then streams
+// exactly n bytes without waiting for acks. receiveRead takes the answer to
+// a READ already sent on sock. The size is shown with the first byte of data,
+// so a replica that fails before that has shown nothing.
+// Like the other handlers it returns 1 if the exchange ended cleanly and the
+// connection can serve another command, 0 if it must be closed.
+static int receiveRead(int sock, int last)
 {
     char buffer[MAX_BUFFER_SIZE];
     ssize_t bytes_received;
+    size_t buffered = 0;
+    char *newline = NULL;
 
-    // Send command to server
-    send(sock, command, strlen(command), 0);
-
-    // First receive file size
+    // Read up to the end of the header line; file data may follow in the same segment
     memset(buffer, 0, sizeof(buffer));
-    bytes_received = recv(sock, buffer, sizeof(buffer), 0);
-    buffer[bytes_received] = '\0';
-    send(sock, command, strlen(command), 0);
+    while (!newline && buffered < sizeof(buffer) - 1)
+    {
+        bytes_received = recv(sock, buffer + buffered, sizeof(buffer) - 1 - buffered, 0);
+        if (bytes_received <= 0)
+            break;
+        buffered += bytes_received;
+        buffer[buffered] = '\0';
+        if (buffer[0] == ' ')
+            break; // Error message, no header
+        newline = memchr(buffer, '\n', buffered);
+    }
 
-    if (strncmp(buffer, "FILE_SIZE:", 10) == 0)
+    if (newline && strncmp(buffer, "FILE_SIZE:", 10) == 0)
     {
         long fileSize;
         sscanf(buffer, "FILE_SIZE:%ld", &fileSize);
+        size_t header_len = newline - buffer + 1;
+        if (buffered == header_len && fileSize > 0)
+        {
+            bytes_received = recv(sock, buffer + buffered, sizeof(buffer) - 1 - buffered, 0);
+            if (bytes_received <= 0 && !last)
+                return -1; // Nothing shown yet, another replica may serve it
+            if (bytes_received > 0)
+                buffered += bytes_received;
+        }
         printf("Receiving file of size: %ld bytes\n", fileSize);
-        long size = 0;
-        // Receive file content
-        memset(buffer, 0, sizeof(buffer));
-        while ((bytes_received = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+
+        // Whatever arrived after the header is already file content
+        long received = buffered - header_len;
+        fwrite(buffer + header_len, 1, received, stdout);
+        while (received < fileSize)
         {
-            send(sock, command, strlen(command), 0);
-            // printf("%d\n",bytes_received);
-            // size+=bytes_received;
-            buffer[bytes_received] = '\0';
-            if (strncmp(buffer, "END_OF_FILE\n", 12) == 0)
+            size_t want = fileSize - received < (long)sizeof(buffer) ? fileSize - received : sizeof(buffer);
+            bytes_received = recv(sock, buffer, want, 0);
+            if (bytes_received <= 0)
+            {
+                printf("\n \033[1;31mERROR 56:\033[0m \033[38;5;214mConnection closed after %ld of %ld bytes!\033[0m\n", received, fileSize);
                 break;
-            printf("%s", buffer);
-            memset(buffer, 0, sizeof(buffer));
+            }
+            fwrite(buffer, 1, bytes_received, stdout);
+            received += bytes_received;
         }
+        fflush(stdout);
+        return received == fileSize;
     }
-    else
+    else if (!last)
+        return -1; // Nothing shown yet, another replica may serve it
+    else if (buffered > 0)
     {
         printf("%s", buffer + 1);
         printf("\033[0m");
     }
+    else
+        printf(" \033[1;31mERROR 504:\033[0m \033[38;5;214mNo answer from the storage server!\033[0m\n");
+    return 0; // Error replies are not framed
+}
+
+int handleRead(int sock, const char *command, int last)
+{
+    send(sock, command, strlen(command), 0);
+    return receiveRead(sock, last);
 }
 
-void handleWrite(int sock, const char *command)
+int handleWrite(int sock, const char *command)
 {
     char buffer[MAX_BUFFER_SIZE];
     char content[MAX_BUFFER_SIZE * 16]; // Larger buffer for user input
@@ -209,7 +636,7 @@ void handleWrite(int sock, const char *command)
     if (scanf("%ld", &contentSize) != 1)
     {
         printf("Error: Invalid content size\n");
-        return;
+        return 1; // Nothing sent yet
     }
 
     // Clear any newline character from stdin
@@ -231,7 +658,7 @@ void handleWrite(int sock, const char *command)
                 printf(" \033[1;31mERROR: 34\033[0m \033[38;5;214mUnable to Read input\033[0m\n\0");
                 printf("\033[0m");
 
-                return;
+                return 1;
             }
             break; // EOF reached
         }
@@ -271,7 +698,7 @@ void handleWrite(int sock, const char *command)
     if (recv_size <= 0)
     {
         printf("Error receiving server acknowledgment\n");
-        return;
+        return 0;
     }
     buffer[recv_size] = '\0';
 
@@ -281,7 +708,7 @@ void handleWrite(int sock, const char *command)
         printf("\033[0m");
         memset(buffer, 0, strlen(buffer));
         memset(content, 0, strlen(content));
-        return;
+        return 0;
     }
 
     // Send content in chunks
@@ -296,7 +723,7 @@ void handleWrite(int sock, const char *command)
         if (sent <= 0)
         {
             printf("Error sending data\n");
-            return;
+            return 0;
         }
 
         remaining -= sent;
@@ -311,29 +738,43 @@ void handleWrite(int sock, const char *command)
     if (recv_size <= 0)
     {
         printf("Error receiving server confirmation\n");
-        return;
+        return 0;
     }
     buffer[recv_size] = '\0';
     memset(content, 0, sizeof(content));
     printf("%s", buffer);
     printf("\033[0m");
+
+    // Chunk acks all come before the confirmation, so a whole confirmation
+    // leaves the connection at a command boundary
+    return (strncmp(buffer, "Successfully wrote", 18) == 0 || strncmp(buffer, "ACK: WRITE REQUEST ACCEPTED", 27) == 0) &&
+           buffer[recv_size - 1] == '\n';
 }
-void handleMeta(int sock, const char *command)
+int handleMeta(int sock, const char *command, int last)
 {
     char buffer[MAX_BUFFER_SIZE];
 
     send(sock, command, strlen(command), 0);
     memset(buffer, 0, sizeof(buffer));
-    ssize_t bytes_received = recv(sock, buffer, sizeof(buffer), 0);
+    ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    if (bytes_received <= 0)
+        return last ? 0 : -1;
     buffer[bytes_received] = '\0';
+    if (!last && strncmp(buffer, "File Metadata:", 14) != 0)
+        return -1;
     printf("%s", buffer);
     printf("\033[0m");
+    // The metadata block ends with the modification time line
+    char *modified = strstr(buffer, "Last modification:");
+    return strncmp(buffer, "File Metadata:", 14) == 0 && modified && strchr(modified, '\n') && buffer[bytes_received - 1] == '\n';
 }
 
-void handleStream(int sock, const char *command)
+// Chunks and acks are not framed, so a stream connection is never reused
+int handleStream(int sock, const char *command, int last)
 {
     char buffer[100001];
     ssize_t bytes_received;
+    int result = 0;
     int pipe_fd[2];
     pid_t ffplay_pid;
     int stop_stream = 0;
@@ -341,7 +782,7 @@ void handleStream(int sock, const char *command)
     if (pipe(pipe_fd) == -1)
     {
         perror("Pipe creation failed");
-        return;
+        return 0;
     }
 
     ffplay_pid = fork();
@@ -350,7 +791,7 @@ void handleStream(int sock, const char *command)
         perror("Fork failed");
         close(pipe_fd[0]);
         close(pipe_fd[1]);
-        return;
+        return 0;
     }
 
     if (ffplay_pid == 0)
@@ -368,8 +809,8 @@ void handleStream(int sock, const char *command)
     send(sock, command, strlen(command), 0);
 
     memset(buffer, 0, sizeof(buffer));
-    bytes_received = recv(sock, buffer, sizeof(buffer), 0);
-    buffer[bytes_received] = '\0';
+    bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    buffer[bytes_received > 0 ? bytes_received : 0] = '\0';
 
     if (strcmp(buffer, "START_STREAM\n") == 0)
     {
@@ -397,6 +838,8 @@ void handleStream(int sock, const char *command)
 
         printf("Stream complete.\n");
     }
+    else if (!last)
+        result = -1; // Nothing played yet, another replica may serve it
     else
     {
         printf("%s", buffer + 1);
@@ -408,11 +851,15 @@ void handleStream(int sock, const char *command)
     kill(ffplay_pid, SIGTERM);
     int status;
     waitpid(ffplay_pid, &status, 0);
+    return result;
 }
 
-struct ServerInfo connect_naming_server(int sock, char *command)
+// Ask the naming server where the path of command is. Returns -1 if it does
+// not know the path.
+int connect_naming_server(int sock, char *command, ReplicaSet *replicas, int *lease_ms)
 {
-    struct ServerInfo server = {"", 0}; // Initialize with empty IP and port 0
+    memset(replicas, 0, sizeof(*replicas));
+    *lease_ms = 0;
 
     send(sock, command, strlen(command), 0);
     char buffer[100001];
@@ -420,17 +867,262 @@ struct ServerInfo connect_naming_server(int sock, char *command)
     recv(sock, buffer, sizeof(buffer), 0);
 
     // Check if path not found
-    if (buffer[0] == ' ')
+    struct ServerInfo primary = {"", 0};
+    if (buffer[0] == ' ' || sscanf(buffer, "StorageServer: %19s : %d", primary.ip, &primary.port) != 2)
     {
         printf("%s", buffer + 1);
         printf("\033[0m");
         fflush(stdout);
-        return server; // Return with null port (0)
+        return -1;
+    }
+    char *lease = strstr(buffer, " LEASE ");
+    if (lease)
+        sscanf(lease, " LEASE %d", lease_ms);
+
+    // REPLICAS <count> <ip> <port> <prefix>..., "-" for no prefix
+    int listed = 0;
+    int consumed = 0;
+    char *list = strstr(buffer, " REPLICAS ");
+    if (list && sscanf(list, " REPLICAS %d%n", &listed, &consumed) == 1)
+    {
+        list += consumed;
+        for (int i = 0; i < listed && replicas->count < MAX_REPLICAS; i++)
+        {
+            int n = replicas->count;
+            if (sscanf(list, " %19s %d %31s%n", replicas->server[n].ip, &replicas->server[n].port, replicas->prefix[n], &consumed) != 3)
+                break;
+            list += consumed;
+            if (strcmp(replicas->prefix[n], "-") == 0)
+            {
+                replicas->prefix[n][0] = '\0';
+                replicas->primary = n;
+            }
+            replicas->count++;
+        }
+    }
+    if (replicas->count == 0 || replicas->prefix[replicas->primary][0] != '\0')
+    {
+        replicas->count = 1;
+        replicas->primary = 0;
+        replicas->server[0] = primary;
+        replicas->prefix[0][0] = '\0';
+    }
+    printf("%d %s", primary.port, primary.ip);
+    return 0;
+}
+
+// The replica set of the path of command: from a live lease if use_lease
+// allows, else from the naming server, leased for next time. *leased tells
+// which. Returns -1 if the naming server does not know the path.
+static int locateReplicas(int naming_sock, char *command, int use_lease, ReplicaSet *replicas, int *leased)
+{
+    char path[MAX_PATH_LENGTH];
+    int have_path = leases_enabled && commandPath(command, path, sizeof(path));
+    *leased = use_lease && have_path && lookupLocation(path, replicas);
+    if (*leased)
+        return 0;
+
+    pthread_mutex_lock(&location_lock);
+    unsigned long seen_revocations = revocation_count;
+    pthread_mutex_unlock(&location_lock);
+    long long asked_ms = monotonicMs(); // The lease started no earlier than this
+    int lease_ms;
+    if (connect_naming_server(naming_sock, command, replicas, &lease_ms) < 0)
+        return -1;
+    if (have_path && lease_ms > 0)
+        cacheLocation(path, replicas, asked_ms + lease_ms, seen_revocations);
+    return 0;
+}
+
+// Connect to the storage server holding the path of command, stored in
+// *server. A live lease saves the naming server round trip; if the leased
+// server cannot be reached its locations are dropped and the naming server
+// is asked after all. Release the connection with releaseStorageConnection.
+int connectStorageServer(int naming_sock, char *command, struct ServerInfo *server_out)
+{
+    ReplicaSet replicas;
+    int leased;
+    if (locateReplicas(naming_sock, command, 1, &replicas, &leased) < 0)
+        return -1;
+    if (replicas.primary < 0 && locateReplicas(naming_sock, command, 0, &replicas, &leased) < 0)
+        return -1;
+    struct ServerInfo server = replicas.server[replicas.primary];
+    int sock = acquireStorageConnection(&server);
+    if (sock < 0 && leased)
+    {
+        forgetServer(&server);
+        if (locateReplicas(naming_sock, command, 0, &replicas, &leased) < 0)
+            return -1;
+        server = replicas.server[replicas.primary];
+        sock = acquireStorageConnection(&server);
     }
+    *server_out = server;
+    return sock;
+}
+
+// Hedged reads: a READ whose first byte is later than most recent ones is
+// sent to the next replica as well, and whichever answers first is read.
+// The delay is the hedge_percentile of the last HEDGE_SAMPLES first byte
+// latencies, so only the slow tail is hedged and the extra load stays near
+// 100 - hedge_percentile percent. 0 turns hedging off.
+static int hedge_percentile = HEDGE_PERCENTILE;
+static int hedge_samples[HEDGE_SAMPLES];
+static int hedge_sample_count = 0;
+static int hedge_sample_next = 0;
+
+static void recordFirstByte(long long latency_ms)
+{
+    hedge_samples[hedge_sample_next] = latency_ms;
+    hedge_sample_next = (hedge_sample_next + 1) % HEDGE_SAMPLES;
+    if (hedge_sample_count < HEDGE_SAMPLES)
+        hedge_sample_count++;
+}
 
-    sscanf(buffer, "StorageServer: %s : %d", server.ip, &server.port);
-    printf("%d %s", server.port, server.ip);
-    return server;
+static int compareInts(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static int hedgeDelayMs()
+{
+    if (hedge_sample_count < HEDGE_MIN_SAMPLES)
+        return HEDGE_INITIAL_DELAY_MS;
+    int sorted[HEDGE_SAMPLES];
+    memcpy(sorted, hedge_samples, hedge_sample_count * sizeof(int));
+    qsort(sorted, hedge_sample_count, sizeof(int), compareInts);
+    int delay = sorted[(hedge_sample_count - 1) * hedge_percentile / 100];
+    return delay < HEDGE_MIN_DELAY_MS ? HEDGE_MIN_DELAY_MS : delay;
+}
+
+// The command for replicas->server[i]: a replica has the path under its prefix
+static void replicaCommand(const ReplicaSet *replicas, int i, const char *verb, const char *path, const char *command, char *out, size_t size)
+{
+    if (replicas->prefix[i][0])
+        snprintf(out, size, "%s %s%s", verb, replicas->prefix[i], path);
+    else
+        snprintf(out, size, "%s", command);
+}
+
+// READ on replicas->server[first] over sock, hedged with the next reachable
+// member if the first byte is late. A hedge that loses is closed, its answer
+// is still on the way. One that wins but fails before its first byte of data
+// leaves the other to be read after all; once data is shown the read ends
+// with the winner, as the other copy would repeat it. If neither answers in
+// CLIENT_READ_TIMEOUT_MS both are given up. *tried is the last member used,
+// for the caller to go on after. Returns like handleRead, and releases both
+// connections.
+static int hedgedRead(ReplicaSet *replicas, int first, int sock, const char *verb, const char *path, const char *command, int *tried)
+{
+    char replica_command[MAX_PATH_LENGTH + 64];
+    replicaCommand(replicas, first, verb, path, command, replica_command, sizeof(replica_command));
+    long long sent_ms[2] = {monotonicMs(), 0};
+    send(sock, replica_command, strlen(replica_command), 0);
+
+    struct pollfd fds[2] = {{sock, POLLIN, 0}, {-1, POLLIN, 0}};
+    int member[2] = {first, -1};
+    *tried = first;
+    if (poll(fds, 1, hedgeDelayMs()) == 0)
+    {
+        int k;
+        for (k = first + 1; k < replicas->count && member[1] < 0; k++)
+        {
+            int hedge_sock = acquireStorageConnection(&replicas->server[k]);
+            if (hedge_sock < 0)
+            {
+                forgetReplica(&replicas->server[k]);
+                continue;
+            }
+            replicaCommand(replicas, k, verb, path, command, replica_command, sizeof(replica_command));
+            sent_ms[1] = monotonicMs();
+            send(hedge_sock, replica_command, strlen(replica_command), 0);
+            fds[1].fd = hedge_sock;
+            member[1] = k;
+        }
+        *tried = k - 1; // The hedge, or the last unreachable one
+        if (poll(fds, member[1] < 0 ? 1 : 2, CLIENT_READ_TIMEOUT_MS) == 0)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if (member[i] >= 0)
+                    releaseStorageConnection(&replicas->server[member[i]], fds[i].fd, 0);
+            }
+            return -1;
+        }
+    }
+
+    int winner = (member[1] >= 0 && fds[1].revents && !fds[0].revents) ? 1 : 0;
+    int other = 1 - winner;
+    int last = *tried == replicas->count - 1;
+    recordFirstByte(monotonicMs() - sent_ms[winner]);
+    int result = receiveRead(fds[winner].fd, last && member[other] < 0);
+    releaseStorageConnection(&replicas->server[member[winner]], fds[winner].fd, result > 0);
+    if (member[other] < 0)
+        return result;
+    int other_result = 0;
+    if (result < 0)
+        result = other_result = receiveRead(fds[other].fd, last);
+    releaseStorageConnection(&replicas->server[member[other]], fds[other].fd, other_result > 0);
+    return result;
+}
+
+// Run a READ, META or STREAM on the replicas of its path in turn until one
+// serves it. One that cannot be reached, or answers with an error while
+// others are left, is passed over without asking the naming server; only a
+// leased set none of which could serve it is asked for again. The handler
+// gets the command with the path as it is on that server and whether it is
+// the last one to try; it returns -1 to move on to the next.
+void runOnReplicas(int naming_sock, char *command, int (*handle)(int, const char *, int))
+{
+    ReplicaSet replicas;
+    int leased;
+    if (locateReplicas(naming_sock, command, 1, &replicas, &leased) < 0)
+        return;
+    char verb[16];
+    char path[MAX_PATH_LENGTH];
+    if (sscanf(command, "%15s", verb) != 1 || !commandPath(command, path, sizeof(path)))
+        return;
+
+    int answered = 0;
+    for (int round = 0; round < 2 && !answered; round++)
+    {
+        for (int i = 0; i < replicas.count && !answered; i++)
+        {
+            int sock = acquireStorageConnection(&replicas.server[i]);
+            if (sock < 0)
+            {
+                forgetReplica(&replicas.server[i]);
+                continue;
+            }
+            if (handle == handleRead && hedge_percentile > 0 && i < replicas.count - 1)
+            {
+                answered = hedgedRead(&replicas, i, sock, verb, path, command, &i) >= 0;
+                continue;
+            }
+            char replica_command[MAX_PATH_LENGTH + 64];
+            replicaCommand(&replicas, i, verb, path, command, replica_command, sizeof(replica_command));
+            int result = handle(sock, replica_command, i == replicas.count - 1);
+            releaseStorageConnection(&replicas.server[i], sock, result > 0);
+            answered = result >= 0;
+        }
+        if (answered || !leased || locateReplicas(naming_sock, command, 0, &replicas, &leased) < 0)
+            break;
+    }
+    if (!answered)
+        printf(" \033[1;31mERROR 503:\033[0m \033[38;5;214mNo replica could serve the request!\033[0m\n");
+}
+
+// Tell the naming server where to send lease revocations. Leases stay off if
+// it does not know the command.
+void registerForLeases(int naming_sock)
+{
+    char request[32];
+    char response[256];
+    snprintf(request, sizeof(request), "LEASES %d", ack_port);
+    send(naming_sock, request, strlen(request), 0);
+    memset(response, 0, sizeof(response));
+    int lease_ms = 0;
+    if (recv(naming_sock, response, sizeof(response) - 1, 0) > 0 && sscanf(response, "LEASES %d", &lease_ms) == 1)
+        leases_enabled = lease_ms > 0;
 }
 int main(int argc, char *argv[])
 {
@@ -463,6 +1155,11 @@ int main(int argc, char *argv[])
         perror("Failed to create thread for ACK reception");
         return -1;
     }
+    registerForLeases(naming_sock);
+    if (getenv("CLIENT_HEDGE_PERCENTILE"))
+        hedge_percentile = atoi(getenv("CLIENT_HEDGE_PERCENTILE"));
+    if (hedge_percentile < 0 || hedge_percentile > 100)
+        hedge_percentile = HEDGE_PERCENTILE;
 
     char command[MAX_BUFFER_SIZE];
 
@@ -492,63 +1189,26 @@ int main(int argc, char *argv[])
 
         if (strncmp(command, "READ ", 5) == 0)
         {
-            struct ServerInfo storage_server = connect_naming_server(naming_sock, command);
-            if (storage_server.port == 0)
-            {
-                continue;
-            }
-            int storage_sock = connectToServer(storage_server.ip, storage_server.port);
-            if (storage_sock < 0)
-            {
-                continue;
-            }
-            handleRead(storage_sock, command);
-            close(storage_sock);
+            runOnReplicas(naming_sock, command, handleRead);
         }
         else if (strncmp(command, "WRITE ", 6) == 0)
         {
-            struct ServerInfo storage_server = connect_naming_server(naming_sock, command);
-            if (storage_server.port == 0)
-            {
-                continue;
-            }
-            int storage_sock = connectToServer(storage_server.ip, storage_server.port);
+            struct ServerInfo storage_server;
+            int storage_sock = connectStorageServer(naming_sock, command, &storage_server);
             if (storage_sock < 0)
             {
                 continue;
             }
-            handleWrite(storage_sock, command);
-            close(storage_sock);
+            int reusable = handleWrite(storage_sock, command);
+            releaseStorageConnection(&storage_server, storage_sock, reusable);
         }
         else if (strncmp(command, "META ", 5) == 0)
         {
-            struct ServerInfo storage_server = connect_naming_server(naming_sock, command);
-            if (storage_server.port == 0)
-            {
-                continue;
-            }
-            int storage_sock = connectToServer(storage_server.ip, storage_server.port);
-            if (storage_sock < 0)
-            {
-                continue;
-            }
-            handleMeta(storage_sock, command);
-            close(storage_sock);
+            runOnReplicas(naming_sock, command, handleMeta);
         }
         else if (strncmp(command, "STREAM ", 7) == 0)
         {
-            struct ServerInfo storage_server = connect_naming_server(naming_sock, command);
-            if (storage_server.port == 0)
-            {
-                continue;
-            }
-            int storage_sock = connectToServer(storage_server.ip, storage_server.port);
-            if (storage_sock < 0)
-            {
-                continue;
-            }
-            handleStream(storage_sock, command);
-            close(storage_sock);
+            runOnReplicas(naming_sock, command, handleStream);
         }
         else if (strncmp(command, "CREATE ", 7) == 0)
         {
@@ -613,6 +1273,7 @@ int main(int argc, char *argv[])
         }
     }
 
+    closeStorageConnections();
     close(naming_sock);
     printf("Connection closed.\n");
     return 0;
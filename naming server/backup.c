@@ -0,0 +1,290 @@
+#include "header.h"
+
+// Replicas of a storage server live in /backup_<id> on two other servers.
+// The source sends them with
+//   BACKUP <dest dir> <peer ip> <peer client port> <epoch> <seq>
+// where epoch and seq are the checkpoint of the last backup to that replica:
+// the source's journal epoch and the last journal event the replica has. If
+// the source still has every event since, it sends only the paths they
+// touched; a new replica, a restarted source or one whose journal rolled past
+// the checkpoint gets a full copy. Either way the reply is
+//   BACKUP DONE <FULL|INCREMENTAL> <epoch> <seq>
+// with the checkpoint for next time. Checkpoints are kept by server id, which
+// survives a server registering again. Between backups the source's chain
+// moves them up: after every namespace sync it is asked how far each replica
+// got, and a replica it streams to is linked, see replicaIsCurrent.
+
+typedef struct BackupCheckpoint
+{
+    int source_id;
+    int dest_id;
+    uint32_t epoch; // Journal epoch of the source seq belongs to
+    uint64_t seq;   // Last journal event of the source the replica has
+    bool linked;    // The source's chain streams to the replica
+    struct BackupCheckpoint *next;
+} BackupCheckpoint;
+
+static BackupCheckpoint *backup_checkpoints = NULL;
+static pthread_mutex_t backup_checkpoints_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Caller holds backup_checkpoints_lock
+static BackupCheckpoint *findCheckpoint(int source_id, int dest_id)
+{
+    for (BackupCheckpoint *checkpoint = backup_checkpoints; checkpoint; checkpoint = checkpoint->next)
+    {
+        if (checkpoint->source_id == source_id && checkpoint->dest_id == dest_id)
+            return checkpoint;
+    }
+    return NULL;
+}
+
+static void saveCheckpoint(int source_id, int dest_id, uint32_t epoch, uint64_t seq)
+{
+    pthread_mutex_lock(&backup_checkpoints_lock);
+    BackupCheckpoint *checkpoint = findCheckpoint(source_id, dest_id);
+    if (!checkpoint)
+    {
+        checkpoint = (BackupCheckpoint *)calloc(1, sizeof(BackupCheckpoint));
+        if (!checkpoint)
+        {
+            pthread_mutex_unlock(&backup_checkpoints_lock);
+            return;
+        }
+        checkpoint->source_id = source_id;
+        checkpoint->dest_id = dest_id;
+        checkpoint->next = backup_checkpoints;
+        backup_checkpoints = checkpoint;
+    }
+    checkpoint->epoch = epoch;
+    checkpoint->seq = seq;
+    pthread_mutex_unlock(&backup_checkpoints_lock);
+}
+
+// A restarting chain streams to nobody until its next status says otherwise
+static void unlinkReplicas(int source_id)
+{
+    pthread_mutex_lock(&backup_checkpoints_lock);
+    for (BackupCheckpoint *checkpoint = backup_checkpoints; checkpoint; checkpoint = checkpoint->next)
+    {
+        if (checkpoint->source_id == source_id)
+            checkpoint->linked = false;
+    }
+    pthread_mutex_unlock(&backup_checkpoints_lock);
+}
+
+// Whether the replica on dest_id is streamed to and has every event of the
+// source up to seq in epoch, that is everything our copy of its tree shows
+bool replicaIsCurrent(int source_id, int dest_id, uint32_t epoch, uint64_t seq)
+{
+    pthread_mutex_lock(&backup_checkpoints_lock);
+    BackupCheckpoint *checkpoint = findCheckpoint(source_id, dest_id);
+    bool current = checkpoint && checkpoint->linked && checkpoint->epoch == epoch && checkpoint->seq >= seq;
+    pthread_mutex_unlock(&backup_checkpoints_lock);
+    return current;
+}
+
+// Have server bring its replica on destination up to date. Epoch 0 asks for
+// a full copy. Returns 1 and stores the new checkpoint on success; either way
+// result says what happened.
+static int sendBackup(StorageServer *server, StorageServer *destination, const char *dest_dir, uint32_t epoch, uint64_t seq, char *result, size_t size)
+{
+    char command[MAX_PATH_LENGTH + 128];
+    char reply[MAX_BUFFER_SIZE];
+    snprintf(command, sizeof(command), "BACKUP %s %s %d %u %llu", dest_dir, destination->ip, destination->client_port,
+             epoch, (unsigned long long)seq);
+    log_message(server->ip, server->nm_port, "Sent to SS:", command);
+    if (ssCommand(server, command, reply, sizeof(reply), 0) < 0)
+    {
+        snprintf(result, size, "server %d did not respond", server->id);
+        return 0;
+    }
+    log_message(server->ip, server->nm_port, "Received from SS:", reply);
+
+    char mode[16];
+    unsigned int new_epoch;
+    unsigned long long new_seq;
+    if (sscanf(reply, "BACKUP DONE %15s %u %llu", mode, &new_epoch, &new_seq) != 3)
+    {
+        reply[strcspn(reply, "\n")] = '\0';
+        snprintf(result, size, "to server %d failed: %s", destination->id, reply);
+        printf("Backup of server %d %s\n", server->id, result);
+        return 0;
+    }
+    saveCheckpoint(server->id, destination->id, new_epoch, new_seq);
+    snprintf(result, size, "%s to server %d up to seq %llu", mode, destination->id, new_seq);
+    printf("Backup of server %d: %s\n", server->id, result);
+    return 1;
+}
+
+// Run by the backup scheduler with no locks held. The destination's tree
+// picks up the backup through its namespace sync, which is run right away.
+// Returns 1 on success; result says what happened either way.
+int take_backup(StorageServerTable *server_table, StorageServer *server, StorageServer *destination, char *result, size_t size)
+{
+    (void)server_table;
+    char dest_dir[64];
+    snprintf(dest_dir, sizeof(dest_dir), "/backup_%d", server->id);
+
+    uint32_t epoch = 0;
+    uint64_t seq = 0;
+    pthread_mutex_lock(&backup_checkpoints_lock);
+    BackupCheckpoint *checkpoint = findCheckpoint(server->id, destination->id);
+    if (checkpoint)
+    {
+        epoch = checkpoint->epoch;
+        seq = checkpoint->seq;
+    }
+    pthread_mutex_unlock(&backup_checkpoints_lock);
+
+    // A replica that lost its backup directory has nothing to build on
+    pthread_mutex_lock(&destination->lock);
+    if (!findNode(destination->root, dest_dir))
+        epoch = 0;
+    pthread_mutex_unlock(&destination->lock);
+
+    int ok = sendBackup(server, destination, dest_dir, epoch, seq, result, size);
+    if (!ok && epoch != 0)
+        ok = sendBackup(server, destination, dest_dir, 0, 0, result, size); // Start over
+    if (ok && syncStorageServer(destination) < 0)
+        log_message_level(LOG_LEVEL_WARN, destination->ip, destination->nm_port, "SS", "Namespace sync after backup failed");
+    return ok;
+}
+
+// Point server's replication chain at its replicas, in slot order, each with
+// the checkpoint its catch-up starts from, see replication.c on the storage
+// server. Replicas without a backup yet join once they have one.
+void configureReplication(StorageServer *server)
+{
+    char ip[2][16];
+    int port[2], id[2];
+    int members = 0;
+    pthread_mutex_lock(&server->lock);
+    StorageServer *replicas[2] = {server->ss_backup_1, server->ss_backup_2};
+    for (int i = 0; i < 2; i++)
+    {
+        if (!replicas[i])
+            continue;
+        snprintf(ip[members], sizeof(ip[members]), "%s", replicas[i]->ip);
+        port[members] = replicas[i]->client_port;
+        id[members] = replicas[i]->id;
+        members++;
+    }
+    int server_id = server->id;
+    pthread_mutex_unlock(&server->lock);
+
+    char command[MAX_PATH_LENGTH + 256];
+    size_t used = snprintf(command, sizeof(command), "REPLICAS /backup_%d", server_id);
+    int listed = 0;
+    pthread_mutex_lock(&backup_checkpoints_lock);
+    for (int i = 0; i < members; i++)
+    {
+        BackupCheckpoint *checkpoint = findCheckpoint(server_id, id[i]);
+        if (!checkpoint)
+            continue;
+        used += snprintf(command + used, sizeof(command) - used, " %s %d %u %llu", ip[i], port[i], checkpoint->epoch,
+                         (unsigned long long)checkpoint->seq);
+        listed++;
+    }
+    pthread_mutex_unlock(&backup_checkpoints_lock);
+    if (listed == 0)
+        return;
+
+    char reply[MAX_BUFFER_SIZE];
+    log_message(server->ip, server->nm_port, "Sent to SS:", command);
+    if (ssCommand(server, command, reply, sizeof(reply), 0) < 0)
+    {
+        log_message_level(LOG_LEVEL_WARN, server->ip, server->nm_port, "SS", "Replication setup failed");
+        return;
+    }
+    log_message(server->ip, server->nm_port, "Received from SS:", reply);
+    if (strncmp(reply, "REPLICAS STARTED", 16) == 0)
+        unlinkReplicas(server_id);
+}
+
+// Ask server how far its chain got, see formatReplicationStatus on the
+// storage server. Run by the namespace syncer right after a sync, so a
+// replica that keeps up reaches the seq the sync brought in.
+void refreshReplicationStatus(StorageServer *server)
+{
+    char ip[2][16];
+    int port[2], id[2];
+    int members = 0;
+    pthread_mutex_lock(&server->lock);
+    StorageServer *replicas[2] = {server->ss_backup_1, server->ss_backup_2};
+    for (int i = 0; i < 2; i++)
+    {
+        if (!replicas[i])
+            continue;
+        snprintf(ip[members], sizeof(ip[members]), "%s", replicas[i]->ip);
+        port[members] = replicas[i]->client_port;
+        id[members] = replicas[i]->id;
+        members++;
+    }
+    int server_id = server->id;
+    pthread_mutex_unlock(&server->lock);
+    if (members == 0)
+        return;
+
+    char command[64];
+    char reply[MAX_BUFFER_SIZE];
+    snprintf(command, sizeof(command), "REPLICAS /backup_%d", server_id);
+    unsigned int epoch;
+    int consumed = 0;
+    if (ssCommand(server, command, reply, sizeof(reply), SS_REQUEST_TIMEOUT_MS) < 0 ||
+        sscanf(reply, "REPLICAS STATUS %u%n", &epoch, &consumed) != 1)
+    {
+        unlinkReplicas(server_id);
+        return;
+    }
+
+    unlinkReplicas(server_id);
+    const char *status = reply + consumed;
+    char member_ip[16];
+    int member_port;
+    unsigned long long seq;
+    while (sscanf(status, "%15s %d %llu%n", member_ip, &member_port, &seq, &consumed) == 3)
+    {
+        status += consumed;
+        for (int i = 0; i < members; i++)
+        {
+            if (strcmp(ip[i], member_ip) != 0 || port[i] != member_port)
+                continue;
+            pthread_mutex_lock(&backup_checkpoints_lock);
+            BackupCheckpoint *checkpoint = findCheckpoint(server_id, id[i]);
+            if (checkpoint)
+            {
+                if (checkpoint->epoch != epoch || checkpoint->seq < seq)
+                {
+                    checkpoint->epoch = epoch;
+                    checkpoint->seq = seq;
+                }
+                checkpoint->linked = true;
+            }
+            pthread_mutex_unlock(&backup_checkpoints_lock);
+        }
+    }
+}
+
+// The entry of a lost server is being taken over by a new run, whose disk may
+// no longer hold what the old one did; nobody keeps it as a replica. Their
+// backups are reassigned, and as the server keeps its id, only brought up to
+// date.
+void forgetBackupServer(StorageServerTable *table, StorageServer *gone)
+{
+    for (int i = 0; i < TABLE_SIZE; i++)
+    {
+        pthread_mutex_lock(&table->locks[i]);
+        for (StorageServer *server = table->table[i]; server; server = server->next)
+        {
+            if (server == gone)
+                continue;
+            pthread_mutex_lock(&server->lock);
+            if (server->ss_backup_1 == gone)
+                server->ss_backup_1 = NULL;
+            if (server->ss_backup_2 == gone)
+                server->ss_backup_2 = NULL;
+            pthread_mutex_unlock(&server->lock);
+        }
+        pthread_mutex_unlock(&table->locks[i]);
+    }
+}
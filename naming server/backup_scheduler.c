@@ -0,0 +1,385 @@
+#include "header.h"
+
+// Replica placement and backups run on one thread of their own, so a storage
+// server registering is never held up by backups. Registrations and
+// disconnects only ask for a placement pass: every active server missing a
+// replica gets a job for the nearest active server before it in id order that
+// is not already its other replica. Every backup_refresh_ms each replica in
+// place gets a job too, which after the first full copy only sends what the
+// source's journal says changed (see backup.c). After each backup the source
+// is told its replicas and streams its changes to them as they happen, so a
+// refresh of a replica that chain keeps up sends nothing; one that finds the
+// chain broken catches it up and starts it again. Jobs run one at a time, and a
+// server is not backed up again within BACKUP_MIN_INTERVAL_MS of its last
+// backup. BACKUPSTATUS shows the queue and how each server's backups went.
+
+int backup_refresh_ms = BACKUP_REFRESH_MS;
+
+typedef struct BackupJob
+{
+    int source_id;
+    int slot; // 1 for ss_backup_1, 2 for ss_backup_2
+    int dest_id;
+    struct BackupJob *next;
+} BackupJob;
+
+// How the backups of one storage server went
+typedef struct BackupHistory
+{
+    int source_id;
+    long long next_allowed_ms; // No backup of the server starts before
+    unsigned long done;
+    unsigned long failed;
+    double last_seconds;
+    long long last_ms; // When the last backup finished, 0 if none has
+    char last_result[160];
+    struct BackupHistory *next;
+} BackupHistory;
+
+// A server as placement saw it
+typedef struct ServerSnapshot
+{
+    int id;
+    bool active;
+    int backup_ids[2]; // 0 for none
+} ServerSnapshot;
+
+static StorageServerTable *backup_table = NULL;
+static BackupJob *backup_queue = NULL;     // Oldest first
+static BackupJob *running_backup = NULL;
+static long long running_since_ms = 0;
+static BackupHistory *backup_history = NULL;
+static bool placement_requested = false;
+static long long next_refresh_ms = 0;
+static pthread_mutex_t backup_scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backup_scheduler_wake;
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Caller holds backup_scheduler_lock
+static BackupHistory *historyOf(int source_id)
+{
+    BackupHistory *history = backup_history;
+    while (history && history->source_id != source_id)
+        history = history->next;
+    if (!history && (history = (BackupHistory *)calloc(1, sizeof(BackupHistory))) != NULL)
+    {
+        history->source_id = source_id;
+        history->next = backup_history;
+        backup_history = history;
+    }
+    return history;
+}
+
+// Caller holds backup_scheduler_lock
+static bool jobPending(int source_id, int slot)
+{
+    if (running_backup && running_backup->source_id == source_id && running_backup->slot == slot)
+        return true;
+    for (BackupJob *job = backup_queue; job; job = job->next)
+    {
+        if (job->source_id == source_id && job->slot == slot)
+            return true;
+    }
+    return false;
+}
+
+// Destination a pending job of source_id's other slot is about to fill, or
+// 0. Caller holds backup_scheduler_lock.
+static int pendingDestination(int source_id, int slot)
+{
+    if (running_backup && running_backup->source_id == source_id && running_backup->slot != slot)
+        return running_backup->dest_id;
+    for (BackupJob *job = backup_queue; job; job = job->next)
+    {
+        if (job->source_id == source_id && job->slot != slot)
+            return job->dest_id;
+    }
+    return 0;
+}
+
+// Caller holds backup_scheduler_lock
+static void queueJob(int source_id, int slot, int dest_id)
+{
+    BackupJob *job = (BackupJob *)calloc(1, sizeof(BackupJob));
+    if (!job)
+        return;
+    job->source_id = source_id;
+    job->slot = slot;
+    job->dest_id = dest_id;
+    BackupJob **link = &backup_queue;
+    while (*link)
+        link = &(*link)->next;
+    *link = job;
+}
+
+static StorageServer *findServerById(int id)
+{
+    for (int i = 0; i < TABLE_SIZE; i++)
+    {
+        pthread_mutex_lock(&backup_table->locks[i]);
+        for (StorageServer *server = backup_table->table[i]; server; server = server->next)
+        {
+            if (server->id == id)
+            {
+                pthread_mutex_unlock(&backup_table->locks[i]);
+                return server;
+            }
+        }
+        pthread_mutex_unlock(&backup_table->locks[i]);
+    }
+    return NULL;
+}
+
+// Every server's id, state and replicas, each read under its own lock only
+static int snapshotServers(ServerSnapshot **snapshot)
+{
+    int count = 0, capacity = 16;
+    ServerSnapshot *servers = (ServerSnapshot *)malloc(capacity * sizeof(ServerSnapshot));
+    for (int i = 0; servers && i < TABLE_SIZE; i++)
+    {
+        pthread_mutex_lock(&backup_table->locks[i]);
+        for (StorageServer *server = backup_table->table[i]; server; server = server->next)
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                servers = (ServerSnapshot *)realloc(servers, capacity * sizeof(ServerSnapshot));
+            }
+            pthread_mutex_lock(&server->lock);
+            servers[count].id = server->id;
+            servers[count].active = server->active;
+            servers[count].backup_ids[0] = server->ss_backup_1 ? server->ss_backup_1->id : 0;
+            servers[count].backup_ids[1] = server->ss_backup_2 ? server->ss_backup_2->id : 0;
+            pthread_mutex_unlock(&server->lock);
+            count++;
+        }
+        pthread_mutex_unlock(&backup_table->locks[i]);
+    }
+    *snapshot = servers;
+    return count;
+}
+
+static const ServerSnapshot *snapshotById(const ServerSnapshot *servers, int count, int id)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (servers[i].id == id)
+            return &servers[i];
+    }
+    return NULL;
+}
+
+// Queue a job for every replica that is missing or gone, and with refresh
+// for every replica in place as well
+static void placeReplicas(bool refresh)
+{
+    ServerSnapshot *servers;
+    int count = snapshotServers(&servers);
+    if (!servers)
+        return;
+    int max_id = 0;
+    for (int i = 0; i < count; i++)
+        max_id = servers[i].id > max_id ? servers[i].id : max_id;
+
+    pthread_mutex_lock(&backup_scheduler_lock);
+    for (int i = 0; count >= 3 && i < count; i++)
+    {
+        const ServerSnapshot *source = &servers[i];
+        if (!source->active)
+            continue;
+        for (int slot = 1; slot <= 2; slot++)
+        {
+            if (jobPending(source->id, slot))
+                continue;
+            const ServerSnapshot *replica = snapshotById(servers, count, source->backup_ids[slot - 1]);
+            if (replica && replica->active)
+            {
+                if (refresh)
+                    queueJob(source->id, slot, replica->id);
+                continue;
+            }
+            int other = source->backup_ids[2 - slot];
+            int pending = pendingDestination(source->id, slot);
+            for (int offset = 1; offset < max_id; offset++)
+            {
+                int id = (source->id - 1 - offset + max_id) % max_id + 1;
+                const ServerSnapshot *candidate = snapshotById(servers, count, id);
+                if (candidate && candidate->active && id != other && id != pending)
+                {
+                    queueJob(source->id, slot, id);
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&backup_scheduler_lock);
+    free(servers);
+}
+
+static void runBackupJob(BackupJob *job)
+{
+    char result[sizeof(((BackupHistory *)0)->last_result)];
+    long long started = monotonicMs();
+    StorageServer *source = findServerById(job->source_id);
+    StorageServer *destination = findServerById(job->dest_id);
+    int ok = 0;
+    if (!source || !destination || !storageServerConnected(source) || !storageServerConnected(destination))
+        snprintf(result, sizeof(result), "server %d or %d is not connected", job->source_id, job->dest_id);
+    else if ((ok = take_backup(backup_table, source, destination, result, sizeof(result))) != 0)
+    {
+        pthread_mutex_lock(&source->lock);
+        if (job->slot == 1)
+            source->ss_backup_1 = destination;
+        else
+            source->ss_backup_2 = destination;
+        pthread_mutex_unlock(&source->lock);
+        configureReplication(source);
+    }
+    long long finished = monotonicMs();
+
+    pthread_mutex_lock(&backup_scheduler_lock);
+    BackupHistory *history = historyOf(job->source_id);
+    if (history)
+    {
+        history->next_allowed_ms = finished + BACKUP_MIN_INTERVAL_MS;
+        history->last_ms = finished;
+        history->last_seconds = (finished - started) / 1000.0;
+        if (ok)
+            history->done++;
+        else
+            history->failed++;
+        snprintf(history->last_result, sizeof(history->last_result), "%s", result);
+    }
+    pthread_mutex_unlock(&backup_scheduler_lock);
+    if (!ok)
+        log_message_level(LOG_LEVEL_WARN, source ? source->ip : NULL, source ? source->nm_port : 0, "SS", result);
+}
+
+static void *backupScheduler(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&backup_scheduler_lock);
+    next_refresh_ms = monotonicMs() + backup_refresh_ms;
+    while (1)
+    {
+        long long now = monotonicMs();
+        bool refresh = backup_refresh_ms > 0 && now >= next_refresh_ms;
+        if (placement_requested || refresh)
+        {
+            placement_requested = false;
+            if (refresh)
+                next_refresh_ms = now + backup_refresh_ms;
+            pthread_mutex_unlock(&backup_scheduler_lock);
+            placeReplicas(refresh);
+            pthread_mutex_lock(&backup_scheduler_lock);
+            continue;
+        }
+
+        // The oldest job whose server may be backed up again by now
+        long long wake_ms = backup_refresh_ms > 0 ? next_refresh_ms : now + 60000;
+        BackupJob **link = &backup_queue;
+        while (*link)
+        {
+            BackupHistory *history = historyOf((*link)->source_id);
+            long long allowed = history ? history->next_allowed_ms : 0;
+            if (allowed <= now)
+                break;
+            wake_ms = allowed < wake_ms ? allowed : wake_ms;
+            link = &(*link)->next;
+        }
+        if (*link)
+        {
+            running_backup = *link;
+            *link = running_backup->next;
+            running_since_ms = now;
+            pthread_mutex_unlock(&backup_scheduler_lock);
+            runBackupJob(running_backup);
+            pthread_mutex_lock(&backup_scheduler_lock);
+            free(running_backup);
+            running_backup = NULL;
+            continue;
+        }
+
+        struct timespec deadline;
+        deadline.tv_sec = wake_ms / 1000;
+        deadline.tv_nsec = (wake_ms % 1000) * 1000000;
+        pthread_cond_timedwait(&backup_scheduler_wake, &backup_scheduler_lock, &deadline);
+    }
+    return NULL;
+}
+
+void startBackupScheduler(StorageServerTable *table)
+{
+    backup_table = table;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&backup_scheduler_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, backupScheduler, NULL) != 0)
+    {
+        perror("Failed to create backup scheduler thread");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Failed to create backup scheduler thread");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Have replicas placed for servers that lack them, without waiting for it
+void scheduleBackups()
+{
+    pthread_mutex_lock(&backup_scheduler_lock);
+    placement_requested = true;
+    pthread_cond_signal(&backup_scheduler_wake);
+    pthread_mutex_unlock(&backup_scheduler_lock);
+}
+
+// BACKUPSTATUS: the job running and those queued, then each server's
+// replicas and how its last backup went
+void formatBackupStatus(char *buffer, size_t size)
+{
+    ServerSnapshot *servers;
+    int count = snapshotServers(&servers);
+    long long now = monotonicMs();
+    size_t offset = 0;
+    buffer[0] = '\0';
+    pthread_mutex_lock(&backup_scheduler_lock);
+    int queued = 0;
+    for (BackupJob *job = backup_queue; job; job = job->next)
+        queued++;
+    if (running_backup)
+        offset += snprintf(buffer + offset, size - offset, "Backing up server %d to server %d (replica %d) for %.1fs, %d queued\n",
+                           running_backup->source_id, running_backup->dest_id, running_backup->slot,
+                           (now - running_since_ms) / 1000.0, queued);
+    else
+        offset += snprintf(buffer + offset, size - offset, "No backup running, %d queued\n", queued);
+    for (BackupJob *job = backup_queue; job && offset < size; job = job->next)
+        offset += snprintf(buffer + offset, size - offset, "Queued: server %d to server %d (replica %d)\n",
+                           job->source_id, job->dest_id, job->slot);
+    for (int i = 0; servers && i < count && offset < size; i++)
+    {
+        offset += snprintf(buffer + offset, size - offset, "Server %d%s: replicas %d, %d", servers[i].id,
+                           servers[i].active ? "" : " (inactive)", servers[i].backup_ids[0], servers[i].backup_ids[1]);
+        BackupHistory *history = backup_history;
+        while (history && history->source_id != servers[i].id)
+            history = history->next;
+        if (offset < size && history && history->last_ms)
+            offset += snprintf(buffer + offset, size - offset, "; %lu done, %lu failed; last %.1fs ago, took %.2fs: %s",
+                               history->done, history->failed, (now - history->last_ms) / 1000.0,
+                               history->last_seconds, history->last_result);
+        if (offset < size)
+            offset += snprintf(buffer + offset, size - offset, "\n");
+    }
+    pthread_mutex_unlock(&backup_scheduler_lock);
+    free(servers);
+    if (offset >= size)
+        buffer[size - 1] = '\0';
+}
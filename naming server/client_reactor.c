@@ -0,0 +1,237 @@
+#include "header.h"
+
+// Connections waiting for a worker
+typedef struct ReadyQueue
+{
+    ClientConnection *head;
+    ClientConnection *tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+} ReadyQueue;
+
+// Readable connections, and ones whose request waits on a storage server.
+// Those go to their own workers, so a slow storage server holds up neither
+// lookups nor the requests of other clients.
+static ReadyQueue readyQueue = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static ReadyQueue storageQueue = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static int epoll_fd = -1;
+
+typedef struct WorkerArgs
+{
+    StorageServerTable *table;
+} WorkerArgs;
+
+static int setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void pushReady(ReadyQueue *queue, ClientConnection *conn)
+{
+    pthread_mutex_lock(&queue->mutex);
+    conn->next = NULL;
+    if (queue->tail)
+        queue->tail->next = conn;
+    else
+        queue->head = conn;
+    queue->tail = conn;
+    pthread_cond_signal(&queue->condition);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static ClientConnection *popReady(ReadyQueue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (!queue->head)
+    {
+        pthread_cond_wait(&queue->condition, &queue->mutex);
+    }
+    ClientConnection *conn = queue->head;
+    queue->head = conn->next;
+    if (!queue->head)
+        queue->tail = NULL;
+    pthread_mutex_unlock(&queue->mutex);
+    return conn;
+}
+
+static void closeConnection(ClientConnection *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    close(conn->socket);
+    leaseDropHolder(lease_table, conn->ip, conn->lease_port);
+    free(conn->request);
+    free(conn);
+}
+
+// Connections are registered with EPOLLONESHOT, so a connection is handed to
+// exactly one worker at a time and must be re-armed once its request is served.
+static int armConnection(ClientConnection *conn, int op)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    return epoll_ctl(epoll_fd, op, conn->socket, &ev);
+}
+
+// Done with a request: listen for the next one, or close on -1
+static void finishRequest(ClientConnection *conn, int result)
+{
+    if (result < 0)
+    {
+        printf("Client %s:%d disconnected\n", conn->ip, conn->port);
+        closeConnection(conn);
+        return;
+    }
+    if (armConnection(conn, EPOLL_CTL_MOD) < 0)
+    {
+        perror("epoll_ctl re-arm failed");
+        closeConnection(conn);
+    }
+}
+
+static void *clientWorker(void *arg)
+{
+    WorkerArgs *args = (WorkerArgs *)arg;
+    while (1)
+    {
+        ClientConnection *conn = popReady(&readyQueue);
+        int result = handleClientRequest(conn, args->table);
+        if (result > 0)
+            pushReady(&storageQueue, conn); // Stays unarmed until a storage worker is done
+        else
+            finishRequest(conn, result);
+    }
+    return NULL;
+}
+
+static void *storageWorker(void *arg)
+{
+    WorkerArgs *args = (WorkerArgs *)arg;
+    while (1)
+    {
+        ClientConnection *conn = popReady(&storageQueue);
+        int result = serveClientRequest(conn, args->table, conn->request);
+        free(conn->request);
+        conn->request = NULL;
+        finishRequest(conn, result);
+    }
+    return NULL;
+}
+
+static void acceptClients(int listen_fd)
+{
+    while (1)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_sock = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+        if (client_sock < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Client accept failed");
+            return;
+        }
+
+        ClientConnection *conn = malloc(sizeof(ClientConnection));
+        if (!conn)
+        {
+            close(client_sock);
+            continue;
+        }
+        conn->socket = client_sock;
+        conn->lease_port = 0;
+        conn->request = NULL;
+        conn->next = NULL;
+        get_ip_and_port(&client_addr, conn->ip, &conn->port);
+
+        if (armConnection(conn, EPOLL_CTL_ADD) < 0)
+        {
+            perror("epoll_ctl add failed");
+            close(client_sock);
+            free(conn);
+            continue;
+        }
+        log_message(conn->ip, conn->port, "Client", "New client connected");
+    }
+}
+
+// Event loop for client sessions: idle connections cost only an epoll
+// registration, and requests are dispatched to NM_WORKER_THREADS workers,
+// the ones waiting on a storage server on to NM_STORAGE_WORKER_THREADS more.
+void runClientReactor(int listen_fd, StorageServerTable *table)
+{
+    if (setNonBlocking(listen_fd) < 0)
+    {
+        perror("Failed to make naming socket non-blocking");
+        exit(EXIT_FAILURE);
+    }
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+    {
+        perror("epoll_ctl listen socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    WorkerArgs *args = malloc(sizeof(WorkerArgs));
+    args->table = table;
+    for (int i = 0; i < NM_WORKER_THREADS; i++)
+    {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, clientWorker, args) != 0)
+        {
+            perror("Failed to create client worker thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(worker);
+    }
+    for (int i = 0; i < NM_STORAGE_WORKER_THREADS; i++)
+    {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, storageWorker, args) != 0)
+        {
+            perror("Failed to create storage worker thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(worker);
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                acceptClients(listen_fd);
+                continue;
+            }
+            // Hang-ups are handed to a worker too; its recv sees the EOF and closes
+            pushReady(&readyQueue, (ClientConnection *)events[i].data.ptr);
+        }
+    }
+}
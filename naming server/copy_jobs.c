@@ -0,0 +1,259 @@
+#include "header.h"
+
+// COPY runs as a job so a client is not held for the length of the transfer.
+// The command is checked up front and answered with "COPY STARTED <id>"; a
+// detached thread then has the source storage server push the data, which
+// reports
+//   PROGRESS <entries done> <entries> <bytes done> <bytes>
+// on the way, followed by bytes done/total of each connection when the copy
+// is spread over several. The outcome, "COPY <id> DONE: ..." or
+// "COPY <id> FAILED: ...", goes to the client's ACK port if it registered one
+// with LEASES, and COPYSTATUS [<id>] shows running and recently finished jobs
+// either way.
+
+#define COPY_JOB_RUNNING 0
+#define COPY_JOB_DONE 1
+#define COPY_JOB_FAILED 2
+
+typedef struct CopyJob
+{
+    uint32_t id;
+    int state; // COPY_JOB_RUNNING, COPY_JOB_DONE or COPY_JOB_FAILED
+    char source[MAX_PATH_LENGTH];
+    char dest_dir[MAX_PATH_LENGTH];
+    StorageServer *source_server;
+    StorageServer *dest_server;
+    char client_ip[INET_ADDRSTRLEN];
+    int client_port; // ACK port the outcome is pushed to, 0 for none
+    unsigned long entries_done;
+    unsigned long entries_total;
+    unsigned long long bytes_done;
+    unsigned long long bytes_total;
+    char streams[256]; // Per-stream bytes from the last report, "" for one stream
+    struct timespec started;
+    struct timespec finished;
+    char result[256];
+    struct CopyJob *next;
+} CopyJob;
+
+static CopyJob *copy_jobs = NULL; // Newest first
+static uint32_t next_copy_job_id = 1;
+static pthread_mutex_t copy_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double secondsBetween(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Called on the source server's reader thread for every PROGRESS frame
+static void copyJobProgress(void *arg, const char *payload, size_t len)
+{
+    (void)len;
+    CopyJob *job = (CopyJob *)arg;
+    unsigned long entries_done, entries_total;
+    unsigned long long bytes_done, bytes_total;
+    int used = 0;
+    if (sscanf(payload, "PROGRESS %lu %lu %llu %llu%n", &entries_done, &entries_total, &bytes_done, &bytes_total, &used) != 4)
+        return;
+    while (payload[used] == ' ')
+        used++;
+    pthread_mutex_lock(&copy_jobs_lock);
+    job->entries_done = entries_done;
+    job->entries_total = entries_total;
+    job->bytes_done = bytes_done;
+    job->bytes_total = bytes_total;
+    snprintf(job->streams, sizeof(job->streams), "%s", payload + used);
+    pthread_mutex_unlock(&copy_jobs_lock);
+}
+
+// Add what was copied to the destination's tree right away instead of waiting
+// for its next namespace sync. Both trees are locked, in address order, so a
+// sync replacing either cannot free nodes under us.
+static int mirrorCopy(CopyJob *job, char *result, size_t size)
+{
+    StorageServer *first = job->source_server;
+    StorageServer *second = job->dest_server;
+    if (first > second)
+    {
+        first = job->dest_server;
+        second = job->source_server;
+    }
+    pthread_mutex_lock(&first->lock);
+    if (second != first)
+        pthread_mutex_lock(&second->lock);
+
+    int ok = 0;
+    Node *source_node = findNode(job->source_server->root, job->source);
+    Node *destParentNode = findNode(job->dest_server->root, job->dest_dir);
+    if (!source_node)
+        snprintf(result, size, " \033[1;31mERROR 404:\033[0m \033[38;5;214mSource Path not found!\033[0m");
+    else if (!destParentNode || destParentNode->type != DIRECTORY_NODE)
+        snprintf(result, size, " \033[1;31mERROR 400:\033[0m \033[38;5;214mDestination Path is not a directory!\033[0m");
+    else if (source_node->type == DIRECTORY_NODE)
+    {
+        addDirectory(destParentNode, source_node->name, source_node->permissions);
+        Node *newRootDir = searchNode(destParentNode->children, source_node->name);
+        // Copy the contents of the source directory to the destination directory
+        copyDirectoryContents(source_node, newRootDir);
+        indexCopiedNode(job->dest_server, newRootDir, job->dest_dir);
+        snprintf(result, size, "Directory copied successfully");
+        ok = 1;
+    }
+    else
+    {
+        addFile(destParentNode, source_node->name, source_node->permissions);
+        indexCopiedNode(job->dest_server, searchNode(destParentNode->children, source_node->name), job->dest_dir);
+        snprintf(result, size, "File copied successfully");
+        ok = 1;
+    }
+
+    if (second != first)
+        pthread_mutex_unlock(&second->lock);
+    pthread_mutex_unlock(&first->lock);
+    leaseDeliverRevocations(job->dest_server);
+    return ok;
+}
+
+// Caller holds copy_jobs_lock. Forget finished jobs past the newest
+// COPY_JOBS_KEPT; running ones stay however many there are.
+static void pruneCopyJobs()
+{
+    int finished = 0;
+    CopyJob **link = &copy_jobs;
+    while (*link)
+    {
+        CopyJob *job = *link;
+        if (job->state != COPY_JOB_RUNNING && ++finished > COPY_JOBS_KEPT)
+        {
+            *link = job->next;
+            free(job);
+            continue;
+        }
+        link = &job->next;
+    }
+}
+
+static void *runCopyJob(void *arg)
+{
+    CopyJob *job = (CopyJob *)arg;
+
+    // The source server pushes the data to the destination's client port;
+    // nothing is locked while it does
+    char command[3 * MAX_PATH_LENGTH];
+    snprintf(command, sizeof(command), "COPY %s %s %s %d PROGRESS", job->source, job->dest_dir,
+             job->dest_server->ip, job->dest_server->client_port);
+    log_message(job->source_server->ip, job->source_server->nm_port, "Sent to SS:", command);
+    char *reply = NULL;
+    ssize_t len = ssRequestProgress(job->source_server, command, &reply, 0, copyJobProgress, job);
+
+    char result[sizeof(job->result)];
+    int ok = 0;
+    if (len < 0)
+        snprintf(result, sizeof(result), " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server did not respond.\033[0m");
+    else
+    {
+        log_message(job->source_server->ip, job->source_server->nm_port, "Received from SS:", reply);
+        if (strncmp(reply, "COPY DONE", 9) == 0)
+            ok = mirrorCopy(job, result, sizeof(result));
+        else
+            snprintf(result, sizeof(result), "%s", reply);
+    }
+    free(reply);
+    result[strcspn(result, "\n")] = '\0';
+
+    char message[sizeof(result) + 64];
+    snprintf(message, sizeof(message), "COPY %u %s: %s", job->id, ok ? "DONE" : "FAILED", result);
+    char client_ip[INET_ADDRSTRLEN];
+    strcpy(client_ip, job->client_ip);
+    int client_port = job->client_port;
+
+    pthread_mutex_lock(&copy_jobs_lock);
+    job->state = ok ? COPY_JOB_DONE : COPY_JOB_FAILED;
+    strcpy(job->result, result);
+    if (ok)
+    {
+        job->entries_done = job->entries_total;
+        job->bytes_done = job->bytes_total;
+    }
+    job->streams[0] = '\0'; // Only of interest while running
+    clock_gettime(CLOCK_MONOTONIC, &job->finished);
+    pruneCopyJobs(); // May free job
+    pthread_mutex_unlock(&copy_jobs_lock);
+
+    printf("%s\n", message);
+    if (client_port > 0)
+        forwardAckToClient(client_ip, client_port, message);
+    else
+        log_message(client_ip, 0, "Client - COPY finished:", message);
+    return NULL;
+}
+
+// Start copying source into dest_dir. The outcome is pushed to
+// client_ip:client_port unless the port is 0. Returns the job id, or 0 if the
+// job could not be started.
+uint32_t startCopyJob(StorageServer *source_server, const char *source, StorageServer *dest_server, const char *dest_dir, const char *client_ip, int client_port)
+{
+    CopyJob *job = (CopyJob *)calloc(1, sizeof(CopyJob));
+    if (!job)
+        return 0;
+    job->state = COPY_JOB_RUNNING;
+    snprintf(job->source, sizeof(job->source), "%s", source);
+    snprintf(job->dest_dir, sizeof(job->dest_dir), "%s", dest_dir);
+    job->source_server = source_server;
+    job->dest_server = dest_server;
+    snprintf(job->client_ip, sizeof(job->client_ip), "%s", client_ip);
+    job->client_port = client_port;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+    pthread_mutex_lock(&copy_jobs_lock);
+    job->id = next_copy_job_id++;
+    job->next = copy_jobs;
+    copy_jobs = job;
+    uint32_t id = job->id;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runCopyJob, job) != 0)
+    {
+        perror("Failed to create copy job thread");
+        copy_jobs = job->next;
+        free(job);
+        id = 0;
+    }
+    else
+        pthread_detach(thread);
+    pthread_mutex_unlock(&copy_jobs_lock);
+    return id;
+}
+
+// COPYSTATUS: one line per job, newest first, or only job id unless it is 0.
+// Returns the number of jobs listed.
+int formatCopyJobs(uint32_t id, char *buffer, size_t size)
+{
+    static const char *state_names[] = {"RUNNING", "DONE", "FAILED"};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size_t offset = 0;
+    int listed = 0;
+    buffer[0] = '\0';
+
+    pthread_mutex_lock(&copy_jobs_lock);
+    for (CopyJob *job = copy_jobs; job && offset < size; job = job->next)
+    {
+        if (id && job->id != id)
+            continue;
+        double seconds = secondsBetween(&job->started, job->state == COPY_JOB_RUNNING ? &now : &job->finished);
+        int n = snprintf(buffer + offset, size - offset,
+                         "Job %u %s %s -> %s: %lu/%lu entries, %llu/%llu bytes, %.1fs%s%s%s%s%s\n",
+                         job->id, state_names[job->state], job->source, job->dest_dir,
+                         job->entries_done, job->entries_total, job->bytes_done, job->bytes_total, seconds,
+                         job->streams[0] ? " (streams " : "", job->streams, job->streams[0] ? ")" : "",
+                         job->state == COPY_JOB_RUNNING ? "" : ", ", job->result);
+        if (n < 0)
+            break;
+        offset += (size_t)n;
+        listed++;
+    }
+    pthread_mutex_unlock(&copy_jobs_lock);
+    if (offset >= size)
+        buffer[size - 1] = '\0';
+    return listed;
+}
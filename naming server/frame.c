@@ -0,0 +1,106 @@
+#include "header.h"
+
+// Framing for the naming server <-> storage server connection. Every message
+// after registration is
+//   u32 request_id | u32 length | payload
+// in network byte order. FRAME_MORE set in length means more frames of the
+// same reply follow; the request is answered by the first frame without it.
+// Payloads longer than FRAME_CHUNK_SIZE go out as several frames, so a big
+// reply never keeps other replies off the connection for long.
+
+static int sendFully(int sock, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int recvFully(int sock, void *data, size_t len)
+{
+    char *out = (char *)data;
+    while (len > 0)
+    {
+        ssize_t n = recv(sock, out, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send payload as the reply (or request) request_id; with more set the
+// receiver keeps waiting for further frames. The caller makes sure only one
+// thread sends on sock at a time.
+int sendFrame(int sock, uint32_t request_id, const char *payload, size_t len, int more)
+{
+    do
+    {
+        size_t chunk = len < FRAME_CHUNK_SIZE ? len : FRAME_CHUNK_SIZE;
+        int last = chunk == len;
+        uint32_t header[2];
+        header[0] = htonl(request_id);
+        header[1] = htonl((uint32_t)chunk | (last && !more ? 0 : FRAME_MORE));
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = (void *)payload;
+        iov[1].iov_len = chunk;
+        if (sendFully(sock, iov, chunk ? 2 : 1) < 0)
+            return -1;
+        payload += chunk;
+        len -= chunk;
+    } while (len > 0);
+    return 0;
+}
+
+// Receive one frame. The payload is malloc'd and NUL terminated, so text
+// commands and replies can be used as strings; the caller frees it.
+int recvFrame(int sock, uint32_t *request_id, char **payload, size_t *len, int *more)
+{
+    uint32_t header[2];
+    if (recvFully(sock, header, sizeof(header)) < 0)
+        return -1;
+    uint32_t length = ntohl(header[1]);
+    size_t size = length & ~FRAME_MORE;
+    if (size > FRAME_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "Frame of %zu bytes, the stream is out of step\n", size);
+        return -1;
+    }
+    char *data = (char *)malloc(size + 1);
+    if (!data || recvFully(sock, data, size) < 0)
+    {
+        free(data);
+        return -1;
+    }
+    data[size] = '\0';
+    *request_id = ntohl(header[0]);
+    *payload = data;
+    *len = size;
+    *more = (length & FRAME_MORE) != 0;
+    return 0;
+}
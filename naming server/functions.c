@@ -1,160 +1,315 @@
 #include "header.h"
 
-Node *receiveNodeChain(int sock)
+// Reads the node tree that sendNodeTree streams from a storage server:
+// a TREE_STREAM_MAGIC header, the journal sequence the tree is current to and
+// one length-prefixed record per node in pre-order, with no acks in between. Data is pulled in TREE_STREAM_BUFFER
+// sized recv calls, or read straight from a SYNC reply that is already in memory.
+typedef struct TreeReader
 {
-    Node *head = NULL;
-    Node *current = NULL;
-
-    	struct sockaddr_in addr;
-    	socklen_t addr_len = sizeof(addr);
-    
-	// Now, let's log the action (get client's IP and port)
-    	if (getpeername(sock, (struct sockaddr *)&addr, &addr_len) == -1) {
-        perror("getpeername failed");
-        return NULL;
-    	}
-
-    	// Extract the client IP address and port
-    	char t_ip[INET_ADDRSTRLEN];
-    	int t_port;
-    	get_ip_and_port(&addr, t_ip, &t_port);
-
-    while (1)
+    int sock;           // -1 when reading a reply in memory
+    const char *window; // buffer, or the reply
+    char buffer[TREE_STREAM_BUFFER];
+    size_t start;
+    size_t end;
+    size_t total_bytes;
+    int node_count;
+    int keep;    // Copy what is read into kept
+    char *kept;
+    size_t kept_len;
+    size_t kept_cap;
+} TreeReader;
+
+static int keepTreeBytes(TreeReader *reader, const char *data, size_t len)
+{
+    if (reader->kept_len + len > reader->kept_cap)
     {
-        // Check for end of chain
-        int marker;
-        if (recv(sock, &marker, sizeof(int), 0) <= 0)
-            return NULL;
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Received Marker");
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
-
-        if (marker == -1)
-            break; // End of chain
-
-        // Receive node data
-        int name_len;
-        if (recv(sock, &name_len, sizeof(int), 0) <= 0)
-            return NULL;
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Received name_len");
-
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
-
+        size_t cap = reader->kept_cap ? reader->kept_cap : TREE_STREAM_BUFFER;
+        while (cap < reader->kept_len + len)
+            cap *= 2;
+        char *grown = (char *)realloc(reader->kept, cap);
+        if (!grown)
+            return -1;
+        reader->kept = grown;
+        reader->kept_cap = cap;
+    }
+    memcpy(reader->kept + reader->kept_len, data, len);
+    reader->kept_len += len;
+    return 0;
+}
 
-        char *name = malloc(name_len);
-        if (recv(sock, name, name_len, 0) <= 0)
+static int getTreeBytes(TreeReader *reader, void *data, size_t len)
+{
+    char *out = (char *)data;
+    while (len > 0)
+    {
+        if (reader->start == reader->end)
         {
-            free(name);
-            return NULL;
+            if (reader->sock < 0)
+                return -1;
+            ssize_t n = recv(reader->sock, reader->buffer, sizeof(reader->buffer), 0);
+            if (n <= 0)
+                return -1;
+            reader->window = reader->buffer;
+            reader->start = 0;
+            reader->end = n;
+            reader->total_bytes += n;
         }
-        log_message(t_ip, t_port, "Receiving Node Chain- Received Name::", name);
-
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
-
-
-        NodeType type;
-        Permissions permissions;
-        if (recv(sock, &type, sizeof(NodeType), 0) <= 0)
-        {
-            free(name);
-            return NULL;
-        }
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Received NodeType");
-
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
-
+        size_t available = reader->end - reader->start;
+        size_t chunk = len < available ? len : available;
+        memcpy(out, reader->window + reader->start, chunk);
+        if (reader->keep && keepTreeBytes(reader, out, chunk) < 0)
+            return -1;
+        reader->start += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
 
-        if (recv(sock, &permissions, sizeof(Permissions), 0) <= 0)
-        {
-            free(name);
-            return NULL;
-        }
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Received Permissions");
+static int getTreeU32(TreeReader *reader, uint32_t *value)
+{
+    uint32_t net;
+    if (getTreeBytes(reader, &net, sizeof(net)) < 0)
+        return -1;
+    *value = ntohl(net);
+    return 0;
+}
 
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
+static Node *readTreeNode(TreeReader *reader)
+{
+    uint32_t record_len, name_len, loc_len, child_count;
+    uint8_t type, permissions;
+    if (getTreeU32(reader, &record_len) < 0 ||
+        getTreeBytes(reader, &type, 1) < 0 ||
+        getTreeBytes(reader, &permissions, 1) < 0 ||
+        getTreeU32(reader, &name_len) < 0 ||
+        getTreeU32(reader, &loc_len) < 0 ||
+        getTreeU32(reader, &child_count) < 0)
+        return NULL;
+    if (name_len == 0 || name_len >= MAX_PATH_LENGTH || loc_len >= MAX_PATH_LENGTH ||
+        record_len != 2 + 3 * sizeof(uint32_t) + name_len + loc_len ||
+        (type != FILE_NODE && type != DIRECTORY_NODE))
+    {
+        fprintf(stderr, "Malformed node record in tree stream\n");
+        return NULL;
+    }
 
+    char name[MAX_PATH_LENGTH];
+    char location[MAX_PATH_LENGTH]; // Root only; nodes derive theirs from the tree
+    if (getTreeBytes(reader, name, name_len) < 0 ||
+        getTreeBytes(reader, location, loc_len) < 0)
+        return NULL;
+    name[name_len] = '\0';
 
-        int loc_len;
-        if (recv(sock, &loc_len, sizeof(int), 0) <= 0)
+    Node *node = createNode(name, (NodeType)type, (Permissions)permissions);
+    reader->node_count++;
+    for (uint32_t i = 0; i < child_count; i++)
+    {
+        Node *child = readTreeNode(reader);
+        if (child == NULL || node->children == NULL)
         {
-            free(name);
+            if (child)
+                freeNode(child);
+            freeNode(node);
             return NULL;
         }
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Received loc_len");
+        child->parent = node;
+        insertNode(node->children, child);
+    }
+    return node;
+}
 
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
+static int getTreeU64(TreeReader *reader, uint64_t *value)
+{
+    uint32_t high, low;
+    if (getTreeU32(reader, &high) < 0 || getTreeU32(reader, &low) < 0)
+        return -1;
+    *value = ((uint64_t)high << 32) | low;
+    return 0;
+}
 
+// Applies an EVENT_STREAM_MAGIC batch (see journal.c on the storage server)
+// to server's tree. Events the naming server already knows about, such as the
+// ones from its own CREATE/DELETE/COPY requests, are skipped by
+// applyNamespaceEvent, so replaying a batch is harmless. Without a server the
+// batch is only checked.
+static int readEventStream(TreeReader *reader, StorageServer *server)
+{
+    uint32_t count;
+    uint64_t last_seq;
+    if (getTreeU32(reader, &count) < 0 || getTreeU64(reader, &last_seq) < 0)
+        return -1;
 
-        char *dataLocation = malloc(loc_len);
-        if (recv(sock, dataLocation, loc_len, 0) <= 0)
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t record_len, path_len;
+        uint64_t seq, size;
+        uint8_t op, type, permissions;
+        char path[MAX_PATH_LENGTH];
+        if (getTreeU32(reader, &record_len) < 0 ||
+            getTreeU64(reader, &seq) < 0 ||
+            getTreeBytes(reader, &op, 1) < 0 ||
+            getTreeBytes(reader, &type, 1) < 0 ||
+            getTreeBytes(reader, &permissions, 1) < 0 ||
+            getTreeU64(reader, &size) < 0 ||
+            getTreeU32(reader, &path_len) < 0)
+            return -1;
+        if (path_len == 0 || path_len >= MAX_PATH_LENGTH || record_len != 8 + 3 + 8 + 4 + path_len)
         {
-            free(name);
-            free(dataLocation);
-            return NULL;
+            fprintf(stderr, "Malformed namespace event\n");
+            return -1;
         }
-        log_message(t_ip, t_port, "Receiving Node Chain- Received dataLoaction:", dataLocation);
-        
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
+        if (getTreeBytes(reader, path, path_len) < 0)
+            return -1;
+        path[path_len] = '\0';
 
+        if (server && seq > server->applied_seq)
+            applyNamespaceEvent(server, (JournalOp)op, (NodeType)type, (Permissions)permissions, (int64_t)size, path);
+        reader->node_count++;
+    }
+    if (server)
+        server->applied_seq = last_seq;
+    return 0;
+}
 
-        // Create new node
-        Node *newNode = createNode(name, type, permissions, dataLocation);
-        free(name);
-        free(dataLocation);
+// What came of reading a namespace stream; the counts are only for debugging
+static void logNamespaceReceived(const TreeReader *reader, int result, uint64_t seq, const char *t_ip, int t_port)
+{
+    char log_buf[256];
+    if (result == 0)
+        snprintf(log_buf, sizeof(log_buf), "Received node tree: %d nodes, %zu bytes (seq %llu), RSS %ld KB",
+                 reader->node_count, reader->total_bytes, (unsigned long long)seq, residentMemoryKB());
+    else if (result == 1)
+        snprintf(log_buf, sizeof(log_buf), "Applied %d namespace events, %zu bytes (seq %llu)", reader->node_count,
+                 reader->total_bytes, (unsigned long long)seq);
+    else
+    {
+        snprintf(log_buf, sizeof(log_buf), "Failed to receive namespace after %d records", reader->node_count);
+        printf("%s\n", log_buf);
+    }
+    log_message_level(result < 0 ? LOG_LEVEL_ERROR : LOG_LEVEL_DEBUG, t_ip, t_port, "SS", log_buf);
+}
 
-        // Check if node has children
-        int has_children;
-        if (recv(sock, &has_children, sizeof(int), 0) <= 0)
+// Reads what a storage server sends to bring our view of it up to date:
+// either its whole tree (stored in *root_out, returns 0) or the journal events
+// since server->applied_seq (applied to server->root, returns 1). Returns -1
+// on a broken stream. The caller holds server->lock if the server is live.
+static int readNamespace(TreeReader *reader, StorageServer *server, Node **root_out, const char *t_ip, int t_port)
+{
+    uint32_t magic;
+    uint64_t seq;
+    int result = -1;
+    *root_out = NULL;
+    if (getTreeU32(reader, &magic) < 0)
+        fprintf(stderr, "Storage server closed the connection\n");
+    else if (magic == TREE_STREAM_MAGIC)
+    {
+        if (getTreeU64(reader, &seq) == 0 && (*root_out = readTreeNode(reader)) != NULL)
         {
-            freeNode(newNode);
-            return NULL;
+            server->applied_seq = seq;
+            result = 0;
         }
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Received has_children");
-
-        send(sock, "OK", 2, 0);
-        log_message(t_ip, t_port, "Receiving Node Chain:", "Sent OK");
+    }
+    else if (magic == EVENT_STREAM_MAGIC && server->root)
+    {
+        if (readEventStream(reader, server) == 0)
+            result = 1;
+    }
+    else
+        fprintf(stderr, "Storage server sent neither a node tree nor namespace events\n");
 
+    logNamespaceReceived(reader, result, server->applied_seq, t_ip, t_port);
+    return result;
+}
 
-        if (has_children)
-        {
-            // Create hash table for children
-            newNode->children = createNodeTable();
+static TreeReader *createSocketTreeReader(int sock)
+{
+    TreeReader *reader = (TreeReader *)calloc(1, sizeof(TreeReader));
+    if (!reader)
+        return NULL;
+    reader->sock = sock;
+    reader->window = reader->buffer;
+    return reader;
+}
 
-            // Receive all hash table entries
-            for (int i = 0; i < TABLE_SIZE; i++)
-            {
-                newNode->children->table[i] = receiveNodeChain(sock);
-
-                // Set parent pointers for the chain
-                Node *child = newNode->children->table[i];
-                while (child != NULL)
-                {
-                    child->parent = newNode;
-                    child = child->next;
-                }
-            }
-        }
+// Read the namespace straight off the connection, during registration
+int receiveNamespace(int sock, StorageServer *server, Node **root_out)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(sock, (struct sockaddr *)&addr, &addr_len) == -1)
+    {
+        perror("getpeername failed");
+        return -1;
+    }
+    char t_ip[INET_ADDRSTRLEN];
+    int t_port;
+    get_ip_and_port(&addr, t_ip, &t_port);
+
+    TreeReader *reader = createSocketTreeReader(sock);
+    if (!reader)
+        return -1;
+    int result = readNamespace(reader, server, root_out, t_ip, t_port);
+    free(reader);
+    return result;
+}
 
-        // Add to chain
-        if (head == NULL)
-        {
-            head = newNode;
-            current = head;
-        }
-        else
+// Registration of a server whose tree we still hold. The stream is read
+// without server->lock, which is never held while waiting on the server: a
+// whole tree comes back in *root_out with its seq in *seq_out, journal events
+// are only checked and kept in *events (to free) for receiveNamespaceReply to
+// apply under the lock. Returns 0 for a tree, 1 for events, -1 if broken.
+int receiveResumedNamespace(int sock, Node **root_out, uint64_t *seq_out, char **events, size_t *events_len)
+{
+    *root_out = NULL;
+    *events = NULL;
+    *events_len = 0;
+    TreeReader *reader = createSocketTreeReader(sock);
+    if (!reader)
+        return -1;
+    reader->keep = 1;
+    uint32_t magic;
+    int result = -1;
+    if (getTreeU32(reader, &magic) < 0)
+        fprintf(stderr, "Storage server closed the connection\n");
+    else if (magic == TREE_STREAM_MAGIC)
+    {
+        reader->keep = 0;
+        if (getTreeU64(reader, seq_out) == 0 && (*root_out = readTreeNode(reader)) != NULL)
+            result = 0;
+    }
+    else if (magic == EVENT_STREAM_MAGIC)
+    {
+        if (readEventStream(reader, NULL) == 0)
         {
-            current->next = newNode;
-            current = newNode;
+            *events = reader->kept;
+            *events_len = reader->kept_len;
+            reader->kept = NULL;
+            result = 1;
         }
     }
+    else
+        fprintf(stderr, "Storage server sent neither a node tree nor namespace events\n");
+    if (result != 1) // Events are logged once applied
+        logNamespaceReceived(reader, result, *seq_out, NULL, 0);
+    free(reader->kept);
+    free(reader);
+    return result;
+}
 
-    return head;
+// Read the namespace from the reply to a SYNC request
+int receiveNamespaceReply(StorageServer *server, const char *data, size_t len, Node **root_out)
+{
+    TreeReader *reader = (TreeReader *)calloc(1, sizeof(TreeReader));
+    if (!reader)
+        return -1;
+    reader->sock = -1;
+    reader->window = data;
+    reader->end = len;
+    reader->total_bytes = len;
+    int result = readNamespace(reader, server, root_out, server->ip, server->nm_port);
+    free(reader);
+    return result;
 }
 
 void *ackListener(void *arg)
@@ -263,6 +418,25 @@ void *ackListener(void *arg)
                 fprintf(stderr, "Failed to parse COMPLETED message\n");
             }
         }
+        else if (strstr(buffer, "failed"))
+        {
+            // The storage server gave up on the write: the file was deleted,
+            // stayed locked, or could not be written
+            if (sscanf(buffer,
+                       "Failed Message from Storage Server:\nClient ID: %d\nClient IP: %15s\nClient Port: %d\nFile: %255s",
+                       &clientId, clientIP, &clientPort, fileName) == 4)
+            {
+                updateWriteStateQueue("FAILED", fileName, clientId, clientIP, clientPort);
+                printf("Updated queue with FAILED message for file: %s\n", fileName);
+                char ack_message[MAX_BUFFER_SIZE];
+                snprintf(ack_message, MAX_BUFFER_SIZE, "ACK: Write FAILED for file: %s", fileName);
+                forwardAckToClient(clientIP, clientPort, ack_message);
+            }
+            else
+            {
+                fprintf(stderr, "Failed to parse FAILED message\n");
+            }
+        }
         else
         {
             fprintf(stderr, "Unknown message received: %s\n", buffer);
@@ -358,127 +532,28 @@ void recursiveList(Node *node, const char *current_path, char *response, int *re
     if (node->type == DIRECTORY_NODE)
     {
         NodeTable *children = node->children; // Directly use node->children without '&'
-        for (int i = 0; i < TABLE_SIZE; i++)
+        uint32_t cursor = 0;
+        Node *child_node;
+        while ((child_node = nextChild(children, &cursor)) != NULL)
         {
-            Node *child_node = children->table[i];
-            while (child_node)
-            {
-                recursiveList(child_node, new_path, response, response_offset, response_size);
-                child_node = child_node->next;
-            }
+            recursiveList(child_node, new_path, response, response_offset, response_size);
         }
     }
 }
 
 StorageServerList *findStorageServersByPath_List(StorageServerTable *table, const char *path)
 {
-    StorageServerList *matching_servers = NULL;
-    StorageServerList *last_match = NULL;
-
-    for (int i = 0; i < TABLE_SIZE; i++)
-    {
-        pthread_mutex_lock(&table->locks[i]);
-        StorageServer *server = table->table[i];
-
-        while (server)
-        {
-            if (server->active && server->root)
-            {
-                // Use searchPath to check if this server has the path
-                Node *found_node = searchPath(server->root, path);
-                if (found_node != NULL)
-                {
-                    // We found the path in this server, add to the list
-                    StorageServerList *new_match = (StorageServerList *)malloc(sizeof(StorageServerList));
-                    new_match->server = server;
-                    new_match->next = NULL;
-
-                    if (last_match)
-                    {
-                        last_match->next = new_match;
-                    }
-                    else
-                    {
-                        matching_servers = new_match;
-                    }
-                    last_match = new_match;
-                }
-            }
-            server = server->next;
-        }
-        pthread_mutex_unlock(&table->locks[i]);
-    }
-
-    return matching_servers;
+    return pathIndexLookupAll(path_index, path);
 }
 
 Node *findNode(Node *root, const char *path)
 {
-    if (!root || !path || strlen(path) == 0)
+    if (!root || !path || path[0] == '\0')
     {
-        printf("Error: Invalid root or path.\n");
         log_message(NULL, 0, "FindNode", "Error: Invalid root or path.");
         return NULL;
     }
-
-    // Handle root path case
-    if (strcmp(path, "/") == 0)
-    {
-        return root;
-    }
-
-    // Tokenize the path using the path separator
-    char *pathCopy = strdup(path); // Make a mutable copy of the path
-    char *token = strtok(pathCopy, PATH_SEPARATOR);
-    Node *current = root;
-
-    while (token != NULL)
-    {
-        // Traverse the children of the current node
-        NodeTable *childrenTable = current->children;
-        if (!childrenTable)
-        {
-            printf("Error: Path component '%s' not found (no children).\n", token);
-            log_message(NULL, 0, "FindNode", "Error: Path component not found (no children).");
-
-            free(pathCopy);
-            return NULL;
-        }
-
-        Node *child = NULL;
-        for (int i = 0; i < TABLE_SIZE; i++)
-        {
-            child = childrenTable->table[i];
-            while (child != NULL)
-            {
-                if (strcmp(child->name, token) == 0)
-                {
-                    break;
-                }
-                child = child->next;
-            }
-            if (child)
-            {
-                break;
-            }
-        }
-
-        if (!child)
-        {
-            printf("Error: Path component '%s' not found.\n", token);
-            log_message(NULL, 0, "FindNode", "Error: Path component not found (no children).");
-
-            free(pathCopy);
-            return NULL;
-        }
-
-        // Move to the next level
-        current = child;
-        token = strtok(NULL, PATH_SEPARATOR);
-    }
-
-    free(pathCopy);
-    return current;
+    return walkPath(root, path, 0);
 }
 
 static unsigned int hashKey(const char *key)
@@ -501,28 +576,25 @@ void copyDirectoryContents(Node *sourceDir, Node *destDir)
         return;
     }
 
-    for (int i = 0; i < TABLE_SIZE; i++)
+    uint32_t cursor = 0;
+    Node *child;
+    while ((child = nextChild(sourceDir->children, &cursor)) != NULL)
     {
-        Node *child = sourceDir->children->table[i];
-        while (child)
+        if (child->type == FILE_NODE)
         {
-            if (child->type == FILE_NODE)
-            {
-                // Copy file
-                addFile(destDir, child->name, child->permissions, child->dataLocation);
-            }
-            else if (child->type == DIRECTORY_NODE)
-            {
-                // Create the new directory in the destination
-                addDirectory(destDir, child->name, child->permissions);
+            // Copy file
+            addFile(destDir, child->name, child->permissions);
+        }
+        else if (child->type == DIRECTORY_NODE)
+        {
+            // Create the new directory in the destination
+            addDirectory(destDir, child->name, child->permissions);
 
-                // Find the newly created directory in the destination
-                Node *newDestDir = searchNode(destDir->children, child->name);
+            // Find the newly created directory in the destination
+            Node *newDestDir = searchNode(destDir->children, child->name);
 
-                // Recursively copy the contents of the directory
-                copyDirectoryContents(child, newDestDir);
-            }
-            child = child->next;
+            // Recursively copy the contents of the directory
+            copyDirectoryContents(child, newDestDir);
         }
     }
 }
@@ -606,211 +678,3 @@ void *monitorWriteStates(void *arg) {
     }
     return NULL;
 }
-
-
-void backup_data(StorageServerTable *server_table)
-{
-    if (!server_table)
-        return;
-    for (int i = 0; i < TABLE_SIZE; i++)
-    {
-        StorageServer *current = server_table->table[i];
-        while (current)
-        {
-            printf("curcscs %s %d\n", current->root->name, current->id);
-            pthread_mutex_lock(&current->lock);
-            if (!current->ss_backup_1 || !current->ss_backup_1->active)
-            {
-                printf("empty\n");
-                StorageServer *backup1 = NULL;
-                int offset = 1;
-                while (!backup1 && offset <= server_table->count)
-                {
-                    printf("offset %d \n", offset);
-                    int backup_id = (current->id - offset + server_table->count) % server_table->count;
-                    if (backup_id != current->id)
-                    {
-                        printf("backup_id%d \n", backup_id);
-                        for (int j = 0; j < TABLE_SIZE; j++)
-                        {
-                            StorageServer *potential_backup = server_table->table[j];
-                            if (current->ss_backup_2)
-                            {
-                                if (potential_backup != current->ss_backup_2)
-                                {
-                                    while (potential_backup)
-                                    {
-                                        if (potential_backup->id == backup_id && potential_backup->active)
-                                        {
-                                            printf("current %s %s\n", current->root->name, potential_backup->root->name);
-                                            int check = take_backup(server_table, current, potential_backup);
-                                            if (check)
-                                            {
-                                                printf("DONE\n");
-                                                backup1 = potential_backup;
-                                                break;
-                                            }
-                                        }
-                                        potential_backup = potential_backup->next;
-                                    }
-                                    if (backup1)
-                                        break;
-                                }
-                            }
-                            else
-                            {
-                                while (potential_backup)
-                                {
-                                    if (potential_backup->id == backup_id && potential_backup->active)
-                                    {
-                                        printf("current %s %s\n", current->root->name, potential_backup->root->name);
-                                        int check = take_backup(server_table, current, potential_backup);
-                                        if (check)
-                                        {
-                                            backup1 = potential_backup;
-                                            break;
-                                        }
-                                    }
-                                    potential_backup = potential_backup->next;
-                                }
-                                if (backup1)
-                                    break;
-                            }
-                        }
-                    }
-                    offset++;
-                }
-                if (backup1)
-                    current->ss_backup_1 = backup1;
-            }
-            if (!current->ss_backup_2 || !current->ss_backup_2->active)
-            {
-                StorageServer *backup2 = NULL;
-                int offset = 1;
-
-                while (!backup2 && offset <= server_table->count)
-                {
-                    int backup_id = (current->id - offset - 1 + server_table->count) % server_table->count;
-                    if (backup_id != current->id)
-                    {
-                        for (int j = 0; j < TABLE_SIZE; j++)
-                        {
-                            StorageServer *potential_backup = server_table->table[j];
-                            if (current->ss_backup_1)
-                            {
-                                if (potential_backup != current->ss_backup_1)
-                                {
-                                    while (potential_backup)
-                                    {
-                                        if (potential_backup->id == backup_id && potential_backup->active)
-                                        {
-                                            printf("current %s %s\n", current->root->name, potential_backup->root->name);
-                                            int check = take_backup(server_table, current, potential_backup);
-                                            if (check)
-                                            {
-                                                backup2 = potential_backup;
-                                                break;
-                                            }
-                                        }
-                                        potential_backup = potential_backup->next;
-                                    }
-                                    if (backup2)
-                                        break;
-                                }
-                            }
-                            else
-                            {
-                                while (potential_backup)
-                                {
-                                    if (potential_backup->id == backup_id && potential_backup->active)
-                                    {
-                                        printf("current %s %s\n", current->root->name, potential_backup->root->name);
-                                        int check = take_backup(server_table, current, potential_backup);
-                                        if (check)
-                                        {
-                                            backup2 = potential_backup;
-                                            break;
-                                        }
-                                    }
-                                    potential_backup = potential_backup->next;
-                                }
-                                if (backup2)
-                                    break;
-                            }
-                        }
-                    }
-                    offset++;
-                }
-                if (backup2)
-                    current->ss_backup_2 = backup2;
-            }
-            pthread_mutex_unlock(&current->lock);
-            current = current->next;
-        }
-    }
-}
-
-int take_backup(StorageServerTable *server_table, StorageServer *server, StorageServer *destination)
-{
-    char response[100001];
-    char path[1024];
-    snprintf(path, sizeof(path), "/backup_%d", server->id);
-    snprintf(response, sizeof(response), "CREATE DIR 1 /backup_%d", server->id);
-    send(destination->socket, response, strlen(response), 0);
-    recv(destination->socket, response, sizeof(response), 0);
-    printf("%s\n", response);
-    if (strncmp(response, "CREATE DONE", 11) == 0)
-    {
-        printf("yeahhh\n");
-        char *lastSlash = strrchr(path, '/');
-        if (!lastSlash)
-        {
-            return 0;
-        }
-        *lastSlash = '\0';
-        char *name = lastSlash + 1;
-        Node *parentDir = searchPath(destination->root, path);
-        *lastSlash = '/';
-        if (!parentDir)
-        {
-            return 0;
-        }
-        NodeType typ = DIRECTORY_NODE;
-        Node *newNode = createNode(name, typ, READ | WRITE, path);
-        newNode->parent = parentDir;
-        insertNode(parentDir->children, newNode);
-        char dest_path[1024];
-        snprintf(dest_path, sizeof(dest_path), "/backup_%d", server->id);
-        snprintf(response, sizeof(response), "COPY / /backup_%d", server->id);
-        send(server->socket, response, strlen(response), 0);
-        recv(server->socket, response, sizeof(response), 0);
-        char server_info[MAX_BUFFER_SIZE];
-        printf("hiiek\n");
-        snprintf(server_info, sizeof(server_info), "SOURCE SERVER_INFO %s %d", destination->ip, destination->client_port);
-        send(server->socket, server_info, strlen(server_info), 0);
-        recv(server->socket, response, sizeof(response), 0);
-        printf("%s\n", response);
-        if (strncmp(response, "COPY DONE", 9) == 0)
-        {
-            if (server->root->type == DIRECTORY_NODE)
-            {
-                printf("%s\n", dest_path);
-                Node *destParentNode = findNode(destination->root, dest_path);
-                if (!destParentNode || destParentNode->type != DIRECTORY_NODE)
-                {
-                    printf("Error: Destination path is not a valid directory\n");
-                    return 0;
-                }
-                addDirectory(destParentNode, server->root->name, server->root->permissions);
-                Node *newRootDir = searchNode(destParentNode->children, server->root->name);
-                copyDirectoryContents(server->root, newRootDir);
-                printf("Backup done\n");
-            }
-            else
-            {
-                Node *destParentNode = findNode(destination->root, dest_path);
-                addFile(destParentNode, server->root->name, server->root->permissions, server->root->dataLocation);
-            }
-        }
-    }
-}
\ No newline at end of file
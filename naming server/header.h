@@ -1,5 +1,6 @@
 #ifndef HEADER_H
 #define HEADER_H
+#define _GNU_SOURCE // POLLRDHUP
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,22 +18,70 @@
 #include <asm-generic/socket.h>
 #include<stdbool.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
 // #include"lru_cache.h"
 #include <ctype.h>
+#include <sys/uio.h>
 #define TABLE_SIZE 10
+#define NODE_TABLE_GROUP 8         // Control bytes probed together in a directory table
+#define NODE_TABLE_MIN_CAPACITY 8  // Slots allocated on a directory's first child
+#define NODE_TABLE_MIGRATE_STEP 32 // Old slots moved per insert during a rehash
+#define NODE_SLAB_CHUNK (1 << 20)  // Block size nodes and directory tables are carved from
+#define NAME_HASH_SEED 2166136261u // FNV-1a over child names, see hash()
+#define NAME_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * 16777619u)
 #define MAX_COMMAND_LENGTH 10
 #define MAX_PATH_LENGTH 1024
 #define MAX_CONTENT_LENGTH 4096
 #define CHUNK_SIZE 1024
-#define MAX_CLIENTS 10
+#define CLIENT_LISTEN_BACKLOG 4096 // Pending client connections queued by the kernel
+#define NM_WORKER_THREADS 8       // Threads serving client requests
+#define NM_STORAGE_WORKER_THREADS 16 // Threads serving client requests that wait on a storage server
+#define MAX_EPOLL_EVENTS 64
+#define PATH_INDEX_BUCKETS 1024 // Initial size of the full-path index, grows as needed
+#define PATH_INDEX_STRIPES 64
+#define TREE_STREAM_MAGIC 0x4E545231 // "NTR1", starts a serialized node tree
+#define TREE_STREAM_BUFFER 65536
+#define EVENT_STREAM_MAGIC 0x4E455631 // "NEV1", starts a batch of namespace events
+#define NM_SYNC_INTERVAL 2            // Seconds between namespace syncs with each storage server
+#define SS_REQUEST_TIMEOUT_MS 60000   // Wait for a CREATE, DELETE or SYNC reply; COPY waits as long as it takes
+#define COPY_JOBS_KEPT 64             // Finished COPY jobs remembered for COPYSTATUS
+#define BACKUP_REFRESH_MS 30000       // How often replicas are brought up to date, NM_BACKUP_REFRESH_MS overrides
+#define BACKUP_MIN_INTERVAL_MS 1000   // Least time between two backups of one storage server
+#define READ_LOAD_HALF_LIFE_MS 1000  // Reads handed to a server count half as much after this
+#define FRAME_MORE 0x80000000u        // Length bit: more frames of this reply follow, see frame.c
+#define FRAME_CHUNK_SIZE 65536        // Longer payloads are split over several frames
+#define FRAME_MAX_PAYLOAD (16 << 20)  // Larger frames mean the stream is out of step
+#define LEASE_DURATION_MS 10000       // How long a client may reuse a location, NM_LEASE_MS overrides
+#define LEASE_TABLE_BUCKETS 4096      // Initial size of the lease table and its index, both grow as needed
+#define LEASE_TABLE_STRIPES 64
+#define LEASE_TABLE_CAPACITY 1000000  // Outstanding leases; past this locations go out unleased
+#define LEASE_REVOKE_TIMEOUT_MS 200   // Connect/send limit when telling a client its lease is gone
 #define STORAGE_PORT 8080
 #define NAMING_PORT 8081
 #define MAX_BUFFER_SIZE 100001
 #define PATH_SEPARATOR "/"
 #define LOG_FILE "naming_server.log"
 
-extern pthread_mutex_t log_mutex;
+#define LOG_RING_SIZE 4096          // Queued log lines, power of two; more are dropped
+#define LOG_ENTRY_SIZE 512          // Longer log lines are truncated
+#define LOG_FLUSH_INTERVAL_US 10000 // Writer sleep when the ring is empty
+
+typedef enum
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
 extern void log_message(const char *ip, int port, const char *role, const char *message);
+extern void log_message_level(LogLevel level, const char *ip, int port, const char *role, const char *message);
+extern void stop_logger(void);
 extern void get_ip_and_port(struct sockaddr_in *sa, char *ip_buffer, int *port);
 extern const char *log_file_path;
 
@@ -66,18 +115,42 @@ typedef enum
     DIRECTORY_NODE
 } NodeType;
 
+typedef enum
+{
+    JOURNAL_CREATE = 1,
+    JOURNAL_DELETE,
+    JOURNAL_RESIZE
+} JournalOp;
+
 typedef struct Node
 {
-    char *name;      
+    const char *name; // Interned, see node_alloc.c
     NodeType type;
     Permissions permissions;
-    char *dataLocation;
     struct Node *parent;
-    struct Node *next;
     struct NodeTable *children; 
-    int lock_type; // 0= none, 1 = read, 2 = write
 } Node;
 
+// Takes the intermediate frames of a reply that reports progress
+typedef void (*SSProgressFn)(void *arg, const char *payload, size_t len);
+
+// A request waiting on a storage server connection, see ss_channel.c
+typedef struct SSRequest
+{
+    uint32_t id;
+    char *reply; // Frames received so far, NUL terminated
+    size_t reply_len;
+    int state;   // SS_REQUEST_WAITING, SS_REQUEST_DONE or SS_REQUEST_FAILED
+    SSProgressFn progress; // NULL: every frame is part of the reply
+    void *progress_arg;
+    pthread_cond_t done;
+    struct SSRequest *next;
+} SSRequest;
+
+#define SS_REQUEST_WAITING 0
+#define SS_REQUEST_DONE 1
+#define SS_REQUEST_FAILED 2
+
 typedef struct StorageServer
 {
     char ip[16];
@@ -87,10 +160,20 @@ typedef struct StorageServer
     Node *root;
     int socket;
     bool active;
-    pthread_mutex_t lock;
+    uint32_t epoch;       // Identifies one run of the storage server
+    uint64_t applied_seq; // Last journal event reflected in root
+    pthread_mutex_t lock;       // Guards root, applied_seq, active and the address a new run takes over; never held while waiting on the server
+    pthread_mutex_t send_lock;  // One frame at a time on socket
+    pthread_mutex_t request_lock;
+    SSRequest *pending;         // Requests waiting for their reply
+    uint32_t next_request_id;
+    bool connected;             // A reader is serving socket; guarded by request_lock
     struct StorageServer *next; // For collision handling in storage server hash table
     struct StorageServer *ss_backup_1;
     struct StorageServer *ss_backup_2;
+    unsigned int read_load;     // Reads handed out lately, see read_replicas.c; guarded by lock
+    long long read_load_ms;     // When read_load was last halved
+    struct LeaseRevocation *revocations; // Taken under lock, see leaseDeliverRevocations; guarded by lock
 } StorageServer;
 
 // Hash table for storage servers
@@ -108,14 +191,123 @@ typedef struct AcceptorArgs
     StorageServerTable *server_table;
 } AcceptorArgs;
 
+typedef struct NodeTableSlots
+{
+    uint8_t *ctrl; // Per slot: empty, deleted, or a 7-bit tag of the name hash
+    Node **slots;
+    uint32_t capacity; // Power of two, a multiple of NODE_TABLE_GROUP
+} NodeTableSlots;
+
+// Children of a directory, see node_table.c
 typedef struct NodeTable
 {
-    Node *table[TABLE_SIZE];
+    NodeTableSlots current;
+    NodeTableSlots old;   // Slots still being drained by an incremental rehash
+    uint32_t migrate_pos; // Next old slot to move
+    uint32_t size;        // Children in both arrays
+    uint32_t used;        // Live and deleted slots in current
 } NodeTable;
 
+// Full path -> (server, node) index over every registered storage server tree.
+// Several servers may hold the same path, so entries are keyed by both.
+typedef struct PathIndexEntry
+{
+    char *path;        // Canonical path relative to the server root
+    unsigned int hash;
+    StorageServer *server;
+    Node *node;
+    struct PathIndexEntry *next;
+} PathIndexEntry;
+
+typedef struct PathIndex
+{
+    PathIndexEntry **buckets;
+    size_t bucket_count; // Power of two
+    atomic_size_t count;
+    pthread_rwlock_t resize_lock;                 // Shared for bucket access, exclusive to grow
+    pthread_mutex_t stripes[PATH_INDEX_STRIPES]; // Bucket locks, striped by slot
+} PathIndex;
+
+extern PathIndex *path_index;
+
+// A client session on the naming server, owned by the epoll reactor
+typedef struct ClientConnection
+{
+    int socket;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    int lease_port;                // Client's ACK port for lease revocations and COPY outcomes, 0 if none
+    char *request;                 // A request waiting for a storage worker
+    struct ClientConnection *next; // For the worker queues
+} ClientConnection;
+
+// A client allowed to reuse the location of a path, see lease_table.c
+typedef struct Lease
+{
+    char *path; // Canonical
+    unsigned int hash;
+    StorageServer *server;
+    char holder_ip[INET_ADDRSTRLEN];
+    int holder_port;      // Where the holder takes revocations
+    long long expires_ms; // CLOCK_MONOTONIC
+    struct LeaseLink *links; // One per index key, see leaseKeys
+    int link_count;
+    struct Lease *next;   // Bucket chain
+    struct Lease *older;  // Expiry order within the stripe
+    struct Lease *newer;
+} Lease;
+
+// Leases filed under one key: a directory or path, a server or a holder
+typedef struct LeaseIndexEntry
+{
+    char *key;
+    unsigned int hash;
+    struct LeaseLink *links;
+    struct LeaseIndexEntry *next;
+} LeaseIndexEntry;
+
+typedef struct LeaseLink
+{
+    Lease *lease;
+    LeaseIndexEntry *entry;
+    struct LeaseLink *prev;
+    struct LeaseLink *next;
+} LeaseLink;
+
+typedef struct LeaseIndex
+{
+    LeaseIndexEntry **buckets;
+    size_t bucket_count; // Power of two
+    atomic_size_t count;
+    pthread_rwlock_t resize_lock;                  // Shared for bucket access, exclusive to grow
+    pthread_mutex_t stripes[LEASE_TABLE_STRIPES]; // Bucket locks, striped by slot
+} LeaseIndex;
+
+typedef struct LeaseStripe
+{
+    pthread_mutex_t lock; // Buckets whose slot falls in this stripe
+    Lease *oldest;        // Those buckets' leases by expiry, for pruning
+    Lease *newest;
+} LeaseStripe;
+
+typedef struct LeaseTable
+{
+    Lease **buckets;
+    size_t bucket_count; // Power of two, at least LEASE_TABLE_STRIPES
+    atomic_size_t count;
+    pthread_rwlock_t resize_lock; // Shared for bucket access, exclusive to grow
+    LeaseStripe stripes[LEASE_TABLE_STRIPES];
+    LeaseIndex index; // Taken only inside a bucket lock, never the other way round
+} LeaseTable;
+
+extern LeaseTable *lease_table;
+extern int lease_duration_ms;
+extern int backup_refresh_ms;
+
 typedef struct StorageServerList
 {
     StorageServer *server;
+    Node *node; // The matched node on that server, as of the lookup; look it up again under server->lock
     struct StorageServerList *next;
 } StorageServerList;
 
@@ -125,7 +317,7 @@ typedef struct AsyncWriteState
     int clientId;
     char clientIP[INET_ADDRSTRLEN];
     int clientPort;
-    char status[10];  // "STARTED" or "COMPLETED"
+    char status[10];  // "STARTED", "COMPLETED" or "FAILED"
     time_t timestamp; // To track when the message was received
     struct AsyncWriteState *next;
 } AsyncWriteState;
@@ -137,14 +329,27 @@ void updateWriteStateQueue(const char *status, const char *fileName, int clientI
 void *monitorWriteStates(void *arg);
 unsigned int hash(const char *str);
 NodeTable *createNodeTable();
-Node *createNode(const char *name, NodeType type, Permissions perms, const char *dataLocation);
+void freeNodeTable(NodeTable *table);
+int removeNode(NodeTable *table, Node *node);
+Node *nextChild(NodeTable *table, uint32_t *cursor);
+Node *createNode(const char *name, NodeType type, Permissions perms);
+int getDataLocation(const Node *node, char *buffer, size_t size);
+Node *allocNode();
+void freeNodeMemory(Node *node);
+NodeTable *allocNodeTable();
+void freeNodeTableMemory(NodeTable *table);
+const char *internName(const char *name);
+void releaseName(const char *name);
+void formatNodeAllocStats(char *buffer, size_t size);
+long residentMemoryKB();
 void insertNode(NodeTable *table, Node *node);
 Node *searchNode(NodeTable *table, const char *name);
-void addFile(Node *parentDir, const char *fileName, Permissions perms, const char *dataLocation);
+Node *searchNodeHashed(NodeTable *table, const char *name, size_t len, unsigned int h);
+Node *walkPath(Node *root, const char *path, int skip_root_name);
+void addFile(Node *parentDir, const char *fileName, Permissions perms);
 void addDirectory(Node *parentDir, const char *dirName, Permissions perms);
 Node *searchPath(Node *root, const char *path);
 void printFileSystemTree(Node *node, int depth);
-char **splitPath(const char *path, int *count);
 int hasPermission(Node *node, Permissions perm);
 void listDirectory(Node *dir);
 
@@ -154,7 +359,12 @@ CommandType parseCommand(const char *cmd);
 void printUsage();
 void getParentPath(const char *path, char *parent);
 void processCommand(Node *root);
-Node *receiveNodeChain(int sock);
+int receiveNamespace(int sock, StorageServer *server, Node **root_out);
+int receiveNamespaceReply(StorageServer *server, const char *data, size_t len, Node **root_out);
+int receiveResumedNamespace(int sock, Node **root_out, uint64_t *seq_out, char **events, size_t *events_len);
+void applyNamespaceEvent(StorageServer *server, JournalOp op, NodeType type, Permissions permissions, int64_t size, const char *path);
+void replaceServerTree(StorageServer *server, Node *root);
+int syncStorageServer(StorageServer *server);
 Node *createEmptyNode(Node *parentDir, const char *name, NodeType type);
 int deleteNode(Node *node);
 int copyNode(Node *sourceNode, Node *destDir, const char *newName);
@@ -162,7 +372,7 @@ ssize_t readFile(Node *fileNode, char *buffer, size_t size);
 ssize_t writeFile(Node *fileNode, const char *buffer, size_t size);
 int getFileMetadata(Node *fileNode, struct stat *metadata);
 ssize_t streamAudioFile(Node *fileNode, char *buffer, size_t size, off_t offset);
-int receiveServerInfo(int sock, char *ip_out, int *nm_port_out, int *client_port_out, Node **root_out);
+int receiveServerInfo(int sock, StorageServerTable *table, StorageServer *server, StorageServer **resumed);
 StorageServerList *findStorageServersByPath_List(StorageServerTable *table, const char *path);
 Node *findNode(Node *root, const char *path);
 void recursiveList(Node *node, const char *current_path, char *response, int *response_offset, size_t response_size);
@@ -171,6 +381,45 @@ void *ackListener(void *arg);
 void forwardAckToClient(const char *clientIP, int clientPort, const char *ack_message);
 // void logEvent(const char *level, const char *ip, int port, const char *message);
 
-void backup_data(StorageServerTable *server_table);
-int take_backup(StorageServerTable *server_table, StorageServer *server, StorageServer *destination);
+void canonicalizePath(const char *path, char *out, size_t size);
+PathIndex *createPathIndex(size_t initial_buckets);
+void pathIndexInsert(PathIndex *index, const char *path, StorageServer *server, Node *node);
+void pathIndexRemove(PathIndex *index, const char *path, StorageServer *server);
+Node *pathIndexLookup(PathIndex *index, const char *path, StorageServer **server_out);
+StorageServerList *pathIndexLookupAll(PathIndex *index, const char *path);
+void pathIndexAddSubtree(PathIndex *index, StorageServer *server, Node *node, const char *path);
+void pathIndexRemoveSubtree(PathIndex *index, StorageServer *server, Node *node, const char *path);
+void indexCopiedNode(StorageServer *server, Node *node, const char *dest_dir);
+LeaseTable *createLeaseTable(size_t initial_buckets);
+int leaseGrant(LeaseTable *table, const char *path, StorageServer *server, const char *ip, int port);
+void leaseRevokePath(LeaseTable *table, const char *path);
+void leaseRevokeServer(LeaseTable *table, StorageServer *server);
+void leaseRevokePathDeferred(LeaseTable *table, StorageServer *server, const char *path);
+void leaseRevokeServerDeferred(LeaseTable *table, StorageServer *server);
+void leaseDeliverRevocations(StorageServer *server);
+void leaseDropHolder(LeaseTable *table, const char *ip, int port);
+int handleClientRequest(ClientConnection *conn, StorageServerTable *table);
+int serveClientRequest(ClientConnection *conn, StorageServerTable *table, const char *buffer);
+int sendFrame(int sock, uint32_t request_id, const char *payload, size_t len, int more);
+int recvFrame(int sock, uint32_t *request_id, char **payload, size_t *len, int *more);
+void initStorageServerChannel(StorageServer *server);
+void destroyStorageServerChannel(StorageServer *server);
+bool storageServerConnected(StorageServer *server);
+ssize_t ssRequest(StorageServer *server, const char *command, char **reply, int timeout_ms);
+ssize_t ssRequestProgress(StorageServer *server, const char *command, char **reply, int timeout_ms, SSProgressFn progress, void *arg);
+int ssCommand(StorageServer *server, const char *command, char *reply, size_t size, int timeout_ms);
+void *storageServerHandler(void *arg);
+void runClientReactor(int listen_fd, StorageServerTable *table);
+uint32_t startCopyJob(StorageServer *source_server, const char *source, StorageServer *dest_server, const char *dest_dir, const char *client_ip, int client_port);
+int formatCopyJobs(uint32_t id, char *buffer, size_t size);
+
+int take_backup(StorageServerTable *server_table, StorageServer *server, StorageServer *destination, char *result, size_t size);
+void startBackupScheduler(StorageServerTable *table);
+void scheduleBackups();
+void formatBackupStatus(char *buffer, size_t size);
+void forgetBackupServer(StorageServerTable *table, StorageServer *gone);
+void configureReplication(StorageServer *server);
+void refreshReplicationStatus(StorageServer *server);
+bool replicaIsCurrent(int source_id, int dest_id, uint32_t epoch, uint64_t seq);
+void appendReadReplicas(StorageServer *server, const char *path, char *response, size_t size);
 #endif
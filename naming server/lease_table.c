@@ -0,0 +1,637 @@
+#include "header.h"
+
+// Location leases. A client that registered an ACK port (LEASES <port>) gets
+// READ/WRITE/META/STREAM answers with "LEASE <ms>" appended and may reuse the
+// location until the lease runs out. Before the location can go stale, i.e. on
+// DELETE, COPY over the path or a storage server going away, the lease is
+// taken back here and the holder is told through its ACK port:
+//   REVOKE <path>              the path and everything below it
+//   REVOKE_SERVER <ip> <port>  every location on that storage server
+// A holder that cannot be reached is covered by the lease running out.
+// Revocations found while a server's lock is held are queued on the server
+// and sent by leaseDeliverRevocations once the lock is let go, so a slow
+// client holds up nobody else's requests on that server.
+
+LeaseTable *lease_table = NULL;
+int lease_duration_ms = LEASE_DURATION_MS;
+
+// Leases are hashed by path into striped buckets as in path_index.c, and
+// each one is also filed in an index under several keys, so a revocation
+// visits only the leases it takes:
+//   every directory above the path, and the path itself, e.g. "/t", "/t/a.txt"
+//   "S<server>"         the storage server it points at
+//   "H<ip>:<port>"      its holder
+// Only "/" is left out, as it would be shared by every lease; revoking it
+// sweeps the table. A bucket lock may be held while an index bucket is
+// locked, never the other way round, and no two of either kind are held at
+// once. Each stripe keeps its leases in expiry order so grants can prune
+// the expired ones without a sweep.
+
+// Distinct clients to send one revocation to
+typedef struct LeaseHolder
+{
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    struct LeaseHolder *next;
+} LeaseHolder;
+
+// What identifies a lease, copied out of the index so the lease's own
+// bucket can be locked once the index bucket is let go
+typedef struct LeaseDescriptor
+{
+    char *path;
+    StorageServer *server;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+} LeaseDescriptor;
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned int hashLeasePath(const char *path)
+{
+    unsigned int h = NAME_HASH_SEED;
+    while (*path)
+    {
+        h = NAME_HASH_STEP(h, *path);
+        path++;
+    }
+    return h;
+}
+
+static size_t powerOfTwoAtLeast(size_t n)
+{
+    size_t buckets = LEASE_TABLE_STRIPES;
+    while (buckets < n)
+        buckets <<= 1;
+    return buckets;
+}
+
+LeaseTable *createLeaseTable(size_t initial_buckets)
+{
+    LeaseTable *table = (LeaseTable *)malloc(sizeof(LeaseTable));
+    table->bucket_count = powerOfTwoAtLeast(initial_buckets);
+    table->buckets = (Lease **)calloc(table->bucket_count, sizeof(Lease *));
+    atomic_init(&table->count, 0);
+    pthread_rwlock_init(&table->resize_lock, NULL);
+    for (int i = 0; i < LEASE_TABLE_STRIPES; i++)
+    {
+        pthread_mutex_init(&table->stripes[i].lock, NULL);
+        table->stripes[i].oldest = NULL;
+        table->stripes[i].newest = NULL;
+    }
+
+    LeaseIndex *index = &table->index;
+    index->bucket_count = powerOfTwoAtLeast(initial_buckets);
+    index->buckets = (LeaseIndexEntry **)calloc(index->bucket_count, sizeof(LeaseIndexEntry *));
+    atomic_init(&index->count, 0);
+    pthread_rwlock_init(&index->resize_lock, NULL);
+    for (int i = 0; i < LEASE_TABLE_STRIPES; i++)
+        pthread_mutex_init(&index->stripes[i], NULL);
+    return table;
+}
+
+// Double the bucket array once the average chain length passes 1. A lease
+// keeps its stripe, as bucket_count is a multiple of LEASE_TABLE_STRIPES.
+static void growLeaseTable(LeaseTable *table)
+{
+    pthread_rwlock_wrlock(&table->resize_lock);
+    if (atomic_load(&table->count) <= table->bucket_count)
+    {
+        pthread_rwlock_unlock(&table->resize_lock);
+        return;
+    }
+
+    size_t new_count = table->bucket_count << 1;
+    Lease **new_buckets = (Lease **)calloc(new_count, sizeof(Lease *));
+    if (!new_buckets)
+    {
+        pthread_rwlock_unlock(&table->resize_lock);
+        return;
+    }
+    for (size_t i = 0; i < table->bucket_count; i++)
+    {
+        Lease *lease = table->buckets[i];
+        while (lease)
+        {
+            Lease *next = lease->next;
+            size_t slot = lease->hash & (new_count - 1);
+            lease->next = new_buckets[slot];
+            new_buckets[slot] = lease;
+            lease = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = new_buckets;
+    table->bucket_count = new_count;
+    pthread_rwlock_unlock(&table->resize_lock);
+}
+
+static void growLeaseIndex(LeaseIndex *index)
+{
+    pthread_rwlock_wrlock(&index->resize_lock);
+    if (atomic_load(&index->count) <= index->bucket_count)
+    {
+        pthread_rwlock_unlock(&index->resize_lock);
+        return;
+    }
+
+    size_t new_count = index->bucket_count << 1;
+    LeaseIndexEntry **new_buckets = (LeaseIndexEntry **)calloc(new_count, sizeof(LeaseIndexEntry *));
+    if (!new_buckets)
+    {
+        pthread_rwlock_unlock(&index->resize_lock);
+        return;
+    }
+    for (size_t i = 0; i < index->bucket_count; i++)
+    {
+        LeaseIndexEntry *entry = index->buckets[i];
+        while (entry)
+        {
+            LeaseIndexEntry *next = entry->next;
+            size_t slot = entry->hash & (new_count - 1);
+            entry->next = new_buckets[slot];
+            new_buckets[slot] = entry;
+            entry = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = new_buckets;
+    index->bucket_count = new_count;
+    pthread_rwlock_unlock(&index->resize_lock);
+}
+
+// Lock the stripe owning a path's bucket; the resize lock is held shared
+// for as long as the caller works on the bucket.
+static size_t lockLeaseBucket(LeaseTable *table, unsigned int hash)
+{
+    pthread_rwlock_rdlock(&table->resize_lock);
+    size_t slot = hash & (table->bucket_count - 1);
+    pthread_mutex_lock(&table->stripes[slot % LEASE_TABLE_STRIPES].lock);
+    return slot;
+}
+
+static void unlockLeaseBucket(LeaseTable *table, size_t slot)
+{
+    pthread_mutex_unlock(&table->stripes[slot % LEASE_TABLE_STRIPES].lock);
+    pthread_rwlock_unlock(&table->resize_lock);
+}
+
+static size_t lockIndexBucket(LeaseIndex *index, unsigned int hash)
+{
+    pthread_rwlock_rdlock(&index->resize_lock);
+    size_t slot = hash & (index->bucket_count - 1);
+    pthread_mutex_lock(&index->stripes[slot % LEASE_TABLE_STRIPES]);
+    return slot;
+}
+
+static void unlockIndexBucket(LeaseIndex *index, size_t slot)
+{
+    pthread_mutex_unlock(&index->stripes[slot % LEASE_TABLE_STRIPES]);
+    pthread_rwlock_unlock(&index->resize_lock);
+}
+
+// File lease under key. Returns 1 if the index has outgrown its buckets.
+static int linkLease(LeaseIndex *index, LeaseLink *link, Lease *lease, const char *key)
+{
+    unsigned int hash = hashLeasePath(key);
+    size_t slot = lockIndexBucket(index, hash);
+    LeaseIndexEntry *entry = index->buckets[slot];
+    while (entry && !(entry->hash == hash && strcmp(entry->key, key) == 0))
+        entry = entry->next;
+    if (!entry)
+    {
+        entry = (LeaseIndexEntry *)malloc(sizeof(LeaseIndexEntry));
+        entry->key = strdup(key);
+        entry->hash = hash;
+        entry->links = NULL;
+        entry->next = index->buckets[slot];
+        index->buckets[slot] = entry;
+        atomic_fetch_add(&index->count, 1);
+    }
+    link->lease = lease;
+    link->entry = entry;
+    link->prev = NULL;
+    link->next = entry->links;
+    if (entry->links)
+        entry->links->prev = link;
+    entry->links = link;
+    int grow = atomic_load(&index->count) > index->bucket_count;
+    unlockIndexBucket(index, slot);
+    return grow;
+}
+
+// The entry stays alive while link is in it, so its hash can be read first
+static void unlinkLease(LeaseIndex *index, LeaseLink *link)
+{
+    LeaseIndexEntry *entry = link->entry;
+    size_t slot = lockIndexBucket(index, entry->hash);
+    if (link->prev)
+        link->prev->next = link->next;
+    else
+        entry->links = link->next;
+    if (link->next)
+        link->next->prev = link->prev;
+    if (!entry->links)
+    {
+        LeaseIndexEntry **chain = &index->buckets[slot];
+        while (*chain != entry)
+            chain = &(*chain)->next;
+        *chain = entry->next;
+        free(entry->key);
+        free(entry);
+        atomic_fetch_sub(&index->count, 1);
+    }
+    unlockIndexBucket(index, slot);
+}
+
+// The index keys of a lease, see the top of the file. Returns how many were
+// written to keys, at most max.
+static int leaseKeys(const Lease *lease, char keys[][MAX_PATH_LENGTH], int max)
+{
+    int count = 0;
+    size_t len = strlen(lease->path);
+    for (size_t i = 2; len > 1 && i <= len && count < max - 2; i++)
+    {
+        if (lease->path[i] == '/' || lease->path[i] == '\0')
+            snprintf(keys[count++], MAX_PATH_LENGTH, "%.*s", (int)i, lease->path);
+    }
+    snprintf(keys[count++], MAX_PATH_LENGTH, "S%p", (void *)lease->server);
+    snprintf(keys[count++], MAX_PATH_LENGTH, "H%s:%d", lease->holder_ip, lease->holder_port);
+    return count;
+}
+
+static int depthOf(const char *path)
+{
+    int depth = 0;
+    for (; *path; path++)
+        depth += *path == '/';
+    return depth;
+}
+
+// Caller holds the lease's bucket
+static void unlinkExpiry(LeaseStripe *stripe, Lease *lease)
+{
+    if (lease->older)
+        lease->older->newer = lease->newer;
+    else
+        stripe->oldest = lease->newer;
+    if (lease->newer)
+        lease->newer->older = lease->older;
+    else
+        stripe->newest = lease->older;
+}
+
+static void appendExpiry(LeaseStripe *stripe, Lease *lease)
+{
+    lease->older = stripe->newest;
+    lease->newer = NULL;
+    if (stripe->newest)
+        stripe->newest->newer = lease;
+    else
+        stripe->oldest = lease;
+    stripe->newest = lease;
+}
+
+// Take a lease out of its bucket, the expiry order and the index, and free
+// it. Caller holds the bucket at slot.
+static void dropLease(LeaseTable *table, size_t slot, Lease *lease)
+{
+    Lease **chain = &table->buckets[slot];
+    while (*chain != lease)
+        chain = &(*chain)->next;
+    *chain = lease->next;
+    unlinkExpiry(&table->stripes[slot % LEASE_TABLE_STRIPES], lease);
+    for (int i = 0; i < lease->link_count; i++)
+        unlinkLease(&table->index, &lease->links[i]);
+    atomic_fetch_sub(&table->count, 1);
+    free(lease->links);
+    free(lease->path);
+    free(lease);
+}
+
+// Drop the expired leases of the stripe that slot falls in; caller holds it
+static void pruneExpired(LeaseTable *table, size_t slot, long long now)
+{
+    LeaseStripe *stripe = &table->stripes[slot % LEASE_TABLE_STRIPES];
+    while (stripe->oldest && stripe->oldest->expires_ms <= now)
+    {
+        Lease *lease = stripe->oldest;
+        dropLease(table, lease->hash & (table->bucket_count - 1), lease);
+    }
+}
+
+// Record that a client holds the location of path on server. Returns the
+// lease length in ms, or 0 if none was granted.
+int leaseGrant(LeaseTable *table, const char *path, StorageServer *server, const char *ip, int port)
+{
+    if (!table || lease_duration_ms <= 0 || port <= 0)
+        return 0;
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, canonical, sizeof(canonical));
+    unsigned int h = hashLeasePath(canonical);
+    long long now = monotonicMs();
+
+    size_t slot = lockLeaseBucket(table, h);
+    LeaseStripe *stripe = &table->stripes[slot % LEASE_TABLE_STRIPES];
+    pruneExpired(table, slot, now);
+    for (Lease *lease = table->buckets[slot]; lease; lease = lease->next)
+    {
+        if (lease->hash == h && lease->holder_port == port && strcmp(lease->holder_ip, ip) == 0 &&
+            strcmp(lease->path, canonical) == 0)
+        {
+            if (lease->server != server)
+            {
+                // Filed under the old server; granted afresh below
+                dropLease(table, slot, lease);
+                break;
+            }
+            lease->expires_ms = now + lease_duration_ms;
+            unlinkExpiry(stripe, lease);
+            appendExpiry(stripe, lease);
+            unlockLeaseBucket(table, slot);
+            return lease_duration_ms;
+        }
+    }
+    if (atomic_load(&table->count) >= LEASE_TABLE_CAPACITY)
+    {
+        unlockLeaseBucket(table, slot);
+        return 0;
+    }
+
+    Lease *lease = (Lease *)malloc(sizeof(Lease));
+    lease->path = strdup(canonical);
+    lease->hash = h;
+    lease->server = server;
+    strncpy(lease->holder_ip, ip, INET_ADDRSTRLEN - 1);
+    lease->holder_ip[INET_ADDRSTRLEN - 1] = '\0';
+    lease->holder_port = port;
+    lease->expires_ms = now + lease_duration_ms;
+
+    int max_keys = depthOf(canonical) + 2;
+    char (*keys)[MAX_PATH_LENGTH] = malloc(max_keys * sizeof(*keys));
+    lease->link_count = leaseKeys(lease, keys, max_keys);
+    lease->links = (LeaseLink *)malloc(lease->link_count * sizeof(LeaseLink));
+    int grow_index = 0;
+    for (int i = 0; i < lease->link_count; i++)
+        grow_index |= linkLease(&table->index, &lease->links[i], lease, keys[i]);
+    free(keys);
+
+    lease->next = table->buckets[slot];
+    table->buckets[slot] = lease;
+    appendExpiry(stripe, lease);
+    size_t count = atomic_fetch_add(&table->count, 1) + 1;
+    size_t buckets = table->bucket_count;
+    unlockLeaseBucket(table, slot);
+
+    if (count > buckets)
+        growLeaseTable(table);
+    if (grow_index)
+        growLeaseIndex(&table->index);
+    return lease_duration_ms;
+}
+
+static void addHolder(LeaseHolder **holders, const char *ip, int port)
+{
+    for (LeaseHolder *holder = *holders; holder; holder = holder->next)
+    {
+        if (holder->port == port && strcmp(holder->ip, ip) == 0)
+            return;
+    }
+    LeaseHolder *holder = (LeaseHolder *)malloc(sizeof(LeaseHolder));
+    strcpy(holder->ip, ip);
+    holder->port = port;
+    holder->next = *holders;
+    *holders = holder;
+}
+
+// Drop every lease filed under key, and return the distinct holders of the
+// live ones. The leases are copied out of the index and then taken from
+// their buckets one at a time; one granted meanwhile is left alone, as it
+// would be had it come just after the revocation.
+static LeaseHolder *takeLeases(LeaseTable *table, const char *key)
+{
+    LeaseIndex *index = &table->index;
+    unsigned int hash = hashLeasePath(key);
+    size_t count = 0;
+    LeaseDescriptor *taken = NULL;
+
+    size_t slot = lockIndexBucket(index, hash);
+    LeaseIndexEntry *entry = index->buckets[slot];
+    while (entry && !(entry->hash == hash && strcmp(entry->key, key) == 0))
+        entry = entry->next;
+    if (entry)
+    {
+        for (LeaseLink *link = entry->links; link; link = link->next)
+            count++;
+        taken = (LeaseDescriptor *)malloc(count * sizeof(LeaseDescriptor));
+        size_t i = 0;
+        for (LeaseLink *link = entry->links; link; link = link->next, i++)
+        {
+            taken[i].path = strdup(link->lease->path);
+            taken[i].server = link->lease->server;
+            strcpy(taken[i].ip, link->lease->holder_ip);
+            taken[i].port = link->lease->holder_port;
+        }
+    }
+    unlockIndexBucket(index, slot);
+
+    LeaseHolder *holders = NULL;
+    long long now = monotonicMs();
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned int h = hashLeasePath(taken[i].path);
+        size_t bucket = lockLeaseBucket(table, h);
+        for (Lease *lease = table->buckets[bucket]; lease; lease = lease->next)
+        {
+            if (lease->hash == h && lease->server == taken[i].server && lease->holder_port == taken[i].port &&
+                strcmp(lease->holder_ip, taken[i].ip) == 0 && strcmp(lease->path, taken[i].path) == 0)
+            {
+                if (lease->expires_ms > now)
+                    addHolder(&holders, lease->holder_ip, lease->holder_port);
+                dropLease(table, bucket, lease);
+                break;
+            }
+        }
+        unlockLeaseBucket(table, bucket);
+        free(taken[i].path);
+    }
+    free(taken);
+    return holders;
+}
+
+// Drop every lease, for a revocation of "/"
+static LeaseHolder *takeAllLeases(LeaseTable *table)
+{
+    LeaseHolder *holders = NULL;
+    long long now = monotonicMs();
+    pthread_rwlock_rdlock(&table->resize_lock);
+    for (size_t slot = 0; slot < table->bucket_count; slot++)
+    {
+        pthread_mutex_lock(&table->stripes[slot % LEASE_TABLE_STRIPES].lock);
+        while (table->buckets[slot])
+        {
+            Lease *lease = table->buckets[slot];
+            if (lease->expires_ms > now)
+                addHolder(&holders, lease->holder_ip, lease->holder_port);
+            dropLease(table, slot, lease);
+        }
+        pthread_mutex_unlock(&table->stripes[slot % LEASE_TABLE_STRIPES].lock);
+    }
+    pthread_rwlock_unlock(&table->resize_lock);
+    return holders;
+}
+
+// A revocation taken under a server's lock, waiting to be sent
+typedef struct LeaseRevocation
+{
+    LeaseHolder *holders;
+    char message[MAX_PATH_LENGTH + 16];
+    struct LeaseRevocation *next;
+} LeaseRevocation;
+
+// Deliver a revocation to each holder and free the list. Connects are bounded
+// by LEASE_REVOKE_TIMEOUT_MS so a vanished client costs little.
+static void notifyHolders(LeaseHolder *holders, const char *message)
+{
+    while (holders)
+    {
+        LeaseHolder *holder = holders;
+        holders = holders->next;
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(holder->port);
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock >= 0 && inet_pton(AF_INET, holder->ip, &addr.sin_addr) == 1)
+        {
+            struct timeval timeout = {LEASE_REVOKE_TIMEOUT_MS / 1000, (LEASE_REVOKE_TIMEOUT_MS % 1000) * 1000};
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // Also bounds connect
+            if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+                send(sock, message, strlen(message), 0) > 0)
+                log_message(holder->ip, holder->port, "Client - Lease revoked:", message);
+            else
+                log_message_level(LOG_LEVEL_WARN, holder->ip, holder->port, "Client", "Lease holder unreachable, waiting for the lease to run out");
+        }
+        if (sock >= 0)
+            close(sock);
+        free(holder);
+    }
+}
+
+static LeaseHolder *takePathLeases(LeaseTable *table, const char *path, char *message, size_t size)
+{
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, canonical, sizeof(canonical));
+    snprintf(message, size, "REVOKE %s", canonical);
+    if (strcmp(canonical, "/") == 0)
+        return takeAllLeases(table);
+    return takeLeases(table, canonical);
+}
+
+static LeaseHolder *takeServerLeases(LeaseTable *table, StorageServer *server, char *message, size_t size)
+{
+    snprintf(message, size, "REVOKE_SERVER %s %d", server->ip, server->client_port);
+    char key[32];
+    snprintf(key, sizeof(key), "S%p", (void *)server);
+    return takeLeases(table, key);
+}
+
+// Caller holds server->lock
+static void deferRevocation(StorageServer *server, LeaseHolder *holders, const char *message)
+{
+    if (!holders)
+        return;
+    LeaseRevocation *revocation = (LeaseRevocation *)malloc(sizeof(LeaseRevocation));
+    if (!revocation)
+    {
+        notifyHolders(holders, message); // Late beats never
+        return;
+    }
+    revocation->holders = holders;
+    snprintf(revocation->message, sizeof(revocation->message), "%s", message);
+    revocation->next = NULL;
+    LeaseRevocation **link = &server->revocations;
+    while (*link)
+        link = &(*link)->next;
+    *link = revocation;
+}
+
+// Take back the leases on path and everything below it
+void leaseRevokePath(LeaseTable *table, const char *path)
+{
+    if (!table)
+        return;
+    char message[MAX_PATH_LENGTH + 16];
+    LeaseHolder *holders = takePathLeases(table, path, message, sizeof(message));
+    if (holders)
+        notifyHolders(holders, message);
+}
+
+// Take back every lease pointing at a storage server that is going away or
+// being replaced. Call before its client port changes or it is freed.
+void leaseRevokeServer(LeaseTable *table, StorageServer *server)
+{
+    if (!table || !server)
+        return;
+    char message[64];
+    LeaseHolder *holders = takeServerLeases(table, server, message, sizeof(message));
+    if (holders)
+        notifyHolders(holders, message);
+}
+
+// As leaseRevokePath, for a caller holding server->lock: the leases are
+// taken now, the holders told by leaseDeliverRevocations(server)
+void leaseRevokePathDeferred(LeaseTable *table, StorageServer *server, const char *path)
+{
+    if (!table)
+        return;
+    char message[MAX_PATH_LENGTH + 16];
+    deferRevocation(server, takePathLeases(table, path, message, sizeof(message)), message);
+}
+
+// As leaseRevokeServer, for a caller holding server->lock
+void leaseRevokeServerDeferred(LeaseTable *table, StorageServer *server)
+{
+    if (!table)
+        return;
+    char message[64];
+    deferRevocation(server, takeServerLeases(table, server, message, sizeof(message)), message);
+}
+
+// Send the revocations queued on server. Call without server->lock held.
+void leaseDeliverRevocations(StorageServer *server)
+{
+    pthread_mutex_lock(&server->lock);
+    LeaseRevocation *revocations = server->revocations;
+    server->revocations = NULL;
+    pthread_mutex_unlock(&server->lock);
+    while (revocations)
+    {
+        LeaseRevocation *revocation = revocations;
+        revocations = revocations->next;
+        notifyHolders(revocation->holders, revocation->message);
+        free(revocation);
+    }
+}
+
+// Forget a client's leases without telling it, e.g. once it has disconnected
+void leaseDropHolder(LeaseTable *table, const char *ip, int port)
+{
+    if (!table || port <= 0)
+        return;
+    char key[INET_ADDRSTRLEN + 16];
+    snprintf(key, sizeof(key), "H%s:%d", ip, port);
+    LeaseHolder *holders = takeLeases(table, key);
+    while (holders)
+    {
+        LeaseHolder *next = holders->next;
+        free(holders);
+        holders = next;
+    }
+}
@@ -1,42 +1,186 @@
 #include "header.h"
+#include <stdint.h>
+#include <strings.h>
+
+// Log lines are handed to a background writer through a bounded lock-free
+// ring (Vyukov-style MPMC queue: every slot carries a sequence number that
+// tells producers and the writer whose turn it is). Producers never block:
+// when the ring is full the line is counted as dropped and discarded.
+typedef struct LogEntry {
+    atomic_size_t sequence;
+    LogLevel level;
+    time_t time;
+    char text[LOG_ENTRY_SIZE];
+} LogEntry;
+
+static LogEntry log_ring[LOG_RING_SIZE];
+static atomic_size_t log_enqueue_pos;
+static size_t log_dequeue_pos; // Only touched by the writer thread
+static atomic_ulong log_dropped;
+static atomic_int log_running;
+static LogLevel log_threshold = LOG_LEVEL_INFO;
+static FILE *log_file = NULL;
+static pthread_t log_writer_thread;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static const char *log_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
 
 // Function to get the current timestamp
 void get_timestamp(char *timestamp, size_t size) {
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(timestamp, size, "%Y-%m-%d %H:%M:%S", tm_info);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(timestamp, size, "%Y-%m-%d %H:%M:%S", &tm_info);
 }
 
-// Function to log the message
-void log_message(const char *ip, int port, const char *role, const char *message) {
-    // Lock the mutex before writing to the log
-    pthread_mutex_lock(&log_mutex);
+// Pop one entry into out; returns 0 when the ring is empty
+static int log_dequeue(LogEntry *out) {
+    LogEntry *slot = &log_ring[log_dequeue_pos & (LOG_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (seq != log_dequeue_pos + 1)
+        return 0;
+    out->level = slot->level;
+    out->time = slot->time;
+    memcpy(out->text, slot->text, sizeof(out->text));
+    atomic_store_explicit(&slot->sequence, log_dequeue_pos + LOG_RING_SIZE, memory_order_release);
+    log_dequeue_pos++;
+    return 1;
+}
+
+static void write_entry(const LogEntry *entry) {
+    // Reformat the timestamp only when the second changes
+    static time_t last_time = 0;
+    static char timestamp[20];
+    if (entry->time != last_time) {
+        struct tm tm_info;
+        localtime_r(&entry->time, &tm_info);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+        last_time = entry->time;
+    }
+    if (entry->level == LOG_LEVEL_INFO)
+        fprintf(log_file, "[%s] %s\n", timestamp, entry->text);
+    else
+        fprintf(log_file, "[%s] %s %s\n", timestamp, log_level_names[entry->level], entry->text);
+}
+
+// Drains the ring into the log file; flushes whenever it runs dry
+static void *log_writer(void *arg) {
+    LogEntry entry;
+    unsigned long reported_drops = 0;
+    while (1) {
+        int wrote = 0;
+        while (log_dequeue(&entry)) {
+            write_entry(&entry);
+            wrote = 1;
+        }
+
+        unsigned long dropped = atomic_load(&log_dropped);
+        if (dropped != reported_drops) {
+            char timestamp[20];
+            get_timestamp(timestamp, sizeof(timestamp));
+            fprintf(log_file, "[%s] WARN %lu log messages dropped (ring full)\n", timestamp, dropped - reported_drops);
+            reported_drops = dropped;
+            wrote = 1;
+        }
+        if (wrote)
+            fflush(log_file);
+
+        if (!atomic_load(&log_running)) {
+            // One last pass for anything queued while shutting down
+            while (log_dequeue(&entry))
+                write_entry(&entry);
+            fflush(log_file);
+            break;
+        }
+        if (!wrote)
+            usleep(LOG_FLUSH_INTERVAL_US);
+    }
+    return NULL;
+}
+
+static void start_logger(void) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&log_ring[i].sequence, i);
+    atomic_init(&log_enqueue_pos, 0);
+    atomic_init(&log_dropped, 0);
+    atomic_init(&log_running, 1);
 
-    // Open the log file for appending
-    FILE *log_file = fopen(log_file_path, "a");
+    const char *level = getenv("NM_LOG_LEVEL");
+    if (level) {
+        for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++)
+            if (strcasecmp(level, log_level_names[i]) == 0)
+                log_threshold = (LogLevel)i;
+    }
+
+    // Kept open for the lifetime of the server with a large stdio buffer
+    log_file = fopen(log_file_path, "a");
     if (log_file == NULL) {
         perror("Failed to open log file");
-        pthread_mutex_unlock(&log_mutex);  // Unlock mutex before returning
+        atomic_store(&log_running, 0);
         return;
     }
+    setvbuf(log_file, NULL, _IOFBF, 1 << 16);
 
-    // Get the current timestamp
-    char timestamp[20];
-    get_timestamp(timestamp, sizeof(timestamp));
-
-    // If IP and Port are 0, log only timestamp and message
-    if (ip == NULL || port == 0) {
-        fprintf(log_file, "[%s] %s\n", timestamp, message);
-    } else {
-        // Format log entry: timestamp, IP, port, role, message
-        fprintf(log_file, "[%s] %s:%d %s %s\n", timestamp, ip, port, role, message);
+    if (pthread_create(&log_writer_thread, NULL, log_writer, NULL) != 0) {
+        perror("Failed to create log writer thread");
+        fclose(log_file);
+        log_file = NULL;
+        atomic_store(&log_running, 0);
+        return;
     }
+    // Fatal paths call exit(); make sure queued lines still reach the file
+    atexit(stop_logger);
+}
 
-    // Close the log file
+// Flush everything still queued and close the log file
+void stop_logger(void) {
+    pthread_once(&log_once, start_logger);
+    if (log_file == NULL)
+        return;
+    atomic_store(&log_running, 0);
+    pthread_join(log_writer_thread, NULL);
     fclose(log_file);
+    log_file = NULL;
+}
 
-    // Unlock the mutex
-    pthread_mutex_unlock(&log_mutex);
+// Function to log a message at the given level without blocking on disk I/O
+void log_message_level(LogLevel level, const char *ip, int port, const char *role, const char *message) {
+    pthread_once(&log_once, start_logger);
+    if (level < log_threshold || !atomic_load_explicit(&log_running, memory_order_relaxed))
+        return;
+
+    // Claim a slot; give up instead of waiting when the writer is behind
+    LogEntry *slot;
+    size_t pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+    while (1) {
+        slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->time = time(NULL);
+    // If IP and Port are 0, log only the message; long messages are truncated
+    if (ip == NULL || port == 0)
+        snprintf(slot->text, sizeof(slot->text), "%s", message);
+    else
+        snprintf(slot->text, sizeof(slot->text), "%s:%d %s %s", ip, port, role, message);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+// Function to log the message
+void log_message(const char *ip, int port, const char *role, const char *message) {
+    log_message_level(LOG_LEVEL_INFO, ip, port, role, message);
 }
 
 // Function to get the IP and port from a socket address (sockaddr_in)
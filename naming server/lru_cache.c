@@ -2,122 +2,238 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Keys are canonical paths, so "t//a.txt/" and "/t/a.txt" share an entry.
+// The high bits of the hash pick the shard, the low bits the bucket.
 static unsigned int hashKey(const char *key) {
-    unsigned int hash = 0;
+    unsigned int hash = 2166136261u;
     while (*key) {
-        hash = (hash * 31) + *key;
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
         key++;
     }
-    return hash % TABLE_SIZE;
+    return hash;
+}
+
+static CacheShard *shardFor(LRUCache *cache, unsigned int hash) {
+    return &cache->shards[(hash >> 24) % LRU_CACHE_SHARDS];
 }
 
 LRUCache *createLRUCache(int capacity) {
     printf("Creating cache\n");
+    if (capacity < LRU_CACHE_SHARDS)
+        capacity = LRU_CACHE_SHARDS;
+
     LRUCache *cache = (LRUCache *)malloc(sizeof(LRUCache));
     cache->capacity = capacity;
-    cache->size = 0;
-    cache->head = NULL;
-    cache->tail = NULL;
-    cache->hashTable = (CacheNode **)calloc(TABLE_SIZE, sizeof(CacheNode *));
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+
+    int per_shard = (capacity + LRU_CACHE_SHARDS - 1) / LRU_CACHE_SHARDS;
+    int buckets = 1;
+    while (buckets < per_shard)
+        buckets <<= 1;
+    for (int i = 0; i < LRU_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = per_shard;
+        shard->size = 0;
+        shard->bucket_count = buckets;
+        shard->head = NULL;
+        shard->tail = NULL;
+        shard->hashTable = (CacheNode **)calloc(buckets, sizeof(CacheNode *));
+    }
     return cache;
 }
 
 void freeLRUCache(LRUCache *cache) {
     printf("Freeing cache\n");
-    CacheNode *current = cache->head;
-    while (current) {
-        CacheNode *next = current->next;
-        free(current->key);
-        free(current);
-        current = next;
+    printCache(cache);
+    for (int i = 0; i < LRU_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+        CacheNode *current = shard->head;
+        while (current) {
+            CacheNode *next = current->next;
+            free(current->key);
+            free(current);
+            current = next;
+        }
+        free(shard->hashTable);
+        pthread_mutex_destroy(&shard->lock);
     }
-    free(cache->hashTable);
     free(cache);
 }
 
-static void moveToHead(LRUCache *cache, CacheNode *node) {
-    printf("Moving to head\n");
-    if (node == cache->head) return;
+static void unlinkList(CacheShard *shard, CacheNode *node) {
     if (node->prev) node->prev->next = node->next;
+    else shard->head = node->next;
     if (node->next) node->next->prev = node->prev;
-    if (node == cache->tail) cache->tail = node->prev;
-    node->next = cache->head;
+    else shard->tail = node->prev;
     node->prev = NULL;
-    if (cache->head) cache->head->prev = node;
-    cache->head = node;
-    if (!cache->tail) cache->tail = node;
-}
-
-static void removeTail(LRUCache *cache) {
-    printf("Removing tail\n");
-    if (!cache->tail) return;
-    CacheNode *tail = cache->tail;
-    if (tail->prev) tail->prev->next = NULL;
-    cache->tail = tail->prev;
-    if (cache->tail == NULL) cache->head = NULL;
-    unsigned int index = hashKey(tail->key);
-    cache->hashTable[index] = NULL;
-    free(tail->key);
-    free(tail);
-    cache->size--;
-}
-
-Node *getLRUCache(LRUCache *cache, const char *key) {
-    printf("Getting cache\n");
-    
-    unsigned int index = hashKey(key);
-    CacheNode *node = cache->hashTable[index];
-
-    int flag = 0;
-    
+    node->next = NULL;
+}
+
+static void pushHead(CacheShard *shard, CacheNode *node) {
+    node->prev = NULL;
+    node->next = shard->head;
+    if (shard->head) shard->head->prev = node;
+    shard->head = node;
+    if (!shard->tail) shard->tail = node;
+}
+
+static void moveToHead(CacheShard *shard, CacheNode *node) {
+    if (node == shard->head) return;
+    unlinkList(shard, node);
+    pushHead(shard, node);
+}
+
+// Take an entry out of both the bucket chain and the LRU list and free it
+static void removeEntry(CacheShard *shard, CacheNode *node) {
+    CacheNode **link = &shard->hashTable[node->hash & (shard->bucket_count - 1)];
+    while (*link && *link != node)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = node->hash_next;
+    unlinkList(shard, node);
+    free(node->key);
+    free(node);
+    shard->size--;
+}
+
+static CacheNode *findEntry(CacheShard *shard, const char *key, unsigned int hash) {
+    CacheNode *node = shard->hashTable[hash & (shard->bucket_count - 1)];
     while (node) {
-        if (strcmp(node->key, key) == 0) {
-            if(flag)
-            {
-                moveToHead(cache, node);
-            }
-            printCache(cache);
-            return node->node;
-        }
-        node = node->next;
-        flag ++;
+        if (node->hash == hash && strcmp(node->key, key) == 0)
+            return node;
+        node = node->hash_next;
     }
-    printCache(cache);
     return NULL;
 }
 
-void putLRUCache(LRUCache *cache, const char *key, Node *node) {
-    printf("Putting cache\n");
-    unsigned int index = hashKey(key);
-    CacheNode *existingNode = cache->hashTable[index];
-    while (existingNode) {
-        if (strcmp(existingNode->key, key) == 0) {
-            existingNode->node = node;
-            moveToHead(cache, existingNode);
-            return;
-        }
-        existingNode = existingNode->next;
+// Returns the cached node and its server, or NULL on a miss. Entries whose
+// server has gone inactive count as misses and are dropped.
+Node *getLRUCache(LRUCache *cache, const char *key, StorageServer **server_out) {
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(key, canonical, sizeof(canonical));
+    unsigned int hash = hashKey(canonical);
+    CacheShard *shard = shardFor(cache, hash);
+
+    Node *found = NULL;
+    pthread_mutex_lock(&shard->lock);
+    CacheNode *node = findEntry(shard, canonical, hash);
+    if (node && !node->server->active) {
+        removeEntry(shard, node);
+        node = NULL;
+    }
+    if (node) {
+        moveToHead(shard, node);
+        found = node->node;
+        if (server_out)
+            *server_out = node->server;
     }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (found)
+        atomic_fetch_add(&cache->hits, 1);
+    else
+        atomic_fetch_add(&cache->misses, 1);
+    return found;
+}
+
+void putLRUCache(LRUCache *cache, const char *key, StorageServer *server, Node *node) {
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(key, canonical, sizeof(canonical));
+    unsigned int hash = hashKey(canonical);
+    CacheShard *shard = shardFor(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheNode *existingNode = findEntry(shard, canonical, hash);
+    if (existingNode) {
+        existingNode->server = server;
+        existingNode->node = node;
+        moveToHead(shard, existingNode);
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
     CacheNode *newNode = (CacheNode *)malloc(sizeof(CacheNode));
+    newNode->key = strdup(canonical);
+    newNode->hash = hash;
+    newNode->server = server;
     newNode->node = node;
-    newNode->key = strdup(key);
-    newNode->prev = NULL;
-    newNode->next = cache->head;
-    if (cache->head) cache->head->prev = newNode;
-    cache->head = newNode;
-    if (!cache->tail) cache->tail = newNode;
-    cache->hashTable[index] = newNode;
-    cache->size++;
-    if (cache->size > cache->capacity) {
-        removeTail(cache);
+    unsigned int index = hash & (shard->bucket_count - 1);
+    newNode->hash_next = shard->hashTable[index];
+    shard->hashTable[index] = newNode;
+    pushHead(shard, newNode);
+    shard->size++;
+    if (shard->size > shard->capacity)
+        removeEntry(shard, shard->tail);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void invalidateLRUCache(LRUCache *cache, const char *key) {
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(key, canonical, sizeof(canonical));
+    unsigned int hash = hashKey(canonical);
+    CacheShard *shard = shardFor(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheNode *node = findEntry(shard, canonical, hash);
+    if (node)
+        removeEntry(shard, node);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Drop a path and everything below it, e.g. after a directory is deleted
+void invalidateLRUCachePrefix(LRUCache *cache, const char *prefix) {
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(prefix, canonical, sizeof(canonical));
+    size_t len = strlen(canonical);
+    int whole_tree = strcmp(canonical, "/") == 0;
+
+    for (int i = 0; i < LRU_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        CacheNode *node = shard->head;
+        while (node) {
+            CacheNode *next = node->next;
+            if (whole_tree ||
+                (strncmp(node->key, canonical, len) == 0 && (node->key[len] == '\0' || node->key[len] == '/')))
+                removeEntry(shard, node);
+            node = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Drop every entry pointing into a storage server's tree before it is freed
+void invalidateLRUCacheServer(LRUCache *cache, StorageServer *server) {
+    for (int i = 0; i < LRU_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        CacheNode *node = shard->head;
+        while (node) {
+            CacheNode *next = node->next;
+            if (node->server == server)
+                removeEntry(shard, node);
+            node = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
     }
 }
 
+void getLRUCacheStats(LRUCache *cache, unsigned long *hits, unsigned long *misses) {
+    *hits = atomic_load(&cache->hits);
+    *misses = atomic_load(&cache->misses);
+}
+
 void printCache(LRUCache *cache) {
-    printf("Printing cache\n");
-    CacheNode *current = cache->head;
-    while (current) {
-        printf("Key: %s\n", current->key);
-        current = current->next;
+    unsigned long hits, misses;
+    getLRUCacheStats(cache, &hits, &misses);
+    int size = 0;
+    for (int i = 0; i < LRU_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        size += cache->shards[i].size;
+        pthread_mutex_unlock(&cache->shards[i].lock);
     }
-}
\ No newline at end of file
+    printf("Cache: %d/%d entries, %lu hits, %lu misses\n", size, cache->capacity, hits, misses);
+}
@@ -3,24 +3,43 @@
 
 #include "header.h"
 
+#define LRU_CACHE_CAPACITY 4096 // Default number of cached paths, NM_CACHE_CAPACITY overrides it
+#define LRU_CACHE_SHARDS 16     // Independent LRU lists, each behind its own mutex
+
 typedef struct CacheNode {
-    Node *node;
     char *key;
-    struct CacheNode *prev;
+    unsigned int hash;
+    StorageServer *server;
+    Node *node;
+    struct CacheNode *prev;      // LRU list of the shard
     struct CacheNode *next;
+    struct CacheNode *hash_next; // Bucket chain of the shard
 } CacheNode;
 
-typedef struct LRUCache {
+typedef struct CacheShard {
+    pthread_mutex_t lock;
     int capacity;
     int size;
-    CacheNode *head;
-    CacheNode *tail;
+    int bucket_count;
+    CacheNode *head; // Most recently used
+    CacheNode *tail; // Next to be evicted
     CacheNode **hashTable;
+} CacheShard;
+
+typedef struct LRUCache {
+    int capacity;
+    CacheShard shards[LRU_CACHE_SHARDS];
+    atomic_ulong hits;
+    atomic_ulong misses;
 } LRUCache;
 
 LRUCache *createLRUCache(int capacity);
 void freeLRUCache(LRUCache *cache);
-Node *getLRUCache(LRUCache *cache, const char *key);
-void putLRUCache(LRUCache *cache, const char *key, Node *node);
+Node *getLRUCache(LRUCache *cache, const char *key, StorageServer **server_out);
+void putLRUCache(LRUCache *cache, const char *key, StorageServer *server, Node *node);
+void invalidateLRUCache(LRUCache *cache, const char *key);
+void invalidateLRUCachePrefix(LRUCache *cache, const char *prefix);
+void invalidateLRUCacheServer(LRUCache *cache, StorageServer *server);
+void getLRUCacheStats(LRUCache *cache, unsigned long *hits, unsigned long *misses);
 void printCache(LRUCache *cache);
-#endif // LRU_CACHE_H
\ No newline at end of file
+#endif // LRU_CACHE_H
@@ -4,7 +4,6 @@
 LRUCache *cache;
 AsyncWriteState *writeStateQueue = NULL; // Head of the queue
 pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex to protect log file access
 pthread_t monitorThread;
 // Log file path
 const char *log_file_path = "serverlog.txt";
@@ -69,50 +68,18 @@ StorageServer *findStorageServer(StorageServerTable *table, const char *ip, int
 // Find storage server containing a specific path
 StorageServer *findStorageServerByPath(StorageServerTable *table, const char *path)
 {
-    Node *cachedNode = getLRUCache(cache, path);
-    if (cachedNode != NULL)
+    StorageServer *server = NULL;
+    if (getLRUCache(cache, path, &server) != NULL)
     {
-        // Return the server associated with the cached node
-        for (int i = 0; i < TABLE_SIZE; i++)
-        {
-            pthread_mutex_lock(&table->locks[i]);
-            StorageServer *server = table->table[i];
-            while (server)
-            {
-                if (server->root == cachedNode)
-                {
-                    pthread_mutex_unlock(&table->locks[i]);
-                    return server;
-                }
-                server = server->next;
-            }
-            pthread_mutex_unlock(&table->locks[i]);
-        }
+        return server;
     }
-
-    // If not found in cache, search in the storage servers
-    for (int i = 0; i < TABLE_SIZE; i++)
+    Node *node = pathIndexLookup(path_index, path, &server);
+    if (node == NULL)
     {
-        pthread_mutex_lock(&table->locks[i]);
-        StorageServer *server = table->table[i];
-        while (server)
-        {
-            if (server->active && server->root)
-            {
-                Node *found_node = searchPath(server->root, path);
-                if (found_node != NULL)
-                {
-                    putLRUCache(cache, path, found_node); // Cache the found node
-                    pthread_mutex_unlock(&table->locks[i]);
-                    return server;
-                }
-            }
-            server = server->next;
-        }
-        pthread_mutex_unlock(&table->locks[i]);
+        return NULL;
     }
-
-    return NULL;
+    putLRUCache(cache, path, server, node);
+    return server;
 }
 
 StorageServer *findStorageServerByPath2(StorageServerTable *table, const char *path)
@@ -150,86 +117,205 @@ StorageServer *handleNewStorageServer(int socket, StorageServerTable *table)
     StorageServer *server = malloc(sizeof(StorageServer));
     server->ss_backup_1 = NULL;
     server->ss_backup_2 = NULL;
+    server->read_load = 0;
+    server->read_load_ms = 0;
+    server->revocations = NULL;
     server->socket = socket;
     server->active = true;
+    server->root = NULL;
+    server->epoch = 0;
+    server->applied_seq = 0;
     pthread_mutex_init(&server->lock, NULL);
+    initStorageServerChannel(server);
     
     // Receive server information
-    if (receiveServerInfo(socket, server->ip, &server->nm_port, &server->client_port, &server->root) != 0)
+    StorageServer *resumed = NULL;
+    if (receiveServerInfo(socket, table, server, &resumed) != 0)
     {
+        pthread_mutex_destroy(&server->lock);
+        destroyStorageServerChannel(server);
         free(server);
         return NULL;
     }
+    if (resumed)
+    {
+        // The same run of the storage server came back and its tree was
+        // brought up to date in place
+        pthread_mutex_destroy(&server->lock);
+        destroyStorageServerChannel(server);
+        free(server);
+        return resumed;
+    }
     StorageServer *existing_server = findStorageServerByPath2(table, server->root->name);
     if (existing_server)
     {
-        server->id=existing_server->id;
+        // A new run of a server we lost takes its entry over in place: backup
+        // jobs, copies and replica lists may still hold the pointer, so the
+        // entry is never freed. Its replicas are placed anew.
+        forgetBackupServer(table, existing_server);
         unsigned int index = hashStorageServer(existing_server->ip, existing_server->nm_port);
-        pthread_mutex_lock(&table->locks[index]);
-        //add or correct it if already exist then dont increase the count just remove the older one and add new one
-        StorageServer *prev = NULL;
-        StorageServer *current = table->table[index];
-        while (current)
+        unsigned int index2 = hashStorageServer(server->ip, server->nm_port);
+        if (index != index2)
         {
-            if (current == existing_server)
+            pthread_mutex_lock(&table->locks[index]);
+            for (StorageServer **link = &table->table[index]; *link; link = &(*link)->next)
             {
-                if (prev)
-                    prev->next = current->next;
-                else
-                    table->table[index] = current->next;
-
-                // Free the existing server resources
-                close(existing_server->socket);
-                pthread_mutex_destroy(&existing_server->lock);
-                free(existing_server->root); // Assuming root needs to be freed
-                free(existing_server);
-
-                break;
+                if (*link == existing_server)
+                {
+                    *link = existing_server->next;
+                    break;
+                }
             }
-            prev = current;
-            current = current->next;
+            pthread_mutex_unlock(&table->locks[index]);
         }
-        pthread_mutex_unlock(&table->locks[index]);
-        unsigned int index2 = hashStorageServer(server->ip, server->nm_port);
-        pthread_mutex_lock(&table->locks[index2]);
-        server->next = table->table[index2];
-        table->table[index2] = server;
-        pthread_mutex_unlock(&table->locks[index2]);
-        return server;
+
+        pthread_mutex_lock(&existing_server->lock);
+        replaceServerTree(existing_server, server->root);
+        close(existing_server->socket);
+        existing_server->socket = socket;
+        memcpy(existing_server->ip, server->ip, sizeof(existing_server->ip));
+        existing_server->nm_port = server->nm_port;
+        existing_server->client_port = server->client_port;
+        existing_server->epoch = server->epoch;
+        existing_server->applied_seq = server->applied_seq;
+        existing_server->ss_backup_1 = NULL;
+        existing_server->ss_backup_2 = NULL;
+        existing_server->read_load = 0;
+        existing_server->active = true;
+        pthread_mutex_unlock(&existing_server->lock);
+        leaseDeliverRevocations(existing_server);
+
+        if (index != index2)
+            addStorageServer(table, existing_server);
+        pthread_mutex_destroy(&server->lock);
+        destroyStorageServerChannel(server);
+        free(server);
+        return existing_server;
     }
     table->count++;
     server->id = table->count;
     addStorageServer(table, server);
+    pathIndexAddSubtree(path_index, server, server->root, "/");
     return server;
 }
 
-// Thread function to handle storage server
-void *storageServerHandler(void *arg)
+// Look for the entry a reconnecting storage server left behind. The journal
+// epoch is only shared by connections from the same run of the server.
+static StorageServer *findResumableServer(StorageServerTable *table, const char *ip, uint32_t epoch)
 {
-    StorageServer *server = (StorageServer *)arg;
+    if (epoch == 0)
+        return NULL;
+    for (int i = 0; i < TABLE_SIZE; i++)
+    {
+        pthread_mutex_lock(&table->locks[i]);
+        for (StorageServer *server = table->table[i]; server; server = server->next)
+        {
+            if (!server->active && server->epoch == epoch && server->root && strcmp(server->ip, ip) == 0)
+            {
+                pthread_mutex_unlock(&table->locks[i]);
+                return server;
+            }
+        }
+        pthread_mutex_unlock(&table->locks[i]);
+    }
+    return NULL;
+}
 
-    while (1)
+// Swap in a freshly received tree for a server; caller holds server->lock
+// and calls leaseDeliverRevocations once it is let go
+void replaceServerTree(StorageServer *server, Node *root)
+{
+    if (server->root)
     {
-        char command[1024];
-        memset(command, 0, sizeof(command));
-        ssize_t bytes_received = recv(server->socket, command, sizeof(command) - 1, 0);
+        leaseRevokeServerDeferred(lease_table, server);
+        pathIndexRemoveSubtree(path_index, server, server->root, "/");
+        invalidateLRUCacheServer(cache, server);
+        freeNode(server->root);
+    }
+    server->root = root;
+    pathIndexAddSubtree(path_index, server, root, "/");
+}
 
-        if (bytes_received <= 0)
+// Apply one journal event from a storage server to our copy of its tree;
+// caller holds server->lock and calls leaseDeliverRevocations once it is let
+// go. Events already reflected in the tree are no-ops.
+void applyNamespaceEvent(StorageServer *server, JournalOp op, NodeType type, Permissions permissions, int64_t size, const char *path)
+{
+    Node *node = searchPath(server->root, path);
+    if (op == JOURNAL_CREATE)
+    {
+        if (node)
+            return;
+        char parent_path[MAX_PATH_LENGTH];
+        getParentPath(path, parent_path);
+        Node *parentDir = parent_path[0] ? searchPath(server->root, parent_path) : server->root;
+        const char *name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        if (!parentDir || parentDir->type != DIRECTORY_NODE || !*name)
         {
-            pthread_mutex_lock(&server->lock);
-            server->active = false;
-            pthread_mutex_unlock(&server->lock);
-            printf("Storage server %s disconnected\n", server->ip);
-            log_message(server->ip, server->nm_port, "SS", "Storage Server Disconnected.");
-            break;
+            log_message_level(LOG_LEVEL_WARN, server->ip, server->nm_port, "SS", "Namespace event for a path without a parent directory");
+            return;
         }
-
-        command[bytes_received] = '\0';
-        // Handle storage server commands/updates
-        // Update the server's node tree as needed
+        Node *newNode = createNode(name, type, permissions);
+        newNode->parent = parentDir;
+        insertNode(parentDir->children, newNode);
+        pathIndexInsert(path_index, path, server, newNode);
+    }
+    else if (op == JOURNAL_DELETE)
+    {
+        if (!node || node == server->root)
+            return;
+        pathIndexRemoveSubtree(path_index, server, node, path);
+        invalidateLRUCachePrefix(cache, path);
+        leaseRevokePathDeferred(lease_table, server, path);
+        deleteNode(node);
     }
+    else if (op == JOURNAL_RESIZE)
+    {
+        // File sizes are not kept on the naming server; the event only
+        // advances applied_seq
+        char log_buf[MAX_PATH_LENGTH + 64];
+        snprintf(log_buf, sizeof(log_buf), "%s is now %lld bytes", path, (long long)size);
+        log_message_level(LOG_LEVEL_DEBUG, server->ip, server->nm_port, "SS", log_buf);
+    }
+}
 
-    return NULL;
+// Ask a storage server for the namespace changes after server->applied_seq
+// and apply them. server->lock is only held to apply the reply.
+int syncStorageServer(StorageServer *server)
+{
+    char request[64];
+    pthread_mutex_lock(&server->lock);
+    snprintf(request, sizeof(request), "SYNC %llu", (unsigned long long)server->applied_seq);
+    pthread_mutex_unlock(&server->lock);
+
+    char *reply;
+    ssize_t len = ssRequest(server, request, &reply, SS_REQUEST_TIMEOUT_MS);
+    if (len < 0)
+        return -1;
+
+    pthread_mutex_lock(&server->lock);
+    Node *root = NULL;
+    int result = server->active ? receiveNamespaceReply(server, reply, len, &root) : -1;
+    if (root)
+        replaceServerTree(server, root); // The journal had rolled past us
+    pthread_mutex_unlock(&server->lock);
+    leaseDeliverRevocations(server);
+    free(reply);
+    return result < 0 ? -1 : 0;
+}
+
+// Index a node that a COPY just added under dest_dir on a storage server.
+// Caller holds server->lock and calls leaseDeliverRevocations after.
+void indexCopiedNode(StorageServer *server, Node *node, const char *dest_dir)
+{
+    if (!node)
+        return;
+    char node_path[MAX_PATH_LENGTH];
+    snprintf(node_path, sizeof(node_path), "%s/%s", dest_dir, node->name);
+    invalidateLRUCachePrefix(cache, node_path);
+    leaseRevokePathDeferred(lease_table, server, node_path);
+    pathIndexAddSubtree(path_index, server, node, node_path);
 }
 
 void getFileName(const char *path, char **filename)
@@ -244,542 +330,475 @@ void getFileName(const char *path, char **filename)
     *filename = lastSlash ? (char *)(lastSlash + 1) : (char *)path;
 }
 
-void *clientHandler(void *arg)
+// CREATE and DELETE wait for a storage server's reply, up to
+// SS_REQUEST_TIMEOUT_MS, and are left to the storage workers
+static bool waitsOnStorageServer(const char *buffer)
 {
-    struct
+    char command[20];
+    if (sscanf(buffer, "%19s", command) != 1)
+        return false;
+    return strcasecmp(command, "CREATE") == 0 || strcasecmp(command, "DELETE") == 0;
+}
+
+// Check a COPY against the trees of both servers, locked in address order as
+// in mirrorCopy so a namespace sync cannot free nodes under us. Unless
+// dest_found, dest_path is not there and its parent is copied into instead;
+// dest_path is changed to it. Returns NULL, or the error to send.
+static const char *checkCopy(StorageServer *source_server, const char *path, StorageServer *dest_server, bool dest_found, char *dest_path)
+{
+    if (!source_server)
+        return " \033[1;31mERROR 404:\033[0m \033[38;5;214mSource Path not found!\033[0m\n\0";
+    StorageServer *first = source_server;
+    StorageServer *second = dest_server;
+    if (second && first > second)
     {
-        int socket;
-        StorageServerTable *table;
-    } *args = arg;
-    int client_socket = args->socket;
-    StorageServerTable *table = args->table;
+        first = dest_server;
+        second = source_server;
+    }
+    pthread_mutex_lock(&first->lock);
+    if (second && second != first)
+        pthread_mutex_lock(&second->lock);
+
+    const char *error = NULL;
+    Node *source_node = findNode(source_server->root, path);
+    // A directory copied into itself would be listed while it grows
+    char source_canonical[MAX_PATH_LENGTH];
+    char dest_canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, source_canonical, sizeof(source_canonical));
+    canonicalizePath(dest_path, dest_canonical, sizeof(dest_canonical));
+    size_t source_len = strlen(source_canonical);
+    char parent_path[MAX_PATH_LENGTH];
+    getParentPath(dest_path, parent_path);
+    Node *dest_node = dest_server ? findNode(dest_server->root, dest_found ? dest_path : parent_path) : NULL;
+    if (!source_node)
+        error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mSource Path not found!\033[0m\n\0";
+    else if (source_node->type == DIRECTORY_NODE && strncmp(dest_canonical, source_canonical, source_len) == 0 &&
+             (dest_canonical[source_len] == '\0' || dest_canonical[source_len] == '/'))
+        error = " \033[1;31mERROR 400:\033[0m \033[38;5;214mCannot copy a directory into itself!\033[0m\n\0";
+    else if (!dest_server)
+        error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mDestination Path not found!\033[0m\n\0";
+    else if (!dest_found && (!dest_node || dest_node->type != DIRECTORY_NODE))
+        error = " \033[1;31mERROR 400:\033[0m \033[38;5;214mPath is not a directory!\033[0m\n\0";
+    else if (dest_found && (!dest_node || dest_node->type == FILE_NODE))
+        error = " \033[1;31mERROR 400:\033[0m \033[38;5;214mDestination Path is not a directory!\033[0m\n\0";
+    else if (!dest_found)
+        strcpy(dest_path, parent_path);
+
+    if (second && second != first)
+        pthread_mutex_unlock(&second->lock);
+    pthread_mutex_unlock(&first->lock);
+    return error;
+}
+
+// Handle one request from a client connection. Called by a reactor worker once
+// the socket is readable; returns 0 to keep the connection, -1 to close it, or
+// 1 if the request waits on a storage server: it is then kept in
+// conn->request for serveClientRequest on a storage worker.
+int handleClientRequest(ClientConnection *conn, StorageServerTable *table)
+{
+    int client_socket = conn->socket;
     char buffer[MAX_BUFFER_SIZE];
-    char command[20];
-    char path[MAX_PATH_LENGTH];
-    char dest_path[MAX_PATH_LENGTH];
     ssize_t bytes_received;
 
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-
-    // Now, let's log the action (get client's IP and port)
-    if (getpeername(client_socket, (struct sockaddr *)&client_addr, &addr_len) == -1)
+    const char *client_ip = conn->ip;
+    int client_port = conn->port;
+    memset(buffer, 0, sizeof(buffer));
+    bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
     {
-        perror("getpeername failed");
-        return NULL;
+        return 0;
+    }
+    if (bytes_received <= 0)
+    {
+        log_message(client_ip, client_port, "Client", "Client disconnected");
+        return -1;
+    }
+    buffer[bytes_received] = '\0';
+    log_message(client_ip, client_port, "Received from Client:", buffer);
+    if (waitsOnStorageServer(buffer))
+    {
+        conn->request = strdup(buffer);
+        if (conn->request)
+            return 1;
     }
+    return serveClientRequest(conn, table, buffer);
+}
 
-    // Extract the client IP address and port
-    char client_ip[INET_ADDRSTRLEN];
-    int client_port;
-    get_ip_and_port(&client_addr, client_ip, &client_port);
-    while (1)
+// Serve one request read off a client connection; returns 0 to keep the
+// connection, -1 to close it
+int serveClientRequest(ClientConnection *conn, StorageServerTable *table, const char *buffer)
+{
+    int client_socket = conn->socket;
+    char command[20];
+    char path[MAX_PATH_LENGTH];
+    char dest_path[MAX_PATH_LENGTH];
+    const char *client_ip = conn->ip;
+    int client_port = conn->port;
+    if (sscanf(buffer, "%s %s", command, path) < 1)
     {
-        memset(buffer, 0, sizeof(buffer));
-        bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-        buffer[bytes_received] = '\0';
-        log_message(client_ip, client_port, "Received from Client:", buffer);
-        if (sscanf(buffer, "%s %s", command, path) < 1)
+        send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid command!\n\0\033[0m",
+             strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid command!\n\0\033[0m"), 0);
+        log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid command!\n\0\033[0m");
+        return 0;
+    }
+    for (int i = 0; command[i]; i++)
+    {
+        command[i] = toupper(command[i]);
+    }
+    printf("%s \n", path);
+    if (strcmp(command, "LEASES") == 0)
+    {
+        // The client takes location leases and hears about revocations on this port
+        char response[64];
+        int lease_port = atoi(path);
+        if (lease_port > 0 && lease_port <= 65535)
         {
-            send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid command!\n\0\033[0m",
-                 strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid command!\n\0\033[0m"), 0);
-            log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid command!\n\0\033[0m");
-            continue;
+            conn->lease_port = lease_port;
+            snprintf(response, sizeof(response), "LEASES %d", lease_duration_ms > 0 ? lease_duration_ms : 0);
         }
-        for (int i = 0; command[i]; i++)
+        else
+            snprintf(response, sizeof(response), "LEASES 0");
+        send(client_socket, response, strlen(response), 0);
+        log_message(client_ip, client_port, "Sent to Client:", response);
+    }
+    else if (strcmp(command, "READ") == 0 || strcmp(command, "WRITE") == 0 || strcmp(command, "META") == 0 || strcmp(command, "STREAM") == 0)
+    {
+        StorageServer *server = findStorageServerByPath(table, path);
+        if (!server || server->active != 1)
         {
-            command[i] = toupper(command[i]);
+            const char *error = " \033[1;31mERROR: 404\033[0m \033[38;5;214mPath not found!\n\0\033[0m";
+            send(client_socket, error, strlen(error), 0);
+            log_message(client_ip, client_port, "Sent to Client:", error);
+            printf("sent error\n");
+            fflush(stdout);
+            return 0;
         }
-        printf("%s \n", path);
-        if (strcmp(command, "READ") == 0 || strcmp(command, "WRITE") == 0 || strcmp(command, "META") == 0 || strcmp(command, "STREAM") == 0)
+        printf("%s\n", server->root->name);
+        // Reads may go to a replica; the set is worked out before server->lock is taken
+        char replicas[512] = "";
+        if (strcmp(command, "WRITE") != 0)
+            appendReadReplicas(server, path, replicas, sizeof(replicas));
+        pthread_mutex_lock(&server->lock);
+        char response[MAX_BUFFER_SIZE];
+        if (server->active)
         {
-            StorageServer *server = findStorageServerByPath(table, path);
-            if (!server || server->active != 1)
+            printf("storage details %s %d\n", server->ip, server->client_port);
+            memset(response, 0, sizeof(response));
+            int lease_ms = leaseGrant(lease_table, path, server, client_ip, conn->lease_port);
+            if (lease_ms > 0)
+                snprintf(response, sizeof(response), "StorageServer: %s : %d LEASE %d%s", server->ip, server->client_port, lease_ms, replicas);
+            else
+                snprintf(response, sizeof(response), "StorageServer: %s : %d%s", server->ip, server->client_port, replicas);
+            send(client_socket, response, strlen(response), 0);
+            log_message(client_ip, client_port, "Sent to Client(SS Details):", response);
+        }
+        else
+        {
+            const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorge Server not active.\n\0\033[0m";
+            send(client_socket, error, strlen(error), 0);
+            log_message(client_ip, client_port, "Sent to Client:", error);
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+    else if (sscanf(buffer, "LIST %s", path) == 1 || strncmp(buffer, "LIST", 4) == 0)
+    {
+        char response[100001];
+        int response_offset = 0;
+        if (strcmp(buffer, "LIST") == 0)
+        {
+            for (int i = 0; i < TABLE_SIZE; i++)
             {
-                const char *error = " \033[1;31mERROR: 404\033[0m \033[38;5;214mPath not found!\n\0\033[0m";
-                send(client_socket, error, strlen(error), 0);
-                log_message(client_ip, client_port, "Sent to Client:", error);
-                printf("sent error\n");
-                fflush(stdout);
-                continue;
+                pthread_mutex_lock(&table->locks[i]);
+                StorageServer *server = table->table[i];
+                while (server)
+                {
+                    if (server->active)
+                    {
+                        // Traverse the entire structure of this server
+                        recursiveList(server->root, "", response, &response_offset, sizeof(response));
+                    }
+                    server = server->next;
+                }
+                pthread_mutex_unlock(&table->locks[i]);
             }
-            printf("%s\n", server->root->name);
-            pthread_mutex_lock(&server->lock);
-            char response[MAX_BUFFER_SIZE];
-            if (server->active)
+            // Send the response with all the matching servers
+            if (response_offset > 0)
             {
-                printf("storage details %s %d\n", server->ip, server->client_port);
-                memset(response, 0, sizeof(response));
-                snprintf(response, sizeof(response), "StorageServer: %s : %d", server->ip, server->client_port);
-                send(client_socket, response, strlen(response), 0);
-                log_message(client_ip, client_port, "Sent to Client(SS Details):", response);
+                send(client_socket, response, response_offset, 0); // Send the listing response to the client
+                log_message(client_ip, client_port, "Sent to Client:", response);
             }
             else
             {
-                const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorge Server not active.\n\0\033[0m";
+                const char *error = " \033[1;31mERROR 401:\033[0m \033[38;5;214mNo Files or Directories found in the path.\n\0\033[0m";
                 send(client_socket, error, strlen(error), 0);
                 log_message(client_ip, client_port, "Sent to Client:", error);
             }
-            pthread_mutex_unlock(&server->lock);
         }
-        else if (sscanf(buffer, "LIST %s", path) == 1 || strncmp(buffer, "LIST", 4) == 0)
+        else
         {
-            char response[100001];
-            int response_offset = 0;
-            if (strcmp(buffer, "LIST") == 0)
+            StorageServerList *servers = findStorageServersByPath_List(table, path);
+            if (!servers)
             {
-                for (int i = 0; i < TABLE_SIZE; i++)
-                {
-                    pthread_mutex_lock(&table->locks[i]);
-                    StorageServer *server = table->table[i];
-                    while (server)
-                    {
-                        if (server->active)
-                        {
-                            // Traverse the entire structure of this server
-                            recursiveList(server->root, "", response, &response_offset, sizeof(response));
-                        }
-                        server = server->next;
-                    }
-                    pthread_mutex_unlock(&table->locks[i]);
-                }
-                // Send the response with all the matching servers
-                if (response_offset > 0)
-                {
-                    send(client_socket, response, response_offset, 0); // Send the listing response to the client
-                    log_message(client_ip, client_port, "Sent to Client:", response);
-                }
-                else
-                {
-                    const char *error = " \033[1;31mERROR 401:\033[0m \033[38;5;214mNo Files or Directories found in the path.\n\0\033[0m";
-                    send(client_socket, error, strlen(error), 0);
-                    log_message(client_ip, client_port, "Sent to Client:", error);
-                }
-            }
-            else
-            {
-                StorageServerList *servers = findStorageServersByPath_List(table, path);
-                if (!servers)
-                {
-                    const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\n\0\033[0m";
-                    send(client_socket, error, strlen(error), 0);
-                    log_message(client_ip, client_port, "Sent to Client:", error);
+                const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\n\0\033[0m";
+                send(client_socket, error, strlen(error), 0);
+                log_message(client_ip, client_port, "Sent to Client:", error);
 
-                    continue;
-                }
+                return 0;
+            }
 
-                // Iterate over all matching servers
-                for (StorageServerList *server_list = servers; server_list != NULL; server_list = server_list->next)
+            // Iterate over all matching servers
+            for (StorageServerList *server_list = servers; server_list != NULL; server_list = server_list->next)
+            {
+                StorageServer *server = server_list->server;
+                pthread_mutex_lock(&server->lock);
+                if (server->active)
                 {
-                    StorageServer *server = server_list->server;
-                    pthread_mutex_lock(&server->lock);
-                    if (server->active)
+                    // The index entry may be gone by now; look the node up
+                    // again under server->lock
+                    Node *target_node = findNode(server->root, path);
+                    if (!target_node)
                     {
-                        // The path has been found in this server, now find the specified path inside the server
-                        Node *target_node = searchPath(server->root, path);
-                        if (!target_node)
-                        {
-                            const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\n\0\033[0m";
-                            send(client_socket, error, strlen(error), 0);
-                            log_message(client_ip, client_port, "Sent to Client:", error);
-                            pthread_mutex_unlock(&server->lock);
-                            continue;
-                        }
-                        else
-                        {
-                            recursiveList(target_node, path, response, &response_offset, sizeof(response));
-                        }
-
-                        // If the path is a directory, list its immediate children
+                        const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\n\0\033[0m";
+                        send(client_socket, error, strlen(error), 0);
+                        log_message(client_ip, client_port, "Sent to Client:", error);
+                        pthread_mutex_unlock(&server->lock);
+                        continue;
                     }
                     else
                     {
-                        const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server not active.\0\n\033[0m";
-                        send(client_socket, error, strlen(error), 0);
-                        log_message(client_ip, client_port, "Sent to Client:", error);
+                        recursiveList(target_node, path, response, &response_offset, sizeof(response));
                     }
-                    pthread_mutex_unlock(&server->lock);
-                }
 
-                // Send the response with all the matching servers
-                if (response_offset > 0)
-                {
-                    send(client_socket, response, response_offset, 0); // Send the listing response to the client
-                    log_message(client_ip, client_port, "Sent to Client:", response);
+                    // If the path is a directory, list its immediate children
                 }
                 else
                 {
-                    const char *error = " \033[1;31mERROR 401:\033[0m \033[38;5;214mNo files or directories found in the path.\n\0\033[0m";
+                    const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server not active.\0\n\033[0m";
                     send(client_socket, error, strlen(error), 0);
                     log_message(client_ip, client_port, "Sent to Client:", error);
                 }
+                pthread_mutex_unlock(&server->lock);
+            }
 
-                // Free the list of servers
-                while (servers)
-                {
-                    StorageServerList *tmp = servers;
-                    servers = servers->next;
-                    free(tmp);
-                }
+            // Send the response with all the matching servers
+            if (response_offset > 0)
+            {
+                send(client_socket, response, response_offset, 0); // Send the listing response to the client
+                log_message(client_ip, client_port, "Sent to Client:", response);
+            }
+            else
+            {
+                const char *error = " \033[1;31mERROR 401:\033[0m \033[38;5;214mNo files or directories found in the path.\n\0\033[0m";
+                send(client_socket, error, strlen(error), 0);
+                log_message(client_ip, client_port, "Sent to Client:", error);
+            }
+
+            // Free the list of servers
+            while (servers)
+            {
+                StorageServerList *tmp = servers;
+                servers = servers->next;
+                free(tmp);
             }
         }
+    }
 
-        else if (strcmp(command, "CREATE") == 0 || strcmp(command, "DELETE") == 0 || strcmp(command, "COPY") == 0)
+    else if (strcmp(command, "CREATE") == 0 || strcmp(command, "DELETE") == 0 || strcmp(command, "COPY") == 0)
+    {
+        // send(client_socket,command,sizeof(command),0);
+        char type[5];
+        int ss_num = -1;
+        if (sscanf(buffer, "CREATE %s %d %s", type, &ss_num, path) == 3)
         {
-            // send(client_socket,command,sizeof(command),0);
-            char type[5];
-            int ss_num = -1;
-            if (sscanf(buffer, "CREATE %s %d %s", type, &ss_num, path) == 3)
+            if (strcmp(type, "FILE") == 0 || strcmp(type, "DIR") == 0)
             {
-                if (strcmp(type, "FILE") == 0 || strcmp(type, "DIR") == 0)
+                printf("%d \n", ss_num);
+                StorageServer *server;
+                for (int i = 0; i < TABLE_SIZE && ss_num != 0; i++)
                 {
-                    printf("%d \n", ss_num);
-                    StorageServer *server;
-                    for (int i = 0; i < TABLE_SIZE && ss_num != 0; i++)
+                    pthread_mutex_lock(&table->locks[i]);
+                    server = table->table[i];
+                    int flag = 0;
+                    while (server)
                     {
-                        pthread_mutex_lock(&table->locks[i]);
-                        server = table->table[i];
-                        int flag = 0;
-                        while (server)
+                        if (server && server->id == ss_num)
                         {
-                            if (server && server->id == ss_num)
-                            {
-                                // ss_num--;
-                                flag = 1;
-                                break;
-                            }
-                            server = server->next;
-                        }
-                        pthread_mutex_unlock(&table->locks[i]);
-                        if (flag)
+                            // ss_num--;
+                            flag = 1;
                             break;
+                        }
+                        server = server->next;
                     }
-                    if (server != NULL)
+                    pthread_mutex_unlock(&table->locks[i]);
+                    if (flag)
+                        break;
+                }
+                if (server != NULL)
+                {
+                    // printf("hii\n");
+                    pthread_mutex_lock(&server->lock);
+                    bool active = server->active;
+                    pthread_mutex_unlock(&server->lock);
+                    if (active)
                     {
-                        // printf("hii\n");
-                        pthread_mutex_lock(&server->lock);
-                        if (server->active)
+                        char respond[100001];
+                        // Wait for the reply without server->lock, so requests
+                        // from other clients to this server go ahead meanwhile
+                        log_message(server->ip, server->nm_port, "Sent to SS:", buffer);
+                        ssCommand(server, buffer, respond, sizeof(respond), SS_REQUEST_TIMEOUT_MS);
+                        // printf(" hjbhjbj\n");
+                        log_message(server->ip, server->nm_port, "Received from SS:", respond);
+                        fflush(stdout);
+                        if (strncmp(respond, "CREATE DONE", 11) == 0)
                         {
-                            char respond[100001];
-                            send(server->socket, buffer, strlen(buffer), 0);
-                            // recv(server->socket,buffer,sizeof(buffer),0);
-                            // send(server->socket,buffer,strlen(buffer),0);
-                            log_message(server->ip, server->nm_port, "Sent to SS:", buffer);
-                            memset(respond, 0, sizeof(respond));
-                            // printf("hyubnj\n");
-                            // usleep(10000);
-                            if (recv(server->socket, respond, sizeof(respond), 0) < 0)
+                            // printf("yeahhh\n");
+                            char *lastSlash = strrchr(path, '/');
+                            if (!lastSlash)
+                            {
+                                send(client_socket, " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0", strlen(" \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0"), 0);
+                                log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0");
+                                    return 0;
+                            }
+                            *lastSlash = '\0';
+                            char *name = lastSlash + 1;
+                            pthread_mutex_lock(&server->lock);
+                            Node *parentDir = searchPath(server->root, path);
+                            *lastSlash = '/';
+                            if (!parentDir)
+                            {
+                                pthread_mutex_unlock(&server->lock);
+                                send(client_socket, " \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0", strlen(" \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0"), 0);
+                                log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0");
+                                    return 0;
+                            }
+                            NodeType typ;
+                            if (strcmp(type, "DIR") == 0)
+                            {
+                                typ = DIRECTORY_NODE;
+                            }
+                            else
                             {
-                                perror("receive ns");
+                                typ = FILE_NODE;
                             }
-                            // printf(" hjbhjbj\n");
-                            log_message(server->ip, server->nm_port, "Received from SS:", respond);
-                            fflush(stdout);
-                            if (strncmp(respond, "CREATE DONE", 11) == 0)
+                            if (!searchNode(parentDir->children, name)) // A namespace sync may have beaten us to it
                             {
-                                // printf("yeahhh\n");
-                                char *lastSlash = strrchr(path, '/');
-                                if (!lastSlash)
-                                {
-                                    send(client_socket, " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0", strlen(" \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0"), 0);
-                                    log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0");
-                                    return NULL;
-                                }
-                                *lastSlash = '\0';
-                                char *name = lastSlash + 1;
-                                Node *parentDir = searchPath(server->root, path);
-                                *lastSlash = '/';
-                                if (!parentDir)
-                                {
-                                    send(client_socket, " \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0", strlen(" \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0"), 0);
-                                    log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 100:\033[0m \033[38;5;214mParent Directory Missing!\033[0m\n\0");
-
-                                    return NULL;
-                                }
-                                NodeType typ;
-                                if (strcmp(type, "DIR") == 0)
-                                {
-                                    typ = DIRECTORY_NODE;
-                                }
-                                else
-                                {
-                                    typ = FILE_NODE;
-                                }
-                                Node *newNode = createNode(name, typ, READ | WRITE, path);
+                                Node *newNode = createNode(name, typ, READ | WRITE);
                                 newNode->parent = parentDir;
                                 insertNode(parentDir->children, newNode);
+                                pathIndexInsert(path_index, path, server, newNode);
                             }
-                            // printf("bhbbh\n");
-                            fflush(stdout);
-                            send(client_socket, respond, strlen(respond), 0);
-                            // printf("bhbbsgfsgh\n");
-                            fflush(stdout);
-                            log_message(client_ip, client_port, "Sent to Client:", respond);
-                        }
-                        else
-                        {
-                            const char *error = "Storage server is not active";
-                            send(client_socket, error, strlen(error), 0);
-                            log_message(client_ip, client_port, "Sent to Client:", error);
+                            pthread_mutex_unlock(&server->lock);
                         }
-                        pthread_mutex_unlock(&server->lock);
+                        // printf("bhbbh\n");
+                        fflush(stdout);
+                        send(client_socket, respond, strlen(respond), 0);
+                        // printf("bhbbsgfsgh\n");
+                        fflush(stdout);
+                        log_message(client_ip, client_port, "Sent to Client:", respond);
                     }
                     else
                     {
-                        // printf("bhbh\n");
-                        fflush(stdout);
-                        const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server not active.\033[0m\n\0";
+                        const char *error = "Storage server is not active";
                         send(client_socket, error, strlen(error), 0);
                         log_message(client_ip, client_port, "Sent to Client:", error);
                     }
                 }
                 else
                 {
-                    printf("else   \n");
+                    // printf("bhbh\n");
                     fflush(stdout);
-                    send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command CREATE type!\033[0m\n\0", strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command CREATE type!\033[0m\n\0"), 0);
-                    log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command CREATE type!\033[0m\n\0");
-                }
-                // }
-            }
-            else if (sscanf(buffer, "DELETE %s", path) == 1)
-            {
-                StorageServer *server = findStorageServerByPath(table, path);
-                if (!server)
-                {
-                    const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0";
+                    const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server not active.\033[0m\n\0";
                     send(client_socket, error, strlen(error), 0);
                     log_message(client_ip, client_port, "Sent to Client:", error);
-
-                    continue;
-                }
-                else
-                {
-                    printf("hiiii delete");
-                    pthread_mutex_lock(&server->lock);
-                    if (server->active)
-                    {
-                        char respond[100001];
-                        printf("server root %s\n", server->root->name);
-                        send(server->socket, buffer, strlen(buffer), 0);
-                        log_message(server->ip, server->nm_port, "Sent to SS:", buffer);
-
-                        memset(respond, 0, sizeof(respond));
-                        recv(server->socket, respond, sizeof(respond), 0);
-                        log_message(server->ip, server->nm_port, "Received from SS:", respond);
-
-                        printf("%s\n", respond);
-                        if (strcmp(respond, "DELETE DONE") == 0)
-                        {
-                            Node *nodeToDelete = searchPath(server->root, path);
-                            deleteNode(nodeToDelete);
-                            putLRUCache(cache, path, NULL);
-                        }
-                        send(client_socket, respond, strlen(respond), 0);
-                        log_message(client_ip, client_port, "Sent to Client:", respond);
-                    }
-                    else
-                    {
-                        const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server not active.\033[0m\n\0";
-                        send(client_socket, error, strlen(error), 0);
-                        log_message(client_ip, client_port, "Sent to Client:", error);
-                    }
-                    pthread_mutex_unlock(&server->lock);
                 }
             }
-            else if (sscanf(buffer, "COPY %s %s", path, dest_path) == 2)
+            else
             {
-                StorageServer *source_server = findStorageServerByPath(table, path);
-                // printf("%s\n", source_server->root->name);
-                if (!source_server)
-                {
-                    const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mSource Path not found!\033[0m\n\0";
-                    send(client_socket, error, strlen(error), 0);
-                    log_message(client_ip, client_port, "Sent to Client:", error);
+                printf("else   \n");
+                fflush(stdout);
+                send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command CREATE type!\033[0m\n\0", strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command CREATE type!\033[0m\n\0"), 0);
+                log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command CREATE type!\033[0m\n\0");
+            }
+            // }
+        }
+        else if (sscanf(buffer, "DELETE %s", path) == 1)
+        {
+            StorageServer *server = findStorageServerByPath(table, path);
+            if (!server)
+            {
+                const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mPath not found!\033[0m\n\0";
+                send(client_socket, error, strlen(error), 0);
+                log_message(client_ip, client_port, "Sent to Client:", error);
 
-                    continue;
-                }
-                Node *source_node = findNode(source_server->root, path);
-                if (!source_node)
-                {
-                    const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mSource Path not found!\033[0m\n\0";
-                    send(client_socket, error, strlen(error), 0);
-                    log_message(client_ip, client_port, "Sent to Client:", error);
-                    continue;
-                }
-                // printf("bansal maa ka loda\n");
-                StorageServer *dest_server = findStorageServerByPath(table, dest_path);
-                if (!dest_server)
+                return 0;
+            }
+            else
+            {
+                printf("hiiii delete");
+                pthread_mutex_lock(&server->lock);
+                bool active = server->active;
+                pthread_mutex_unlock(&server->lock);
+                if (active)
                 {
-                    // Destination server not found, check if parent directory exists
-                    char parent_path[MAX_PATH_LENGTH];
-                    getParentPath(dest_path, parent_path);
+                    char respond[100001];
+                    log_message(server->ip, server->nm_port, "Sent to SS:", buffer);
+                    ssCommand(server, buffer, respond, sizeof(respond), SS_REQUEST_TIMEOUT_MS);
+                    log_message(server->ip, server->nm_port, "Received from SS:", respond);
 
-                    dest_server = findStorageServerByPath(table, parent_path);
-                    if (!dest_server)
+                    printf("%s\n", respond);
+                    if (strcmp(respond, "DELETE DONE") == 0)
                     {
-                        const char *error = " \033[1;31mERROR 404:\033[0m \033[38;5;214mDestination Path not found!\033[0m\n\0";
-                        send(client_socket, error, strlen(error), 0);
-                        log_message(client_ip, client_port, "Sent to Client:", error);
-                        continue;
-                    }
-
-                    // Check if parent directory exists and is actually a directory
-                    Node *parent_node = findNode(dest_server->root, parent_path);
-                    if (!parent_node || parent_node->type != DIRECTORY_NODE)
-                    {
-                        const char *error = " \033[1;31mERROR 400:\033[0m \033[38;5;214mPath is not a directory!\033[0m\n\0";
-                        send(client_socket, error, strlen(error), 0);
-                        log_message(client_ip, client_port, "Sent to Client:", error);
-                        continue;
-                    }
-                    else
-                    {
-                        char init_cmd[MAX_BUFFER_SIZE];
-                        memset(buffer, 0, sizeof(buffer));
-                        snprintf(buffer, sizeof(buffer), "COPY %s %s", path, parent_path);
-                        send(source_server->socket, buffer, strlen(buffer), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Sent to SS:", buffer);
-                        memset(init_cmd, 0, sizeof(init_cmd));
-                        recv(source_server->socket, init_cmd, sizeof(init_cmd), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Received from SS:", init_cmd);
-
-                        char server_info[MAX_BUFFER_SIZE];
-                        memset(server_info, 0, sizeof(server_info));
-                        snprintf(server_info, sizeof(server_info), "SOURCE SERVER_INFO %s %d",
-                                 dest_server->ip, dest_server->client_port);
-                        send(source_server->socket, server_info, strlen(server_info), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Sent to SS:", server_info);
-
-                        char response[100001];
-                        memset(response, 0, sizeof(response));
-                        recv(source_server->socket, response, sizeof(response), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Received from SS:", response);
-
-                        if (strncmp(response, "COPY DONE", 9) == 0)
+                        pthread_mutex_lock(&server->lock);
+                        Node *nodeToDelete = searchPath(server->root, path);
+                        if (nodeToDelete) // Unless a namespace sync already removed it
                         {
-                            // implement logic to copy files and directrix from the source hast table to dest in the directrix we are copying the data
-                            if (source_node->type == DIRECTORY_NODE)
-                            {
-                                Node *destParentNode = findNode(dest_server->root, parent_path);
-                                if (!destParentNode || destParentNode->type != DIRECTORY_NODE)
-                                {
-                                    printf("Error: Destination path is not a valid directory\n");
-                                    const char *error = " \033[1;31mERROR 400:\033[0m \033[38;5;214mDestination Path is not a directory!\033[0m\n\0";
-                                    send(client_socket, error, strlen(error), 0);
-                                    log_message(client_ip, client_port, "Sent to Client:", error);
-                                    continue;
-                                }
-                                addDirectory(destParentNode, source_node->name, source_node->permissions);
-                                Node *newRootDir = searchNode(destParentNode->children, source_node->name);
-                                // Copy the contents of the source directory to the destination directory
-                                copyDirectoryContents(source_node, destParentNode);
-
-                                const char *success = "Directory copied successfully";
-                                send(client_socket, success, strlen(success), 0);
-                                log_message(client_ip, client_port, "Sent to Client:", success);
-                            }
-                            else
-                            {
-                                // Handle single file copy (using previous implementation)
-                                // char parent_path[MAX_PATH_LENGTH];
-                                // getParentPath(dest_path, parent_path);
-                                Node *destParentNode = findNode(dest_server->root, dest_path);
-                                addFile(destParentNode, source_node->name, source_node->permissions, source_node->dataLocation);
-                                // handleCopyOperation(source_node, destParentNode, dest_path);
-                                const char *success = "File copied successfully";
-                                send(client_socket, success, strlen(success), 0);
-                                log_message(client_ip, client_port, "Sent to Client:", success);
-                            }
+                            pathIndexRemoveSubtree(path_index, server, nodeToDelete, path);
+                            deleteNode(nodeToDelete);
                         }
-                        send(client_socket, response, strlen(response), 0);
-                        log_message(client_ip, client_port, "Sent to Client:", response);
+                        pthread_mutex_unlock(&server->lock);
+                        invalidateLRUCachePrefix(cache, path);
+                        leaseRevokePath(lease_table, path);
                     }
+                    send(client_socket, respond, strlen(respond), 0);
+                    log_message(client_ip, client_port, "Sent to Client:", respond);
                 }
                 else
                 {
-                    Node *dest_node = findNode(dest_server->root, dest_path);
-                    if (dest_node->type == FILE_NODE)
-                    {
-                        const char *error = " \033[1;31mERROR 400:\033[0m \033[38;5;214mDestination Path is not a directory!\033[0m\n\0";
-                        send(client_socket, error, strlen(error), 0);
-                        log_message(client_ip, client_port, "Sent to Client:", error);
-
-                        continue;
-                    }
-                    else
-                    {
-                        printf("hello\n");
-                        char init_cmd[MAX_BUFFER_SIZE];
-                        send(source_server->socket, buffer, strlen(buffer), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Sent to SS:", buffer);
-                        memset(init_cmd, 0, sizeof(init_cmd));
-                        recv(source_server->socket, init_cmd, sizeof(init_cmd), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Received from SS:", init_cmd);
-                        char server_info[MAX_BUFFER_SIZE];
-                        memset(server_info, 0, sizeof(server_info));
-                        snprintf(server_info, sizeof(server_info), "SOURCE SERVER_INFO %s %d",
-                                 dest_server->ip, dest_server->client_port);
-                        send(source_server->socket, server_info, strlen(server_info), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Sent to SS:", server_info);
-
-                        char response[100001];
-                        memset(response, 0, sizeof(response));
-                        recv(source_server->socket, response, sizeof(response), 0);
-                        log_message(source_server->ip, source_server->nm_port, "Received from SS:", response);
-
-                        if (strncmp(response, "COPY DONE", 9) == 0)
-                        {
-                            // implement logic to copy files and directrix from the source hast table to dest in the directrix we are copying the data
-                            if (source_node->type == DIRECTORY_NODE)
-                            {
-                                printf("%s\n", dest_path);
-                                Node *destParentNode = findNode(dest_server->root, dest_path);
-                                if (!destParentNode || destParentNode->type != DIRECTORY_NODE)
-                                {
-                                    printf("Error: Destination path is not a valid directory\n");
-                                    const char *error = " \033[1;31mERROR 400:\033[0m \033[38;5;214mDestination Path is not a valid Directory!\033[0m\n\0";
-                                    send(client_socket, error, strlen(error), 0);
-                                    log_message(client_ip, client_port, "Sent to Client:", error);
-                                    continue;
-                                }
-                                addDirectory(destParentNode, source_node->name, source_node->permissions);
-                                Node *newRootDir = searchNode(destParentNode->children, source_node->name);
-                                // Copy the contents of the source directory to the destination directory
-                                copyDirectoryContents(source_node, newRootDir);
-
-                                const char *success = "Directory copied successfully";
-                                send(client_socket, success, strlen(success), 0);
-                                log_message(client_ip, client_port, "Sent to Client:", success);
-                            }
-                            else
-                            {
-                                // Handle single file copy (using previous implementation)
-                                // char parent_path[MAX_PATH_LENGTH];
-                                // getParentPath(dest_path, parent_path);
-                                Node *destParentNode = findNode(dest_server->root, dest_path);
-                                addFile(destParentNode, source_node->name, source_node->permissions, source_node->dataLocation);
-                                // handleCopyOperation(source_node, destParentNode, dest_path);
-                                const char *success = "File copied successfully";
-                                send(client_socket, success, strlen(success), 0);
-                                log_message(client_ip, client_port, "Sent to Client:", success);
-                            }
-                        }
-                        send(client_socket, response, strlen(response), 0);
-                        log_message(client_ip, client_port, "Received from Client:", response);
-                    }
+                    const char *error = " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server not active.\033[0m\n\0";
+                    send(client_socket, error, strlen(error), 0);
+                    log_message(client_ip, client_port, "Sent to Client:", error);
                 }
             }
-            else
-            {
-                send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command!\033[0m\n\0",
-                     strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command!\033[0m\n\0"), 0);
-                log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command!\033[0m\n\0");
-            }
         }
-        else if (strcmp(command, "EXIT") == 0)
+        else if (sscanf(buffer, "COPY %s %s", path, dest_path) == 2)
         {
-            break;
+            StorageServer *source_server = findStorageServerByPath(table, path);
+            StorageServer *dest_server = findStorageServerByPath(table, dest_path);
+            bool dest_found = dest_server != NULL;
+            if (source_server && !dest_server)
+            {
+                // Destination server not found, it may hold the parent directory
+                char parent_path[MAX_PATH_LENGTH];
+                getParentPath(dest_path, parent_path);
+                dest_server = findStorageServerByPath(table, parent_path);
+            }
+            const char *error = checkCopy(source_server, path, dest_server, dest_found, dest_path);
+            if (error)
+            {
+                send(client_socket, error, strlen(error), 0);
+                log_message(client_ip, client_port, "Sent to Client:", error);
+                return 0;
+            }
+            // The copy goes on in the background; the client hears how it
+            // ended on its ACK port and can ask with COPYSTATUS meanwhile
+            char response[128];
+            uint32_t job_id = startCopyJob(source_server, path, dest_server, dest_path, client_ip, conn->lease_port);
+            if (job_id)
+                snprintf(response, sizeof(response), "COPY STARTED %u", job_id);
+            else
+                snprintf(response, sizeof(response), " \033[1;31mERROR 45:\033[0m \033[38;5;214mCould not start the copy!\033[0m\n");
+            send(client_socket, response, strlen(response), 0);
+            log_message(client_ip, client_port, "Sent to Client:", response);
         }
         else
         {
@@ -788,10 +807,42 @@ void *clientHandler(void *arg)
             log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command!\033[0m\n\0");
         }
     }
+    else if (strcmp(command, "COPYSTATUS") == 0)
+    {
+        // COPYSTATUS [<job id>]
+        char response[MAX_BUFFER_SIZE];
+        uint32_t job_id = 0;
+        if (sscanf(buffer, "%*s %u", &job_id) != 1)
+            job_id = 0;
+        if (formatCopyJobs(job_id, response, sizeof(response)) == 0)
+            snprintf(response, sizeof(response), job_id ? " \033[1;31mERROR 404:\033[0m \033[38;5;214mNo such copy job!\033[0m\n" : "No copy jobs\n");
+        send(client_socket, response, strlen(response), 0);
+        log_message(client_ip, client_port, "Sent to Client:", response);
+    }
+    else if (strcmp(command, "BACKUPSTATUS") == 0)
+    {
+        char response[MAX_BUFFER_SIZE];
+        formatBackupStatus(response, sizeof(response));
+        send(client_socket, response, strlen(response), 0);
+        log_message(client_ip, client_port, "Sent to Client:", response);
+    }
+    else if (strcmp(command, "EXIT") == 0)
+    {
+        return -1;
+    }
+    else
+    {
+        send(client_socket, " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command!\033[0m\n\0",
+             strlen(" \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command!\033[0m\n\0"), 0);
+        log_message(client_ip, client_port, "Sent to Client:", " \033[1;31mERROR 101:\033[0m \033[38;5;214mInvalid Command!\033[0m\n\0");
+    }
+    return 0;
 }
 
-// Function to receive all server information
-int receiveServerInfo(int sock, char *ip_out, int *nm_port_out, int *client_port_out, Node **root_out)
+// Function to receive all server information. A server reconnecting within
+// the same run (same journal epoch) only sends the namespace events we
+// missed; it is updated in place and returned through *resumed.
+int receiveServerInfo(int sock, StorageServerTable *table, StorageServer *server, StorageServer **resumed)
 {
     char buffer[1024];
     int bytes_received;
@@ -820,18 +871,60 @@ int receiveServerInfo(int sock, char *ip_out, int *nm_port_out, int *client_port
     // Log the message to the log file
     log_message(ss_ip, ss_port, "Received from SS:", buffer);
     // memset(buffer, 0 , sizeof(buffer));
-    memcpy(ip_out, buffer, 16);
-    memcpy(nm_port_out, buffer + 16, sizeof(int));
-    memcpy(client_port_out, buffer + 16 + sizeof(int), sizeof(int));
-    ip_out[15] = '\0';
+    int offset = 16 + 2 * sizeof(int);
+    memcpy(server->ip, buffer, 16);
+    memcpy(&server->nm_port, buffer + 16, sizeof(int));
+    memcpy(&server->client_port, buffer + 16 + sizeof(int), sizeof(int));
+    memcpy(&server->epoch, buffer + offset, sizeof(uint32_t));
+    server->ip[15] = '\0';
+    offset += sizeof(uint32_t);
+
+    // Tell the server whether we still hold its tree and how far it goes
+    StorageServer *previous = findResumableServer(table, server->ip, server->epoch);
+    uint32_t resume = previous ? 1 : 0;
+    uint64_t applied_seq = previous ? previous->applied_seq : 0;
+    memcpy(buffer + offset, &resume, sizeof(uint32_t));
+    memcpy(buffer + offset + sizeof(uint32_t), &applied_seq, sizeof(uint64_t));
     send(sock, buffer, sizeof(buffer), 0);
     log_message(ss_ip, ss_port, "Sent to SS:", buffer);
 
-    *root_out = receiveNodeChain(sock);
-    if (*root_out == NULL)
-        return -1;
+    if (!previous)
+    {
+        Node *root = NULL;
+        if (receiveNamespace(sock, server, &root) != 0)
+            return -1;
+        server->root = root;
+        return 0;
+    }
 
-    return 0;
+    // The stream is read before previous->lock is taken, so lookups on the
+    // tree we hold go on meanwhile; a whole tree is swapped in, events are
+    // applied from memory
+    Node *root = NULL;
+    uint64_t seq = 0;
+    char *events = NULL;
+    size_t events_len = 0;
+    int result = receiveResumedNamespace(sock, &root, &seq, &events, &events_len);
+    pthread_mutex_lock(&previous->lock);
+    if (result == 1)
+        result = receiveNamespaceReply(previous, events, events_len, &root);
+    else if (result == 0)
+        previous->applied_seq = seq;
+    free(events);
+    if (result >= 0)
+    {
+        if (root)
+            replaceServerTree(previous, root);
+        close(previous->socket);
+        previous->socket = sock;
+        previous->nm_port = server->nm_port;
+        previous->client_port = server->client_port;
+        previous->active = true;
+        *resumed = previous;
+    }
+    pthread_mutex_unlock(&previous->lock);
+    leaseDeliverRevocations(previous);
+    return result >= 0 ? 0 : -1;
 }
 
 void *storageServerAcceptor(void *arg)
@@ -859,7 +952,7 @@ void *storageServerAcceptor(void *arg)
         if (!server)
         {
             printf("Failed to handle new storage server connection.\n");
-            log_message(NULL, 0, "SS", "Failed to handle new storage server connection.");
+            log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Failed to handle new storage server connection.");
 
             close(storage_sock);
             continue;
@@ -870,7 +963,7 @@ void *storageServerAcceptor(void *arg)
         if (pthread_create(&server_thread, NULL, storageServerHandler, server) != 0)
         {
             perror("Failed to create storage server handler thread");
-            log_message(NULL, 0, "SS", "Failed to create storage server handler thread");
+            log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Failed to create storage server handler thread");
 
             pthread_mutex_lock(&server->lock);
             server->active = false;
@@ -905,10 +998,7 @@ void *storageServerAcceptor(void *arg)
                  server->ip, server->nm_port, server->client_port, (server->root != NULL) ? server->root->name : "No root directory", server_table->count);
         log_message(NULL, 0, "SS", log_buf);
 
-        if(server_table->count >= 3)
-        {
-            backup_data(server_table);
-        }
+        scheduleBackups(); // Placed and copied on the backup scheduler's thread
     }
 
 
@@ -951,7 +1041,19 @@ pthread_t ackListenerThread;
 int main()
 {
     StorageServerTable *server_table = createStorageServerTable();
-    cache = createLRUCache(5);
+    int cache_capacity = LRU_CACHE_CAPACITY;
+    if (getenv("NM_CACHE_CAPACITY"))
+        cache_capacity = atoi(getenv("NM_CACHE_CAPACITY"));
+    cache = createLRUCache(cache_capacity);
+    // A storage server may vanish mid-request; report it as a failed send
+    signal(SIGPIPE, SIG_IGN);
+    path_index = createPathIndex(PATH_INDEX_BUCKETS);
+    if (getenv("NM_LEASE_MS"))
+        lease_duration_ms = atoi(getenv("NM_LEASE_MS"));
+    lease_table = createLeaseTable(LEASE_TABLE_BUCKETS);
+    if (getenv("NM_BACKUP_REFRESH_MS"))
+        backup_refresh_ms = atoi(getenv("NM_BACKUP_REFRESH_MS"));
+    startBackupScheduler(server_table);
     int storage_server_fd, naming_server_fd;
     struct sockaddr_in storage_addr, naming_addr;
     int opt = 1;
@@ -960,14 +1062,14 @@ int main()
     if ((storage_server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
         perror("Storage socket creation failed");
-        log_message(NULL, 0, "SS", "Storage socket creation failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Storage socket creation failed");
         exit(EXIT_FAILURE);
     }
 
     if (setsockopt(storage_server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
     {
         perror("Set socket options failed");
-        log_message(NULL, 0, "SS", "Set socket options failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Set socket options failed");
         exit(EXIT_FAILURE);
     }
 
@@ -978,7 +1080,7 @@ int main()
     if (bind(storage_server_fd, (struct sockaddr *)&storage_addr, sizeof(storage_addr)) < 0)
     {
         perror("Storage bind failed");
-        log_message(NULL, 0, "SS", "Storage bind failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Storage bind failed");
         exit(EXIT_FAILURE);
     }
 
@@ -986,14 +1088,14 @@ int main()
     if (getsockname(storage_server_fd, (struct sockaddr *)&storage_addr, &addr_len) < 0)
     {
         perror("Getsockname for storage server failed");
-        log_message(NULL, 0, "SS", "Getsockname for storage server failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Getsockname for storage server failed");
         exit(EXIT_FAILURE);
     }
 
     if (listen(storage_server_fd, 10) < 0)
     {
         perror("Storage listen failed");
-        log_message(NULL, 0, "SS", "Storage listen failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Storage listen failed");
         exit(EXIT_FAILURE);
     }
 
@@ -1007,7 +1109,7 @@ int main()
     if (pthread_create(&storage_acceptor_thread, NULL, storageServerAcceptor, args) != 0)
     {
         perror("Failed to create storage server acceptor thread");
-        log_message(NULL, 0, "SS", "Failed to create storage server acceptor thread");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Failed to create storage server acceptor thread");
 
         free(args);
         close(storage_server_fd);
@@ -1027,7 +1129,7 @@ int main()
     if (pthread_create(&ackListenerThread, NULL, ackListener, NULL) != 0)
     {
         perror("Failed to create acknowledgment listener thread");
-        log_message(NULL, 0, "SS", "Failed to create acknowledgment listener thread");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "SS", "Failed to create acknowledgment listener thread");
 
         exit(EXIT_FAILURE);
     }
@@ -1044,14 +1146,14 @@ int main()
     if ((naming_server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
         perror("Naming socket creation failed");
-        log_message(NULL, 0, "NM", "Naming socket creation failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "NM", "Naming socket creation failed");
         exit(EXIT_FAILURE);
     }
 
     if (setsockopt(naming_server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
     {
         perror("Set naming socket options failed");
-        log_message(NULL, 0, "NM", "Set naming socket options failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "NM", "Set naming socket options failed");
         exit(EXIT_FAILURE);
     }
 
@@ -1062,7 +1164,7 @@ int main()
     if (bind(naming_server_fd, (struct sockaddr *)&naming_addr, sizeof(naming_addr)) < 0)
     {
         perror("Naming bind failed");
-        log_message(NULL, 0, "NM", "Naming bind failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "NM", "Naming bind failed");
         exit(EXIT_FAILURE);
     }
 
@@ -1070,14 +1172,14 @@ int main()
     if (getsockname(naming_server_fd, (struct sockaddr *)&naming_addr, &addr_len) < 0)
     {
         perror("Getsockname for naming server failed");
-        log_message(NULL, 0, "NM", "Getsockname for naming server failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "NM", "Getsockname for naming server failed");
         exit(EXIT_FAILURE);
     }
 
-    if (listen(naming_server_fd, MAX_CLIENTS) < 0)
+    if (listen(naming_server_fd, CLIENT_LISTEN_BACKLOG) < 0)
     {
         perror("Naming listen failed");
-        log_message(NULL, 0, "NM", "Naming listen failed");
+        log_message_level(LOG_LEVEL_ERROR, NULL, 0, "NM", "Naming listen failed");
         exit(EXIT_FAILURE);
     }
     char ip_buffer[INET_ADDRSTRLEN];
@@ -1086,29 +1188,13 @@ int main()
     // inet_ntop(AF_INET, &(naming_addr.sin_addr), ip_buffer, INET_ADDRSTRLEN);
     int naming_port=ntohs(naming_addr.sin_port);
     printf("IP: %s \nStorage_port :%d\nnaming_port :%d\n",ip_buffer,Storage_port,naming_port);
-    while (1)
-    {
-        socklen_t storage_addrlen = sizeof(naming_addr);
-        int client_sock = accept(naming_server_fd, (struct sockaddr *)&naming_addr, &storage_addrlen);
-        if (client_sock < 0)
-            continue;
-
-        struct
-        {
-            int socket;
-            StorageServerTable *table;
-        } *args = malloc(sizeof(*args));
-        args->socket = client_sock;
-        args->table = server_table;
-
-        pthread_t client_thread;
-        pthread_create(&client_thread, NULL, clientHandler, args);
-        pthread_detach(client_thread);
-    }
+    // Client sessions are multiplexed over epoll and served by a fixed worker pool
+    runClientReactor(naming_server_fd, server_table);
 
     // Cleanup
     // freeNode(storage_info.root);
     freeLRUCache(cache);
+    stop_logger();
     close(storage_server_fd);
     close(naming_server_fd);
     return 0;
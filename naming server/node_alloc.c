@@ -0,0 +1,203 @@
+#include "header.h"
+
+// Memory for the namespace tree. Nodes and directory tables come from slabs:
+// NODE_SLAB_CHUNK-sized blocks carved into equal objects, with freed objects
+// kept on a free list for reuse. A tree is then a few large blocks instead of
+// millions of small mallocs, and siblings created together sit next to each
+// other in memory.
+//
+// Names are interned: every distinct name is stored once with a reference
+// count, and nodes share the copy. Most names repeat across directories.
+
+typedef struct Slab
+{
+    size_t object_size;
+    void *free_list;   // Freed objects, linked through their first word
+    char *chunk;       // Block objects are currently carved from
+    size_t chunk_used; // Bytes of chunk handed out
+    size_t chunks;
+    size_t in_use;
+    pthread_mutex_t lock;
+} Slab;
+
+typedef struct InternedName
+{
+    struct InternedName *next;
+    unsigned int hash;
+    unsigned int refs;
+    char name[]; // What nodes point at
+} InternedName;
+
+static Slab node_slab = {sizeof(Node), NULL, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+static Slab table_slab = {sizeof(NodeTable), NULL, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static InternedName **name_buckets = NULL;
+static size_t name_bucket_count = 0;
+static size_t name_count = 0;
+static size_t name_bytes = 0;
+static pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *slabAlloc(Slab *slab)
+{
+    size_t size = (slab->object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pthread_mutex_lock(&slab->lock);
+    void *object = slab->free_list;
+    if (object)
+    {
+        slab->free_list = *(void **)object;
+    }
+    else
+    {
+        if (!slab->chunk || slab->chunk_used + size > NODE_SLAB_CHUNK)
+        {
+            // Blocks are never returned; freed objects are reused instead
+            slab->chunk = malloc(NODE_SLAB_CHUNK);
+            if (!slab->chunk)
+            {
+                pthread_mutex_unlock(&slab->lock);
+                return NULL;
+            }
+            slab->chunk_used = 0;
+            slab->chunks++;
+        }
+        object = slab->chunk + slab->chunk_used;
+        slab->chunk_used += size;
+    }
+    slab->in_use++;
+    pthread_mutex_unlock(&slab->lock);
+    return object;
+}
+
+static void slabFree(Slab *slab, void *object)
+{
+    if (!object)
+        return;
+    pthread_mutex_lock(&slab->lock);
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+Node *allocNode()
+{
+    return (Node *)slabAlloc(&node_slab);
+}
+
+void freeNodeMemory(Node *node)
+{
+    slabFree(&node_slab, node);
+}
+
+NodeTable *allocNodeTable()
+{
+    return (NodeTable *)slabAlloc(&table_slab);
+}
+
+void freeNodeTableMemory(NodeTable *table)
+{
+    slabFree(&table_slab, table);
+}
+
+static void growNameBuckets()
+{
+    size_t count = name_bucket_count ? name_bucket_count * 2 : 1024;
+    InternedName **buckets = (InternedName **)calloc(count, sizeof(InternedName *));
+    if (!buckets)
+        return;
+    for (size_t i = 0; i < name_bucket_count; i++)
+    {
+        InternedName *entry = name_buckets[i];
+        while (entry)
+        {
+            InternedName *next = entry->next;
+            entry->next = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(name_buckets);
+    name_buckets = buckets;
+    name_bucket_count = count;
+}
+
+// Shared copy of name; pair every call with releaseName
+const char *internName(const char *name)
+{
+    unsigned int h = hash(name);
+    size_t len = strlen(name);
+    pthread_mutex_lock(&name_lock);
+    if (name_count >= name_bucket_count)
+        growNameBuckets();
+    InternedName **bucket = &name_buckets[h & (name_bucket_count - 1)];
+    for (InternedName *entry = *bucket; entry; entry = entry->next)
+    {
+        if (entry->hash == h && strcmp(entry->name, name) == 0)
+        {
+            entry->refs++;
+            pthread_mutex_unlock(&name_lock);
+            return entry->name;
+        }
+    }
+    InternedName *entry = malloc(sizeof(InternedName) + len + 1);
+    if (!entry)
+    {
+        pthread_mutex_unlock(&name_lock);
+        return NULL;
+    }
+    entry->hash = h;
+    entry->refs = 1;
+    memcpy(entry->name, name, len + 1);
+    entry->next = *bucket;
+    *bucket = entry;
+    name_count++;
+    name_bytes += sizeof(InternedName) + len + 1;
+    pthread_mutex_unlock(&name_lock);
+    return entry->name;
+}
+
+void releaseName(const char *name)
+{
+    if (!name)
+        return;
+    InternedName *entry = (InternedName *)(name - offsetof(InternedName, name));
+    pthread_mutex_lock(&name_lock);
+    if (--entry->refs == 0)
+    {
+        InternedName **link = &name_buckets[entry->hash & (name_bucket_count - 1)];
+        while (*link != entry)
+            link = &(*link)->next;
+        *link = entry->next;
+        name_count--;
+        name_bytes -= sizeof(InternedName) + strlen(entry->name) + 1;
+        free(entry);
+    }
+    pthread_mutex_unlock(&name_lock);
+}
+
+void formatNodeAllocStats(char *buffer, size_t size)
+{
+    pthread_mutex_lock(&node_slab.lock);
+    size_t nodes = node_slab.in_use, node_chunks = node_slab.chunks;
+    pthread_mutex_unlock(&node_slab.lock);
+    pthread_mutex_lock(&table_slab.lock);
+    size_t tables = table_slab.in_use, table_chunks = table_slab.chunks;
+    pthread_mutex_unlock(&table_slab.lock);
+    pthread_mutex_lock(&name_lock);
+    size_t names = name_count, bytes = name_bytes;
+    pthread_mutex_unlock(&name_lock);
+    snprintf(buffer, size, "Tree memory: %zu nodes, %zu directory tables in %zu KB of slabs, %zu distinct names in %zu KB\n",
+             nodes, tables, (node_chunks + table_chunks) * (NODE_SLAB_CHUNK / 1024), names, bytes / 1024);
+}
+
+// Resident set size of this process in KB, or -1 where /proc is missing
+long residentMemoryKB()
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return -1;
+    long pages_total, pages_resident;
+    int ok = fscanf(statm, "%ld %ld", &pages_total, &pages_resident) == 2;
+    fclose(statm);
+    return ok ? pages_resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
@@ -14,7 +14,10 @@ ssize_t readFile(Node *fileNode, char *buffer, size_t size)
         return -1;
     }
 
-    int fd = open(fileNode->dataLocation, O_RDONLY);
+    char location[PATH_MAX];
+    if (getDataLocation(fileNode, location, sizeof(location)) < 0)
+        return -1;
+    int fd = open(location, O_RDONLY);
     if (fd == -1)
     {
         perror("Error opening file");
@@ -55,7 +58,10 @@ ssize_t writeFile(Node *fileNode, const char *buffer, size_t size)
         flags |= O_TRUNC;
     }
 
-    int fd = open(fileNode->dataLocation, flags);
+    char location[PATH_MAX];
+    if (getDataLocation(fileNode, location, sizeof(location)) < 0)
+        return -1;
+    int fd = open(location, flags);
     if (fd == -1)
     {
         perror("Error opening file");
@@ -74,12 +80,13 @@ ssize_t writeFile(Node *fileNode, const char *buffer, size_t size)
 
 int getFileMetadata(Node *fileNode, struct stat *metadata)
 {
-    if (!fileNode || !fileNode->dataLocation)
+    char location[PATH_MAX];
+    if (!fileNode || getDataLocation(fileNode, location, sizeof(location)) < 0)
     {
         return -1;
     }
 
-    return stat(fileNode->dataLocation, metadata);
+    return stat(location, metadata);
 }
 
 ssize_t streamAudioFile(Node *fileNode, char *buffer, size_t size, off_t offset)
@@ -96,7 +103,10 @@ ssize_t streamAudioFile(Node *fileNode, char *buffer, size_t size, off_t offset)
         return -1;
     }
 
-    int fd = open(fileNode->dataLocation, O_RDONLY);
+    char location[PATH_MAX];
+    if (getDataLocation(fileNode, location, sizeof(location)) < 0)
+        return -1;
+    int fd = open(location, O_RDONLY);
     if (fd == -1)
     {
         perror("Error opening audio file");
@@ -137,8 +147,15 @@ Node *createEmptyNode(Node *parentDir, const char *name, NodeType type)
     }
 
     // Create the physical file/directory
+    char location[PATH_MAX];
     char fullPath[PATH_MAX];
-    snprintf(fullPath, PATH_MAX, "%s/%s", parentDir->dataLocation, name);
+    if (getDataLocation(parentDir, location, sizeof(location)) < 0)
+        return NULL;
+    if (snprintf(fullPath, PATH_MAX, "%s/%s", location, name) >= PATH_MAX)
+    {
+        printf("Error: path of %s is too long\n", name);
+        return NULL;
+    }
 
     if (type == DIRECTORY_NODE)
     {
@@ -160,7 +177,7 @@ Node *createEmptyNode(Node *parentDir, const char *name, NodeType type)
     }
 
     // Create and insert the node
-    Node *newNode = createNode(name, type, READ | WRITE, fullPath);
+    Node *newNode = createNode(name, type, READ | WRITE);
     newNode->parent = parentDir;
     insertNode(parentDir->children, newNode);
     return newNode;
@@ -177,15 +194,11 @@ int deleteNode(Node *node)
     // Recursively delete all children if the node is a directory
     if (node->type == DIRECTORY_NODE && node->children)
     {
-        for (int i = 0; i < TABLE_SIZE; i++)
+        uint32_t cursor = 0;
+        Node *child;
+        while ((child = nextChild(node->children, &cursor)) != NULL)
         {
-            Node *child = node->children->table[i];
-            while (child)
-            {
-                Node *next = child->next;
-                deleteNode(child);
-                child = next;
-            }
+            deleteNode(child);
         }
     }
 
@@ -207,33 +220,13 @@ int deleteNode(Node *node)
     //     }
     // }
 
-    // Remove node from parent's hash table
-    unsigned int index = hash(node->name);
-    Node *current = node->parent->children->table[index];
-    Node *prev = NULL;
-
-    while (current != NULL)
-    {
-        if (current == node)
-        {
-            if (prev == NULL)
-            {
-                node->parent->children->table[index] = current->next;
-            }
-            else
-            {
-                prev->next = current->next;
-            }
-            free(node->name);
-            free(node->dataLocation);
-            free(node);
-            return 0;
-        }
-        prev = current;
-        current = current->next;
-    }
-
-    return -1;
+    // Remove node from parent's table
+    if (removeNode(node->parent->children, node) != 0)
+        return -1;
+    releaseName(node->name);
+    freeNodeTable(node->children);
+    freeNodeMemory(node);
+    return 0;
 }
 
 int copyNode(Node *sourceNode, Node *destDir, const char *newName)
@@ -245,9 +238,13 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
     }
 
     // Create destination path
+    char sourcePath[PATH_MAX];
     char destPath[PATH_MAX];
-    snprintf(destPath, PATH_MAX, "%s/%s",
-             destDir->dataLocation,
+    if (getDataLocation(sourceNode, sourcePath, sizeof(sourcePath)) < 0 ||
+        getDataLocation(destDir, destPath, sizeof(destPath)) < 0)
+        return -1;
+    size_t destLen = strlen(destPath);
+    snprintf(destPath + destLen, PATH_MAX - destLen, "/%s",
              newName ? newName : sourceNode->name);
 
     if (sourceNode->type == DIRECTORY_NODE)
@@ -261,12 +258,12 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
 
         // Create node in our file system
         Node *newDir = createNode(newName ? newName : sourceNode->name,
-                                  DIRECTORY_NODE, sourceNode->permissions, destPath);
+                                  DIRECTORY_NODE, sourceNode->permissions);
         newDir->parent = destDir;
         insertNode(destDir->children, newDir);
 
         // Copy contents recursively
-        DIR *dir = opendir(sourceNode->dataLocation);
+        DIR *dir = opendir(sourcePath);
         if (!dir)
         {
             perror("Error opening source directory");
@@ -292,7 +289,7 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
     {
         // Copy file contents
         char buffer[8192];
-        int sourceFd = open(sourceNode->dataLocation, O_RDONLY);
+        int sourceFd = open(sourcePath, O_RDONLY);
         int destFd = open(destPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
         if (sourceFd == -1 || destFd == -1)
@@ -321,7 +318,7 @@ int copyNode(Node *sourceNode, Node *destDir, const char *newName)
         close(destFd);
 
         // Create node in our file system
-        Node *newFile = createNode(newName ? newName : sourceNode->name, FILE_NODE, sourceNode->permissions, destPath);
+        Node *newFile = createNode(newName ? newName : sourceNode->name, FILE_NODE, sourceNode->permissions);
         newFile->parent = destDir;
         insertNode(destDir->children, newFile);
     }
@@ -0,0 +1,259 @@
+#include "header.h"
+
+PathIndex *path_index = NULL;
+
+// FNV-1a over the canonical path
+static unsigned int hashPath(const char *path)
+{
+    unsigned int hash = 2166136261u;
+    while (*path)
+    {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+        path++;
+    }
+    return hash;
+}
+
+// Collapse repeated slashes, drop a trailing slash and make the path absolute,
+// so "t//a.txt/" and "/t/a.txt" share one index entry. The root is "/".
+void canonicalizePath(const char *path, char *out, size_t size)
+{
+    size_t len = 0;
+    out[len++] = '/';
+    for (const char *p = path; *p && len < size - 1; p++)
+    {
+        if (*p == '/' && out[len - 1] == '/')
+            continue;
+        out[len++] = *p;
+    }
+    if (len > 1 && out[len - 1] == '/')
+        len--;
+    out[len] = '\0';
+}
+
+static void joinPath(const char *parent, const char *name, char *out, size_t size)
+{
+    char joined[MAX_PATH_LENGTH];
+    snprintf(joined, sizeof(joined), "%s/%s", parent, name);
+    canonicalizePath(joined, out, size);
+}
+
+PathIndex *createPathIndex(size_t initial_buckets)
+{
+    PathIndex *index = (PathIndex *)malloc(sizeof(PathIndex));
+    size_t buckets = 1;
+    while (buckets < initial_buckets)
+        buckets <<= 1;
+    index->buckets = (PathIndexEntry **)calloc(buckets, sizeof(PathIndexEntry *));
+    index->bucket_count = buckets;
+    atomic_init(&index->count, 0);
+    pthread_rwlock_init(&index->resize_lock, NULL);
+    for (int i = 0; i < PATH_INDEX_STRIPES; i++)
+        pthread_mutex_init(&index->stripes[i], NULL);
+    return index;
+}
+
+// Double the bucket array once the average chain length passes 1
+static void growPathIndex(PathIndex *index)
+{
+    pthread_rwlock_wrlock(&index->resize_lock);
+    if (atomic_load(&index->count) <= index->bucket_count)
+    {
+        pthread_rwlock_unlock(&index->resize_lock);
+        return;
+    }
+
+    size_t new_count = index->bucket_count << 1;
+    PathIndexEntry **new_buckets = (PathIndexEntry **)calloc(new_count, sizeof(PathIndexEntry *));
+    if (!new_buckets)
+    {
+        pthread_rwlock_unlock(&index->resize_lock);
+        return;
+    }
+    for (size_t i = 0; i < index->bucket_count; i++)
+    {
+        PathIndexEntry *entry = index->buckets[i];
+        while (entry)
+        {
+            PathIndexEntry *next = entry->next;
+            size_t slot = entry->hash & (new_count - 1);
+            entry->next = new_buckets[slot];
+            new_buckets[slot] = entry;
+            entry = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = new_buckets;
+    index->bucket_count = new_count;
+    pthread_rwlock_unlock(&index->resize_lock);
+}
+
+// Lock the stripe owning a path's bucket; the resize lock is held shared
+// for as long as the caller works on the bucket.
+static size_t lockBucket(PathIndex *index, unsigned int hash)
+{
+    pthread_rwlock_rdlock(&index->resize_lock);
+    size_t slot = hash & (index->bucket_count - 1);
+    pthread_mutex_lock(&index->stripes[slot % PATH_INDEX_STRIPES]);
+    return slot;
+}
+
+static void unlockBucket(PathIndex *index, size_t slot)
+{
+    pthread_mutex_unlock(&index->stripes[slot % PATH_INDEX_STRIPES]);
+    pthread_rwlock_unlock(&index->resize_lock);
+}
+
+// Add or refresh the entry for (path, server)
+void pathIndexInsert(PathIndex *index, const char *path, StorageServer *server, Node *node)
+{
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, canonical, sizeof(canonical));
+    unsigned int hash = hashPath(canonical);
+
+    size_t slot = lockBucket(index, hash);
+    PathIndexEntry *entry = index->buckets[slot];
+    while (entry)
+    {
+        if (entry->hash == hash && entry->server == server && strcmp(entry->path, canonical) == 0)
+        {
+            entry->node = node;
+            unlockBucket(index, slot);
+            return;
+        }
+        entry = entry->next;
+    }
+
+    entry = (PathIndexEntry *)malloc(sizeof(PathIndexEntry));
+    entry->path = strdup(canonical);
+    entry->hash = hash;
+    entry->server = server;
+    entry->node = node;
+    entry->next = index->buckets[slot];
+    index->buckets[slot] = entry;
+    size_t count = atomic_fetch_add(&index->count, 1) + 1;
+    size_t buckets = index->bucket_count;
+    unlockBucket(index, slot);
+
+    if (count > buckets)
+        growPathIndex(index);
+}
+
+void pathIndexRemove(PathIndex *index, const char *path, StorageServer *server)
+{
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, canonical, sizeof(canonical));
+    unsigned int hash = hashPath(canonical);
+
+    size_t slot = lockBucket(index, hash);
+    PathIndexEntry *entry = index->buckets[slot];
+    PathIndexEntry *prev = NULL;
+    while (entry)
+    {
+        if (entry->hash == hash && entry->server == server && strcmp(entry->path, canonical) == 0)
+        {
+            if (prev)
+                prev->next = entry->next;
+            else
+                index->buckets[slot] = entry->next;
+            free(entry->path);
+            free(entry);
+            atomic_fetch_sub(&index->count, 1);
+            break;
+        }
+        prev = entry;
+        entry = entry->next;
+    }
+    unlockBucket(index, slot);
+}
+
+// Find the node for a path on any active storage server
+Node *pathIndexLookup(PathIndex *index, const char *path, StorageServer **server_out)
+{
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, canonical, sizeof(canonical));
+    unsigned int hash = hashPath(canonical);
+
+    Node *found = NULL;
+    size_t slot = lockBucket(index, hash);
+    for (PathIndexEntry *entry = index->buckets[slot]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->server->active && strcmp(entry->path, canonical) == 0)
+        {
+            found = entry->node;
+            if (server_out)
+                *server_out = entry->server;
+            break;
+        }
+    }
+    unlockBucket(index, slot);
+    return found;
+}
+
+// Every active storage server holding the path
+StorageServerList *pathIndexLookupAll(PathIndex *index, const char *path)
+{
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, canonical, sizeof(canonical));
+    unsigned int hash = hashPath(canonical);
+
+    StorageServerList *head = NULL;
+    StorageServerList *tail = NULL;
+    size_t slot = lockBucket(index, hash);
+    for (PathIndexEntry *entry = index->buckets[slot]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->server->active && strcmp(entry->path, canonical) == 0)
+        {
+            StorageServerList *match = (StorageServerList *)malloc(sizeof(StorageServerList));
+            match->server = entry->server;
+            match->node = entry->node;
+            match->next = NULL;
+            if (tail)
+                tail->next = match;
+            else
+                head = match;
+            tail = match;
+        }
+    }
+    unlockBucket(index, slot);
+    return head;
+}
+
+// Index a node and everything below it; path is the node's full path
+void pathIndexAddSubtree(PathIndex *index, StorageServer *server, Node *node, const char *path)
+{
+    if (!node)
+        return;
+    pathIndexInsert(index, path, server, node);
+    if (node->type != DIRECTORY_NODE || !node->children)
+        return;
+
+    uint32_t cursor = 0;
+    Node *child;
+    while ((child = nextChild(node->children, &cursor)) != NULL)
+    {
+        char child_path[MAX_PATH_LENGTH];
+        joinPath(path, child->name, child_path, sizeof(child_path));
+        pathIndexAddSubtree(index, server, child, child_path);
+    }
+}
+
+// Drop a node and everything below it; must run before the nodes are freed
+void pathIndexRemoveSubtree(PathIndex *index, StorageServer *server, Node *node, const char *path)
+{
+    if (!node)
+        return;
+    if (node->type == DIRECTORY_NODE && node->children)
+    {
+        uint32_t cursor = 0;
+        Node *child;
+        while ((child = nextChild(node->children, &cursor)) != NULL)
+        {
+            char child_path[MAX_PATH_LENGTH];
+            joinPath(path, child->name, child_path, sizeof(child_path));
+            pathIndexRemoveSubtree(index, server, child, child_path);
+        }
+    }
+    pathIndexRemove(index, path, server);
+}
@@ -0,0 +1,138 @@
+#include "header.h"
+
+// READ, META and STREAM may be served by a server's replicas as well as by
+// the server itself: the chain keeps /backup_<id> on each of them up to date
+// with every change (see replication.c on the storage server). The answer to
+// those commands lists where the path can be read, best first:
+//   REPLICAS <count> <ip> <client port> <prefix> ...
+// where prefix goes in front of the path on that server, "-" for none. A
+// replica is listed only while the chain streams to it and it has every
+// namespace event our copy of the primary's tree shows (replicaIsCurrent),
+// and its tree has the path; both are brought in by the periodic namespace
+// sync shortly after the file appears on the primary.
+//
+// The first entry is picked by the power of two choices: two candidates at
+// random, the less loaded one wins. The naming server never sees a read end,
+// so load is the number of reads handed to a server, halved every
+// READ_LOAD_HALF_LIFE_MS. The rest follow least loaded first, for the client
+// to fail over to without asking again.
+
+typedef struct ReadCandidate
+{
+    StorageServer *server;
+    char ip[16]; // Copied under the server's lock
+    int port;
+    char prefix[32];
+    unsigned int load;
+} ReadCandidate;
+
+// Caller holds server->lock
+static unsigned int currentReadLoad(StorageServer *server, long long now)
+{
+    if (server->read_load_ms == 0)
+        server->read_load_ms = now;
+    while (server->read_load > 0 && now - server->read_load_ms >= READ_LOAD_HALF_LIFE_MS)
+    {
+        server->read_load /= 2;
+        server->read_load_ms += READ_LOAD_HALF_LIFE_MS;
+    }
+    if (server->read_load == 0)
+        server->read_load_ms = now;
+    return server->read_load;
+}
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Add replica as a candidate if it is up, current and has path in backup_dir
+static int addReplica(ReadCandidate *candidates, int count, StorageServer *replica, int source_id, uint32_t epoch,
+                      uint64_t seq, const char *backup_dir, const char *path, long long now)
+{
+    if (!replica || !storageServerConnected(replica) || !replicaIsCurrent(source_id, replica->id, epoch, seq))
+        return count;
+    char replica_path[MAX_PATH_LENGTH + 32];
+    snprintf(replica_path, sizeof(replica_path), "%s%s", backup_dir, path);
+    pthread_mutex_lock(&replica->lock);
+    if (replica->active && replica->root && findNode(replica->root, replica_path))
+    {
+        candidates[count].server = replica;
+        snprintf(candidates[count].ip, sizeof(candidates[count].ip), "%s", replica->ip);
+        candidates[count].port = replica->client_port;
+        snprintf(candidates[count].prefix, sizeof(candidates[count].prefix), "%s", backup_dir);
+        candidates[count].load = currentReadLoad(replica, now);
+        count++;
+    }
+    pthread_mutex_unlock(&replica->lock);
+    return count;
+}
+
+// Append the replica set of path on server to response. Call without
+// server->lock held.
+void appendReadReplicas(StorageServer *server, const char *path, char *response, size_t size)
+{
+    char canonical[MAX_PATH_LENGTH];
+    canonicalizePath(path, canonical, sizeof(canonical));
+    long long now = monotonicMs();
+    ReadCandidate candidates[3];
+    int count = 0;
+
+    pthread_mutex_lock(&server->lock);
+    StorageServer *replicas[2] = {server->ss_backup_1, server->ss_backup_2};
+    int server_id = server->id;
+    uint32_t epoch = server->epoch;
+    uint64_t seq = server->applied_seq;
+    candidates[0].server = server;
+    snprintf(candidates[0].ip, sizeof(candidates[0].ip), "%s", server->ip);
+    candidates[0].port = server->client_port;
+    snprintf(candidates[0].prefix, sizeof(candidates[0].prefix), "-");
+    candidates[0].load = currentReadLoad(server, now);
+    count = 1;
+    pthread_mutex_unlock(&server->lock);
+
+    char backup_dir[32];
+    snprintf(backup_dir, sizeof(backup_dir), "/backup_%d", server_id);
+    for (int i = 0; i < 2; i++)
+        count = addReplica(candidates, count, replicas[i], server_id, epoch, seq, backup_dir, canonical, now);
+
+    // Two choices; ties go to the primary, then slot order
+    int first = 0;
+    if (count > 1)
+    {
+        int a = rand() % count;
+        int b = (a + 1 + rand() % (count - 1)) % count;
+        if (b < a)
+        {
+            int t = a;
+            a = b;
+            b = t;
+        }
+        first = candidates[b].load < candidates[a].load ? b : a;
+    }
+    ReadCandidate chosen = candidates[first];
+    memmove(&candidates[1], &candidates[0], first * sizeof(ReadCandidate));
+    candidates[0] = chosen;
+    for (int i = 2; i < count; i++)
+    {
+        for (int j = i; j > 1 && candidates[j].load < candidates[j - 1].load; j--)
+        {
+            ReadCandidate t = candidates[j];
+            candidates[j] = candidates[j - 1];
+            candidates[j - 1] = t;
+        }
+    }
+
+    pthread_mutex_lock(&chosen.server->lock);
+    currentReadLoad(chosen.server, now);
+    chosen.server->read_load++;
+    pthread_mutex_unlock(&chosen.server->lock);
+
+    size_t used = strlen(response);
+    used += snprintf(response + used, size > used ? size - used : 0, " REPLICAS %d", count);
+    for (int i = 0; i < count && used < size; i++)
+        used += snprintf(response + used, size - used, " %s %d %s", candidates[i].ip, candidates[i].port,
+                         candidates[i].prefix);
+}
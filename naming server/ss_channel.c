@@ -0,0 +1,246 @@
+#include "header.h"
+
+// Requests to a storage server share its one connection. After registration
+// every message on it is a frame tagged with a request id (see frame.c):
+// ssRequest sends a command and sleeps until storageServerHandler, the one
+// reader of the connection, has collected the frames of its reply. Nobody
+// holds server->lock while a storage server works, so a slow COPY no longer
+// keeps CREATE, DELETE or namespace syncs of the same server waiting.
+
+void initStorageServerChannel(StorageServer *server)
+{
+    pthread_mutex_init(&server->send_lock, NULL);
+    pthread_mutex_init(&server->request_lock, NULL);
+    server->pending = NULL;
+    server->next_request_id = 1;
+    server->connected = false;
+}
+
+void destroyStorageServerChannel(StorageServer *server)
+{
+    pthread_mutex_destroy(&server->send_lock);
+    pthread_mutex_destroy(&server->request_lock);
+}
+
+bool storageServerConnected(StorageServer *server)
+{
+    pthread_mutex_lock(&server->request_lock);
+    bool connected = server->connected;
+    pthread_mutex_unlock(&server->request_lock);
+    return connected;
+}
+
+// Caller holds request_lock
+static void unlinkRequest(StorageServer *server, SSRequest *request)
+{
+    for (SSRequest **link = &server->pending; *link; link = &(*link)->next)
+    {
+        if (*link == request)
+        {
+            *link = request->next;
+            return;
+        }
+    }
+}
+
+// Send command to server and wait for its whole reply. Returns the reply
+// length and stores the malloc'd, NUL terminated reply in *reply, or returns
+// -1 if the server went away or took longer than timeout_ms (0 waits as long
+// as the connection lasts).
+ssize_t ssRequest(StorageServer *server, const char *command, char **reply, int timeout_ms)
+{
+    return ssRequestProgress(server, command, reply, timeout_ms, NULL, NULL);
+}
+
+// ssRequest for commands whose reply is preceded by progress reports: every
+// frame but the last goes to progress(arg, ...), on the connection's reader
+// thread, and only the last one is returned
+ssize_t ssRequestProgress(StorageServer *server, const char *command, char **reply, int timeout_ms, SSProgressFn progress, void *arg)
+{
+    SSRequest request;
+    request.reply = NULL;
+    request.reply_len = 0;
+    request.state = SS_REQUEST_WAITING;
+    request.progress = progress;
+    request.progress_arg = arg;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&request.done, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_lock(&server->request_lock);
+    if (!server->connected)
+    {
+        pthread_mutex_unlock(&server->request_lock);
+        pthread_cond_destroy(&request.done);
+        return -1;
+    }
+    request.id = server->next_request_id++;
+    request.next = server->pending;
+    server->pending = &request;
+    pthread_mutex_unlock(&server->request_lock);
+
+    pthread_mutex_lock(&server->send_lock);
+    int sent = sendFrame(server->socket, request.id, command, strlen(command), 0);
+    pthread_mutex_unlock(&server->send_lock);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&server->request_lock);
+    if (sent < 0)
+        request.state = SS_REQUEST_FAILED;
+    while (request.state == SS_REQUEST_WAITING)
+    {
+        if (timeout_ms <= 0)
+            pthread_cond_wait(&request.done, &server->request_lock);
+        else if (pthread_cond_timedwait(&request.done, &server->request_lock, &deadline) == ETIMEDOUT)
+            request.state = SS_REQUEST_FAILED;
+    }
+    // A late reply finds no request and is dropped
+    unlinkRequest(server, &request);
+    pthread_mutex_unlock(&server->request_lock);
+    pthread_cond_destroy(&request.done);
+
+    if (request.state != SS_REQUEST_DONE)
+    {
+        free(request.reply);
+        char log_buf[MAX_PATH_LENGTH + 32];
+        snprintf(log_buf, sizeof(log_buf), "No reply to %s", command);
+        log_message_level(LOG_LEVEL_WARN, server->ip, server->nm_port, "SS", log_buf);
+        return -1;
+    }
+    if (!request.reply)
+        request.reply = (char *)calloc(1, 1);
+    *reply = request.reply;
+    return (ssize_t)request.reply_len;
+}
+
+// ssRequest for short text replies, copied into reply. If there is no reply,
+// reply holds an error for the client instead and -1 is returned.
+int ssCommand(StorageServer *server, const char *command, char *reply, size_t size, int timeout_ms)
+{
+    char *data;
+    ssize_t len = ssRequest(server, command, &data, timeout_ms);
+    if (len < 0)
+    {
+        snprintf(reply, size, " \033[1;31mERROR 402:\033[0m \033[38;5;214mStorage Server did not respond.\033[0m\n");
+        return -1;
+    }
+    snprintf(reply, size, "%s", data);
+    free(data);
+    return 0;
+}
+
+// Hand a reply frame to the request waiting for it
+static void deliverFrame(StorageServer *server, uint32_t id, const char *payload, size_t len, int more)
+{
+    pthread_mutex_lock(&server->request_lock);
+    SSRequest *request = server->pending;
+    while (request && request->id != id)
+        request = request->next;
+    if (request && request->progress && more)
+        request->progress(request->progress_arg, payload, len);
+    else if (request)
+    {
+        char *grown = (char *)realloc(request->reply, request->reply_len + len + 1);
+        if (grown)
+        {
+            memcpy(grown + request->reply_len, payload, len);
+            request->reply_len += len;
+            grown[request->reply_len] = '\0';
+            request->reply = grown;
+        }
+        else
+            request->state = SS_REQUEST_FAILED;
+        if (!more && request->state == SS_REQUEST_WAITING)
+            request->state = SS_REQUEST_DONE;
+        if (request->state != SS_REQUEST_WAITING)
+        {
+            unlinkRequest(server, request);
+            pthread_cond_signal(&request->done);
+        }
+    }
+    pthread_mutex_unlock(&server->request_lock);
+}
+
+// Pulls namespace changes, then how far the replicas got, every
+// NM_SYNC_INTERVAL seconds while the connection it was started for lasts
+static void *storageServerSyncer(void *arg)
+{
+    StorageServer *server = (StorageServer *)arg;
+    while (1)
+    {
+        for (int i = 0; i < NM_SYNC_INTERVAL; i++)
+        {
+            sleep(1);
+            if (!storageServerConnected(server))
+                return NULL;
+        }
+        if (syncStorageServer(server) < 0)
+            log_message_level(LOG_LEVEL_WARN, server->ip, server->nm_port, "SS", "Namespace sync failed");
+        else
+            refreshReplicationStatus(server);
+    }
+    return NULL;
+}
+
+// Thread function to handle storage server: the only reader of its
+// connection. Reply frames go to the requests waiting for them; once the
+// connection breaks every waiting request fails and the server is marked
+// inactive.
+void *storageServerHandler(void *arg)
+{
+    StorageServer *server = (StorageServer *)arg;
+
+    pthread_mutex_lock(&server->request_lock);
+    server->connected = true;
+    pthread_mutex_unlock(&server->request_lock);
+
+    pthread_t syncer;
+    bool syncing = pthread_create(&syncer, NULL, storageServerSyncer, server) == 0;
+    if (!syncing)
+        perror("Failed to create namespace sync thread");
+
+    while (1)
+    {
+        uint32_t request_id;
+        char *payload;
+        size_t len;
+        int more;
+        if (recvFrame(server->socket, &request_id, &payload, &len, &more) < 0)
+            break;
+        deliverFrame(server, request_id, payload, len, more);
+        free(payload);
+    }
+
+    pthread_mutex_lock(&server->request_lock);
+    server->connected = false;
+    for (SSRequest *request = server->pending; request; request = request->next)
+    {
+        request->state = SS_REQUEST_FAILED;
+        pthread_cond_signal(&request->done);
+    }
+    server->pending = NULL;
+    pthread_mutex_unlock(&server->request_lock);
+    if (syncing)
+        pthread_join(syncer, NULL);
+
+    pthread_mutex_lock(&server->lock);
+    server->active = false;
+    pthread_mutex_unlock(&server->lock);
+    // Clients must come back to us to find out where the files went
+    leaseRevokeServer(lease_table, server);
+    scheduleBackups(); // Replicas it held are placed elsewhere
+    printf("Storage server %s disconnected\n", server->ip);
+    log_message_level(LOG_LEVEL_WARN, server->ip, server->nm_port, "SS", "Storage Server Disconnected.");
+    return NULL;
+}